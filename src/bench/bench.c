@@ -0,0 +1,408 @@
+//
+//  Created by Stasel
+//
+
+// Microbenchmarks for the database and encryption layers, run against a synthetic namespace.
+// Build with `make bench` and run `./secfs-bench --help` for the options.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include "../utilities/utilities.h"
+#include "../security/encryption.h"
+#include "../db/indexdb.h"
+#include "../db/blockdb.h"
+
+typedef struct {
+    UInt files;
+    UInt depth;
+    UInt fanout;
+    ULong fileSize;
+    UInt samples;
+    UInt rounds;
+    Cipher cipher;
+} BenchOptions;
+
+// Synthetic secure folder held in memory
+typedef struct {
+    IndexDB *indexDB;
+    BlockDB *blockDB;
+    Item **files;
+    UInt filesLength;
+    Item **dirs;
+    UInt dirsLength;
+    ULong blocks;
+} Namespace;
+
+typedef struct {
+    ULong *nanos;
+    UInt length;
+} Latencies;
+
+static Latencies init_latencies(UInt count) {
+    Latencies latencies;
+    latencies.nanos = malloc(sizeof(ULong) * MAX(count, 1));
+    latencies.length = 0;
+    return latencies;
+}
+
+static Int compare_nanos(const void *a, const void *b) {
+    ULong first = *(const ULong*)a;
+    ULong second = *(const ULong*)b;
+    return first < second ? -1 : first > second;
+}
+
+static double percentile_micros(Latencies latencies, double percentile) {
+    UInt index = (UInt)(percentile * (double)(latencies.length - 1) + 0.5);
+    return (double)latencies.nanos[index] / 1e3;
+}
+
+// Prints one result line and frees the latencies
+static void report(const String name, Latencies latencies, ULong bytesPerOp) {
+    if (latencies.length == 0) {
+        free(latencies.nanos);
+        return;
+    }
+    ULong total = 0;
+    for (UInt i = 0; i < latencies.length; i++) {
+        total += latencies.nanos[i];
+    }
+    qsort(latencies.nanos, latencies.length, sizeof(ULong), compare_nanos);
+
+    double opsPerSecond = (double)latencies.length / ((double)total / 1e9);
+    printf("%-28s %8u %12.0f %10.1f %10.1f %10.1f %10.1f", name, latencies.length, opsPerSecond,
+           percentile_micros(latencies, 0.5), percentile_micros(latencies, 0.9),
+           percentile_micros(latencies, 0.99), percentile_micros(latencies, 1.0));
+    if (bytesPerOp > 0) {
+        printf(" %9.1f", opsPerSecond * (double)bytesPerOp / (1024.0 * 1024.0));
+    }
+    else {
+        printf(" %9s", "-");
+    }
+    printf(" %9.1f\n", (double)peakMemoryBytes() / (1024.0 * 1024.0));
+    free(latencies.nanos);
+}
+
+static void fatal_on_error(Error error, const String action) {
+    if (error) {
+        fatalError("%s failed: %s", action, error);
+    }
+}
+
+// MARK: - Synthetic namespace
+
+static void add_dirs(Namespace *ns, Item *parent, UInt level, const BenchOptions *options) {
+    if (level == options->depth) {
+        return;
+    }
+    for (UInt i = 0; i < options->fanout; i++) {
+        char path[PATH_MAX_LENGTH];
+        if (snprintf(path, sizeof path, "%s/d%u", strcmp(parent->path, "/") == 0 ? "" : parent->path, i) >= PATH_MAX_LENGTH) {
+            fatalError("Namespace is too deep");
+        }
+        Item *dir = create_item(ItemTypeDir, path);
+        add_item(ns->indexDB, dir);
+        ns->dirs[ns->dirsLength++] = dir;
+        add_dirs(ns, dir, level + 1, options);
+    }
+}
+
+static Namespace generate_namespace(const BenchOptions *options, const String blocksPath, ByteArray key, ByteArray iv) {
+    Namespace ns;
+    ns.indexDB = init_indexDB();
+    ns.blockDB = init_blockDB(blocksPath, options->cipher, key, iv);
+    ns.blocks = 0;
+
+    UInt maxDirs = 1;
+    UInt levelDirs = 1;
+    for (UInt level = 0; level < options->depth; level++) {
+        levelDirs *= options->fanout;
+        maxDirs += levelDirs;
+    }
+    ns.dirs = malloc(sizeof(Item*) * maxDirs);
+    ns.dirsLength = 0;
+
+    Item *root = create_item(ItemTypeDir, "/");
+    add_item(ns.indexDB, root);
+    ns.dirs[ns.dirsLength++] = root;
+    add_dirs(&ns, root, 0, options);
+
+    // Files are spread over the deepest directories
+    UInt firstLeaf = ns.dirsLength - levelDirs;
+    ns.files = malloc(sizeof(Item*) * MAX(options->files, 1));
+    ns.filesLength = 0;
+    UInt blocksPerFile = (UInt)((options->fileSize + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    for (UInt i = 0; i < options->files; i++) {
+        Item *dir = ns.dirs[firstLeaf + i % levelDirs];
+        char path[PATH_MAX_LENGTH];
+        if (snprintf(path, sizeof path, "%s/f%u", strcmp(dir->path, "/") == 0 ? "" : dir->path, i) >= PATH_MAX_LENGTH) {
+            fatalError("Namespace is too deep");
+        }
+        Item *file = create_item(ItemTypeFile, path);
+        file->size = options->fileSize;
+        add_item(ns.indexDB, file);
+        ns.files[ns.filesLength++] = file;
+
+        for (UInt index = 0; index < blocksPerFile; index++) {
+            fatal_on_error(add_block(ns.blockDB, generate_block(file->id, index)), "add_block");
+            ns.blocks++;
+        }
+    }
+    return ns;
+}
+
+static UInt random_index(UInt length) {
+    return (UInt)((ULong)random() % length);
+}
+
+// MARK: - Benchmarks
+
+static void bench_search_item_path(Namespace *ns, const BenchOptions *options) {
+    Latencies latencies = init_latencies(options->samples);
+    for (UInt i = 0; i < options->samples && ns->filesLength > 0; i++) {
+        Item *expected = ns->files[random_index(ns->filesLength)];
+        ULong start = monotonicNanos();
+        Item *found = search_item_path(ns->indexDB, expected->path);
+        latencies.nanos[latencies.length++] = monotonicNanos() - start;
+        if (found != expected) {
+            fatalError("search_item_path returned the wrong item for %s", expected->path);
+        }
+    }
+    report("search_item_path", latencies, 0);
+}
+
+static void bench_get_dir_items(Namespace *ns, const BenchOptions *options) {
+    Latencies latencies = init_latencies(options->samples);
+    for (UInt i = 0; i < options->samples; i++) {
+        Item *dir = ns->dirs[random_index(ns->dirsLength)];
+        ULong start = monotonicNanos();
+        ItemArray items = get_dir_items(ns->indexDB, dir->path);
+        latencies.nanos[latencies.length++] = monotonicNanos() - start;
+        free(items.items);
+    }
+    report("get_dir_items", latencies, 0);
+}
+
+static void bench_all_blocks_for_file(BlockDB *db, Namespace *ns, const BenchOptions *options, const String name) {
+    Latencies latencies = init_latencies(options->samples);
+    for (UInt i = 0; i < options->samples && ns->filesLength > 0; i++) {
+        Item *file = ns->files[random_index(ns->filesLength)];
+        ULong start = monotonicNanos();
+        BlocksForFileResult result = all_blocks_for_file(db, file->id);
+        latencies.nanos[latencies.length++] = monotonicNanos() - start;
+        fatal_on_error(result.error, "all_blocks_for_file");
+        release_blocks(db, result);
+    }
+    report(name, latencies, 0);
+}
+
+// Looks up the block at a random offset, which reaches past 4 GB with a large --file-size
+static void bench_blocks_for_file(Namespace *ns, const BenchOptions *options) {
+    Latencies latencies = init_latencies(options->samples);
+    for (UInt i = 0; i < options->samples && ns->filesLength > 0 && options->fileSize > 0; i++) {
+        Item *file = ns->files[random_index(ns->filesLength)];
+        ULong offset = ((ULong)random() * BLOCK_SIZE + (ULong)random()) % file->size;
+        ULong start = monotonicNanos();
+        BlocksForFileResult result = blocks_for_file(ns->blockDB, file->id, offset, 1);
+        latencies.nanos[latencies.length++] = monotonicNanos() - start;
+        fatal_on_error(result.error, "blocks_for_file");
+        if (result.length != 1 || (ULong)result.blocks[0]->index != offset / BLOCK_SIZE) {
+            fatalError("blocks_for_file missed the block at offset %llu", (unsigned long long)offset);
+        }
+        release_blocks(ns->blockDB, result);
+    }
+    report("blocks_for_file", latencies, 0);
+}
+
+static void bench_index_archive_load(Namespace *ns, const BenchOptions *options, const String path, ByteArray key, ByteArray iv) {
+    ULong bytes = (ULong)ns->indexDB->length * sizeof(Item);
+    Latencies archiveLatencies = init_latencies(options->rounds);
+    Latencies loadLatencies = init_latencies(options->rounds);
+    for (UInt i = 0; i < options->rounds; i++) {
+        ULong start = monotonicNanos();
+        fatal_on_error(archive_indexDB(path, ns->indexDB, options->cipher, key, iv), "archive_indexDB");
+        archiveLatencies.nanos[archiveLatencies.length++] = monotonicNanos() - start;
+
+        start = monotonicNanos();
+        LoadIndexDBResult loadResult = load_indexDB(path, options->cipher, key, iv);
+        loadLatencies.nanos[loadLatencies.length++] = monotonicNanos() - start;
+        fatal_on_error(loadResult.error, "load_indexDB");
+        if (loadResult.indexDB->length != ns->indexDB->length) {
+            fatalError("load_indexDB loaded %u of %u items", loadResult.indexDB->length, ns->indexDB->length);
+        }
+        for (UInt j = 0; j < loadResult.indexDB->length; j++) {
+            free(loadResult.indexDB->items[j]);
+        }
+        free(loadResult.indexDB->items);
+        free(loadResult.indexDB);
+    }
+    report("archive_indexDB", archiveLatencies, bytes);
+    report("load_indexDB", loadLatencies, bytes);
+}
+
+static void bench_block_archive_load(Namespace *ns, const BenchOptions *options, const String path, ByteArray key, ByteArray iv) {
+    ULong bytes = ns->blocks * sizeof(Block);
+    Latencies archiveLatencies = init_latencies(options->rounds);
+    for (UInt i = 0; i < options->rounds; i++) {
+        // Rewrite every shard in each round
+        for (UInt shard = 0; shard < BLOCK_SHARD_COUNT; shard++) {
+            ns->blockDB->shards[shard].dirty = true;
+        }
+        ULong start = monotonicNanos();
+        fatal_on_error(archive_blockDB(ns->blockDB), "archive_blockDB");
+        archiveLatencies.nanos[archiveLatencies.length++] = monotonicNanos() - start;
+    }
+    report("archive_blockDB", archiveLatencies, bytes);
+
+    // First access of every file on a freshly loaded database includes loading its shard
+    LoadBlockDBResult loadResult = load_blockDB(path, options->cipher, key, iv);
+    fatal_on_error(loadResult.error, "load_blockDB");
+    bench_all_blocks_for_file(loadResult.blockDB, ns, options, "all_blocks_for_file (cold)");
+}
+
+static void bench_cipher(const BenchOptions *options, ByteArray key, ByteArray iv) {
+    ByteArray sample = get_random_bytes(BLOCK_SIZE);
+    EncryptResult encrypted = cipher_encrypt(options->cipher, sample, key, iv);
+    fatal_on_error(encrypted.error, "cipher_encrypt");
+
+    Latencies encryptLatencies = init_latencies(options->samples);
+    Latencies decryptLatencies = init_latencies(options->samples);
+    UInt cipherSamples = MAX(options->samples / 100, 10);
+    for (UInt i = 0; i < cipherSamples; i++) {
+        ULong start = monotonicNanos();
+        EncryptResult encryptResult = cipher_encrypt(options->cipher, sample, key, iv);
+        encryptLatencies.nanos[encryptLatencies.length++] = monotonicNanos() - start;
+        free(encryptResult.cipher.bytes);
+
+        start = monotonicNanos();
+        DecryptResult decryptResult = cipher_decrypt(options->cipher, encrypted.cipher, key, iv);
+        decryptLatencies.nanos[decryptLatencies.length++] = monotonicNanos() - start;
+        fatal_on_error(decryptResult.error, "cipher_decrypt");
+        free(decryptResult.plainText.bytes);
+    }
+    report("cipher_encrypt (block)", encryptLatencies, BLOCK_SIZE);
+    report("cipher_decrypt (block)", decryptLatencies, BLOCK_SIZE);
+    free(encrypted.cipher.bytes);
+    free(sample.bytes);
+}
+
+// MARK: - Main
+
+static void remove_bench_files(const String directory, const String indexPath, const String blocksPath) {
+    unlink(indexPath);
+    for (UInt shard = 0; shard < BLOCK_SHARD_COUNT; shard++) {
+        char path[PATH_MAX_LENGTH + 8];
+        snprintf(path, sizeof path, "%s%03x", blocksPath, shard);
+        unlink(path);
+    }
+    rmdir(blocksPath);
+    rmdir(directory);
+}
+
+static void show_help(void) {
+    printf("Usage: secfs-bench [options]\n\n");
+    printf("Options:\n");
+    printf("  --files <count>      Files in the synthetic namespace (default: 100000)\n");
+    printf("  --depth <levels>     Directory levels above the files (default: 3)\n");
+    printf("  --fanout <count>     Subdirectories per directory (default: 10)\n");
+    printf("  --file-size <bytes>  Size of every file, determines its block count (default: 1048576)\n");
+    printf("  --samples <count>    Operations measured per lookup benchmark (default: 1000)\n");
+    printf("  --rounds <count>     Archive and load rounds per database (default: 5)\n");
+    printf("  --cipher <name>      Cipher for the databases and blocks (default: %s)\n", cipher_name(DEFAULT_CIPHER));
+}
+
+static ULong parse_size(const String name, const String value) {
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || value[0] == '-') {
+        fatalError("Invalid value '%s' for --%s", value, name);
+    }
+    return (ULong)number;
+}
+
+static UInt parse_count(const String name, const String value) {
+    ULong number = parse_size(name, value);
+    if (number > UINT32_MAX) {
+        fatalError("Invalid value '%s' for --%s", value, name);
+    }
+    return (UInt)number;
+}
+
+int main(int argc, String argv[]) {
+    BenchOptions options = { 100000, 3, 10, 1048576, 1000, 5, DEFAULT_CIPHER };
+    static struct option longOptions[] = {
+        { "files", required_argument, NULL, 'f' },
+        { "depth", required_argument, NULL, 'd' },
+        { "fanout", required_argument, NULL, 'o' },
+        { "file-size", required_argument, NULL, 's' },
+        { "samples", required_argument, NULL, 'n' },
+        { "rounds", required_argument, NULL, 'r' },
+        { "cipher", required_argument, NULL, 'c' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Int option;
+    while ((option = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 'f': options.files = parse_count("files", optarg); break;
+            case 'd': options.depth = parse_count("depth", optarg); break;
+            case 'o': options.fanout = MAX(parse_count("fanout", optarg), 1); break;
+            case 's': options.fileSize = parse_size("file-size", optarg); break;
+            case 'n': options.samples = MAX(parse_count("samples", optarg), 1); break;
+            case 'r': options.rounds = MAX(parse_count("rounds", optarg), 1); break;
+            case 'c': {
+                Int cipher = cipher_from_name(optarg);
+                if (cipher == -1) {
+                    fatalError("Unknown cipher '%s'", optarg);
+                }
+                options.cipher = (Cipher)cipher;
+                break;
+            }
+            case 'h':
+                show_help();
+                return 0;
+            default:
+                show_help();
+                return 1;
+        }
+    }
+
+    char directory[] = "/tmp/secfs-bench-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        fatalError("Couldn't create a temporary directory");
+    }
+    char indexPath[PATH_MAX_LENGTH];
+    char blocksPath[PATH_MAX_LENGTH];
+    snprintf(indexPath, sizeof indexPath, "%s/index", directory);
+    snprintf(blocksPath, sizeof blocksPath, "%s/blocks/", directory);
+    mkdir(blocksPath, 0700);
+
+    ByteArray key = get_random_bytes(KEY_LENGTH);
+    ByteArray iv = get_random_bytes(IV_LENGTH);
+    srandom(1);
+
+    ULong start = monotonicNanos();
+    Namespace ns = generate_namespace(&options, blocksPath, key, iv);
+    printf("Namespace: %u files, %u directories, %llu blocks, cipher %s (generated in %.1f ms)\n\n",
+           ns.filesLength, ns.dirsLength, (unsigned long long)ns.blocks, cipher_name(options.cipher),
+           (double)(monotonicNanos() - start) / 1e6);
+
+    printf("%-28s %8s %12s %10s %10s %10s %10s %9s %9s\n", "Benchmark", "Ops", "Ops/s",
+           "p50 us", "p90 us", "p99 us", "max us", "MB/s", "RSS MB");
+    bench_search_item_path(&ns, &options);
+    bench_get_dir_items(&ns, &options);
+    bench_all_blocks_for_file(ns.blockDB, &ns, &options, "all_blocks_for_file");
+    bench_blocks_for_file(&ns, &options);
+    bench_index_archive_load(&ns, &options, indexPath, key, iv);
+    bench_block_archive_load(&ns, &options, blocksPath, key, iv);
+    bench_cipher(&options, key, iv);
+
+    remove_bench_files(directory, indexPath, blocksPath);
+    return 0;
+}
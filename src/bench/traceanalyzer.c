@@ -0,0 +1,286 @@
+//
+//  Created by Stasel
+//
+
+// Reads a trace file written by secfs --trace and breaks request latency down into phases.
+// Build with `make secfs-trace` and run `./secfs-trace <trace file>`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include "../utilities/utilities.h"
+#include "../utilities/stats.h"
+#include "../utilities/trace.h"
+
+typedef struct {
+    ULong *nanos;
+    UInt length;
+    UInt max;
+} Durations;
+
+typedef struct {
+    TraceSpan *request;
+    TraceSpan *phases; // Spans of the request's stages, ordered by start
+    UInt phasesLength;
+} Request;
+
+typedef struct {
+    UInt top;
+    String only;
+} AnalyzerOptions;
+
+static void add_duration(Durations *durations, ULong nanos) {
+    if (durations->length >= durations->max) {
+        durations->max = MAX(durations->max * 2, 64);
+        durations->nanos = realloc(durations->nanos, sizeof(ULong) * durations->max);
+    }
+    durations->nanos[durations->length++] = nanos;
+}
+
+static Int compare_nanos(const void *a, const void *b) {
+    ULong first = *(const ULong*)a;
+    ULong second = *(const ULong*)b;
+    return first < second ? -1 : first > second;
+}
+
+static double percentile_micros(Durations durations, double percentile) {
+    UInt index = (UInt)(percentile * (double)(durations.length - 1) + 0.5);
+    return (double)durations.nanos[index] / 1e3;
+}
+
+static ULong total_nanos(Durations durations) {
+    ULong total = 0;
+    for (UInt i = 0; i < durations.length; i++) {
+        total += durations.nanos[i];
+    }
+    return total;
+}
+
+static Int compare_spans(const void *a, const void *b) {
+    const TraceSpan *first = a;
+    const TraceSpan *second = b;
+    if (first->requestId != second->requestId) {
+        return first->requestId < second->requestId ? -1 : 1;
+    }
+    if (first->start != second->start) {
+        return first->start < second->start ? -1 : 1;
+    }
+    // The operation span goes before the phases starting along with it
+    return (Int)stats_is_stage((Metric)first->metric) - (Int)stats_is_stage((Metric)second->metric);
+}
+
+static Int compare_requests_by_duration(const void *a, const void *b) {
+    ULong first = ((const Request*)a)->request->end - ((const Request*)a)->request->start;
+    ULong second = ((const Request*)b)->request->end - ((const Request*)b)->request->start;
+    return first > second ? -1 : first < second;
+}
+
+static TraceSpan* load_trace(const String path, ULong *length) {
+    ReadFileResult readResult = readFile(path);
+    if (readResult.error) {
+        fatalError("Couldn't read %s: %s", path, readResult.error);
+    }
+    TraceHeader header;
+    if (readResult.contents.length < sizeof header) {
+        fatalError("%s is not a trace file", path);
+    }
+    memcpy(&header, readResult.contents.bytes, sizeof header);
+    if (memcmp(header.magic, TRACE_MAGIC, sizeof header.magic) != 0 || header.version != TRACE_VERSION || header.spanSize != sizeof(TraceSpan)) {
+        fatalError("%s is not a trace file of this version of secfs", path);
+    }
+    if (readResult.contents.length < sizeof header + header.spanCount * sizeof(TraceSpan)) {
+        fatalError("%s is truncated", path);
+    }
+
+    TraceSpan *spans = malloc(sizeof(TraceSpan) * MAX(header.spanCount, 1));
+    memcpy(spans, readResult.contents.bytes + sizeof header, sizeof(TraceSpan) * header.spanCount);
+    free(readResult.contents.bytes);
+    for (ULong i = 0; i < header.spanCount; i++) {
+        if (spans[i].metric >= MetricCount) {
+            fatalError("%s contains unknown phases", path);
+        }
+    }
+    *length = header.spanCount;
+    return spans;
+}
+
+static void print_phases(TraceSpan *spans, ULong length) {
+    Durations durations[MetricCount];
+    memset(durations, 0, sizeof durations);
+    for (ULong i = 0; i < length; i++) {
+        if (spans[i].metric < MetricCount) {
+            add_duration(&durations[spans[i].metric], spans[i].end - spans[i].start);
+        }
+    }
+
+    printf("All spans\n");
+    printf("%-16s %10s %12s %10s %10s %10s %10s\n", "Phase", "Count", "Total ms", "Mean us", "p50 us", "p99 us", "Max us");
+    for (UInt metric = 0; metric < MetricCount; metric++) {
+        Durations phase = durations[metric];
+        if (phase.length == 0) {
+            continue;
+        }
+        qsort(phase.nanos, phase.length, sizeof(ULong), compare_nanos);
+        ULong total = total_nanos(phase);
+        printf("%-16s %10u %12.1f %10.1f %10.1f %10.1f %10.1f\n", stats_metric_name((Metric)metric), phase.length, (double)total / 1e6,
+               (double)total / phase.length / 1e3, percentile_micros(phase, 0.5), percentile_micros(phase, 0.99), percentile_micros(phase, 1.0));
+        free(phase.nanos);
+    }
+    printf("\n");
+}
+
+// Where the time of each operation goes, on average per request
+static void print_breakdown(Request *requests, UInt length, const AnalyzerOptions *options) {
+    for (UInt op = 0; op < MetricCount; op++) {
+        if (stats_is_stage((Metric)op)) {
+            continue;
+        }
+        if (options->only != NULL && strcmp(options->only, stats_metric_name((Metric)op)) != 0) {
+            continue;
+        }
+
+        Durations durations = { NULL, 0, 0 };
+        ULong phaseNanos[MetricCount] = { 0 };
+        UInt phaseCounts[MetricCount] = { 0 };
+        for (UInt i = 0; i < length; i++) {
+            if (requests[i].request->metric != op) {
+                continue;
+            }
+            add_duration(&durations, requests[i].request->end - requests[i].request->start);
+            for (UInt p = 0; p < requests[i].phasesLength; p++) {
+                TraceSpan *phase = &requests[i].phases[p];
+                phaseNanos[phase->metric] += phase->end - phase->start;
+                phaseCounts[phase->metric]++;
+            }
+        }
+        if (durations.length == 0) {
+            continue;
+        }
+
+        qsort(durations.nanos, durations.length, sizeof(ULong), compare_nanos);
+        ULong total = total_nanos(durations);
+        printf("%s: %u requests, p50 %.1f us, p99 %.1f us, max %.1f us\n", stats_metric_name((Metric)op), durations.length,
+               percentile_micros(durations, 0.5), percentile_micros(durations, 0.99), percentile_micros(durations, 1.0));
+        printf("    %-16s %12s %14s %8s\n", "Phase", "Per request", "us per request", "Share");
+        ULong accounted = 0;
+        for (UInt metric = 0; metric < MetricCount; metric++) {
+            if (phaseCounts[metric] == 0) {
+                continue;
+            }
+            accounted += phaseNanos[metric];
+            printf("    %-16s %12.1f %14.1f %7.1f%%\n", stats_metric_name((Metric)metric), (double)phaseCounts[metric] / durations.length,
+                   (double)phaseNanos[metric] / durations.length / 1e3, 100.0 * (double)phaseNanos[metric] / (double)MAX(total, 1));
+        }
+        // Queueing, copying and everything else which isn't a traced stage
+        ULong other = total > accounted ? total - accounted : 0;
+        printf("    %-16s %12s %14.1f %7.1f%%\n\n", "other", "-", (double)other / durations.length / 1e3, 100.0 * (double)other / (double)MAX(total, 1));
+        free(durations.nanos);
+    }
+}
+
+static void print_slowest(Request *requests, UInt length, const AnalyzerOptions *options) {
+    qsort(requests, length, sizeof(Request), compare_requests_by_duration);
+    printf("Slowest requests\n");
+    UInt printed = 0;
+    for (UInt i = 0; i < length && printed < options->top; i++) {
+        TraceSpan *request = requests[i].request;
+        if (options->only != NULL && strcmp(options->only, stats_metric_name((Metric)request->metric)) != 0) {
+            continue;
+        }
+        printed++;
+        printf("%s #%llu, path %016llx, thread %u: %.1f us%s\n", stats_metric_name((Metric)request->metric), (unsigned long long)request->requestId,
+               (unsigned long long)request->pathId, request->thread, (double)(request->end - request->start) / 1e3, request->failed ? " (failed)" : "");
+        for (UInt p = 0; p < requests[i].phasesLength; p++) {
+            TraceSpan *phase = &requests[i].phases[p];
+            printf("    +%10.1f us  %-16s %10.1f us", (double)(phase->start - request->start) / 1e3, stats_metric_name((Metric)phase->metric),
+                   (double)(phase->end - phase->start) / 1e3);
+            if (phase->blockIndex != TRACE_NO_BLOCK) {
+                printf("  block %u", phase->blockIndex);
+            }
+            printf("%s\n", phase->failed ? "  (failed)" : "");
+        }
+    }
+}
+
+static void show_help(void) {
+    printf("Usage: secfs-trace [options] <trace file>\n\n");
+    printf("Options:\n");
+    printf("  --top <count>   Slowest requests to list (default: 10)\n");
+    printf("  --op <name>     Only report requests of this operation, for example read\n");
+}
+
+int main(int argc, String argv[]) {
+    AnalyzerOptions options = { 10, NULL };
+    static struct option longOptions[] = {
+        { "top", required_argument, NULL, 't' },
+        { "op", required_argument, NULL, 'o' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Int option;
+    while ((option = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 't':
+                options.top = (UInt)strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                options.only = optarg;
+                break;
+            case 'h':
+                show_help();
+                return 0;
+            default:
+                show_help();
+                return 1;
+        }
+    }
+    if (argc - optind < 1) {
+        show_help();
+        return 1;
+    }
+
+    ULong length;
+    TraceSpan *spans = load_trace(argv[optind], &length);
+    printf("%llu spans\n\n", (unsigned long long)length);
+    print_phases(spans, length);
+
+    // A request is its operation span and the stage spans recorded with its id before it ended.
+    // Requests whose operation span was overwritten in the ring are left out.
+    qsort(spans, length, sizeof(TraceSpan), compare_spans);
+    Request *requests = malloc(sizeof(Request) * MAX(length, 1));
+    UInt requestsLength = 0;
+    for (ULong first = 0; first < length;) {
+        ULong last = first;
+        while (last < length && spans[last].requestId == spans[first].requestId) {
+            last++;
+        }
+        if (spans[first].requestId != 0) {
+            TraceSpan *request = NULL;
+            for (ULong i = first; i < last; i++) {
+                if (!stats_is_stage((Metric)spans[i].metric)) {
+                    request = &spans[i];
+                }
+            }
+            if (request != NULL) {
+                // The operation span starts first, its phases follow it
+                Request *entry = &requests[requestsLength++];
+                entry->request = request;
+                entry->phases = &spans[first];
+                entry->phasesLength = (UInt)(last - first);
+                if (request == &spans[first]) {
+                    entry->phases++;
+                    entry->phasesLength--;
+                }
+            }
+        }
+        first = last;
+    }
+
+    print_breakdown(requests, requestsLength, &options);
+    print_slowest(requests, requestsLength, &options);
+    free(requests);
+    free(spans);
+    return 0;
+}
@@ -0,0 +1,821 @@
+//
+//  Created by Stasel
+//
+
+// End-to-end workload driver. Calls the file system callbacks directly against a temporary
+// secure folder, without mounting, so results are free of kernel and FUSE overhead.
+// Build with `make workload` and run `./secfs-workload --help` for the options.
+
+#define FUSE_USE_VERSION 31
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fuse.h>
+#include "../utilities/utilities.h"
+#include "../security/encryption.h"
+#include "../filesystem/filesystem.h"
+
+#define HISTOGRAM_BUCKETS 40 // Powers of two nanoseconds, up to ~9 minutes
+#define FSYNC_THREADS_MAX 64
+
+typedef struct {
+    ULong fileSize;
+    UInt randomOps;
+    UInt stormFiles;
+    UInt treeFiles;
+    UInt indexFiles;
+    UInt fsyncThreads;
+    Cipher cipher;
+    Bool directBackingIO;
+    String only;
+    Bool histograms;
+} WorkloadOptions;
+
+typedef struct {
+    ULong *nanos;
+    UInt length;
+    UInt max;
+    ULong logicalBytes;
+} Samples;
+
+typedef void (*Workload)(Samples *samples, const WorkloadOptions *options);
+
+static const struct fuse_operations *ops;
+static WorkloadOptions workloadOptions;
+
+// MARK: - Measurements
+
+static Samples init_samples(void) {
+    Samples samples = { NULL, 0, 0, 0 };
+    return samples;
+}
+
+static void add_sample(Samples *samples, ULong nanos) {
+    if (samples->length >= samples->max) {
+        samples->max = MAX(samples->max * 2, 1024);
+        samples->nanos = realloc(samples->nanos, sizeof(ULong) * samples->max);
+    }
+    samples->nanos[samples->length++] = nanos;
+}
+
+// Bytes this process handed to write(2), which is everything secfs writes to the backing store
+static ULong written_bytes(void) {
+    FILE *file = fopen("/proc/self/io", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    char line[128];
+    ULong bytes = 0;
+    while (fgets(line, sizeof line, file) != NULL) {
+        unsigned long long value;
+        if (sscanf(line, "wchar: %llu", &value) == 1) {
+            bytes = value;
+        }
+    }
+    fclose(file);
+    return bytes;
+}
+
+static Int compare_nanos(const void *a, const void *b) {
+    ULong first = *(const ULong*)a;
+    ULong second = *(const ULong*)b;
+    return first < second ? -1 : first > second;
+}
+
+static double percentile_micros(Samples samples, double percentile) {
+    UInt index = (UInt)(percentile * (double)(samples.length - 1) + 0.5);
+    return (double)samples.nanos[index] / 1e3;
+}
+
+static void print_histogram(Samples samples) {
+    UInt buckets[HISTOGRAM_BUCKETS] = { 0 };
+    UInt largest = 0;
+    for (UInt i = 0; i < samples.length; i++) {
+        UInt bucket = 0;
+        while (bucket < HISTOGRAM_BUCKETS - 1 && samples.nanos[i] >= (1UL << (bucket + 1))) {
+            bucket++;
+        }
+        buckets[bucket]++;
+        largest = MAX(largest, buckets[bucket]);
+    }
+    for (UInt bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        if (buckets[bucket] == 0) {
+            continue;
+        }
+        char bar[41];
+        UInt width = MAX(buckets[bucket] * 40 / largest, 1);
+        memset(bar, '#', width);
+        bar[width] = '\0';
+        printf("    %10.1f us - %10.1f us %8u %s\n", (double)(1UL << bucket) / 1e3, (double)(1UL << (bucket + 1)) / 1e3, buckets[bucket], bar);
+    }
+}
+
+typedef struct {
+    ULong backingBytes; // Written to the secure folder
+    ULong pageFaults;
+    ULong bufferAllocations;
+} WorkloadCosts;
+
+static WorkloadCosts current_costs(void) {
+    WorkloadCosts costs = { written_bytes(), pageFaults(), buffer_pool_counters().allocations };
+    return costs;
+}
+
+static void report(const String name, Samples samples, ULong wallNanos, WorkloadCosts costs) {
+    if (samples.length == 0) {
+        printf("%-24s no operations\n", name);
+        return;
+    }
+    qsort(samples.nanos, samples.length, sizeof(ULong), compare_nanos);
+    double seconds = (double)wallNanos / 1e9;
+    printf("%-24s %8u %10.0f", name, samples.length, (double)samples.length / seconds);
+    if (samples.logicalBytes > 0) {
+        double gigabytes = (double)samples.logicalBytes / (1024.0 * 1024.0 * 1024.0);
+        printf(" %9.1f %9.2f %10.0f %10.1f", (double)samples.logicalBytes / (1024.0 * 1024.0) / seconds,
+               (double)costs.backingBytes / (double)samples.logicalBytes,
+               (double)costs.pageFaults / gigabytes, (double)costs.bufferAllocations / gigabytes);
+    }
+    else {
+        printf(" %9s %9s %10s %10s", "-", "-", "-", "-");
+    }
+    printf(" %10.1f %10.1f %10.1f %10.1f\n", percentile_micros(samples, 0.5), percentile_micros(samples, 0.9),
+           percentile_micros(samples, 0.99), percentile_micros(samples, 1.0));
+    if (workloadOptions.histograms) {
+        print_histogram(samples);
+    }
+}
+
+static void check(Int result, const String operation, const String path) {
+    if (result < 0) {
+        fatalError("%s %s failed: %s", operation, path, strerror(-result));
+    }
+}
+
+// Waits for the pending changes to reach the backing store
+static void commit(void) {
+    check(ops->fsync("/", 0, NULL), "fsync", "/");
+}
+
+// MARK: - Data workloads
+
+static void fill_file(const String path, ULong size) {
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    check(ops->create(path, 0644, &fi), "create", path);
+    ByteArray chunk = get_random_bytes(1048576);
+    for (ULong offset = 0; offset < size; offset += chunk.length) {
+        size_t length = (size_t)MIN(chunk.length, size - offset);
+        check(ops->write(path, (const char*)chunk.bytes, length, (off_t)offset, &fi), "write", path);
+    }
+    free(chunk.bytes);
+}
+
+static void sequential(Samples *samples, const WorkloadOptions *options, UInt requestSize, Bool write) {
+    char path[32];
+    snprintf(path, sizeof path, "/sequential%u", requestSize);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    if (write) {
+        check(ops->create(path, 0644, &fi), "create", path);
+    }
+    ByteArray buffer = get_random_bytes(requestSize);
+    for (ULong offset = 0; offset < options->fileSize; offset += requestSize) {
+        ULong start = monotonicNanos();
+        Int result = write
+            ? ops->write(path, (const char*)buffer.bytes, requestSize, (off_t)offset, &fi)
+            : ops->read(path, (char*)buffer.bytes, requestSize, (off_t)offset, &fi);
+        add_sample(samples, monotonicNanos() - start);
+        check(result, write ? "write" : "read", path);
+        samples->logicalBytes += requestSize;
+    }
+    free(buffer.bytes);
+}
+
+static void random_io(Samples *samples, const WorkloadOptions *options, UInt requestSize, Bool write) {
+    String path = "/random";
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    ByteArray buffer = get_random_bytes(requestSize);
+    ULong slots = MAX(options->fileSize / requestSize, 1);
+    for (UInt i = 0; i < options->randomOps; i++) {
+        off_t offset = (off_t)(((ULong)random() % slots) * requestSize);
+        ULong start = monotonicNanos();
+        Int result = write
+            ? ops->write(path, (const char*)buffer.bytes, requestSize, offset, &fi)
+            : ops->read(path, (char*)buffer.bytes, requestSize, offset, &fi);
+        add_sample(samples, monotonicNanos() - start);
+        check(result, write ? "write" : "read", path);
+        samples->logicalBytes += requestSize;
+    }
+    free(buffer.bytes);
+}
+
+static void seq_write_4k(Samples *samples, const WorkloadOptions *options) { sequential(samples, options, 4096, true); }
+static void seq_read_4k(Samples *samples, const WorkloadOptions *options) { sequential(samples, options, 4096, false); }
+static void seq_write_128k(Samples *samples, const WorkloadOptions *options) { sequential(samples, options, 131072, true); }
+static void seq_read_128k(Samples *samples, const WorkloadOptions *options) { sequential(samples, options, 131072, false); }
+static void seq_write_1m(Samples *samples, const WorkloadOptions *options) { sequential(samples, options, 1048576, true); }
+static void seq_read_1m(Samples *samples, const WorkloadOptions *options) { sequential(samples, options, 1048576, false); }
+static void rand_write_4k(Samples *samples, const WorkloadOptions *options) { random_io(samples, options, 4096, true); }
+static void rand_read_4k(Samples *samples, const WorkloadOptions *options) { random_io(samples, options, 4096, false); }
+static void rand_write_64k(Samples *samples, const WorkloadOptions *options) { random_io(samples, options, 65536, true); }
+static void rand_read_64k(Samples *samples, const WorkloadOptions *options) { random_io(samples, options, 65536, false); }
+
+// Chunks straddling block boundaries of a file far past 4 GB, read back and checked along with the
+// holes in between
+#define SPARSE_CHUNKS 32
+#define SPARSE_CHUNK_SIZE 8192
+#define SPARSE_FIRST_OFFSET (4ULL * 1024 * 1024 * 1024 - 4096)
+#define SPARSE_STRIDE (3ULL * 1024 * 1024 * 1024 + 12345)
+
+static void sparse_4g(Samples *samples, const WorkloadOptions *options) {
+    (void)options;
+    String path = "/sparse";
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    check(ops->create(path, 0644, &fi), "create", path);
+    Byte *chunk = malloc(SPARSE_CHUNK_SIZE);
+    Byte *readBack = malloc(SPARSE_CHUNK_SIZE);
+    for (UInt pass = 0; pass < 2; pass++) {
+        for (UInt i = 0; i < SPARSE_CHUNKS; i++) {
+            ULong offset = SPARSE_FIRST_OFFSET + i * SPARSE_STRIDE;
+            for (UInt j = 0; j < SPARSE_CHUNK_SIZE; j++) {
+                chunk[j] = (Byte)(i * 31 + j * 7 + 1);
+            }
+            ULong start = monotonicNanos();
+            Int result = pass == 0
+                ? ops->write(path, (const char*)chunk, SPARSE_CHUNK_SIZE, (off_t)offset, &fi)
+                : ops->read(path, (char*)readBack, SPARSE_CHUNK_SIZE, (off_t)offset, &fi);
+            add_sample(samples, monotonicNanos() - start);
+            check(result, pass == 0 ? "write" : "read", path);
+            samples->logicalBytes += SPARSE_CHUNK_SIZE;
+            if (pass == 1 && (result != SPARSE_CHUNK_SIZE || memcmp(chunk, readBack, SPARSE_CHUNK_SIZE) != 0)) {
+                fatalError("Data at offset %llu differs from what was written", (unsigned long long)offset);
+            }
+        }
+    }
+
+    // The file ends after the last chunk and the space between chunks reads as zeros
+    struct stat stats;
+    ULong end = SPARSE_FIRST_OFFSET + (SPARSE_CHUNKS - 1) * SPARSE_STRIDE + SPARSE_CHUNK_SIZE;
+    check(ops->getattr(path, &stats, NULL), "getattr", path);
+    if ((ULong)stats.st_size != end) {
+        fatalError("Size of %s is %llu instead of %llu", path, (unsigned long long)stats.st_size, (unsigned long long)end);
+    }
+    for (UInt i = 0; i + 1 < SPARSE_CHUNKS; i++) {
+        ULong offset = SPARSE_FIRST_OFFSET + i * SPARSE_STRIDE + SPARSE_STRIDE / 2;
+        check(ops->read(path, (char*)readBack, SPARSE_CHUNK_SIZE, (off_t)offset, &fi), "read", path);
+        for (UInt j = 0; j < SPARSE_CHUNK_SIZE; j++) {
+            if (readBack[j] != 0) {
+                fatalError("Hole at offset %llu isn't zeros", (unsigned long long)(offset + j));
+            }
+        }
+    }
+    check(ops->unlink(path), "unlink", path);
+    free(chunk);
+    free(readBack);
+}
+
+// Reads the whole file back in block sized requests and compares it with the expected bytes
+static void expect_contents(Samples *samples, const String path, const Byte *expected, ULong size) {
+    struct stat stats;
+    check(ops->getattr(path, &stats, NULL), "getattr", path);
+    if ((ULong)stats.st_size != size) {
+        fatalError("Size of %s is %llu instead of %llu", path, (unsigned long long)stats.st_size, (unsigned long long)size);
+    }
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    Byte *readBack = malloc(BLOCK_SIZE);
+    for (ULong offset = 0; offset < size; offset += BLOCK_SIZE) {
+        size_t length = (size_t)MIN(BLOCK_SIZE, size - offset);
+        ULong start = monotonicNanos();
+        Int result = ops->read(path, (char*)readBack, length, (off_t)offset, &fi);
+        add_sample(samples, monotonicNanos() - start);
+        check(result, "read", path);
+        samples->logicalBytes += length;
+        if ((size_t)result != length || memcmp(expected + offset, readBack, length) != 0) {
+            fatalError("Data of %s at offset %llu differs from what was written", path, (unsigned long long)offset);
+        }
+    }
+    free(readBack);
+}
+
+// A multi-block file copied with copy_file_range shares its blocks with the clone. Writes into the
+// clone across block boundaries must leave the source as it was, and unlinking the source must
+// leave the clone readable.
+#define CLONE_SIZE (4ULL * BLOCK_SIZE + 12345)
+#define CLONE_WRITE_SIZE 8192
+
+static void clone_cow(Samples *samples, const WorkloadOptions *options) {
+    (void)options;
+    String source = "/clone-source";
+    String clone = "/clone";
+    struct fuse_file_info sourceFi;
+    struct fuse_file_info cloneFi;
+    memset(&sourceFi, 0, sizeof sourceFi);
+    memset(&cloneFi, 0, sizeof cloneFi);
+    Byte *original = malloc(CLONE_SIZE);
+    Byte *expected = malloc(CLONE_SIZE);
+    for (ULong i = 0; i < CLONE_SIZE; i++) {
+        original[i] = (Byte)(i * 7 + i / 4093 + 1);
+    }
+    check(ops->create(source, 0644, &sourceFi), "create", source);
+    for (ULong offset = 0; offset < CLONE_SIZE; offset += BLOCK_SIZE) {
+        size_t length = (size_t)MIN(BLOCK_SIZE, CLONE_SIZE - offset);
+        check(ops->write(source, (const char*)original + offset, length, (off_t)offset, &sourceFi), "write", source);
+    }
+    commit();
+
+    check(ops->create(clone, 0644, &cloneFi), "create", clone);
+    for (ULong offset = 0; offset < CLONE_SIZE;) {
+        ULong start = monotonicNanos();
+        ssize_t copied = ops->copy_file_range(source, &sourceFi, (off_t)offset, clone, &cloneFi, (off_t)offset, CLONE_SIZE - offset, 0);
+        add_sample(samples, monotonicNanos() - start);
+        check((Int)copied, "copy_file_range", source);
+        if (copied == 0) {
+            fatalError("copy_file_range of %s stopped at offset %llu", source, (unsigned long long)offset);
+        }
+        offset += (ULong)copied;
+        samples->logicalBytes += (ULong)copied;
+    }
+
+    // Writes straddling every block boundary and one in the partial last block
+    memcpy(expected, original, CLONE_SIZE);
+    Byte chunk[CLONE_WRITE_SIZE];
+    for (ULong block = 1; block <= CLONE_SIZE / BLOCK_SIZE; block++) {
+        ULong offset = block < CLONE_SIZE / BLOCK_SIZE ? block * BLOCK_SIZE - CLONE_WRITE_SIZE / 2 : CLONE_SIZE - CLONE_WRITE_SIZE;
+        memset(chunk, (Int)(block * 37 + 3), sizeof chunk);
+        ULong start = monotonicNanos();
+        Int result = ops->write(clone, (const char*)chunk, sizeof chunk, (off_t)offset, &cloneFi);
+        add_sample(samples, monotonicNanos() - start);
+        check(result, "write", clone);
+        samples->logicalBytes += sizeof chunk;
+        memcpy(expected + offset, chunk, sizeof chunk);
+    }
+    commit();
+    expect_contents(samples, source, original, CLONE_SIZE);
+    expect_contents(samples, clone, expected, CLONE_SIZE);
+
+    // The blocks only the source referenced are reclaimed after the save, the shared ones stay
+    check(ops->unlink(source), "unlink", source);
+    commit();
+    commit();
+    expect_contents(samples, clone, expected, CLONE_SIZE);
+    check(ops->unlink(clone), "unlink", clone);
+    free(original);
+    free(expected);
+}
+
+// A hole punched across block boundaries reads as zeros and leaves the size and the bytes around it
+// alone, zeroing a range past the end without FALLOC_FL_KEEP_SIZE extends the file
+#define PUNCH_SIZE (3ULL * BLOCK_SIZE + 4321)
+#define PUNCH_OFFSET (BLOCK_SIZE - 5000)
+#define PUNCH_LENGTH (BLOCK_SIZE + 10000)
+#define ZERO_OFFSET (PUNCH_SIZE - 3000)
+#define ZERO_LENGTH (BLOCK_SIZE + 7000)
+
+static void punch_hole(Samples *samples, const WorkloadOptions *options) {
+    (void)options;
+#if FALLOC_FL_PUNCH_HOLE == 0
+    (void)samples;
+    printf("punch-hole needs FALLOC_FL_PUNCH_HOLE, which this system doesn't have\n");
+#else
+    String path = "/punched";
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    Byte *expected = calloc(1, ZERO_OFFSET + ZERO_LENGTH);
+    for (ULong i = 0; i < PUNCH_SIZE; i++) {
+        expected[i] = (Byte)(i * 11 + i / 4091 + 1);
+    }
+    check(ops->create(path, 0644, &fi), "create", path);
+    for (ULong offset = 0; offset < PUNCH_SIZE; offset += BLOCK_SIZE) {
+        size_t length = (size_t)MIN(BLOCK_SIZE, PUNCH_SIZE - offset);
+        check(ops->write(path, (const char*)expected + offset, length, (off_t)offset, &fi), "write", path);
+    }
+    commit();
+
+    ULong start = monotonicNanos();
+    Int result = ops->fallocate(path, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, PUNCH_OFFSET, PUNCH_LENGTH, &fi);
+    add_sample(samples, monotonicNanos() - start);
+    check(result, "fallocate", path);
+    memset(expected + PUNCH_OFFSET, 0, PUNCH_LENGTH);
+    commit();
+    expect_contents(samples, path, expected, PUNCH_SIZE);
+
+    start = monotonicNanos();
+    result = ops->fallocate(path, FALLOC_FL_ZERO_RANGE, ZERO_OFFSET, ZERO_LENGTH, &fi);
+    add_sample(samples, monotonicNanos() - start);
+    check(result, "fallocate", path);
+    memset(expected + ZERO_OFFSET, 0, PUNCH_SIZE - ZERO_OFFSET);
+    commit();
+    expect_contents(samples, path, expected, ZERO_OFFSET + ZERO_LENGTH);
+    check(ops->unlink(path), "unlink", path);
+    free(expected);
+#endif
+}
+
+// The cold workloads start with none of the block files in the page cache of the host
+static Int evict_entry(const char *path, const struct stat *stats, int flag, struct FTW *ftw) {
+    (void)stats;
+    (void)ftw;
+#ifdef POSIX_FADV_DONTNEED
+    Int fd = flag == FTW_F ? open(path, O_RDONLY) : ERROR;
+    if (fd != ERROR) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+#else
+    (void)path;
+    (void)flag;
+#endif
+    return 0;
+}
+
+static void evict_backing_files(const String directory) {
+    nftw(directory, evict_entry, 16, FTW_PHYS);
+}
+
+// MARK: - Metadata workloads
+
+static void create_stat_unlink(Samples *samples, const WorkloadOptions *options) {
+    check(ops->mkdir("/storm", 0755), "mkdir", "/storm");
+    char path[PATH_MAX_LENGTH];
+    struct stat stats;
+    for (UInt phase = 0; phase < 3; phase++) {
+        for (UInt i = 0; i < options->stormFiles; i++) {
+            snprintf(path, sizeof path, "/storm/file%u", i);
+            struct fuse_file_info fi;
+            memset(&fi, 0, sizeof fi);
+            ULong start = monotonicNanos();
+            Int result = phase == 0 ? ops->create(path, 0644, &fi)
+                : phase == 1 ? ops->getattr(path, &stats, NULL)
+                : ops->unlink(path);
+            add_sample(samples, monotonicNanos() - start);
+            check(result, phase == 0 ? "create" : phase == 1 ? "getattr" : "unlink", path);
+        }
+    }
+}
+
+// Directories of ten entries, files of 0 to 64k like a source tree
+static void untar(Samples *samples, const WorkloadOptions *options) {
+    check(ops->mkdir("/tree", 0755), "mkdir", "/tree");
+    ByteArray content = get_random_bytes(65536);
+    char dir[PATH_MAX_LENGTH] = "/tree";
+    for (UInt i = 0; i < options->treeFiles; i++) {
+        char path[PATH_MAX_LENGTH + 16];
+        ULong start = monotonicNanos();
+        if (i % 10 == 0) {
+            // Every tenth directory goes one level deeper, the rest are siblings
+            if (i % 100 == 0 && strlen(dir) < PATH_MAX_LENGTH - 32) {
+                snprintf(path, sizeof path, "%s/sub%u", dir, i);
+            }
+            else {
+                snprintf(path, sizeof path, "/tree/dir%u", i);
+            }
+            check(ops->mkdir(path, 0755), "mkdir", path);
+            strcpy(dir, path);
+        }
+        snprintf(path, sizeof path, "%s/file%u", dir, i);
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof fi);
+        check(ops->create(path, 0644, &fi), "create", path);
+        size_t size = (size_t)random() % content.length;
+        if (size > 0) {
+            check(ops->write(path, (const char*)content.bytes, size, 0, &fi), "write", path);
+        }
+        check(ops->release(path, &fi), "release", path);
+        add_sample(samples, monotonicNanos() - start);
+        samples->logicalBytes += size;
+    }
+    free(content.bytes);
+}
+
+static void rename_tree(Samples *samples, const WorkloadOptions *options) {
+    (void)options;
+    struct stat stats;
+    if (ops->getattr("/tree", &stats, NULL) < 0) {
+        fatalError("rename-tree needs the tree created by the untar workload");
+    }
+    for (UInt i = 0; i < 10; i++) {
+        ULong start = monotonicNanos();
+        check(ops->rename(i % 2 == 0 ? "/tree" : "/renamed", i % 2 == 0 ? "/renamed" : "/tree", 0), "rename", "/tree");
+        add_sample(samples, monotonicNanos() - start);
+    }
+}
+
+// MARK: - Lookups during archives
+
+#define GETATTR_ARCHIVES 20 // Archives of the whole index getattr-during-archive runs against
+
+typedef struct {
+    atomic_bool done;
+} ArchiveThread;
+
+// Files of a single directory, created once for both getattr workloads
+static void build_index(const WorkloadOptions *options) {
+    struct stat stats;
+    if (ops->getattr("/index", &stats, NULL) == SUCCESS) {
+        return;
+    }
+    check(ops->mkdir("/index", 0755), "mkdir", "/index");
+    char path[PATH_MAX_LENGTH];
+    for (UInt i = 0; i < options->indexFiles; i++) {
+        snprintf(path, sizeof path, "/index/file%u", i);
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof fi);
+        check(ops->create(path, 0644, &fi), "create", path);
+        check(ops->release(path, &fi), "release", path);
+    }
+    commit();
+}
+
+static void stat_random_file(Samples *samples, const WorkloadOptions *options) {
+    char path[PATH_MAX_LENGTH];
+    struct stat stats;
+    snprintf(path, sizeof path, "/index/file%u", (UInt)((ULong)random() % MAX(options->indexFiles, 1)));
+    ULong start = monotonicNanos();
+    Int result = ops->getattr(path, &stats, NULL);
+    add_sample(samples, monotonicNanos() - start);
+    check(result, "getattr", path);
+}
+
+static void getattr_index(Samples *samples, const WorkloadOptions *options) {
+    build_index(options);
+    for (UInt i = 0; i < options->randomOps; i++) {
+        stat_random_file(samples, options);
+    }
+}
+
+// Every commit makes the save thread snapshot, encrypt and write the whole index
+static void* archive_thread(void *arg) {
+    ArchiveThread *thread = arg;
+    for (UInt i = 0; i < GETATTR_ARCHIVES; i++) {
+        commit();
+    }
+    atomic_store(&thread->done, true);
+    return NULL;
+}
+
+// Renames run on the metadata thread like getattr in both modes, so they can delay a lookup but never
+// overlap it. What does overlap is the save thread archiving the index.
+static void getattr_during_archive(Samples *samples, const WorkloadOptions *options) {
+    build_index(options);
+    ArchiveThread thread;
+    atomic_init(&thread.done, false);
+    pthread_t id;
+    pthread_create(&id, NULL, archive_thread, &thread);
+    while (!atomic_load(&thread.done)) {
+        stat_random_file(samples, options);
+    }
+    pthread_join(id, NULL);
+}
+
+// MARK: - fsync under concurrency
+
+typedef struct {
+    UInt index;
+    Samples samples;
+} FsyncThread;
+
+// The path based callbacks run single threaded when mounted, so only the fsync calls overlap
+static pthread_mutex_t callbackLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void* fsync_thread(void *arg) {
+    FsyncThread *thread = arg;
+    char path[PATH_MAX_LENGTH];
+    snprintf(path, sizeof path, "/fsync%u", thread->index);
+    struct fuse_file_info fi;
+    memset(&fi, 0, sizeof fi);
+    Byte data[4096];
+    memset(data, (Int)thread->index, sizeof data);
+    for (UInt i = 0; i < 20; i++) {
+        pthread_mutex_lock(&callbackLock);
+        check(ops->write(path, (const char*)data, sizeof data, (off_t)(i * sizeof data), &fi), "write", path);
+        pthread_mutex_unlock(&callbackLock);
+        ULong start = monotonicNanos();
+        check(ops->fsync(path, 0, &fi), "fsync", path);
+        add_sample(&thread->samples, monotonicNanos() - start);
+    }
+    return NULL;
+}
+
+static void concurrent_fsync(Samples *samples, const WorkloadOptions *options) {
+    UInt threads = MIN(MAX(options->fsyncThreads, 1), FSYNC_THREADS_MAX);
+    pthread_t ids[FSYNC_THREADS_MAX];
+    FsyncThread states[FSYNC_THREADS_MAX];
+    for (UInt i = 0; i < threads; i++) {
+        char path[PATH_MAX_LENGTH];
+        snprintf(path, sizeof path, "/fsync%u", i);
+        struct fuse_file_info fi;
+        memset(&fi, 0, sizeof fi);
+        check(ops->create(path, 0644, &fi), "create", path);
+        states[i].index = i;
+        states[i].samples = init_samples();
+    }
+    for (UInt i = 0; i < threads; i++) {
+        pthread_create(&ids[i], NULL, fsync_thread, &states[i]);
+    }
+    for (UInt i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        for (UInt j = 0; j < states[i].samples.length; j++) {
+            add_sample(samples, states[i].samples.nanos[j]);
+        }
+        free(states[i].samples.nanos);
+        samples->logicalBytes += 20 * 4096;
+    }
+}
+
+// MARK: - Main
+
+typedef struct {
+    String name;
+    Workload workload;
+} WorkloadEntry;
+
+static const WorkloadEntry workloads[] = {
+    { "seq-write-4k", seq_write_4k },
+    { "seq-read-4k", seq_read_4k },
+    { "seq-write-128k", seq_write_128k },
+    { "seq-read-128k", seq_read_128k },
+    { "seq-write-1m", seq_write_1m },
+    { "seq-read-1m", seq_read_1m },
+    { "cold-seq-read-1m", seq_read_1m },
+    { "rand-write-4k", rand_write_4k },
+    { "rand-read-4k", rand_read_4k },
+    { "rand-write-64k", rand_write_64k },
+    { "rand-read-64k", rand_read_64k },
+    { "cold-rand-read-64k", rand_read_64k },
+    { "sparse-4g", sparse_4g },
+    { "clone-cow", clone_cow },
+    { "punch-hole", punch_hole },
+    { "create-stat-unlink", create_stat_unlink },
+    { "untar", untar },
+    { "rename-tree", rename_tree },
+    { "getattr-index", getattr_index },
+    { "getattr-during-archive", getattr_during_archive },
+    { "fsync-concurrent", concurrent_fsync },
+};
+
+static Int remove_entry(const char *path, const struct stat *stats, int flag, struct FTW *ftw) {
+    (void)stats;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void show_help(void) {
+    printf("Usage: secfs-workload [options]\n\n");
+    printf("Options:\n");
+    printf("  --size <bytes>       File size of the sequential and random workloads (default: 16777216)\n");
+    printf("  --ops <count>        Requests per random workload (default: 1000)\n");
+    printf("  --files <count>      Files created, stated and unlinked by create-stat-unlink (default: 5000)\n");
+    printf("  --tree-files <count> Files in the untar tree (default: 2000)\n");
+    printf("  --index-files <count> Files of the index the getattr workloads look up (default: 20000)\n");
+    printf("  --threads <count>    Threads of fsync-concurrent (default: 8)\n");
+    printf("  --cipher <name>      Cipher of the secure folder (default: %s)\n", cipher_name(DEFAULT_CIPHER));
+    printf("  --direct-backing-io  Read and write block files with O_DIRECT, to compare with buffered I/O\n");
+    printf("  --only <workload>    Run a single workload\n");
+    printf("  --histograms         Print a latency histogram for every workload\n\n");
+    printf("Workloads:");
+    for (UInt i = 0; i < sizeof workloads / sizeof workloads[0]; i++) {
+        printf(" %s", workloads[i].name);
+    }
+    printf("\n");
+}
+
+static ULong parse_size(const String name, const String value) {
+    char *end;
+    errno = 0;
+    unsigned long long number = strtoull(value, &end, 10);
+    if (end == value || *end != '\0' || errno == ERANGE || value[0] == '-') {
+        fatalError("Invalid value '%s' for --%s", value, name);
+    }
+    return (ULong)number;
+}
+
+static UInt parse_count(const String name, const String value) {
+    ULong number = parse_size(name, value);
+    if (number > UINT32_MAX) {
+        fatalError("Invalid value '%s' for --%s", value, name);
+    }
+    return (UInt)number;
+}
+
+int main(int argc, String argv[]) {
+    WorkloadOptions options = { 16777216, 1000, 5000, 2000, 20000, 8, DEFAULT_CIPHER, false, NULL, false };
+    static struct option longOptions[] = {
+        { "size", required_argument, NULL, 's' },
+        { "ops", required_argument, NULL, 'o' },
+        { "files", required_argument, NULL, 'f' },
+        { "tree-files", required_argument, NULL, 't' },
+        { "index-files", required_argument, NULL, 'i' },
+        { "threads", required_argument, NULL, 'j' },
+        { "cipher", required_argument, NULL, 'c' },
+        { "direct-backing-io", no_argument, NULL, 'D' },
+        { "only", required_argument, NULL, 'w' },
+        { "histograms", no_argument, NULL, 'g' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Int option;
+    while ((option = getopt_long(argc, argv, "h", longOptions, NULL)) != -1) {
+        switch (option) {
+            case 's': options.fileSize = MAX(parse_size("size", optarg), 1048576); break;
+            case 'o': options.randomOps = parse_count("ops", optarg); break;
+            case 'f': options.stormFiles = parse_count("files", optarg); break;
+            case 't': options.treeFiles = parse_count("tree-files", optarg); break;
+            case 'i': options.indexFiles = parse_count("index-files", optarg); break;
+            case 'j': options.fsyncThreads = parse_count("threads", optarg); break;
+            case 'w': options.only = optarg; break;
+            case 'g': options.histograms = true; break;
+            case 'D': options.directBackingIO = true; break;
+            case 'c': {
+                Int cipher = cipher_from_name(optarg);
+                if (cipher == -1) {
+                    fatalError("Unknown cipher '%s'", optarg);
+                }
+                options.cipher = (Cipher)cipher;
+                break;
+            }
+            case 'h':
+                show_help();
+                return 0;
+            default:
+                show_help();
+                return 1;
+        }
+    }
+    workloadOptions = options;
+
+    char directory[] = "/tmp/secfs-workload-XXXXXX";
+    if (mkdtemp(directory) == NULL) {
+        fatalError("Couldn't create a temporary directory");
+    }
+    char dataPath[sizeof directory + 1];
+    snprintf(dataPath, sizeof dataPath, "%s/", directory);
+
+    LoadSecfsResult initResult = init_secfs(dataPath, get_random_bytes(KEY_LENGTH), get_random_bytes(IV_LENGTH), options.cipher);
+    if (initResult.error) {
+        fatalError("Could not initialize secure folder: %s", initResult.error);
+    }
+    FsOptions fsOptions = default_fs_options();
+    fsOptions.directBackingIO = options.directBackingIO;
+    ops = fs_operations(initResult.secfs, fsOptions);
+    srandom(1);
+
+    printf("Secure folder %s, cipher %s, %s block files\n\n", dataPath, cipher_name(options.cipher),
+           initResult.secfs->directIO ? "direct" : "buffered");
+    printf("%-24s %8s %10s %9s %9s %10s %10s %10s %10s %10s %10s\n", "Workload", "Ops", "Ops/s", "MB/s", "Write amp",
+           "Faults/GB", "Allocs/GB", "p50 us", "p90 us", "p99 us", "max us");
+
+    // The random workloads run against a file of the configured size
+    Bool randomFileReady = false;
+    for (UInt i = 0; i < sizeof workloads / sizeof workloads[0]; i++) {
+        const WorkloadEntry *entry = &workloads[i];
+        if (options.only != NULL && strcmp(options.only, entry->name) != 0) {
+            continue;
+        }
+        if (strstr(entry->name, "rand-") != NULL && !randomFileReady) {
+            fill_file("/random", options.fileSize);
+            commit();
+            randomFileReady = true;
+        }
+        if (strcmp(entry->name, "rename-tree") == 0 && options.only != NULL) {
+            untar(&(Samples){ NULL, 0, 0, 0 }, &options);
+            commit();
+        }
+
+        if (strncmp(entry->name, "cold-", 5) == 0) {
+            evict_backing_files(directory);
+        }
+
+        Samples samples = init_samples();
+        WorkloadCosts before = current_costs();
+        ULong start = monotonicNanos();
+        entry->workload(&samples, &options);
+        ULong wallNanos = monotonicNanos() - start;
+
+        // Include the metadata written for the workload in its write amplification
+        commit();
+        WorkloadCosts after = current_costs();
+        WorkloadCosts costs = { after.backingBytes - before.backingBytes, after.pageFaults - before.pageFaults,
+                                after.bufferAllocations - before.bufferAllocations };
+        report(entry->name, samples, wallNanos, costs);
+        free(samples.nanos);
+    }
+
+    printf("\nPeak memory: %.1f MB\n", (double)peakMemoryBytes() / (1024.0 * 1024.0));
+    ops->destroy(NULL);
+    nftw(directory, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return 0;
+}
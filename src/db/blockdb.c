@@ -7,83 +7,346 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <uuid/uuid.h>
 #include "../utilities/utilities.h"
+#include "recordfile.h"
+#include "../utilities/stats.h"
+#include "../utilities/epoch.h"
+#include "../utilities/memory.h"
 
-Error archive_blockDB (const String path, BlockDB *db, ByteArray key, ByteArray iv) {
-    ByteArray archivedData = initByteArray(db->length * (UInt)sizeof(Block));
-    for (UInt i = 0; i < db->length; i++) {
-        memcpy(&archivedData.bytes[i * sizeof(Block)], db->blocks[i], sizeof(Block));
+// A loaded block, its slot in the shard and in the published view
+#define LOADED_BLOCK_MEMORY (sizeof(Block) + 2 * sizeof(Block*))
+
+UInt shard_index(uuid_t fileId) {
+    // The first 12 bits of a random uuid are random
+    return ((UInt)fileId[0] << 4 | (UInt)fileId[1] >> 4) % BLOCK_SHARD_COUNT;
+}
+
+void shard_path(BlockDB *db, UInt shard, char *out, ULong size) {
+    snprintf(out, size, "%s%03x", db->path, shard);
+}
+
+ByteArray shard_key(BlockDB *db, UInt shard) {
+    return shard < atomic_load(&db->rotatedShards) ? db->key : db->previousKey;
+}
+
+static void add_loaded_blocks(BlockDB *db, UInt count) {
+    db->loadedBlocks += count;
+    memory_charge(MemoryBlockMetadata, count * LOADED_BLOCK_MEMORY);
+}
+
+static void remove_loaded_blocks(BlockDB *db, UInt count) {
+    db->loadedBlocks -= count;
+    memory_uncharge(MemoryBlockMetadata, count * LOADED_BLOCK_MEMORY);
+}
+
+static void append_to_shard(BlockShard *shard, Block *block) {
+    // Increase memory to store blocks if it's full
+    while (shard->length >= shard->max) {
+        if (shard->max == 0) {
+            shard->blocks = malloc(sizeof(Block*) * 1);
+            shard->max = 1;
+        }
+        else {
+            shard->max = shard->max * 2;
+            shard->blocks = realloc(shard->blocks, sizeof(Block*) * shard->max);
+        }
     }
-    
-    // Encrypt
-    ByteArray encryptedData = initByteArray(0);
-    if (archivedData.length > 0) {
-        AESEncryptResult encryptResult = aes_encrypt(archivedData, key, iv);
-        if (encryptResult.error) {
-            free(archivedData.bytes);
-            return encryptResult.error;
+    // Add block and increase index
+    shard->blocks[shard->length] = block;
+    (shard->length)++;
+}
+
+// Must be called with db->lock held after the blocks of a shard changed
+static void publish_shard(BlockShard *shard) {
+    BlockShardView *view = NULL;
+    if (shard->loaded) {
+        view = malloc(sizeof(BlockShardView) + sizeof(Block*) * shard->length);
+        view->length = shard->length;
+        memcpy(view->blocks, shard->blocks, sizeof(Block*) * shard->length);
+    }
+    epoch_retire(atomic_exchange(&shard->view, view));
+}
+
+static void load_block_record(const Byte *record, void *context) {
+    Block *block = ALLOC(Block);
+    memcpy(block, record, sizeof(Block));
+    append_to_shard((BlockShard*)context, block);
+}
+
+static void evict_shards(BlockDB *db, UInt keep) {
+    while (db->loadedBlocks > BLOCK_CACHE_MAX_BLOCKS || memory_over_budget()) {
+        // Find the least recently used shard which can be dropped
+        BlockShard *victim = NULL;
+        for (UInt i = 0; i < BLOCK_SHARD_COUNT; i++) {
+            BlockShard *shard = &db->shards[i];
+            if (i == keep || !shard->loaded || shard->dirty || atomic_load(&shard->pins) > 0 || shard->length == 0) {
+                continue;
+            }
+            if (victim == NULL || atomic_load(&shard->lastUsed) < atomic_load(&victim->lastUsed)) {
+                victim = shard;
+            }
         }
-        encryptedData = encryptResult.cipher;
+        if (victim == NULL) {
+            return;
+        }
+
+        // Lookups pin the shard before reading its view, so they either find no view or keep the shard
+        BlockShardView *view = atomic_exchange(&victim->view, NULL);
+        if (atomic_load(&victim->pins) > 0) {
+            atomic_store(&victim->view, view);
+            return;
+        }
+        epoch_retire(view);
+
+        debugPrint("Evicting %d blocks from block cache", victim->length);
+        for (UInt i = 0; i < victim->length; i++) {
+            epoch_retire(victim->blocks[i]);
+        }
+        free(victim->blocks);
+        remove_loaded_blocks(db, victim->length);
+        victim->blocks = NULL;
+        victim->length = 0;
+        victim->max = 0;
+        victim->loaded = false;
+    }
+}
+
+void trim_blockDB(BlockDB *db) {
+    pthread_mutex_lock(&db->lock);
+    evict_shards(db, BLOCK_SHARD_COUNT);
+    pthread_mutex_unlock(&db->lock);
+}
+
+// Must be called with db->lock held
+static Error load_shard(BlockDB *db, UInt index) {
+    BlockShard *shard = &db->shards[index];
+    atomic_store(&shard->lastUsed, atomic_fetch_add(&db->clock, 1) + 1);
+    if (shard->loaded) {
+        return NULL;
     }
-    
-    WriteFileResult writeResult = writeFile(path, encryptedData);
-    free(encryptedData.bytes);
-    free(archivedData.bytes);
-    return writeResult.error;
 
+    char path[PATH_MAX_LENGTH];
+    shard_path(db, index, path, sizeof path);
+    if (isFileExists(path)) {
+        Error error = load_records(path, sizeof(Block), load_block_record, shard, db->cipher, shard_key(db, index), db->iv);
+        if (error) {
+            for (UInt i = 0; i < shard->length; i++) {
+                free(shard->blocks[i]);
+            }
+            shard->length = 0;
+            return error;
+        }
+    }
+
+    debugPrint("Loaded %d blocks from shard %03x", shard->length, index);
+    shard->loaded = true;
+    publish_shard(shard);
+    add_loaded_blocks(db, shard->length);
+    evict_shards(db, index);
     return NULL;
 }
 
-LoadBlockDBResult load_blockDB (const String path, ByteArray key, ByteArray iv) {
+LoadBlockDBResult load_blockDB (const String path, Cipher cipher, ByteArray key, ByteArray iv) {
     LoadBlockDBResult result;
     result.error = NULL;
     result.blockDB = NULL;
-    
-    // Read encrypted file
-    ReadFileResult readResult = readFile(path);
-    if (readResult.error) {
-        result.error = readResult.error;
+
+    // Shards are loaded on demand, only make sure the storage is there
+    struct stat stats;
+    if (stat(path, &stats) == ERROR) {
+        result.error = strerror(errno);
         return result;
     }
+
+    result.blockDB = init_blockDB(path, cipher, key, iv);
+    return result;
+}
+
+static void migrate_block_record(const Byte *record, void *context) {
+    BlockDB *db = context;
+    Block *block = ALLOC(Block);
+    memcpy(block, record, sizeof(Block));
+    append_to_shard(&db->shards[shard_index(block->fileId)], block);
+    add_loaded_blocks(db, 1);
+}
+
+Error migrate_blockDB(BlockDB *db, const String legacyPath) {
+    pthread_mutex_lock(&db->lock);
+
+    // The single file database is the source of truth. Any shard written by an interrupted
+    // migration is discarded and every shard gets rewritten by the next archive.
+    for (UInt i = 0; i < BLOCK_SHARD_COUNT; i++) {
+        db->shards[i].loaded = true;
+        db->shards[i].dirty = true;
+        db->shards[i].version++;
+    }
+    Error error = load_records(legacyPath, sizeof(Block), migrate_block_record, db, db->cipher, db->key, db->iv);
+    for (UInt i = 0; i < BLOCK_SHARD_COUNT; i++) {
+        publish_shard(&db->shards[i]);
+    }
+
+    pthread_mutex_unlock(&db->lock);
+    return error;
+}
+
+BlockDBSnapshot snapshot_blockDB(BlockDB *db) {
+    BlockDBSnapshot snapshot = { 0, NULL, false, 0, { NULL, 0 } };
+    pthread_mutex_lock(&db->lock);
+    if (db->referencesDirty) {
+        snapshot.referencesDirty = true;
+        snapshot.referencesVersion = db->referencesVersion;
+        snapshot.references = initByteArray((ULong)db->referencesLength * sizeof(BlockReference));
+        memcpy(snapshot.references.bytes, db->references, snapshot.references.length);
+    }
     
-    // Decrypt data if exist
-    ByteArray data;
-    if (readResult.contents.length > 0) {
-        AESDecryptResult decryptResult = aes_decrypt(readResult.contents, key, iv);
-        if (decryptResult.error) {
-            result.error = decryptResult.error;
-            return result;
+    for (UInt index = 0; index < BLOCK_SHARD_COUNT; index++) {
+        BlockShard *shard = &db->shards[index];
+        if (!shard->dirty) {
+            continue;
+        }
+        if (snapshot.shards == NULL) {
+            snapshot.shards = malloc(sizeof(BlockShardSnapshot) * BLOCK_SHARD_COUNT);
+        }
+        
+        BlockShardSnapshot *shardSnapshot = &snapshot.shards[snapshot.length++];
+        shardSnapshot->shard = index;
+        shardSnapshot->version = shard->version;
+        shardSnapshot->records = initByteArray((ULong)shard->length * sizeof(Block));
+        for (UInt i = 0; i < shard->length; i++) {
+            memcpy(&shardSnapshot->records.bytes[i * sizeof(Block)], shard->blocks[i], sizeof(Block));
+        }
+    }
+    
+    pthread_mutex_unlock(&db->lock);
+    return snapshot;
+}
+
+typedef struct {
+    BlockDB *db;
+    BlockDBSnapshot snapshot;
+    Error error;
+} ArchiveShardsTask;
+
+static void archive_shard(UInt index, void *context) {
+    ArchiveShardsTask *task = context;
+    BlockDB *db = task->db;
+    BlockShardSnapshot *shardSnapshot = &task->snapshot.shards[index];
+    char path[PATH_MAX_LENGTH];
+    shard_path(db, shardSnapshot->shard, path, sizeof path);
+    
+    // A key rotation may have written a newer version meanwhile
+    pthread_mutex_lock(&db->lock);
+    Bool stale = shardSnapshot->version < db->shards[shardSnapshot->shard].archivedVersion;
+    pthread_mutex_unlock(&db->lock);
+    if (stale) {
+        return;
+    }
+    
+    Error error = NULL;
+    if (shardSnapshot->records.length == 0) {
+        if (unlink(path) == ERROR && errno != ENOENT) {
+            error = strerror(errno);
         }
-        data = decryptResult.plainText;
     }
     else {
-        data = readResult.contents; // 0 bytes
+        error = archive_records(path, shardSnapshot->records, db->cipher, shard_key(db, shardSnapshot->shard), db->iv);
     }
     
-    // Extract data
-    result.blockDB = init_blockDB();
-    Block *readBlock = ALLOC(Block);
-    for (ULong offset = 0; offset < data.length; offset += sizeof(Block)) {
-        memcpy(readBlock, &data.bytes[offset], sizeof(Block));
-        add_block(result.blockDB, readBlock);
-        readBlock = ALLOC(Block);
+    if (error) {
+        pthread_mutex_lock(&db->lock);
+        task->error = error;
+        pthread_mutex_unlock(&db->lock);
+    }
+    else {
+        set_shard_archived(db, shardSnapshot->shard, shardSnapshot->version);
     }
+}
+
+void set_shard_archived(BlockDB *db, UInt shardIndex, ULong version) {
+    pthread_mutex_lock(&db->lock);
+    // Shards changed since the snapshot stay dirty and can't be evicted
+    BlockShard *shard = &db->shards[shardIndex];
+    shard->archivedVersion = MAX(shard->archivedVersion, version);
+    if (shard->version == version) {
+        shard->dirty = false;
+    }
+    pthread_mutex_unlock(&db->lock);
+}
+
+Error archive_blockDB_snapshot(BlockDB *db, BlockDBSnapshot snapshot) {
+    if (mkdir(db->path, 0700) == ERROR && errno != EEXIST) {
+        return strerror(errno);
+    }
+    
+    // Shards are independent files, encrypt and write them in parallel
+    ArchiveShardsTask task = { db, snapshot, NULL };
+    parallelFor(snapshot.length, cpuCount(), archive_shard, &task);
     
-    free(readBlock);
-    free(data.bytes);
+    pthread_mutex_lock(&db->lock);
+    evict_shards(db, BLOCK_SHARD_COUNT);
+    pthread_mutex_unlock(&db->lock);
+    return task.error;
+}
 
-    return result;
+void free_blockDB_snapshot(BlockDBSnapshot snapshot) {
+    for (UInt i = 0; i < snapshot.length; i++) {
+        free(snapshot.shards[i].records.bytes);
+    }
+    free(snapshot.shards);
+    free(snapshot.references.bytes);
+}
+
+Error archive_blockDB (BlockDB *db) {
+    BlockDBSnapshot snapshot = snapshot_blockDB(db);
+    Error error = archive_blockDB_snapshot(db, snapshot);
+    free_blockDB_snapshot(snapshot);
+    return error;
 }
 
-BlockDB* init_blockDB(void) {
+BlockDB* init_blockDB(const String path, Cipher cipher, ByteArray key, ByteArray iv) {
     BlockDB *newDB = ALLOC(BlockDB);
-    newDB->length = 0;
-    newDB->max = 0;
-    newDB->blocks = NULL;
+    memset(newDB->shards, 0, sizeof newDB->shards);
+    newDB->loadedBlocks = 0;
+    atomic_init(&newDB->clock, 0);
+    newDB->path = malloc(strlen(path) + 1);
+    strcpy(newDB->path, path);
+    newDB->cipher = cipher;
+    newDB->key = key;
+    newDB->previousKey = key;
+    atomic_init(&newDB->rotatedShards, BLOCK_SHARD_COUNT);
+    newDB->iv = iv;
+    newDB->references = NULL;
+    newDB->referencesLength = 0;
+    newDB->referencesMax = 0;
+    newDB->referencesDirty = false;
+    newDB->referencesVersion = 0;
+    pthread_mutex_init(&newDB->lock, NULL);
     return newDB;
 }
 
+// Only for databases no other thread refers to anymore, so nothing waits for the epochs
+void free_blockDB(BlockDB *db) {
+    if (db == NULL) {
+        return;
+    }
+    for (UInt index = 0; index < BLOCK_SHARD_COUNT; index++) {
+        BlockShard *shard = &db->shards[index];
+        for (UInt i = 0; i < shard->length; i++) {
+            free(shard->blocks[i]);
+        }
+        free(shard->blocks);
+        free(atomic_load(&shard->view));
+    }
+    remove_loaded_blocks(db, db->loadedBlocks);
+    free(db->references);
+    free(db->path);
+    pthread_mutex_destroy(&db->lock);
+    free(db);
+}
+
 Block* generate_block(uuid_t fileId, UInt index) {
     Block *newBlock = ALLOC(Block);
     uuid_copy(newBlock->fileId, fileId);
@@ -95,92 +358,344 @@ Block* generate_block(uuid_t fileId, UInt index) {
     return newBlock;
 }
 
-void add_block(BlockDB *db, Block *block) {
-    // Increase memory to store blocks if it's full
-    while (db->length >= db->max) {
-        if (db -> max == 0) {
-            db -> blocks = malloc(sizeof(Block)*1);
-            db -> max = 1;
-        }
-        else {
-            db->max = db->max * 2;
-            db->blocks = realloc(db->blocks, sizeof(Block) * db->max);
-        }
+Error add_block(BlockDB *db, Block *block) {
+    pthread_mutex_lock(&db->lock);
+    UInt index = shard_index(block->fileId);
+    Error error = load_shard(db, index);
+    if (error == NULL) {
+        append_to_shard(&db->shards[index], block);
+        publish_shard(&db->shards[index]);
+        db->shards[index].dirty = true;
+        db->shards[index].version++;
+        add_loaded_blocks(db, 1);
     }
-    // Add block and increase index
-    db->blocks[db->length] = block;
-    (db->length)++;
+    pthread_mutex_unlock(&db->lock);
+    return error;
 }
 
-Int search_block_index(BlockDB *db, uuid_t blockId) {
-    for (UInt i = 0; i < db->length; i++) {
-        if(uuid_compare(db->blocks[i]->id, blockId) == 0) {
-            return (Int)i;
-        }
+Error remove_block(BlockDB *db, Block *block) {
+    pthread_mutex_lock(&db->lock);
+    UInt index = shard_index(block->fileId);
+    Error error = load_shard(db, index);
+    if (error) {
+        pthread_mutex_unlock(&db->lock);
+        return error;
     }
-    return -1;
-}
 
-void remove_block(BlockDB *db, uuid_t blockId) {
     // find block index
-    Int index = search_block_index(db, blockId);
-    if (index == -1) {
-        // block was not found, nothing to remove
-        return;
-    }
-    
-    // free and shift array to the left
-    free(db->blocks[index]);
-    for (Int i = index; i < (Int)db->length - 1; i++) {
-        db->blocks[i] = db->blocks[i+1];
+    BlockShard *shard = &db->shards[index];
+    error = "Block was removed";
+    for (UInt i = 0; i < shard->length; i++) {
+        if (shard->blocks[i] != block) {
+            continue;
+        }
+
+        // shift array to the left, lookups may still be reading the block until the new view is out
+        memmove(&shard->blocks[i], &shard->blocks[i + 1], sizeof(Block*) * (shard->length - i - 1));
+        (shard->length)--;
+        publish_shard(shard);
+        epoch_retire(block);
+        shard->dirty = true;
+        shard->version++;
+        remove_loaded_blocks(db, 1);
+        error = NULL;
+        break;
     }
-    
-    (db->length)--;
+
+    pthread_mutex_unlock(&db->lock);
+    return error;
 }
 
-Block* search_block(BlockDB *db, uuid_t blockId) {
-    Int index = search_block_index(db, blockId);
-    if (index == -1) {
-        // block was not found
-        return NULL;
+Error replace_block(BlockDB *db, Block *block, Block *replacement) {
+    pthread_mutex_lock(&db->lock);
+    UInt index = shard_index(block->fileId);
+    Error error = load_shard(db, index);
+    if (error) {
+        pthread_mutex_unlock(&db->lock);
+        return error;
+    }
+
+    BlockShard *shard = &db->shards[index];
+    error = "Block was removed";
+    for (UInt i = 0; i < shard->length; i++) {
+        if (shard->blocks[i] != block) {
+            continue;
+        }
+        shard->blocks[i] = replacement;
+        publish_shard(shard);
+        epoch_retire(block);
+        shard->dirty = true;
+        shard->version++;
+        error = NULL;
+        break;
     }
-    return db->blocks[index];
+
+    pthread_mutex_unlock(&db->lock);
+    return error;
 }
 
-BlocksForFileResult all_blocks_for_file(BlockDB *db, uuid_t fileId) {
+// Collect the blocks of a file which start or end within [offset, offset+size] and pin their shard.
+// Loaded shards are looked up without the lock, only loading one takes it.
+static BlocksForFileResult find_blocks(BlockDB *db, uuid_t fileId, Bool matchAll, ULong offset, ULong size) {
     BlocksForFileResult result;
+    result.error = NULL;
     result.length = 0;
-    result.blocks = malloc(sizeof(Block) * db->length);
-    for (UInt i = 0; i < db->length; i++) {
-        Block *block = db->blocks[i];
-        if (uuid_compare(block->fileId, fileId) == 0) {
+    result.blocks = NULL;
+    result.shard = shard_index(fileId);
+
+    ULong start = stats_start();
+    BlockShard *shard = &db->shards[result.shard];
+    epoch_enter();
+    atomic_fetch_add(&shard->pins, 1);
+    BlockShardView *view = atomic_load(&shard->view);
+    if (view == NULL) {
+        pthread_mutex_lock(&db->lock);
+        result.error = load_shard(db, result.shard);
+        view = atomic_load(&shard->view);
+        pthread_mutex_unlock(&db->lock);
+        if (result.error) {
+            atomic_fetch_sub(&shard->pins, 1);
+            epoch_exit();
+            stats_record(MetricBlockLookup, start, 0, true);
+            return result;
+        }
+    }
+    else {
+        atomic_store_explicit(&shard->lastUsed, atomic_fetch_add_explicit(&db->clock, 1, memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+
+    result.blocks = malloc(sizeof(Block*) * MAX(view->length, 1));
+    for (UInt i = 0; i < view->length; i++) {
+        Block *block = view->blocks[i];
+        if (uuid_compare(block->fileId, fileId) != 0) {
+            continue;
+        }
+
+        ULong blockStart = (ULong)block->index * BLOCK_SIZE;
+        ULong blockEnd = blockStart + BLOCK_SIZE;
+        Bool matchRange = blockStart < offset + size && blockEnd > offset;
+        if (matchAll || matchRange) {
             result.blocks[result.length++] = block;
         }
     }
-    
+
     // compact array
-    result.blocks = realloc(result.blocks, sizeof(Block) * result.length);
+    result.blocks = realloc(result.blocks, sizeof(Block*) * MAX(result.length, 1));
+    stats_record(MetricBlockLookup, start, 0, false);
     return result;
 }
 
-BlocksForFileResult blocks_for_file(BlockDB *db, uuid_t fileId, UInt offset, ULong size) {
-    
+BlocksForFileResult blocks_in_shard(BlockDB *db, UInt shardIndex) {
     BlocksForFileResult result;
+    result.error = NULL;
     result.length = 0;
-    result.blocks = malloc(sizeof(Block) * db->length);
-    for (UInt i = 0; i < db->length; i++) {
-        Block *block = db->blocks[i];
-        Bool matchFileId = uuid_compare(block->fileId, fileId) == 0;
-        UInt blockStart = block->index * BLOCK_SIZE;
-        UInt blockEnd = blockStart + BLOCK_SIZE;
-        Bool matchRange = (blockStart >= offset && blockStart <= size+offset) || ( blockEnd >= offset && blockEnd <= size + offset);
-
-        if (matchFileId && matchRange) {
-            result.blocks[result.length++] = block;
+    result.blocks = NULL;
+    result.shard = shardIndex;
+
+    epoch_enter();
+    pthread_mutex_lock(&db->lock);
+    result.error = load_shard(db, shardIndex);
+    if (result.error == NULL) {
+        BlockShard *shard = &db->shards[shardIndex];
+        atomic_fetch_add(&shard->pins, 1);
+        result.length = shard->length;
+        result.blocks = malloc(sizeof(Block*) * MAX(shard->length, 1));
+        memcpy(result.blocks, shard->blocks, sizeof(Block*) * shard->length);
+    }
+    pthread_mutex_unlock(&db->lock);
+    if (result.error) {
+        epoch_exit();
+    }
+    return result;
+}
+
+BlockShardSnapshot replace_shard_blocks(BlockDB *db, UInt shardIndex, Block **blocks, const Block *replacements, UInt length) {
+    pthread_mutex_lock(&db->lock);
+    BlockShard *shard = &db->shards[shardIndex];
+    
+    // Lookups may be reading the blocks, they're replaced by copies. The pinned blocks keep the
+    // order of the shard, and the caller's array is pointed at the copies.
+    Block **retired = malloc(sizeof(Block*) * MAX(length, 1));
+    UInt retiredLength = 0;
+    UInt next = 0;
+    for (UInt i = 0; i < shard->length && next < length; i++) {
+        if (shard->blocks[i] != blocks[next]) {
+            continue;
         }
+        Block *copy = ALLOC(Block);
+        memcpy(copy, &replacements[next], sizeof(Block));
+        retired[retiredLength++] = blocks[next];
+        shard->blocks[i] = copy;
+        blocks[next++] = copy;
+    }
+    publish_shard(shard);
+    for (UInt i = 0; i < retiredLength; i++) {
+        epoch_retire(retired[i]);
     }
+    free(retired);
+    shard->dirty = true;
+    shard->version++;
     
-    // compact array
-    result.blocks = realloc(result.blocks, sizeof(Block) * result.length);
-    return result;
+    BlockShardSnapshot snapshot;
+    snapshot.shard = shardIndex;
+    snapshot.version = shard->version;
+    snapshot.records = initByteArray((ULong)shard->length * sizeof(Block));
+    for (UInt i = 0; i < shard->length; i++) {
+        memcpy(&snapshot.records.bytes[i * sizeof(Block)], shard->blocks[i], sizeof(Block));
+    }
+    pthread_mutex_unlock(&db->lock);
+    return snapshot;
+}
+
+BlocksForFileResult all_blocks_for_file(BlockDB *db, uuid_t fileId) {
+    return find_blocks(db, fileId, true, 0, 0);
+}
+
+BlocksForFileResult blocks_for_file(BlockDB *db, uuid_t fileId, ULong offset, ULong size) {
+    return find_blocks(db, fileId, false, offset, size);
+}
+
+void release_blocks(BlockDB *db, BlocksForFileResult result) {
+    free(result.blocks);
+    if (result.error) {
+        return;
+    }
+    atomic_fetch_sub(&db->shards[result.shard].pins, 1);
+    epoch_exit();
+}
+
+// Must be called with db->lock held. Position of the id in the sorted references, or where it belongs.
+static UInt find_reference(BlockDB *db, uuid_t id, Bool *found) {
+    UInt low = 0;
+    UInt high = db->referencesLength;
+    while (low < high) {
+        UInt middle = (low + high) / 2;
+        Int result = uuid_compare(db->references[middle].id, id);
+        if (result == 0) {
+            *found = true;
+            return middle;
+        }
+        if (result < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    *found = false;
+    return low;
+}
+
+// Must be called with db->lock held
+static UInt references_locked(BlockDB *db, uuid_t id) {
+    Bool found;
+    UInt position = find_reference(db, id, &found);
+    return found ? db->references[position].count : 1;
+}
+
+// Must be called with db->lock held
+static void set_references_locked(BlockDB *db, uuid_t id, UInt count) {
+    Bool found;
+    UInt position = find_reference(db, id, &found);
+    if (found && count > 1) {
+        db->references[position].count = count;
+    }
+    else if (found) {
+        memmove(&db->references[position], &db->references[position + 1], sizeof(BlockReference) * (db->referencesLength - position - 1));
+        db->referencesLength--;
+    }
+    else if (count > 1) {
+        if (db->referencesLength >= db->referencesMax) {
+            db->referencesMax = MAX(db->referencesMax * 2, 64);
+            db->references = realloc(db->references, sizeof(BlockReference) * db->referencesMax);
+        }
+        memmove(&db->references[position + 1], &db->references[position], sizeof(BlockReference) * (db->referencesLength - position));
+        uuid_copy(db->references[position].id, id);
+        db->references[position].count = count;
+        db->referencesLength++;
+    }
+    else {
+        return;
+    }
+    db->referencesDirty = true;
+    db->referencesVersion++;
+}
+
+UInt block_file_references(BlockDB *db, uuid_t id) {
+    pthread_mutex_lock(&db->lock);
+    UInt count = references_locked(db, id);
+    pthread_mutex_unlock(&db->lock);
+    return count;
+}
+
+void retain_block_file(BlockDB *db, uuid_t id) {
+    pthread_mutex_lock(&db->lock);
+    set_references_locked(db, id, references_locked(db, id) + 1);
+    pthread_mutex_unlock(&db->lock);
+}
+
+Bool release_block_file(BlockDB *db, uuid_t id) {
+    pthread_mutex_lock(&db->lock);
+    UInt count = references_locked(db, id);
+    if (count > 1) {
+        set_references_locked(db, id, count - 1);
+    }
+    pthread_mutex_unlock(&db->lock);
+    return count <= 1;
+}
+
+void set_block_file_references(BlockDB *db, uuid_t id, UInt count) {
+    pthread_mutex_lock(&db->lock);
+    set_references_locked(db, id, count);
+    pthread_mutex_unlock(&db->lock);
+}
+
+ByteArray pack_block_references(BlockDB *db) {
+    pthread_mutex_lock(&db->lock);
+    ByteArray records = initByteArray((ULong)db->referencesLength * sizeof(BlockReference));
+    memcpy(records.bytes, db->references, records.length);
+    pthread_mutex_unlock(&db->lock);
+    return records;
+}
+
+static void load_reference_record(const Byte *record, void *context) {
+    BlockDB *db = context;
+    BlockReference reference;
+    memcpy(&reference, record, sizeof(BlockReference));
+    set_references_locked(db, reference.id, reference.count);
+}
+
+Error load_block_references(BlockDB *db, const String path, ByteArray key) {
+    if (!isFileExists(path)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&db->lock);
+    Error error = load_records(path, sizeof(BlockReference), load_reference_record, db, db->cipher, key, db->iv);
+    db->referencesDirty = false;
+    pthread_mutex_unlock(&db->lock);
+    return error;
+}
+
+Error archive_block_references(BlockDB *db, BlockDBSnapshot snapshot, const String path, ByteArray key) {
+    if (!snapshot.referencesDirty) {
+        return NULL;
+    }
+    Error error = NULL;
+    if (snapshot.references.length == 0) {
+        if (unlink(path) == ERROR && errno != ENOENT) {
+            error = strerror(errno);
+        }
+    }
+    else {
+        error = archive_records(path, snapshot.references, db->cipher, key, db->iv);
+    }
+    if (error == NULL) {
+        // Counts changed since the snapshot are written by the next archive
+        pthread_mutex_lock(&db->lock);
+        if (db->referencesVersion == snapshot.referencesVersion) {
+            db->referencesDirty = false;
+        }
+        pthread_mutex_unlock(&db->lock);
+    }
+    return error;
 }
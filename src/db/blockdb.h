@@ -5,7 +5,9 @@
 #ifndef blockdb_h
 #define blockdb_h
 
+#include <pthread.h>
 #include <uuid/uuid.h>
+#include <stdatomic.h>
 #include "../utilities/utilities.h"
 #include "../security/encryption.h"
 
@@ -18,10 +20,55 @@ typedef struct {
     Byte iv[IV_LENGTH];
 } Block;
 
+// Block metadata is sharded by file id. Each shard is stored in its own encrypted file and is only
+// loaded the first time one of its files is accessed. Clean shards are evicted when more than
+// BLOCK_CACHE_MAX_BLOCKS blocks are loaded or the memory budget is exceeded.
+#define BLOCK_SHARD_COUNT 4096
+#define BLOCK_CACHE_MAX_BLOCKS 1048576
+
+// Copy of the block list of a shard which is never changed, so lookups read it without taking the
+// lock. Every change publishes a new one and retires the old one through the epochs.
+typedef struct {
+    UInt length;
+    Block *blocks[];
+} BlockShardView;
+
 typedef struct {
     Block **blocks;
     UInt length;
     UInt max;
+    Bool loaded;
+    Bool dirty;
+    ULong version; // Bumped on every change, a shard is clean once its latest version is on disk
+    atomic_uint pins;
+    atomic_ullong lastUsed;
+    ULong archivedVersion; // Latest version on disk, older snapshots are never written over it
+    _Atomic(BlockShardView*) view; // NULL while the shard isn't loaded
+} BlockShard;
+
+// Block file shared by several blocks since a file was cloned. Files missing from the sorted list
+// of shared files have a single reference.
+typedef struct {
+    uuid_t id;
+    UInt count;
+} BlockReference;
+
+typedef struct {
+    BlockShard shards[BLOCK_SHARD_COUNT];
+    UInt loadedBlocks;
+    atomic_ullong clock;
+    String path; // Shards directory
+    Cipher cipher;
+    ByteArray key;
+    ByteArray previousKey;     // Key of the shards not rotated yet while the data key is rotated
+    atomic_uint rotatedShards; // Shards below this one use key, the others previousKey
+    ByteArray iv;
+    BlockReference *references;
+    UInt referencesLength;
+    UInt referencesMax;
+    Bool referencesDirty;
+    ULong referencesVersion;
+    pthread_mutex_t lock;
 } BlockDB;
 
 typedef struct {
@@ -29,20 +76,65 @@ typedef struct {
     BlockDB *blockDB;
 } LoadBlockDBResult;
 
+typedef struct {
+    UInt shard;
+    ULong version;
+    ByteArray records;
+} BlockShardSnapshot;
+
+// Packed copy of the dirty shards, written to disk without holding any lock
 typedef struct {
+    UInt length;
+    BlockShardSnapshot *shards;
+    Bool referencesDirty;
+    ULong referencesVersion;
+    ByteArray references;
+} BlockDBSnapshot;
+
+// Blocks stay valid until the result is handed back with release_blocks, on the same thread
+typedef struct {
+    String error;
     UInt length;
     Block **blocks;
+    UInt shard;
 } BlocksForFileResult;
 
-LoadBlockDBResult load_blockDB (const String path, ByteArray key, ByteArray iv);
-Error archive_blockDB (const String path, BlockDB *db, ByteArray key, ByteArray iv);
+LoadBlockDBResult load_blockDB (const String path, Cipher cipher, ByteArray key, ByteArray iv);
+Error migrate_blockDB(BlockDB *db, const String legacyPath);
+Error archive_blockDB (BlockDB *db);
+BlockDBSnapshot snapshot_blockDB(BlockDB *db);
+Error archive_blockDB_snapshot(BlockDB *db, BlockDBSnapshot snapshot);
+void free_blockDB_snapshot(BlockDBSnapshot snapshot);
+void trim_blockDB(BlockDB *db); // Evicts clean shards until the memory budget is met
 
-BlockDB* init_blockDB(void);
+BlockDB* init_blockDB(const String path, Cipher cipher, ByteArray key, ByteArray iv);
+void free_blockDB(BlockDB *db);
 Block* generate_block(uuid_t fileId, UInt index);
-void add_block(BlockDB *db, Block *block);
-void remove_block(BlockDB *db, uuid_t blockId);
-Block* search_block(BlockDB *db, uuid_t blockId);
+Error add_block(BlockDB *db, Block *block);
+Error remove_block(BlockDB *db, Block *block); // Fails if the block was already removed
+Error replace_block(BlockDB *db, Block *block, Block *replacement); // Lookups see either of them, never neither
 BlocksForFileResult all_blocks_for_file(BlockDB *db, uuid_t fileId);
-BlocksForFileResult blocks_for_file(BlockDB *db, uuid_t fileId, UInt offset, ULong size);
+BlocksForFileResult blocks_for_file(BlockDB *db, uuid_t fileId, ULong offset, ULong size);
+BlocksForFileResult blocks_in_shard(BlockDB *db, UInt shard); // Every block of a shard, for whole volume scans
+void release_blocks(BlockDB *db, BlocksForFileResult result);
+
+UInt shard_index(uuid_t fileId);
+void shard_path(BlockDB *db, UInt shard, char *out, ULong size);
+ByteArray shard_key(BlockDB *db, UInt shard);
+
+// Replaces blocks pinned by blocks_in_shard with their re-encrypted copies, which blocks then points
+// at, and packs the whole shard. The caller writes the records and hands the version back with
+// set_shard_archived.
+BlockShardSnapshot replace_shard_blocks(BlockDB *db, UInt shard, Block **blocks, const Block *replacements, UInt length);
+void set_shard_archived(BlockDB *db, UInt shard, ULong version);
+
+// Reference counts of block files. The count table is stored next to the index, with its key.
+UInt block_file_references(BlockDB *db, uuid_t id);
+void retain_block_file(BlockDB *db, uuid_t id);
+Bool release_block_file(BlockDB *db, uuid_t id); // True when the file isn't referenced anymore and can be deleted
+void set_block_file_references(BlockDB *db, uuid_t id, UInt count);
+ByteArray pack_block_references(BlockDB *db);
+Error load_block_references(BlockDB *db, const String path, ByteArray key);
+Error archive_block_references(BlockDB *db, BlockDBSnapshot snapshot, const String path, ByteArray key);
 
 #endif /* blockdb_h */
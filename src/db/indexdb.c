@@ -8,7 +8,10 @@
 #include <string.h>
 #include "indexdb.h"
 #include "../utilities/utilities.h"
+#include "../utilities/stats.h"
+#include "../utilities/memory.h"
 #include "../security/encryption.h"
+#include "recordfile.h"
 
 IndexDB* init_indexDB(void) {
     IndexDB* newDB = ALLOC(IndexDB);
@@ -18,59 +21,35 @@ IndexDB* init_indexDB(void) {
     return newDB;
 }
 
-Error archive_indexDB(const String path, IndexDB *db, ByteArray key, ByteArray iv) {
-    
+ByteArray snapshot_indexDB(IndexDB *db) {
     // Export to binary data
-    ByteArray archivedData = initByteArray(db->length * (UInt)sizeof(Item));
+    ByteArray archivedData = initByteArray((ULong)db->length * sizeof(Item));
     for (UInt i = 0; i < db->length; i++) {
         memcpy(&archivedData.bytes[i * sizeof(Item)], db->items[i], sizeof(Item));
     }
-    
-    // Encrypt
-    AESEncryptResult encryptResult = aes_encrypt(archivedData, key, iv);
-    if (encryptResult.error) {
-        free(archivedData.bytes);
-        return encryptResult.error;
-    }
-    
-    WriteFileResult writeResult = writeFile(path, encryptResult.cipher);
+    return archivedData;
+}
+
+Error archive_indexDB(const String path, IndexDB *db, Cipher cipher, ByteArray key, ByteArray iv) {
+    ByteArray archivedData = snapshot_indexDB(db);
+    Error error = archive_records(path, archivedData, cipher, key, iv);
     free(archivedData.bytes);
-    free(encryptResult.cipher.bytes);
-    return writeResult.error;
+    return error;
+}
+
+static void load_item_record(const Byte *record, void *context) {
+    Item *item = ALLOC(Item);
+    memcpy(item, record, sizeof(Item));
+    add_item((IndexDB*)context, item);
 }
 
-LoadIndexDBResult load_indexDB (const String path, ByteArray key, ByteArray iv) {
+LoadIndexDBResult load_indexDB (const String path, Cipher cipher, ByteArray key, ByteArray iv) {
     LoadIndexDBResult result;
     result.error = NULL;
-    result.indexDB = NULL;
-    
-    // Read encrypted file
-    ReadFileResult readResult = readFile(path);
-    if (readResult.error) {
-        result.error = readResult.error;
-        return result;
-    }
-    
-    // Decrypt data
-    AESDecryptResult decryptResult = aes_decrypt(readResult.contents, key, iv);
-    if (decryptResult.error) {
-        result.error = decryptResult.error;
-        return result;
-    }
-    ByteArray data = decryptResult.plainText;
-    
-    // Extract data
     result.indexDB = init_indexDB();
-    Item *readItem = ALLOC(Item);
-    for (ULong offset = 0; offset < data.length; offset += sizeof(Item)) {
-        memcpy(readItem, &data.bytes[offset], sizeof(Item));
-        add_item(result.indexDB, readItem);
-        readItem = ALLOC(Item);
-    }
     
-    free(readItem);
-    free(data.bytes);
-
+    // Decrypt and extract items chunk by chunk
+    result.error = load_records(path, sizeof(Item), load_item_record, result.indexDB, cipher, key, iv);
     return result;
 }
 
@@ -98,6 +77,7 @@ void add_item(IndexDB *db, Item *item) {
     // Add block and increase index
     db->items[db->length] = item;
     (db->length)++;
+    memory_charge(MemoryIndexMetadata, sizeof(Item) + sizeof(Item*));
 }
 
 Int search_item_index(IndexDB *db, uuid_t itemId) {
@@ -124,6 +104,24 @@ void remove_item(IndexDB *db, uuid_t itemId) {
     }
     
     (db->length)--;
+    memory_uncharge(MemoryIndexMetadata, sizeof(Item) + sizeof(Item*));
+}
+
+Item* detach_item(IndexDB *db, uuid_t itemId) {
+    Int index = search_item_index(db, itemId);
+    if (index == -1) {
+        return NULL;
+    }
+    
+    // shift array to the left, the item itself is kept for the caller
+    Item *item = db->items[index];
+    for (Int i = index; i < (Int)db->length - 1; i++) {
+        db->items[i] = db->items[i+1];
+    }
+    
+    (db->length)--;
+    memory_uncharge(MemoryIndexMetadata, sizeof(Item) + sizeof(Item*));
+    return item;
 }
 
 Item* search_item(IndexDB *db, uuid_t itemId) {
@@ -136,54 +134,67 @@ Item* search_item(IndexDB *db, uuid_t itemId) {
 }
 
 Item* search_item_path(IndexDB *db, const String path) {
-    for (UInt i = 0; i < db->length; i++) {
+    ULong start = stats_start();
+    Item *result = NULL;
+    for (UInt i = 0; i < db->length && result == NULL; i++) {
         if(strcmp(path, db->items[i]->path) == 0) {
-            return db->items[i];
+            result = db->items[i];
         }
     }
-    return NULL;
+    stats_record(MetricPathLookup, start, 0, false);
+    return result;
 }
 
 
+// Whether path is dirPath itself or lies somewhere below it
+static Bool is_descendant_path(const String dirPath, const String path) {
+    ULong dirLength = strlen(dirPath);
+    if (strncmp(dirPath, path, dirLength) != 0) {
+        return false;
+    }
+    return path[dirLength] == '\0' || path[dirLength] == '/' || (dirLength > 0 && dirPath[dirLength - 1] == '/');
+}
+
 ItemArray get_dir_items(IndexDB *db, const String path) {
     ItemArray result;
     result.length = 0;
-    result.items = malloc(sizeof(Item) * db->length);
+    result.items = malloc(sizeof(Item*) * MAX(db->length, 1));
     
+    ULong pathLength = strlen(path);
     for (UInt i = 0; i < db->length; i++) {
         Item *item = db->items[i];
-        if (!isPrefix(path, item->path)) {
+        if (!is_descendant_path(path, item->path) || item->path[pathLength] == '\0') {
             continue;
         }
-        // make sure its direct child
-        String suffix = item->path + strlen(path) + 1;
-        Int slashIndex = firstIndexOf(suffix, '/');
         
-        // Check that there are no '/' characters in the path beyond suffix
-        // With the exception of the last character
-        if(strlen(suffix) > 0 && (slashIndex == -1 || slashIndex == (Int)strlen(suffix) - 1)) {
+        // make sure its direct child, there are no '/' characters after the directory path
+        String suffix = item->path + pathLength;
+        if (*suffix == '/') {
+            suffix++;
+        }
+        if (strlen(suffix) > 0 && firstIndexOf(suffix, '/') == -1) {
             result.items[result.length++] = item;
         }
     }
     
     // compact array
-    result.items = realloc(result.items, sizeof(Item) * result.length);
+    result.items = realloc(result.items, sizeof(Item*) * MAX(result.length, 1));
     return  result;
 }
 
 ItemArray get_dir_descendants(IndexDB *db, const String path) {
     ItemArray result;
     result.length = 0;
-    result.items = malloc(sizeof(Item) * db->length);
+    result.items = malloc(sizeof(Item*) * MAX(db->length, 1));
     
     for (UInt i = 0; i < db->length; i++) {
         Item *item = db->items[i];
-        if (isPrefix(path, item->path)) {
+        if (is_descendant_path(path, item->path)) {
             result.items[result.length++] = item;
         }
     }
     
     // compact array
-    result.items = realloc(result.items, sizeof(Item) * result.length);
+    result.items = realloc(result.items, sizeof(Item*) * MAX(result.length, 1));
     return result;
 }
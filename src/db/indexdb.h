@@ -7,6 +7,7 @@
 
 #include <uuid/uuid.h>
 #include "../utilities/utilities.h"
+#include "../security/encryption.h"
 
 typedef enum { ItemTypeFile = 0, ItemTypeDir = 1 } ItemType;
 
@@ -35,12 +36,14 @@ typedef struct {
 
 
 IndexDB* init_indexDB(void);
-LoadIndexDBResult load_indexDB (const String path, ByteArray key, ByteArray iv);
-Error archive_indexDB(const String path, IndexDB *db, ByteArray key, ByteArray iv);
+LoadIndexDBResult load_indexDB (const String path, Cipher cipher, ByteArray key, ByteArray iv);
+Error archive_indexDB(const String path, IndexDB *db, Cipher cipher, ByteArray key, ByteArray iv);
+ByteArray snapshot_indexDB(IndexDB *db);
 
 Item* create_item(ItemType type, String path);
 void add_item(IndexDB *db, Item *item);
 void remove_item(IndexDB *db, uuid_t itemId);
+Item* detach_item(IndexDB *db, uuid_t itemId); // Removes without freeing
 Item* search_item(IndexDB *db, uuid_t itemId);
 Item* search_item_path(IndexDB *db, const String path);
 
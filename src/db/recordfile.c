@@ -0,0 +1,146 @@
+//
+//  Created by Stasel
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include "recordfile.h"
+
+typedef struct {
+    Byte *record;
+    UInt recordSize;
+    UInt filled;
+    RecordHandler handler;
+    void *context;
+} RecordAssembler;
+
+static void assemble_records(RecordAssembler *assembler, ByteArray data) {
+    ULong offset = 0;
+    while (offset < data.length) {
+        UInt copyLength = (UInt)MIN(assembler->recordSize - assembler->filled, data.length - offset);
+        memcpy(&assembler->record[assembler->filled], &data.bytes[offset], copyLength);
+        assembler->filled += copyLength;
+        offset += copyLength;
+        if (assembler->filled == assembler->recordSize) {
+            assembler->handler(assembler->record, assembler->context);
+            assembler->filled = 0;
+        }
+    }
+}
+
+Error load_records(const String path, UInt recordSize, RecordHandler handler, void *context,
+                   Cipher cipher, ByteArray key, ByteArray iv) {
+    
+    FILE *handle = fopen(path, "rb");
+    if (handle == NULL) {
+        return strerror(errno);
+    }
+    
+    CipherStream *stream = cipher_decrypt_stream(cipher, key, iv);
+    if (stream == NULL) {
+        fclose(handle);
+        return "Invalid key or IV";
+    }
+    
+    RecordAssembler assembler = { malloc(recordSize), recordSize, 0, handler, context };
+    ByteArray chunk = initByteArray(RECORD_FILE_CHUNK_SIZE);
+    ULong totalRead = 0;
+    Error error = NULL;
+    
+    while (error == NULL) {
+        size_t readLength = fread(chunk.bytes, 1, RECORD_FILE_CHUNK_SIZE, handle);
+        if (readLength == 0) {
+            if (ferror(handle)) {
+                error = strerror(errno);
+            }
+            break;
+        }
+        totalRead += readLength;
+        
+        ByteArray input = { chunk.bytes, (ULong)readLength };
+        CipherStreamResult updateResult = cipher_stream_update(stream, input);
+        if (updateResult.error) {
+            error = updateResult.error;
+            break;
+        }
+        assemble_records(&assembler, updateResult.output);
+    }
+    
+    // An empty file is an empty database, it was never encrypted
+    if (error == NULL && totalRead > 0) {
+        CipherStreamResult finalResult = cipher_stream_final(stream);
+        if (finalResult.error) {
+            error = finalResult.error;
+        }
+        else {
+            assemble_records(&assembler, finalResult.output);
+        }
+    }
+    
+    if (error == NULL && assembler.filled != 0) {
+        error = "Database file is corrupted";
+    }
+    
+    fclose(handle);
+    cipher_stream_free(stream);
+    free(chunk.bytes);
+    free(assembler.record);
+    return error;
+}
+
+static Error write_output(FILE *handle, CipherStreamResult streamResult) {
+    if (streamResult.error) {
+        return streamResult.error;
+    }
+    if (streamResult.output.length > 0 && fwrite(streamResult.output.bytes, streamResult.output.length, 1, handle) != 1) {
+        return strerror(errno);
+    }
+    return NULL;
+}
+
+Error archive_records(const String path, ByteArray records, Cipher cipher, ByteArray key, ByteArray iv) {
+    // Write next to the target and rename over it, readers and crashes never see a partial file
+    char tempPath[PATH_MAX_LENGTH];
+    snprintf(tempPath, sizeof tempPath, "%s%s", path, RECORD_FILE_TEMP_SUFFIX);
+    
+    FILE *handle = fopen(tempPath, "wb");
+    if (handle == NULL) {
+        return strerror(errno);
+    }
+    
+    // Encrypt chunk by chunk
+    Error error = NULL;
+    if (records.length > 0) {
+        CipherStream *stream = cipher_encrypt_stream(cipher, key, iv);
+        if (stream == NULL) {
+            error = "Invalid key or IV";
+        }
+        for (ULong offset = 0; error == NULL && offset < records.length; offset += RECORD_FILE_CHUNK_SIZE) {
+            ByteArray chunk = { &records.bytes[offset], MIN(RECORD_FILE_CHUNK_SIZE, records.length - offset) };
+            error = write_output(handle, cipher_stream_update(stream, chunk));
+        }
+        if (error == NULL) {
+            error = write_output(handle, cipher_stream_final(stream));
+        }
+        cipher_stream_free(stream);
+    }
+    
+    if (error == NULL && (fflush(handle) != 0 || fsync(fileno(handle)) == ERROR)) {
+        error = strerror(errno);
+    }
+    fclose(handle);
+    
+    if (error == NULL && rename(tempPath, path) == ERROR) {
+        error = strerror(errno);
+    }
+    if (error) {
+        unlink(tempPath);
+        return error;
+    }
+    
+    // The rename itself is only durable once the directory is synced
+    return syncParentDirectory(path);
+}
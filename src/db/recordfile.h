@@ -0,0 +1,27 @@
+//
+//  Created by Stasel
+//
+
+#ifndef recordfile_h
+#define recordfile_h
+
+#include "../utilities/utilities.h"
+#include "../security/encryption.h"
+
+// Encrypted files holding an array of fixed size records, shared by IndexDB and BlockDB
+
+#define RECORD_FILE_CHUNK_SIZE 1048576 // 1M
+#define RECORD_FILE_TEMP_SUFFIX ".tmp"
+
+typedef void (*RecordHandler)(const Byte *record, void *context);
+
+// Stream the file through decryption in bounded chunks and call `handler` once per record.
+// The record buffer is reused, handlers must copy what they keep.
+Error load_records(const String path, UInt recordSize, RecordHandler handler, void *context,
+                   Cipher cipher, ByteArray key, ByteArray iv);
+
+// Encrypt the packed records chunk by chunk into a temporary file which then atomically replaces `path`.
+// No records are written as an empty file.
+Error archive_records(const String path, ByteArray records, Cipher cipher, ByteArray key, ByteArray iv);
+
+#endif /* recordfile_h */
@@ -11,42 +11,239 @@
 #include <unistd.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include "filesystem.h"
+#include "filesystem_ll.h"
 #include "../utilities/utilities.h"
+#include "../utilities/stats.h"
+#include "../utilities/trace.h"
+#include "../utilities/memory.h"
 #include <fcntl.h>
 
 
-#define LOCK_DB pthread_mutex_lock(&saveStateLock);
-#define UNLOCK_DB pthread_mutex_unlock(&saveStateLock);
-#define DB_SAVE_INTERVAL_SEC 10
+#define DB_SAVE_INTERVAL_SEC 10 // Minimum time between two archives, changes made in between are coalesced
+#define RECLAIM_BATCH_BLOCKS 64 // Block files deleted between two checks of the reclaim rate
+#define MIGRATION_BATCH_FILES 1024 // Block files moved between two checks for unmount
 
 static Secfs *secfs;
+static FsOptions fsOptions;
 static Bool dbSaveRequested = false;
+static Bool urgentSaveRequested = false;
+static ULong savesStarted = 0;
+static ULong savesCompleted = 0;
+static Error lastSaveError = NULL;
 pthread_t saveStateThreadId;
 pthread_mutex_t saveStateLock;
+pthread_mutex_t saveRequestLock;
+pthread_cond_t saveRequestCondition;
+pthread_cond_t saveCompletedCondition;
+
+// Time spent waiting for the lock is traced as contention
+void lock_db(void) {
+    ULong start = stats_start();
+    pthread_mutex_lock(&saveStateLock);
+    stats_record(MetricLockWait, start, 0, false);
+}
 
 void schedule_db_save(void) {
+    pthread_mutex_lock(&saveRequestLock);
+    if (!dbSaveRequested) {
+        dbSaveRequested = true;
+        pthread_cond_signal(&saveRequestCondition);
+    }
+    pthread_mutex_unlock(&saveRequestLock);
+}
+
+// Group commit: wait for a save which starts after this call. Every caller arriving while a save
+// is running shares the next one, along with its single pass of block syncs. The path based
+// interface is mounted single threaded, so only fsyncs of the low-level I/O threads overlap.
+Error commit_changes(void) {
+    pthread_mutex_lock(&saveRequestLock);
+    ULong target = savesStarted + 1;
     dbSaveRequested = true;
+    urgentSaveRequested = true;
+    pthread_cond_signal(&saveRequestCondition);
+    while (savesCompleted < target) {
+        pthread_cond_wait(&saveCompletedCondition, &saveRequestLock);
+    }
+    Error error = lastSaveError;
+    pthread_mutex_unlock(&saveRequestLock);
+    return error;
+}
+
+// Nothing is written to preallocate, holes read as zeros. Punching a hole drops the blocks it covers.
+Int fallocate_item(Item *file, Int mode, ULong offset, ULong length) {
+    Error error = NULL;
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        return EOPNOTSUPP;
+    }
+    if (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE)) {
+        // Holes are punched within the file only
+        if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE)) {
+            return EOPNOTSUPP;
+        }
+        if (offset < file->size) {
+            error = punch_item_data(secfs, file, offset, MIN(length, file->size - offset));
+        }
+    }
+    if (error == NULL && !(mode & FALLOC_FL_KEEP_SIZE)) {
+        error = allocate_item_data(secfs, file, offset, length);
+    }
+    if (error) {
+        debugPrint("[Warning] couldn't allocate file: %s", error);
+        return EIO;
+    }
+    schedule_db_save();
+    return SUCCESS;
+}
+
+// Kernel cache invalidation. Notifying the kernel from within the operation which caused the change
+// may deadlock on the kernel's inode locks, so paths are queued and invalidated on a separate thread.
+typedef struct {
+    String *paths;
+    UInt length;
+    UInt max;
+    Bool notifying;
+    struct fuse *fuse; // NULL until mounted and after unmount
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+} InvalidationQueue;
+
+static InvalidationQueue invalidations;
+pthread_t invalidationThreadId;
+
+static atomic_bool keyRotationStopped;
+static Bool keyRotationRunning = false;
+pthread_t keyRotationThreadId;
+
+static atomic_bool reclaimStopped;
+static Bool reclaimRunning = false;
+pthread_t reclaimThreadId;
+
+static atomic_bool blockMigrationStopped;
+static Bool blockMigrationRunning = false;
+pthread_t blockMigrationThreadId;
+
+static Bool is_kernel_cache_enabled(void) {
+    return fsOptions.entryTimeout > 0 || fsOptions.attrTimeout > 0 || fsOptions.negativeTimeout > 0 || fsOptions.keepCache;
+}
+
+static void invalidate_path(const char *path) {
+    if (!is_kernel_cache_enabled()) {
+        return;
+    }
+    
+    pthread_mutex_lock(&invalidations.lock);
+    if (invalidations.fuse != NULL) {
+        Bool queued = false;
+        for (UInt i = 0; i < invalidations.length && !queued; i++) {
+            queued = strcmp(invalidations.paths[i], path) == 0;
+        }
+        if (!queued) {
+            if (invalidations.length >= invalidations.max) {
+                invalidations.max = MAX(invalidations.max * 2, 16);
+                invalidations.paths = realloc(invalidations.paths, sizeof(String) * invalidations.max);
+            }
+            invalidations.paths[invalidations.length] = malloc(strlen(path) + 1);
+            strcpy(invalidations.paths[invalidations.length++], path);
+            pthread_cond_signal(&invalidations.condition);
+        }
+    }
+    pthread_mutex_unlock(&invalidations.lock);
+}
+
+void* process_invalidations(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&invalidations.lock);
+    while (true) {
+        while (invalidations.length == 0) {
+            pthread_cond_wait(&invalidations.condition, &invalidations.lock);
+        }
+        String path = invalidations.paths[--invalidations.length];
+        struct fuse *fuse = invalidations.fuse;
+        invalidations.notifying = true;
+        pthread_mutex_unlock(&invalidations.lock);
+        
+        // Fails with ENOENT when the kernel doesn't cache the path, which is fine
+        if (fuse != NULL) {
+            Int result = fuse_invalidate_path(fuse, path);
+            debugPrint("Invalidated %s (%d)", path, result);
+        }
+        free(path);
+        
+        pthread_mutex_lock(&invalidations.lock);
+        invalidations.notifying = false;
+        pthread_cond_broadcast(&invalidations.condition);
+    }
+}
+
+static void stop_invalidations(void) {
+    pthread_mutex_lock(&invalidations.lock);
+    invalidations.fuse = NULL;
+    while (invalidations.notifying) {
+        pthread_cond_wait(&invalidations.condition, &invalidations.lock);
+    }
+    pthread_mutex_unlock(&invalidations.lock);
+}
+
+// Deletes the block files of deleted files at the configured rate, so the time unlink takes doesn't
+// depend on the size of the file and a large deletion doesn't starve other I/O
+static void* reclaim_deleted_blocks(void *arg) {
+    (void)arg;
+    ULong start = monotonicNanos();
+    ULong reclaimed = 0;
+    while (!atomic_load(&reclaimStopped)) {
+        UInt count = reclaim_blocks(secfs, RECLAIM_BATCH_BLOCKS);
+        if (count == 0) {
+            // Nothing is owed for the time spent idle
+            usleep(100000);
+            start = monotonicNanos();
+            reclaimed = 0;
+            continue;
+        }
+        reclaimed += count;
+        
+        // Throttle to the configured rate, checking for unmount every 100 ms
+        while (fsOptions.reclaimRate > 0 && !atomic_load(&reclaimStopped)) {
+            double due = (double)reclaimed / fsOptions.reclaimRate;
+            double elapsed = (double)(monotonicNanos() - start) / 1e9;
+            if (elapsed >= due) {
+                break;
+            }
+            usleep((useconds_t)(MIN(due - elapsed, 0.1) * 1e6));
+        }
+    }
+    return NULL;
+}
+
+// Whatever is left is deleted on the next mount
+static void stop_reclaim(void) {
+    if (!reclaimRunning) {
+        return;
+    }
+    atomic_store(&reclaimStopped, true);
+    pthread_join(reclaimThreadId, NULL);
+    reclaimRunning = false;
+}
+
+static Bool is_stats_path(const char *path) {
+    return strcmp(path, STATS_FILE_PATH) == 0;
 }
 
 static void* fs_init(struct fuse_conn_info *connInfo, struct fuse_config *config) {
     debugPrint("fs_init");
     (void) connInfo;
-    config->entry_timeout = 0;
-    config->attr_timeout = 0;
-    config->negative_timeout = 0;
+    config->entry_timeout = fsOptions.entryTimeout;
+    config->attr_timeout = fsOptions.attrTimeout;
+    config->negative_timeout = fsOptions.negativeTimeout;
+    
+    pthread_mutex_lock(&invalidations.lock);
+    invalidations.fuse = fuse_get_context()->fuse;
+    pthread_mutex_unlock(&invalidations.lock);
     return NULL;
 }
 
-static int fs_getattr(const char *path, struct stat *statOut, struct fuse_file_info *info) {
-    (void) info;
-
-//    debugPrint("fs_getattr %s", path);
-    Item *item = search_item_path(secfs->indexDB, (const String)path);
-    if (item == NULL) {
-        return -ENOENT;
-    }
-    
+static void fill_stat(Item *item, struct stat *statOut) {
     memset(statOut, 0, sizeof(struct stat));
     if (item->type == ItemTypeDir) {
         statOut->st_mode = S_IFDIR | 0755;
@@ -56,35 +253,112 @@ static int fs_getattr(const char *path, struct stat *statOut, struct fuse_file_i
     }
     statOut->st_size = (off_t)item->size;
     statOut->st_nlink = 1;
-    return SUCCESS;
 }
 
-static int fs_readdir(const char *path, void *out, fuse_fill_dir_t filler, off_t offset,
-                      struct fuse_file_info *info, enum fuse_readdir_flags flags) {
-    (void) offset;
+static int fs_getattr(const char *path, struct stat *statOut, struct fuse_file_info *info) {
     (void) info;
-    (void) flags;
 
-    debugPrint("fs_readdir %s", path);
+//    debugPrint("fs_getattr %s", path);
+    if (is_stats_path(path)) {
+        // Size is unknown until the file is read, reads bypass the page cache
+        memset(statOut, 0, sizeof(struct stat));
+        statOut->st_mode = S_IFREG | 0444;
+        statOut->st_nlink = 1;
+        return SUCCESS;
+    }
     
-    filler(out, ".", NULL, 0, 0);
-    filler(out, "..", NULL, 0, 0);
+    Item *item = search_item_path(secfs->indexDB, (const String)path);
+    if (item == NULL) {
+        return -ENOENT;
+    }
+    
+    fill_stat(item, statOut);
+    return SUCCESS;
+}
+
+// Directory listing taken on opendir, so readdir offsets stay stable while the directory changes
+typedef struct {
+    String *names;
+    struct stat *stats;
+    UInt length;
+} DirListing;
+
+static int fs_opendir(const char *path, struct fuse_file_info *info) {
+    debugPrint("fs_opendir %s", path);
+    if (is_stats_path(path)) {
+        return -ENOTDIR;
+    }
+    Item *dir = search_item_path(secfs->indexDB, (const String)path);
+    if (dir == NULL) {
+        return -ENOENT;
+    }
+    if (dir->type != ItemTypeDir) {
+        return -ENOTDIR;
+    }
     
     ItemArray items = get_dir_items(secfs->indexDB, (const String)path);
+    DirListing *listing = ALLOC(DirListing);
+    listing->names = malloc(sizeof(String) * MAX(items.length, 1));
+    listing->stats = malloc(sizeof(struct stat) * MAX(items.length, 1));
+    listing->length = items.length;
     for (UInt i = 0; i < items.length; i++) {
-        if (strcmp(path, items.items[i]->path) == 0) {
-            continue;
+        listing->names[i] = strdup(basename(items.items[i]->path));
+        fill_stat(items.items[i], &listing->stats[i]);
+    }
+    free(items.items);
+    info->fh = (uint64_t)(uintptr_t)listing;
+    return SUCCESS;
+}
+
+// Entries are handed out with their offsets, which lets readdirplus pass the attributes on to the
+// kernel instead of it asking for them with a getattr per entry
+static int fs_readdir(const char *path, void *out, fuse_fill_dir_t filler, off_t offset,
+                      struct fuse_file_info *info, enum fuse_readdir_flags flags) {
+    debugPrint("fs_readdir %s", path);
+    DirListing *listing = (DirListing*)(uintptr_t)info->fh;
+    enum fuse_fill_dir_flags fillFlags = (flags & FUSE_READDIR_PLUS) ? FUSE_FILL_DIR_PLUS : 0;
+    for (ULong i = (ULong)offset; i < listing->length + 2; i++) {
+        Int full;
+        if (i < 2) {
+            full = filler(out, i == 0 ? "." : "..", NULL, (off_t)(i + 1), 0);
+        }
+        else {
+            full = filler(out, listing->names[i - 2], &listing->stats[i - 2], (off_t)(i + 1), fillFlags);
         }
+        if (full) {
+            break;
+        }
+    }
+    return SUCCESS;
+}
 
-        filler(out, basename(items.items[i]->path), NULL, 0, 0);
+static int fs_releasedir(const char *path, struct fuse_file_info *info) {
+    (void)path;
+    DirListing *listing = (DirListing*)(uintptr_t)info->fh;
+    for (UInt i = 0; i < listing->length; i++) {
+        free(listing->names[i]);
     }
-    free(items.items);
+    free(listing->names);
+    free(listing->stats);
+    free(listing);
     return SUCCESS;
 }
 
 static int fs_open(const char *path, struct fuse_file_info *fi) {
     debugPrint("fs_open %s", path);
     
+    if (is_stats_path(path)) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        // Every open reads a consistent report
+        ByteArray *report = ALLOC(ByteArray);
+        *report = stats_report();
+        fi->fh = (uint64_t)(uintptr_t)report;
+        fi->direct_io = 1;
+        return SUCCESS;
+    }
+    
     Item *item = search_item_path(secfs->indexDB, (const String)path);
     if (item == NULL) {
         return  -ENOENT;
@@ -92,11 +366,21 @@ static int fs_open(const char *path, struct fuse_file_info *fi) {
     
     // Truncate the file to 0 size of flag exist
     if ((fi->flags & O_TRUNC)) {
-        purge_item(secfs, item);
         Item *newItem = create_item(ItemTypeFile, (String)path);
         LOCK_DB;
+        purge_item(secfs, item);
         add_item(secfs->indexDB, newItem);
         UNLOCK_DB;
+        invalidate_path(path);
+        item = newItem;
+    }
+    
+    // Read-mostly files keep their pages between opens, large files are streamed without caching
+    if (fsOptions.directIOMinSize > 0 && item->size >= fsOptions.directIOMinSize) {
+        fi->direct_io = 1;
+    }
+    else if (fsOptions.keepCache && (fi->flags & O_ACCMODE) == O_RDONLY) {
+        fi->keep_cache = 1;
     }
     
     return SUCCESS;
@@ -104,8 +388,17 @@ static int fs_open(const char *path, struct fuse_file_info *fi) {
 
 static int fs_read(const char *path, char *out, size_t size, off_t offset, struct fuse_file_info *info) {
 
-    (void)info;
     debugPrint("fs_read %s (size=%d, offset=%d)", path, size, offset);
+    
+    if (is_stats_path(path)) {
+        ByteArray *report = (ByteArray*)(uintptr_t)info->fh;
+        if ((ULong)offset >= report->length) {
+            return 0;
+        }
+        size = MIN(size, report->length - (ULong)offset);
+        memcpy(out, report->bytes + offset, size);
+        return (Int)size;
+    }
 
     // Get item
     Item *file = search_item_path(secfs->indexDB, (const String)path);
@@ -117,48 +410,17 @@ static int fs_read(const char *path, char *out, size_t size, off_t offset, struc
         return -EISDIR;
     }
     
-    // Get all blocks to read
-    BlocksForFileResult blocksResult = all_blocks_for_file(secfs->blockDB, file->id);
-
-    debugPrint("Total blocks to read: %d", blocksResult.length);
-
-    // Read from blocks
-    ULong maxReadSize = MIN(file->size, (ULong)offset + size);
-    UInt lastBlockIndex = (UInt)(maxReadSize / BLOCK_SIZE);
-    for (UInt index = (UInt)(offset / BLOCK_SIZE); index <= lastBlockIndex; index ++) {
-        debugPrint("    reading block %d",index);
-
-        // Find the correct block in the list
-        Block *currentBlock = NULL;
-        for (UInt j = 0; j < blocksResult.length; j++) {
-            if (blocksResult.blocks[j]->index == index) {
-                currentBlock = blocksResult.blocks[j];
-                break;
-            }
-        }
-        
-        // Read block bytes.
-        ByteArray blockData;
-        if (currentBlock == NULL) {
-            blockData = initByteArray(BLOCK_SIZE);
-        }
-        else {
-            blockData = read_block(secfs, currentBlock).bytes;
-        }
-        
-        // Append to output
-        ULong start = MAX((ULong)offset, index*BLOCK_SIZE);
-        ULong end = MIN((ULong)offset+size, index*BLOCK_SIZE + BLOCK_SIZE);
-        ULong dataStart = start - (ULong)offset;
-        ULong dataEnd = end - (ULong)offset;
-        
-        debugPrint("    Block ranges %d to %d; Data ranges %d to %d", start, end, dataStart, dataEnd);
-        memcpy( &out[dataStart], &blockData.bytes[start%BLOCK_SIZE], dataEnd - dataStart);
-        
-        free(blockData.bytes);
+    // Direct I/O reads are not clamped to the file size by the kernel
+    if ((ULong)offset >= file->size) {
+        return 0;
     }
+    size = MIN(size, file->size - (ULong)offset);
     
-    free(blocksResult.blocks);
+    Error error = read_item_data(secfs, file, (Byte*)out, size, (ULong)offset);
+    if (error) {
+        debugPrint("[Warning] couldn't read file: %s", error);
+        return -EIO;
+    }
     return (Int)size;
 }
 
@@ -167,6 +429,9 @@ static int fs_write(const char *path, const char *data, size_t size, off_t offse
     (void)info;
     
     debugPrint("fs_write %s (size=%d, offset=%d)", path, size, offset);
+    if (is_stats_path(path)) {
+        return -EACCES;
+    }
 
     // Get item
     Item *file = search_item_path(secfs->indexDB, (const String)path);
@@ -178,60 +443,12 @@ static int fs_write(const char *path, const char *data, size_t size, off_t offse
         return -EISDIR;
     }
     
-    // Get all blocks to write
-    BlocksForFileResult blocksResult = all_blocks_for_file(secfs->blockDB, file->id);
-    debugPrint("    Found %d blocks for the file", blocksResult.length);
-    
-    // Write data to blocks:
-    for (UInt index = (UInt)(offset / BLOCK_SIZE); index <= (UInt)(((ULong)offset + size) / BLOCK_SIZE); index ++) {
-        
-        debugPrint("    Writing block %d",index);
-
-        // Find the correct block in the list
-        Block *currentBlock = NULL;
-        for (UInt j = 0; j < blocksResult.length; j++) {
-            if (blocksResult.blocks[j]->index == index) {
-                currentBlock = blocksResult.blocks[j];
-                break;
-            }
-        }
-        
-        // Read block bytes. If block doesn't exist, we will create a new one filled with zeros as the data
-        ByteArray blockData;
-        if (currentBlock == NULL) {
-            debugPrint("   Creating new block index %d", index);
-            currentBlock = generate_block(file->id, index);
-            blockData = initByteArray(BLOCK_SIZE);
-            LOCK_DB;
-            add_block(secfs->blockDB, currentBlock);
-            UNLOCK_DB;
-        }
-        else {
-            ReadBlockResult readResult = read_block(secfs, currentBlock);
-            blockData = readResult.bytes;
-        }
-    
-        // Partially modify block according to the data
-        ULong start = MAX((ULong)offset, index*BLOCK_SIZE);
-        ULong end = MIN((ULong)offset+size, index*BLOCK_SIZE + BLOCK_SIZE);
-        ULong dataStart = start - (ULong)offset;
-        ULong dataEnd = end - (ULong)offset;
-        debugPrint("   Block ranges %d to %d; Data ranges %d to %d", start, end, dataStart, dataEnd);
-        memcpy( &blockData.bytes[start%BLOCK_SIZE], &data[dataStart], dataEnd - dataStart);
-        
-        // Write block back to disk
-        Error writeError = write_block(secfs, currentBlock, blockData);
-        if(writeError) {
-            debugPrint("[Warning] couldn't write block on disk: %s", writeError);
-        }
-        free(blockData.bytes);
+    Error error = write_item_data(secfs, file, (const Byte*)data, size, (ULong)offset);
+    if (error) {
+        debugPrint("[Warning] couldn't write file: %s", error);
+        return -EIO;
     }
     
-    // Update file size
-    file->size = MAX(file->size, size + (ULong)offset);
-    
-    // Finalize
-    free(blocksResult.blocks);
     schedule_db_save();
     return (Int)size;
 }
@@ -239,6 +456,9 @@ static int fs_write(const char *path, const char *data, size_t size, off_t offse
 static int fs_truncate(const char *path, off_t size, struct fuse_file_info *info) {
     (void)info;
     debugPrint("fs_truncate %s to %d", path, size);
+    if (is_stats_path(path)) {
+        return -EACCES;
+    }
     
     Item *file = search_item_path(secfs->indexDB, (const String)path);
     if (file == NULL) {
@@ -249,7 +469,12 @@ static int fs_truncate(const char *path, off_t size, struct fuse_file_info *info
         return -EISDIR;
     }
     
-    file->size = (ULong)size;
+    Error error = truncate_item_data(secfs, file, (ULong)size);
+    if (error) {
+        debugPrint("[Warning] couldn't truncate file: %s", error);
+        return -EIO;
+    }
+    invalidate_path(path);
     
     schedule_db_save();
     return SUCCESS;
@@ -264,6 +489,9 @@ static int fs_create(const char *path, mode_t mode, struct fuse_file_info *info)
     }
     
     debugPrint("fs_create %s", path);
+    if (is_stats_path(path)) {
+        return -EEXIST;
+    }
     Item *existingItem = search_item_path(secfs->indexDB, (String)path);
     if (existingItem != NULL) {
         return -EEXIST;
@@ -282,15 +510,18 @@ static int fs_create(const char *path, mode_t mode, struct fuse_file_info *info)
 static int fs_mkdir(const char *path, mode_t mode) {
     (void)mode;
     debugPrint("fs_mkdir %s", path);
+    if (is_stats_path(path)) {
+        return -EEXIST;
+    }
     Item *exisitngDir = search_item_path(secfs->indexDB, (String)path);
     if (exisitngDir != NULL) {
         return -EEXIST;
     }
     
-    LOCK_DB;
     Item *newDir = create_item(ItemTypeDir, (String)path);
-    UNLOCK_DB;
+    LOCK_DB;
     add_item(secfs->indexDB, newDir);
+    UNLOCK_DB;
     
     schedule_db_save();
     return SUCCESS;
@@ -299,6 +530,9 @@ static int fs_mkdir(const char *path, mode_t mode) {
 
 static int fs_unlink(const char *path) {
     debugPrint("fs_unlink %s", path);
+    if (is_stats_path(path)) {
+        return -EPERM;
+    }
 
     Item *item = search_item_path(secfs->indexDB, (String)path);
     if (item == NULL) {
@@ -309,6 +543,7 @@ static int fs_unlink(const char *path) {
     LOCK_DB;
     purge_item(secfs, item);
     UNLOCK_DB;
+    invalidate_path(path);
     
     schedule_db_save();
     return SUCCESS;
@@ -320,6 +555,9 @@ static int fs_rename(const char *sourcePath, const char *destinationPath, unsign
     if (flags) {
         return -EINVAL;
     }
+    if (is_stats_path(sourcePath) || is_stats_path(destinationPath)) {
+        return -EPERM;
+    }
     
     Item *sourceItem = search_item_path(secfs->indexDB, (String)sourcePath);
     if (sourceItem == NULL) {
@@ -344,25 +582,11 @@ static int fs_rename(const char *sourcePath, const char *destinationPath, unsign
     }
     
     // Rename all descendants for directories
-    ItemArray descendants = get_dir_descendants(secfs->indexDB, sourceItem->path);
-    ULong sourceItemLength = strlen(sourceItem->path);
-    for (UInt i = 0; i < descendants.length; i++) {
-        Item *descendant = descendants.items[i];
-        char newName[PATH_MAX_LENGTH];
-        char suffix[PATH_MAX_LENGTH];
-        ULong suffixLength = strlen(descendant->path) - sourceItemLength;
-        strncpy(suffix, descendant->path + sourceItemLength, suffixLength);
-        suffix[suffixLength] = '\0';
-        snprintf(newName, sizeof newName, "%s%s", destinationPath, suffix);
-        LOCK_DB;
-        strcpy(descendant->path, newName);
-        UNLOCK_DB;
-    }
-    free(descendants.items);
-    
     LOCK_DB;
-    strcpy(sourceItem->path,destinationPath);
+    rename_item(secfs, sourceItem, (String)destinationPath);
     UNLOCK_DB;
+    invalidate_path(sourcePath);
+    invalidate_path(destinationPath);
 
     schedule_db_save();
     return 0;
@@ -370,15 +594,25 @@ static int fs_rename(const char *sourcePath, const char *destinationPath, unsign
 
 static int fs_rmdir(const char *path)
 {
-    debugPrint("fs_mkdir %s", path);
+    debugPrint("fs_rmdir %s", path);
+    if (is_stats_path(path)) {
+        return -ENOTDIR;
+    }
     Item *dir = search_item_path(secfs->indexDB, (String)path);
     if (dir == NULL) {
         return -ENOENT;
     }
     
+    ItemArray children = get_dir_items(secfs->indexDB, dir->path);
+    free(children.items);
+    if (children.length > 0) {
+        return -ENOTEMPTY;
+    }
+    
     LOCK_DB;
     purge_item(secfs, dir);
     UNLOCK_DB;
+    invalidate_path(path);
 
     schedule_db_save();
     return SUCCESS;
@@ -397,6 +631,9 @@ static int fs_statfs(const char *path, struct statvfs *stbuf) {
 
 static int fs_access(const char *path, int mask) {
     debugPrint("fs_access %s", path);
+    if (is_stats_path(path)) {
+        return (mask & (W_OK | X_OK)) ? -EACCES : SUCCESS;
+    }
 
     Item *item = search_item_path(secfs->indexDB, (String)path);
     if (item == NULL) {
@@ -447,15 +684,102 @@ static int fs_chown(const char *path, uid_t uid, gid_t gid, struct fuse_file_inf
 }
 
 static int fs_release(const char *path, struct fuse_file_info *fi) {
-    (void)fi;
     debugPrint("fs_release %s", path);
-    return -ENOSYS;
+    if (is_stats_path(path)) {
+        ByteArray *report = (ByteArray*)(uintptr_t)fi->fh;
+        free(report->bytes);
+        free(report);
+    }
+    return SUCCESS;
 }
 
 static int fs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi) {
     (void)fi;
     debugPrint("fs_fsync %s, isdatasync=%d", path,isdatasync);
-    return -ENOSYS;
+    
+    Item *item = search_item_path(secfs->indexDB, (String)path);
+    if (item == NULL && !is_stats_path(path)) {
+        return -ENOENT;
+    }
+    
+    // Block syncs and the metadata archive are shared with concurrent fsync calls
+    Error error = commit_changes();
+    if (error) {
+        debugPrint("[Warning] fsync failed: %s", error);
+        return -EIO;
+    }
+    return SUCCESS;
+}
+
+static int fs_fsyncdir(const char *path, int isdatasync, struct fuse_file_info *fi) {
+    return fs_fsync(path, isdatasync, fi);
+}
+
+// Called on unmount, make sure nothing is lost
+static void fs_destroy(void *privateData) {
+    (void)privateData;
+    debugPrint("fs_destroy");
+    stop_invalidations();
+    stop_reclaim();
+    Error error = commit_changes();
+    if (error) {
+        fprintf(stderr, "[ERROR] Couldn't save changes on unmount: %s\n", error);
+    }
+}
+
+static int fs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *info) {
+    (void)info;
+    debugPrint("fs_fallocate %s mode=%d (offset=%d, length=%d)", path, mode, offset, length);
+    if (is_stats_path(path)) {
+        return -EACCES;
+    }
+    
+    Item *file = search_item_path(secfs->indexDB, (String)path);
+    if (file == NULL) {
+        return -ENOENT;
+    }
+    if (file->type == ItemTypeDir) {
+        return -EISDIR;
+    }
+    return -fallocate_item(file, mode, (ULong)offset, (ULong)length);
+}
+
+// Server side copy, cp and other tools use it instead of reading and writing the data through the
+// kernel. Whole blocks are cloned by sharing their block files.
+static ssize_t fs_copy_file_range(const char *sourcePath, struct fuse_file_info *sourceInfo, off_t sourceOffset,
+                                  const char *destinationPath, struct fuse_file_info *destinationInfo, off_t destinationOffset,
+                                  size_t size, int flags) {
+    (void)sourceInfo;
+    (void)destinationInfo;
+    debugPrint("fs_copy_file_range %s -> %s (size=%d)", sourcePath, destinationPath, size);
+    if (flags) {
+        return -EINVAL;
+    }
+    if (is_stats_path(sourcePath) || is_stats_path(destinationPath)) {
+        return -EOPNOTSUPP;
+    }
+    
+    Item *source = search_item_path(secfs->indexDB, (String)sourcePath);
+    Item *destination = search_item_path(secfs->indexDB, (String)destinationPath);
+    if (source == NULL || destination == NULL) {
+        return -ENOENT;
+    }
+    if (source->type == ItemTypeDir || destination->type == ItemTypeDir) {
+        return -EISDIR;
+    }
+    if ((ULong)sourceOffset >= source->size) {
+        return 0;
+    }
+    size = MIN(MIN(size, source->size - (ULong)sourceOffset), COPY_MAX_SIZE);
+    
+    Error error = copy_item_data(secfs, source, (ULong)sourceOffset, destination, (ULong)destinationOffset, size);
+    if (error) {
+        debugPrint("[Warning] couldn't copy file: %s", error);
+        return -EIO;
+    }
+    
+    schedule_db_save();
+    return (ssize_t)size;
 }
 
 static off_t fs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
@@ -464,22 +788,76 @@ static off_t fs_lseek(const char *path, off_t off, int whence, struct fuse_file_
     return -ENOSYS;
 }
 
+// Timed and traced entry points, an operation failed when it returns an error code and processed
+// the bytes it returns
+#define TIMED_OPERATION(metric, path, call) {\
+        ULong start = stats_start();\
+        trace_begin_request(trace_enabled() ? trace_path_id((String)(path)) : 0);\
+        Int result = (call);\
+        stats_record((metric), start, result > 0 ? (ULong)result : 0, result < 0);\
+        trace_end_request();\
+        return result;\
+    }
+
+static int timed_getattr(const char *path, struct stat *statOut, struct fuse_file_info *info)
+    TIMED_OPERATION(MetricGetattr, path, fs_getattr(path, statOut, info))
+static int timed_access(const char *path, int mask)
+    TIMED_OPERATION(MetricAccess, path, fs_access(path, mask))
+static int timed_mkdir(const char *path, mode_t mode)
+    TIMED_OPERATION(MetricMkdir, path, fs_mkdir(path, mode))
+// Directories are listed on opendir, which counts as readdir
+static int timed_opendir(const char *path, struct fuse_file_info *info)
+    TIMED_OPERATION(MetricReaddir, path, fs_opendir(path, info))
+static int timed_rmdir(const char *path)
+    TIMED_OPERATION(MetricRmdir, path, fs_rmdir(path))
+static int timed_create(const char *path, mode_t mode, struct fuse_file_info *info)
+    TIMED_OPERATION(MetricCreate, path, fs_create(path, mode, info))
+static int timed_open(const char *path, struct fuse_file_info *fi)
+    TIMED_OPERATION(MetricOpen, path, fs_open(path, fi))
+static int timed_read(const char *path, char *out, size_t size, off_t offset, struct fuse_file_info *info)
+    TIMED_OPERATION(MetricRead, path, fs_read(path, out, size, offset, info))
+static int timed_write(const char *path, const char *data, size_t size, off_t offset, struct fuse_file_info *info)
+    TIMED_OPERATION(MetricWrite, path, fs_write(path, data, size, offset, info))
+static int timed_truncate(const char *path, off_t size, struct fuse_file_info *info)
+    TIMED_OPERATION(MetricTruncate, path, fs_truncate(path, size, info))
+static int timed_unlink(const char *path)
+    TIMED_OPERATION(MetricUnlink, path, fs_unlink(path))
+static int timed_rename(const char *sourcePath, const char *destinationPath, unsigned int flags)
+    TIMED_OPERATION(MetricRename, sourcePath, fs_rename(sourcePath, destinationPath, flags))
+static int timed_statfs(const char *path, struct statvfs *stbuf)
+    TIMED_OPERATION(MetricStatfs, path, fs_statfs(path, stbuf))
+static int timed_release(const char *path, struct fuse_file_info *fi)
+    TIMED_OPERATION(MetricRelease, path, fs_release(path, fi))
+static int timed_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+    TIMED_OPERATION(MetricFsync, path, fs_fsync(path, isdatasync, fi))
+static int timed_fsyncdir(const char *path, int isdatasync, struct fuse_file_info *fi)
+    TIMED_OPERATION(MetricFsync, path, fs_fsyncdir(path, isdatasync, fi))
+static int timed_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *info)
+    TIMED_OPERATION(MetricFallocate, path, fs_fallocate(path, mode, offset, length, info))
+static ssize_t timed_copy_file_range(const char *sourcePath, struct fuse_file_info *sourceInfo, off_t sourceOffset,
+                                     const char *destinationPath, struct fuse_file_info *destinationInfo, off_t destinationOffset,
+                                     size_t size, int flags)
+    TIMED_OPERATION(MetricCopy, destinationPath, (Int)fs_copy_file_range(sourcePath, sourceInfo, sourceOffset, destinationPath, destinationInfo, destinationOffset, size, flags))
+
 // Define all possible supported operations in the file system
 static const struct fuse_operations secfs_operations = {
     .init            = fs_init,
-    .getattr         = fs_getattr,
-    .access          = fs_access,
-    .mkdir           = fs_mkdir,
+    .destroy         = fs_destroy,
+    .getattr         = timed_getattr,
+    .access          = timed_access,
+    .mkdir           = timed_mkdir,
+    .opendir         = timed_opendir,
     .readdir         = fs_readdir,
-    .rmdir           = fs_rmdir,
-    .create          = fs_create,
-    .open            = fs_open,
-    .read            = fs_read,
-    .write           = fs_write,
-    .truncate        = fs_truncate,
-    .unlink          = fs_unlink,
-    .rename          = fs_rename,
-    .statfs          = fs_statfs,
+    .releasedir      = fs_releasedir,
+    .rmdir           = timed_rmdir,
+    .create          = timed_create,
+    .open            = timed_open,
+    .read            = timed_read,
+    .write           = timed_write,
+    .truncate        = timed_truncate,
+    .unlink          = timed_unlink,
+    .rename          = timed_rename,
+    .statfs          = timed_statfs,
     
     .readlink        = fs_readlink,
     .mknod           = fs_mknod,
@@ -487,34 +865,254 @@ static const struct fuse_operations secfs_operations = {
     .link            = fs_link,
     .chmod           = fs_chmod,
     .chown           = fs_chown,
-    .release         = fs_release,
-    .fsync           = fs_fsync,
+    .release         = timed_release,
+    .fsync           = timed_fsync,
+    .fsyncdir        = timed_fsyncdir,
     .lseek           = fs_lseek,
+    .fallocate       = timed_fallocate,
+    .copy_file_range = timed_copy_file_range,
 };
 
 
-// Save database to file every x seconds on a different thread
+// Save database to file on a different thread whenever it changes, at most once every DB_SAVE_INTERVAL_SEC
 void* save_state(void* arg) {
     (void)arg;
+    struct timespec nextSave = { 0, 0 };
     while (true) {
-        if (dbSaveRequested) {
-            LOCK_DB;
-            archive_secfs(secfs);
-            UNLOCK_DB;
-            dbSaveRequested = false;
-            
+        pthread_mutex_lock(&saveRequestLock);
+        while (!dbSaveRequested) {
+            pthread_cond_wait(&saveRequestCondition, &saveRequestLock);
         }
-        sleep(DB_SAVE_INTERVAL_SEC);
+        while (!urgentSaveRequested && pthread_cond_timedwait(&saveRequestCondition, &saveRequestLock, &nextSave) != ETIMEDOUT) {
+            // Keep coalescing changes until the interval is over or someone waits for the save
+        }
+        dbSaveRequested = false;
+        urgentSaveRequested = false;
+        ULong saveNumber = ++savesStarted;
+        pthread_mutex_unlock(&saveRequestLock);
+        
+        // Only copying the databases blocks file system operations, encrypting and writing doesn't
+        LOCK_DB;
+        SecfsSnapshot snapshot = snapshot_secfs(secfs);
+        UNLOCK_DB;
+        
+        // Blocks referenced by the snapshot reach the disk before the metadata does
+        Error error = sync_dirty_blocks(secfs);
+        if (error == NULL) {
+            error = archive_secfs_snapshot(secfs, snapshot);
+        }
+        free_secfs_snapshot(snapshot);
+        if (error) {
+            debugPrint("[Warning] couldn't archive database: %s", error);
+        }
+        
+        pthread_mutex_lock(&saveRequestLock);
+        savesCompleted = saveNumber;
+        lastSaveError = error;
+        pthread_cond_broadcast(&saveCompletedCondition);
+        pthread_mutex_unlock(&saveRequestLock);
+        if (error) {
+            schedule_db_save();
+        }
+        
+        clock_gettime(CLOCK_MONOTONIC, &nextSave);
+        nextSave.tv_sec += DB_SAVE_INTERVAL_SEC;
+    }
+}
+
+// Re-encrypts the volume with a new data key one shard at a time, so file system operations only
+// wait for the shard being switched. Stopping or crashing leaves it to resume on the next mount.
+static void* rotate_data_key(void *arg) {
+    (void)arg;
+    Error error = NULL;
+    if (!secfs->keys->rotating) {
+        error = start_key_rotation(secfs);
+    }
+    if (error == NULL && !secfs->keys->indexRotated) {
+        lock_archives(secfs);
+        LOCK_DB;
+        ByteArray indexRecords = snapshot_secfs_index(secfs);
+        UNLOCK_DB;
+        error = rotate_index_key(secfs, indexRecords);
+        unlock_archives(secfs);
+        free(indexRecords.bytes);
+    }
+    
+    ULong start = monotonicNanos();
+    ULong rotatedBytes = 0;
+    UInt shard = secfs->keys->rotatedShards;
+    for (; shard < BLOCK_SHARD_COUNT && error == NULL && !atomic_load(&keyRotationStopped); shard++) {
+        ULong bytes = 0;
+        error = rotate_shard_key(secfs, shard, cpuCount(), &bytes);
+        rotatedBytes += bytes;
+        
+        // Throttle to the configured rate, checking for unmount every 100 ms
+        while (fsOptions.keyRotationRate > 0 && !atomic_load(&keyRotationStopped)) {
+            double due = (double)rotatedBytes / (fsOptions.keyRotationRate * 1024 * 1024);
+            double elapsed = (double)(monotonicNanos() - start) / 1e9;
+            if (elapsed >= due) {
+                break;
+            }
+            usleep((useconds_t)(MIN(due - elapsed, 0.1) * 1e6));
+        }
+        if ((shard + 1) % 256 == 0) {
+            printf("Key rotation: %u of %u shards\n", shard + 1, BLOCK_SHARD_COUNT);
+            fflush(stdout);
+        }
+    }
+    
+    if (error == NULL && shard == BLOCK_SHARD_COUNT) {
+        error = finish_key_rotation(secfs);
+        if (error == NULL) {
+            printf("Data key rotated, %.1f MB re-encrypted\n", (double)rotatedBytes / (1024.0 * 1024.0));
+            fflush(stdout);
+        }
+    }
+    if (error) {
+        fprintf(stderr, "[ERROR] Key rotation stopped: %s. It resumes on the next mount\n", error);
+    }
+    return NULL;
+}
+
+// Moves the block files to the layout of the volume header one directory of the previous layout
+// at a time. Stopping or crashing leaves it to resume on the next mount.
+static void* migrate_block_layout(void *arg) {
+    (void)arg;
+    UInt directories = block_directory_count(secfs->header.previousBlockFanOut);
+    UInt directory = 0;
+    ULong moved = 0;
+    Error error = NULL;
+    while (directory < directories && error == NULL && !atomic_load(&blockMigrationStopped)) {
+        UInt count = 0;
+        error = migrate_block_directory(secfs, directory, MIGRATION_BATCH_FILES, &count);
+        if (count < MIGRATION_BATCH_FILES) {
+            directory++;
+        }
+        if ((moved + count) / 100000 > moved / 100000) {
+            printf("Block migration: %llu files moved\n", (unsigned long long)(moved + count));
+            fflush(stdout);
+        }
+        moved += count;
+    }
+    
+    if (error == NULL && directory == directories) {
+        error = finish_block_migration(secfs);
+        if (error == NULL) {
+            printf("Block files moved to %u levels of directories, %llu files moved\n", secfs->header.blockFanOut, (unsigned long long)moved);
+            fflush(stdout);
+        }
+    }
+    if (error) {
+        fprintf(stderr, "[ERROR] Block migration stopped: %s. It resumes on the next mount\n", error);
+    }
+    return NULL;
+}
+
+static void stop_block_migration(void) {
+    if (!blockMigrationRunning) {
+        return;
+    }
+    atomic_store(&blockMigrationStopped, true);
+    pthread_join(blockMigrationThreadId, NULL);
+    blockMigrationRunning = false;
+}
+
+static void stop_key_rotation(void) {
+    if (!keyRotationRunning) {
+        return;
     }
+    atomic_store(&keyRotationStopped, true);
+    pthread_join(keyRotationThreadId, NULL);
+    keyRotationRunning = false;
+}
+
+static void shed_block_metadata(void *blockDB) {
+    trim_blockDB((BlockDB*)blockDB);
+}
+
+static void shed_pooled_buffers(void *pool) {
+    buffer_pool_trim((BufferPool*)pool);
 }
 
-void fs_start(Secfs *secfsRef, String mountPath) {
+FsOptions default_fs_options(void) {
+    FsOptions options;
+    options.entryTimeout = DEFAULT_CACHE_TIMEOUT_SEC;
+    options.attrTimeout = DEFAULT_CACHE_TIMEOUT_SEC;
+    options.negativeTimeout = DEFAULT_CACHE_TIMEOUT_SEC;
+    options.keepCache = true;
+    options.directIOMinSize = 0;
+    options.lowLevel = false;
+    options.tracePath = NULL;
+    options.rotateKey = false;
+    options.keyRotationRate = DEFAULT_KEY_ROTATION_RATE;
+    options.memoryLimit = 0;
+    options.hugePages = false;
+    options.directBackingIO = false;
+    options.reclaimRate = DEFAULT_RECLAIM_RATE;
+    options.blockFanOut = -1;
+    return options;
+}
+
+const struct fuse_operations* fs_operations(Secfs *secfsRef, FsOptions options) {
     secfs = secfsRef;
+    fsOptions = options;
+    memory_set_budget(options.memoryLimit);
+    memory_set_shedder(MemoryBlockMetadata, shed_block_metadata, secfs->blockDB);
+    memory_set_shedder(MemoryPooledBuffers, shed_pooled_buffers, secfs->blockBuffers);
+    trim_blockDB(secfs->blockDB);
+    if (!buffer_pool_use_huge_pages(secfs->blockBuffers, options.hugePages)) {
+        printf("Transparent huge pages aren't supported on this system, block buffers use regular pages\n");
+    }
+    Error directError = use_direct_block_io(secfs, options.directBackingIO);
+    if (directError) {
+        printf("%s, block files go through the page cache\n", directError);
+    }
+    
+    // A migration in progress is finished first, whatever the options ask for
+    if (!atomic_load(&secfs->blockMigration) && options.blockFanOut >= 0 && (UInt)options.blockFanOut != secfs->header.blockFanOut) {
+        Error migrationError = start_block_migration(secfs, (UInt)options.blockFanOut);
+        if (migrationError) {
+            fprintf(stderr, "[ERROR] Couldn't change the block layout: %s\n", migrationError);
+        }
+    }
+    if (options.tracePath != NULL) {
+        trace_start(options.tracePath);
+    }
     
     //schedule database saving in a different thread
+    pthread_condattr_t conditionAttributes;
+    pthread_condattr_init(&conditionAttributes);
+    pthread_condattr_setclock(&conditionAttributes, CLOCK_MONOTONIC);
+    pthread_cond_init(&saveRequestCondition, &conditionAttributes);
+    pthread_cond_init(&saveCompletedCondition, NULL);
+    pthread_condattr_destroy(&conditionAttributes);
+    pthread_mutex_init(&saveRequestLock, NULL);
     pthread_mutex_init(&saveStateLock, NULL);
     pthread_create(&saveStateThreadId, NULL, save_state, NULL);
     
+    memset(&invalidations, 0, sizeof invalidations);
+    pthread_mutex_init(&invalidations.lock, NULL);
+    pthread_cond_init(&invalidations.condition, NULL);
+    pthread_create(&invalidationThreadId, NULL, process_invalidations, NULL);
+    
+    // An interrupted rotation continues whether asked for or not, until then two keys are in use
+    if (options.rotateKey || secfs->keys->rotating) {
+        atomic_init(&keyRotationStopped, false);
+        keyRotationRunning = pthread_create(&keyRotationThreadId, NULL, rotate_data_key, NULL) == 0;
+    }
+    
+    atomic_init(&reclaimStopped, false);
+    reclaimRunning = pthread_create(&reclaimThreadId, NULL, reclaim_deleted_blocks, NULL) == 0;
+    if (atomic_load(&secfs->blockMigration)) {
+        atomic_init(&blockMigrationStopped, false);
+        blockMigrationRunning = pthread_create(&blockMigrationThreadId, NULL, migrate_block_layout, NULL) == 0;
+    }
+    return &secfs_operations;
+}
+
+void fs_start(Secfs *secfsRef, String mountPath, FsOptions options) {
+    const struct fuse_operations *operations = fs_operations(secfsRef, options);
+    
     String args[4];
     Int argc = 0;
     args[argc++] = "secfs";
@@ -526,10 +1124,24 @@ void fs_start(Secfs *secfsRef, String mountPath) {
     args[argc++] = "-s";
     args[argc++] = mountPath;
 
-    struct fuse_args fuse_args = FUSE_ARGS_INIT(argc, args);
-    Int returnCode = fuse_main(fuse_args.argc, fuse_args.argv, &secfs_operations, NULL);
-    
-    fuse_opt_free_args(&fuse_args);
+    Int returnCode;
+    if (options.lowLevel) {
+        returnCode = fs_ll_main(secfs, mountPath, options);
+    }
+    else {
+        struct fuse_args fuse_args = FUSE_ARGS_INIT(argc, args);
+        returnCode = fuse_main(fuse_args.argc, fuse_args.argv, operations, NULL);
+        fuse_opt_free_args(&fuse_args);
+    }
+    stop_key_rotation();
+    stop_block_migration();
+    stop_reclaim();
+
+    Error traceError = trace_dump();
+    if (traceError) {
+        fprintf(stderr, "[ERROR] Couldn't write trace to %s: %s\n", options.tracePath, traceError);
+    }
+
     pthread_mutex_destroy(&saveStateLock);
     exit(returnCode);
 }
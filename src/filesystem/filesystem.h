@@ -5,9 +5,68 @@
 #ifndef filesystem_h
 #define filesystem_h
 
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/falloc.h>
+#endif
 #include "../utilities/utilities.h"
 #include "secfs.h"
 
-void fs_start(Secfs *secfs, String mountPath);
+#define DEFAULT_CACHE_TIMEOUT_SEC 1.0
+#define DEFAULT_KEY_ROTATION_RATE 100.0
+#define DEFAULT_RECLAIM_RATE 2000.0 // Block files of deleted files deleted per second
+#define COPY_MAX_SIZE 1073741824 // Bytes of one copy_file_range request, callers repeat it for the rest
+
+// Read-only file at the mount root with the counters and latency histograms of every operation.
+// It is not listed and shadows any item of the same name.
+#define STATS_FILE_NAME ".secfs-stats"
+#define STATS_FILE_PATH "/" STATS_FILE_NAME
+
+// Kernel caching policy. Secfs invalidates the cached entries it changes behind the kernel's back,
+// so names, attributes and file pages can be cached safely.
+typedef struct {
+    double entryTimeout;    // Seconds the kernel may cache name lookups
+    double attrTimeout;     // Seconds the kernel may cache file attributes
+    double negativeTimeout; // Seconds the kernel may cache failed lookups
+    Bool keepCache;         // Keep the page cache across opens of files opened for reading only
+    ULong directIOMinSize;  // Files of at least this size bypass the page cache (streaming), 0 to disable
+    Bool lowLevel;          // Serve the low-level FUSE API with inode numbers instead of paths
+    String tracePath;       // Record request traces, written to this file on SIGUSR1 and unmount, NULL to disable
+    Bool rotateKey;         // Re-encrypt the volume with a new data key in the background
+    double keyRotationRate; // MB per second a key rotation re-encrypts at most, 0 for no limit
+    ULong memoryLimit;      // Bytes of metadata and buffers secfs keeps in memory at most, 0 for no limit
+    Bool hugePages;         // Back the block buffers with transparent huge pages
+    Bool directBackingIO;   // Read and write block files with direct I/O, bypassing the page cache of the host
+    double reclaimRate;     // Block files of deleted files deleted per second at most, 0 for no limit
+    Int blockFanOut;        // Levels of directories to move the block files to, -1 keeps the layout of the volume
+} FsOptions;
+
+// Database locking and saving, shared by the path based and the inode based implementations
+#define LOCK_DB lock_db();
+#define UNLOCK_DB pthread_mutex_unlock(&saveStateLock);
+extern pthread_mutex_t saveStateLock;
+
+void lock_db(void);
+
+void schedule_db_save(void);
+Error commit_changes(void);
+
+// Preallocation and hole punching of both implementations, returns an errno code. Systems without
+// the flags only preallocate, any flag is unsupported there.
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0
+#define FALLOC_FL_PUNCH_HOLE 0
+#define FALLOC_FL_ZERO_RANGE 0
+#endif
+Int fallocate_item(Item *file, Int mode, ULong offset, ULong length);
+
+struct fuse_operations;
+
+FsOptions default_fs_options(void);
+void fs_start(Secfs *secfs, String mountPath, FsOptions options);
+
+// Starts the background saving and returns the path based operations without mounting,
+// for harnesses which call the callbacks directly. init is not meant to be called this way.
+const struct fuse_operations* fs_operations(Secfs *secfs, FsOptions options);
 
 #endif /* filesystem_h */
@@ -0,0 +1,1255 @@
+//
+//  Created by Stasel
+//
+
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <fuse_lowlevel.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include "filesystem_ll.h"
+#include "../utilities/utilities.h"
+#include "../utilities/stats.h"
+#include "../utilities/trace.h"
+#include "../utilities/memory.h"
+
+#define IO_THREADS 8
+#define INODE_TABLE_MIN_BUCKETS 1024
+#define UNKNOWN_INO 0xffffffff
+#define STATS_INO 0xfffffffe // Never handed out, inode numbers grow from the root
+
+// Kernel reference to an item. Inode numbers are never reused, so a directory rename doesn't
+// invalidate anything below it and requests never resolve paths.
+typedef struct Inode {
+    fuse_ino_t ino;
+    uuid_t itemId;
+    Item *item;              // NULL once the item was deleted
+    ULong lookups;           // References held by the kernel, dropped by forget
+    UInt opens;              // Open file handles
+    UInt listings;           // Open directory handles listing the item
+    Bool unlinked;           // Removed from the index while open, purged on last release
+    pthread_rwlock_t ioLock; // The data of a file is read concurrently and written exclusively
+    struct Inode *nextByIno;
+    struct Inode *nextById;
+} Inode;
+
+// Only changed by the session thread
+typedef struct {
+    Inode **byIno;
+    Inode **byId;
+    UInt buckets;
+    UInt length;
+    fuse_ino_t nextIno;
+} InodeTable;
+
+typedef enum { IOJobRead = 0, IOJobWrite = 1, IOJobFsync = 2, IOJobCopy = 3, IOJobFallocate = 4 } IOJobType;
+
+typedef struct IOJob {
+    IOJobType type;
+    fuse_req_t request;
+    Inode *inode;
+    ULong size;
+    ULong offset;
+    Byte *data;
+    Inode *source;      // Copies only, inode is the destination
+    ULong sourceOffset;
+    Int mode;           // Fallocate only
+    ULong start;
+    struct IOJob *next;
+} IOJob;
+
+typedef struct {
+    IOJob *first;
+    IOJob *last;
+    Bool stopping;
+    pthread_t threads[IO_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t condition;
+} IOQueue;
+
+// Directory listing taken on opendir, so readdir offsets stay stable while the directory changes.
+// The inodes of the children are kept until releasedir.
+typedef struct {
+    fuse_ino_t ino;
+    Inode **inodes;
+    String *names;
+    UInt length;
+} DirHandle;
+
+static Secfs *secfs;
+static FsOptions fsOptions;
+static InodeTable inodes;
+static IOQueue ioQueue;
+
+// Held shared while file data is read or written and exclusively while items are created,
+// renamed or deleted
+static pthread_rwlock_t namespaceLock;
+
+// Whether the request being handled on this thread was answered with an error
+static __thread Bool requestFailed;
+
+// MARK: - Inode table
+
+static UInt id_bucket(uuid_t id, UInt buckets) {
+    ULong hash;
+    memcpy(&hash, id, sizeof hash);
+    return (UInt)(hash % buckets);
+}
+
+static void insert_inode_buckets(Inode *inode) {
+    UInt inoBucket = (UInt)(inode->ino % inodes.buckets);
+    inode->nextByIno = inodes.byIno[inoBucket];
+    inodes.byIno[inoBucket] = inode;
+    UInt idBucket = id_bucket(inode->itemId, inodes.buckets);
+    inode->nextById = inodes.byId[idBucket];
+    inodes.byId[idBucket] = inode;
+}
+
+static void grow_inode_table(void) {
+    Inode **oldByIno = inodes.byIno;
+    UInt oldBuckets = inodes.buckets;
+    inodes.buckets = MAX(oldBuckets * 2, INODE_TABLE_MIN_BUCKETS);
+    inodes.byIno = calloc(inodes.buckets, sizeof(Inode*));
+    free(inodes.byId);
+    inodes.byId = calloc(inodes.buckets, sizeof(Inode*));
+    for (UInt i = 0; i < oldBuckets; i++) {
+        Inode *inode = oldByIno[i];
+        while (inode != NULL) {
+            Inode *next = inode->nextByIno;
+            insert_inode_buckets(inode);
+            inode = next;
+        }
+    }
+    free(oldByIno);
+}
+
+static Inode* find_inode(fuse_ino_t ino) {
+    Inode *inode = inodes.byIno[ino % inodes.buckets];
+    while (inode != NULL && inode->ino != ino) {
+        inode = inode->nextByIno;
+    }
+    return inode;
+}
+
+static Inode* find_inode_for_item(Item *item) {
+    Inode *inode = inodes.byId[id_bucket(item->id, inodes.buckets)];
+    while (inode != NULL && (inode->item != item || uuid_compare(inode->itemId, item->id) != 0)) {
+        inode = inode->nextById;
+    }
+    return inode;
+}
+
+static Inode* create_inode(Item *item, fuse_ino_t ino) {
+    if (inodes.length >= inodes.buckets) {
+        grow_inode_table();
+    }
+    Inode *inode = ALLOC(Inode);
+    inode->ino = ino;
+    uuid_copy(inode->itemId, item->id);
+    inode->item = item;
+    inode->lookups = 0;
+    inode->opens = 0;
+    inode->listings = 0;
+    inode->unlinked = false;
+    pthread_rwlock_init(&inode->ioLock, NULL);
+    insert_inode_buckets(inode);
+    inodes.length++;
+    return inode;
+}
+
+// Inode of an item, created on the first lookup
+static Inode* inode_for_item(Item *item) {
+    Inode *inode = find_inode_for_item(item);
+    if (inode == NULL) {
+        inode = create_inode(item, inodes.nextIno++);
+    }
+    return inode;
+}
+
+static void remove_inode(Inode *inode) {
+    Inode **link = &inodes.byIno[inode->ino % inodes.buckets];
+    while (*link != inode) {
+        link = &(*link)->nextByIno;
+    }
+    *link = inode->nextByIno;
+
+    link = &inodes.byId[id_bucket(inode->itemId, inodes.buckets)];
+    while (*link != inode) {
+        link = &(*link)->nextById;
+    }
+    *link = inode->nextById;
+
+    pthread_rwlock_destroy(&inode->ioLock);
+    free(inode);
+    inodes.length--;
+}
+
+// Deletes the data of an unlinked file once nothing refers to it anymore
+static void release_inode_if_unused(Inode *inode) {
+    if (inode->unlinked && inode->opens == 0) {
+        pthread_rwlock_wrlock(&namespaceLock);
+        LOCK_DB;
+        purge_item(secfs, inode->item);
+        UNLOCK_DB;
+        pthread_rwlock_unlock(&namespaceLock);
+        free(inode->item);
+        inode->item = NULL;
+        inode->unlinked = false;
+        schedule_db_save();
+    }
+    if (inode->ino != FUSE_ROOT_ID && inode->lookups == 0 && inode->opens == 0 && inode->listings == 0) {
+        remove_inode(inode);
+    }
+}
+
+// MARK: - Helpers
+
+static Int reply_err(fuse_req_t request, Int error) {
+    requestFailed = requestFailed || error != 0;
+    return fuse_reply_err(request, error);
+}
+
+static Bool is_stats_entry(fuse_ino_t parent, const char *name) {
+    return parent == FUSE_ROOT_ID && strcmp(name, STATS_FILE_NAME) == 0;
+}
+
+static void fill_stats_stat(struct stat *statOut) {
+    // Size is unknown until the file is read, reads bypass the page cache
+    memset(statOut, 0, sizeof(struct stat));
+    statOut->st_ino = STATS_INO;
+    statOut->st_mode = S_IFREG | 0444;
+    statOut->st_nlink = 1;
+}
+
+static Item* item_for_inode(fuse_req_t request, fuse_ino_t ino) {
+    Inode *inode = find_inode(ino);
+    if (inode == NULL || inode->item == NULL) {
+        reply_err(request, ENOENT);
+        return NULL;
+    }
+    return inode->item;
+}
+
+static Bool child_path(Item *parent, const char *name, char *out) {
+    Int length;
+    if (strcmp(parent->path, "/") == 0) {
+        length = snprintf(out, PATH_MAX_LENGTH, "/%s", name);
+    }
+    else {
+        length = snprintf(out, PATH_MAX_LENGTH, "%s/%s", parent->path, name);
+    }
+    return length < PATH_MAX_LENGTH;
+}
+
+static void fill_stat(Inode *inode, struct stat *statOut) {
+    memset(statOut, 0, sizeof(struct stat));
+    statOut->st_ino = inode->ino;
+    if (inode->item->type == ItemTypeDir) {
+        statOut->st_mode = S_IFDIR | 0755;
+    }
+    else {
+        statOut->st_mode = S_IFREG | 0755;
+    }
+    statOut->st_size = (off_t)inode->item->size;
+    statOut->st_nlink = 1;
+}
+
+static void fill_entry(Inode *inode, struct fuse_entry_param *entry) {
+    memset(entry, 0, sizeof(struct fuse_entry_param));
+    entry->ino = inode->ino;
+    entry->attr_timeout = fsOptions.attrTimeout;
+    entry->entry_timeout = fsOptions.entryTimeout;
+    fill_stat(inode, &entry->attr);
+}
+
+static Bool has_children(Item *dir) {
+    ItemArray children = get_dir_items(secfs->indexDB, dir->path);
+    Bool result = children.length > 0;
+    free(children.items);
+    return result;
+}
+
+// Must be called with the namespace lock held exclusively.
+// Open files stay readable until their last handle is closed.
+static void delete_item(Item *item) {
+    Inode *inode = find_inode_for_item(item);
+    if (inode != NULL && inode->opens > 0 && item->type == ItemTypeFile) {
+        LOCK_DB;
+        detach_item(secfs->indexDB, item->id);
+        UNLOCK_DB;
+        inode->unlinked = true;
+        return;
+    }
+    if (inode != NULL) {
+        inode->item = NULL;
+    }
+    LOCK_DB;
+    purge_item(secfs, item);
+    UNLOCK_DB;
+}
+
+static void open_policy(Item *item, struct fuse_file_info *fi) {
+    // Read-mostly files keep their pages between opens, large files are streamed without caching
+    if (fsOptions.directIOMinSize > 0 && item->size >= fsOptions.directIOMinSize) {
+        fi->direct_io = 1;
+    }
+    else if (fsOptions.keepCache && (fi->flags & O_ACCMODE) == O_RDONLY) {
+        fi->keep_cache = 1;
+    }
+}
+
+// MARK: - Asynchronous I/O
+
+static void enqueue_io(IOJob *job) {
+    job->next = NULL;
+    pthread_mutex_lock(&ioQueue.lock);
+    if (ioQueue.last == NULL) {
+        ioQueue.first = job;
+    }
+    else {
+        ioQueue.last->next = job;
+    }
+    ioQueue.last = job;
+    pthread_cond_signal(&ioQueue.condition);
+    pthread_mutex_unlock(&ioQueue.lock);
+}
+
+static void run_read(IOJob *job) {
+    trace_begin_request(job->inode->ino);
+    pthread_rwlock_rdlock(&namespaceLock);
+    pthread_rwlock_rdlock(&job->inode->ioLock);
+
+    // Direct I/O reads are not clamped to the file size by the kernel
+    Item *file = job->inode->item;
+    ULong size = 0;
+    Error error = NULL;
+    Byte *out = NULL;
+    if (file != NULL && job->offset < file->size) {
+        size = MIN(job->size, file->size - job->offset);
+        out = malloc(MAX(size, 1));
+        memory_charge(MemoryIOBuffers, size);
+        error = read_item_data(secfs, file, out, size, job->offset);
+    }
+
+    pthread_rwlock_unlock(&job->inode->ioLock);
+    pthread_rwlock_unlock(&namespaceLock);
+
+    stats_record(MetricRead, job->start, error ? 0 : size, file == NULL || error != NULL);
+    trace_end_request();
+    if (file == NULL) {
+        reply_err(job->request, ENOENT);
+    }
+    else if (error) {
+        debugPrint("[Warning] couldn't read file: %s", error);
+        reply_err(job->request, EIO);
+    }
+    else {
+        fuse_reply_buf(job->request, (const char*)out, size);
+    }
+    free(out);
+    memory_uncharge(MemoryIOBuffers, size);
+}
+
+static void run_write(IOJob *job) {
+    trace_begin_request(job->inode->ino);
+    pthread_rwlock_rdlock(&namespaceLock);
+    pthread_rwlock_wrlock(&job->inode->ioLock);
+
+    Item *file = job->inode->item;
+    Error error = NULL;
+    if (file != NULL) {
+        error = write_item_data(secfs, file, job->data, job->size, job->offset);
+    }
+
+    pthread_rwlock_unlock(&job->inode->ioLock);
+    pthread_rwlock_unlock(&namespaceLock);
+
+    stats_record(MetricWrite, job->start, error ? 0 : job->size, file == NULL || error != NULL);
+    trace_end_request();
+    if (file == NULL) {
+        reply_err(job->request, ENOENT);
+    }
+    else if (error) {
+        debugPrint("[Warning] couldn't write file: %s", error);
+        reply_err(job->request, EIO);
+    }
+    else {
+        schedule_db_save();
+        fuse_reply_write(job->request, job->size);
+    }
+}
+
+static void lock_io(Inode *inode, Bool exclusive) {
+    if (exclusive) {
+        pthread_rwlock_wrlock(&inode->ioLock);
+    }
+    else {
+        pthread_rwlock_rdlock(&inode->ioLock);
+    }
+}
+
+static void run_copy(IOJob *job) {
+    trace_begin_request(job->inode->ino);
+    pthread_rwlock_rdlock(&namespaceLock);
+    
+    // Inode locks are taken in inode order, so opposite copies between two files can't deadlock
+    Inode *source = job->source;
+    Inode *destination = job->inode;
+    Inode *first = source->ino < destination->ino ? source : destination;
+    Inode *second = source->ino < destination->ino ? destination : source;
+    if (first == second) {
+        pthread_rwlock_wrlock(&first->ioLock);
+    }
+    else {
+        lock_io(first, first == destination);
+        lock_io(second, second == destination);
+    }
+    
+    ULong size = 0;
+    Error error = NULL;
+    Bool found = source->item != NULL && destination->item != NULL;
+    if (found && job->sourceOffset < source->item->size) {
+        size = MIN(MIN(job->size, source->item->size - job->sourceOffset), COPY_MAX_SIZE);
+        error = copy_item_data(secfs, source->item, job->sourceOffset, destination->item, job->offset, size);
+    }
+    
+    if (first != second) {
+        pthread_rwlock_unlock(&second->ioLock);
+    }
+    pthread_rwlock_unlock(&first->ioLock);
+    pthread_rwlock_unlock(&namespaceLock);
+    
+    stats_record(MetricCopy, job->start, error ? 0 : size, !found || error != NULL);
+    trace_end_request();
+    if (!found) {
+        reply_err(job->request, ENOENT);
+    }
+    else if (error) {
+        debugPrint("[Warning] couldn't copy file: %s", error);
+        reply_err(job->request, EIO);
+    }
+    else {
+        schedule_db_save();
+        fuse_reply_write(job->request, size);
+    }
+}
+
+static void run_fallocate(IOJob *job) {
+    trace_begin_request(job->inode->ino);
+    pthread_rwlock_rdlock(&namespaceLock);
+    pthread_rwlock_wrlock(&job->inode->ioLock);
+    
+    Item *file = job->inode->item;
+    Int error = file != NULL ? fallocate_item(file, job->mode, job->offset, job->size) : ENOENT;
+    
+    pthread_rwlock_unlock(&job->inode->ioLock);
+    pthread_rwlock_unlock(&namespaceLock);
+    
+    stats_record(MetricFallocate, job->start, 0, error != SUCCESS);
+    trace_end_request();
+    reply_err(job->request, error);
+}
+
+static void run_fsync(IOJob *job) {
+    trace_begin_request(job->inode->ino);
+    // Block syncs and the metadata archive are shared with concurrent fsync calls
+    Error error = commit_changes();
+    if (error) {
+        debugPrint("[Warning] fsync failed: %s", error);
+    }
+    stats_record(MetricFsync, job->start, 0, error != NULL);
+    trace_end_request();
+    reply_err(job->request, error ? EIO : 0);
+}
+
+static void* process_io(void *arg) {
+    (void)arg;
+    while (true) {
+        pthread_mutex_lock(&ioQueue.lock);
+        while (ioQueue.first == NULL && !ioQueue.stopping) {
+            pthread_cond_wait(&ioQueue.condition, &ioQueue.lock);
+        }
+        IOJob *job = ioQueue.first;
+        if (job == NULL) {
+            pthread_mutex_unlock(&ioQueue.lock);
+            return NULL;
+        }
+        ioQueue.first = job->next;
+        if (ioQueue.first == NULL) {
+            ioQueue.last = NULL;
+        }
+        pthread_mutex_unlock(&ioQueue.lock);
+
+        switch (job->type) {
+            case IOJobRead:
+                run_read(job);
+                break;
+            case IOJobWrite:
+                run_write(job);
+                break;
+            case IOJobFsync:
+                run_fsync(job);
+                break;
+            case IOJobCopy:
+                run_copy(job);
+                break;
+            case IOJobFallocate:
+                run_fallocate(job);
+                break;
+            default:
+                reply_err(job->request, EINVAL);
+                break;
+        }
+        if (job->type == IOJobWrite) {
+            memory_release(MemoryDirtyBuffers, job->size);
+        }
+        free(job->data);
+        free(job);
+    }
+}
+
+static void start_io_threads(void) {
+    memset(&ioQueue, 0, sizeof ioQueue);
+    pthread_mutex_init(&ioQueue.lock, NULL);
+    pthread_cond_init(&ioQueue.condition, NULL);
+    for (UInt i = 0; i < IO_THREADS; i++) {
+        pthread_create(&ioQueue.threads[i], NULL, process_io, NULL);
+    }
+}
+
+// Finishes the queued requests before returning
+static void stop_io_threads(void) {
+    pthread_mutex_lock(&ioQueue.lock);
+    ioQueue.stopping = true;
+    pthread_cond_broadcast(&ioQueue.condition);
+    pthread_mutex_unlock(&ioQueue.lock);
+    for (UInt i = 0; i < IO_THREADS; i++) {
+        pthread_join(ioQueue.threads[i], NULL);
+    }
+}
+
+static IOJob* create_io_job(IOJobType type, fuse_req_t request, fuse_ino_t ino) {
+    ULong start = stats_start();
+    Metric metric = type == IOJobRead ? MetricRead : type == IOJobWrite ? MetricWrite : type == IOJobCopy ? MetricCopy :
+                    type == IOJobFallocate ? MetricFallocate : MetricFsync;
+    Inode *inode = find_inode(ino);
+    if (inode == NULL || inode->item == NULL) {
+        reply_err(request, ENOENT);
+        stats_record(metric, start, 0, true);
+        return NULL;
+    }
+    if (type != IOJobFsync && inode->item->type == ItemTypeDir) {
+        reply_err(request, EISDIR);
+        stats_record(metric, start, 0, true);
+        return NULL;
+    }
+    IOJob *job = ALLOC(IOJob);
+    job->start = start;
+    job->type = type;
+    job->request = request;
+    job->inode = inode;
+    job->size = 0;
+    job->offset = 0;
+    job->data = NULL;
+    job->source = NULL;
+    job->sourceOffset = 0;
+    job->mode = 0;
+    return job;
+}
+
+// MARK: - Operations
+
+static void ll_init(void *userData, struct fuse_conn_info *connInfo) {
+    (void)userData;
+    debugPrint("ll_init");
+    // Truncation on open is done by the kernel through setattr
+    connInfo->want &= ~(UInt)FUSE_CAP_ATOMIC_O_TRUNC;
+}
+
+// Called on unmount, make sure nothing is lost
+static void ll_destroy(void *userData) {
+    (void)userData;
+    debugPrint("ll_destroy");
+    Error error = commit_changes();
+    if (error) {
+        fprintf(stderr, "[ERROR] Couldn't save changes on unmount: %s\n", error);
+    }
+}
+
+static void ll_lookup(fuse_req_t request, fuse_ino_t parent, const char *name) {
+    if (is_stats_entry(parent, name)) {
+        struct fuse_entry_param entry;
+        memset(&entry, 0, sizeof entry);
+        entry.ino = STATS_INO;
+        entry.attr_timeout = fsOptions.attrTimeout;
+        entry.entry_timeout = fsOptions.entryTimeout;
+        fill_stats_stat(&entry.attr);
+        fuse_reply_entry(request, &entry);
+        return;
+    }
+
+    Item *parentItem = item_for_inode(request, parent);
+    if (parentItem == NULL) {
+        return;
+    }
+
+    char path[PATH_MAX_LENGTH];
+    if (!child_path(parentItem, name, path)) {
+        reply_err(request, ENAMETOOLONG);
+        return;
+    }
+
+    Item *item = search_item_path(secfs->indexDB, path);
+    if (item == NULL) {
+        if (fsOptions.negativeTimeout > 0) {
+            // Zero inode caches the missing name
+            struct fuse_entry_param entry;
+            memset(&entry, 0, sizeof entry);
+            entry.entry_timeout = fsOptions.negativeTimeout;
+            fuse_reply_entry(request, &entry);
+        }
+        else {
+            reply_err(request, ENOENT);
+        }
+        return;
+    }
+
+    Inode *inode = inode_for_item(item);
+    inode->lookups++;
+    struct fuse_entry_param entry;
+    fill_entry(inode, &entry);
+    fuse_reply_entry(request, &entry);
+}
+
+static void forget_inode(fuse_ino_t ino, uint64_t lookups) {
+    Inode *inode = find_inode(ino);
+    if (inode == NULL) {
+        return;
+    }
+    inode->lookups -= MIN(inode->lookups, lookups);
+    release_inode_if_unused(inode);
+}
+
+static void ll_forget(fuse_req_t request, fuse_ino_t ino, uint64_t lookups) {
+    forget_inode(ino, lookups);
+    fuse_reply_none(request);
+}
+
+static void ll_forget_multi(fuse_req_t request, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        forget_inode(forgets[i].ino, forgets[i].nlookup);
+    }
+    fuse_reply_none(request);
+}
+
+static void ll_getattr(fuse_req_t request, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)fi;
+    if (ino == STATS_INO) {
+        struct stat statOut;
+        fill_stats_stat(&statOut);
+        fuse_reply_attr(request, &statOut, fsOptions.attrTimeout);
+        return;
+    }
+    Inode *inode = find_inode(ino);
+    if (inode == NULL || inode->item == NULL) {
+        reply_err(request, ENOENT);
+        return;
+    }
+    struct stat statOut;
+    pthread_rwlock_rdlock(&namespaceLock);
+    fill_stat(inode, &statOut);
+    pthread_rwlock_unlock(&namespaceLock);
+    fuse_reply_attr(request, &statOut, fsOptions.attrTimeout);
+}
+
+static void ll_setattr(fuse_req_t request, fuse_ino_t ino, struct stat *attributes, int toSet, struct fuse_file_info *fi) {
+    (void)fi;
+    debugPrint("ll_setattr %d, to_set=%d", ino, toSet);
+    if (ino == STATS_INO) {
+        reply_err(request, EACCES);
+        return;
+    }
+    Inode *inode = find_inode(ino);
+    if (inode == NULL || inode->item == NULL) {
+        reply_err(request, ENOENT);
+        return;
+    }
+
+    // Only the size can be changed, like the path based implementation
+    if (toSet & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID | FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)) {
+        reply_err(request, ENOSYS);
+        return;
+    }
+    if (toSet & FUSE_SET_ATTR_SIZE) {
+        if (inode->item->type == ItemTypeDir) {
+            reply_err(request, EISDIR);
+            return;
+        }
+        pthread_rwlock_rdlock(&namespaceLock);
+        pthread_rwlock_wrlock(&inode->ioLock);
+        Error error = truncate_item_data(secfs, inode->item, (ULong)attributes->st_size);
+        pthread_rwlock_unlock(&inode->ioLock);
+        pthread_rwlock_unlock(&namespaceLock);
+        schedule_db_save();
+        if (error) {
+            debugPrint("[Warning] couldn't truncate file: %s", error);
+            reply_err(request, EIO);
+            return;
+        }
+    }
+
+    struct stat statOut;
+    fill_stat(inode, &statOut);
+    fuse_reply_attr(request, &statOut, fsOptions.attrTimeout);
+}
+
+static void create_child(fuse_req_t request, fuse_ino_t parent, const char *name, ItemType type, struct fuse_file_info *fi) {
+    if (is_stats_entry(parent, name)) {
+        reply_err(request, EEXIST);
+        return;
+    }
+    Item *parentItem = item_for_inode(request, parent);
+    if (parentItem == NULL) {
+        return;
+    }
+
+    char path[PATH_MAX_LENGTH];
+    if (!child_path(parentItem, name, path)) {
+        reply_err(request, ENAMETOOLONG);
+        return;
+    }
+    if (search_item_path(secfs->indexDB, path) != NULL) {
+        reply_err(request, EEXIST);
+        return;
+    }
+
+    Item *newItem = create_item(type, path);
+    pthread_rwlock_wrlock(&namespaceLock);
+    LOCK_DB;
+    add_item(secfs->indexDB, newItem);
+    UNLOCK_DB;
+    pthread_rwlock_unlock(&namespaceLock);
+    schedule_db_save();
+
+    Inode *inode = inode_for_item(newItem);
+    inode->lookups++;
+    struct fuse_entry_param entry;
+    fill_entry(inode, &entry);
+    if (fi != NULL) {
+        inode->opens++;
+        open_policy(newItem, fi);
+        fuse_reply_create(request, &entry, fi);
+    }
+    else {
+        fuse_reply_entry(request, &entry);
+    }
+}
+
+static void ll_mkdir(fuse_req_t request, fuse_ino_t parent, const char *name, mode_t mode) {
+    (void)mode;
+    debugPrint("ll_mkdir %s", name);
+    create_child(request, parent, name, ItemTypeDir, NULL);
+}
+
+static void ll_create(fuse_req_t request, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    (void)mode;
+    debugPrint("ll_create %s", name);
+    create_child(request, parent, name, ItemTypeFile, fi);
+}
+
+static void remove_child(fuse_req_t request, fuse_ino_t parent, const char *name, ItemType type) {
+    if (is_stats_entry(parent, name)) {
+        reply_err(request, type == ItemTypeDir ? ENOTDIR : EPERM);
+        return;
+    }
+    Item *parentItem = item_for_inode(request, parent);
+    if (parentItem == NULL) {
+        return;
+    }
+
+    char path[PATH_MAX_LENGTH];
+    if (!child_path(parentItem, name, path)) {
+        reply_err(request, ENAMETOOLONG);
+        return;
+    }
+    Item *item = search_item_path(secfs->indexDB, path);
+    if (item == NULL) {
+        reply_err(request, ENOENT);
+        return;
+    }
+    if (item->type != type) {
+        reply_err(request, type == ItemTypeDir ? ENOTDIR : EISDIR);
+        return;
+    }
+    if (type == ItemTypeDir && has_children(item)) {
+        reply_err(request, ENOTEMPTY);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&namespaceLock);
+    delete_item(item);
+    pthread_rwlock_unlock(&namespaceLock);
+    schedule_db_save();
+    reply_err(request, 0);
+}
+
+static void ll_unlink(fuse_req_t request, fuse_ino_t parent, const char *name) {
+    debugPrint("ll_unlink %s", name);
+    remove_child(request, parent, name, ItemTypeFile);
+}
+
+static void ll_rmdir(fuse_req_t request, fuse_ino_t parent, const char *name) {
+    debugPrint("ll_rmdir %s", name);
+    remove_child(request, parent, name, ItemTypeDir);
+}
+
+static void ll_rename(fuse_req_t request, fuse_ino_t parent, const char *name, fuse_ino_t newParent, const char *newName, unsigned int flags) {
+    debugPrint("ll_rename %s -> %s", name, newName);
+    if (flags) {
+        reply_err(request, EINVAL);
+        return;
+    }
+    if (is_stats_entry(parent, name) || is_stats_entry(newParent, newName)) {
+        reply_err(request, EPERM);
+        return;
+    }
+
+    Item *parentItem = item_for_inode(request, parent);
+    if (parentItem == NULL) {
+        return;
+    }
+    Item *newParentItem = item_for_inode(request, newParent);
+    if (newParentItem == NULL) {
+        return;
+    }
+
+    char sourcePath[PATH_MAX_LENGTH];
+    char destinationPath[PATH_MAX_LENGTH];
+    if (!child_path(parentItem, name, sourcePath) || !child_path(newParentItem, newName, destinationPath)) {
+        reply_err(request, ENAMETOOLONG);
+        return;
+    }
+
+    Item *sourceItem = search_item_path(secfs->indexDB, sourcePath);
+    if (sourceItem == NULL) {
+        reply_err(request, ENOENT);
+        return;
+    }
+    Item *destinationItem = search_item_path(secfs->indexDB, destinationPath);
+    if (destinationItem == sourceItem) {
+        reply_err(request, 0);
+        return;
+    }
+    if (destinationItem != NULL && destinationItem->type == ItemTypeDir && sourceItem->type == ItemTypeFile) {
+        // Trying to rename file into folder
+        reply_err(request, EISDIR);
+        return;
+    }
+    if (destinationItem != NULL && destinationItem->type == ItemTypeFile && sourceItem->type == ItemTypeDir) {
+        // Trying to rename folder into existing file
+        reply_err(request, ENOTDIR);
+        return;
+    }
+    if (destinationItem != NULL && destinationItem->type == ItemTypeDir && has_children(destinationItem)) {
+        reply_err(request, ENOTEMPTY);
+        return;
+    }
+
+    // Inodes refer to items, so nothing below a renamed directory changes for the kernel
+    pthread_rwlock_wrlock(&namespaceLock);
+    if (destinationItem != NULL) {
+        delete_item(destinationItem);
+    }
+    LOCK_DB;
+    rename_item(secfs, sourceItem, destinationPath);
+    UNLOCK_DB;
+    pthread_rwlock_unlock(&namespaceLock);
+
+    schedule_db_save();
+    reply_err(request, 0);
+}
+
+static void ll_open(fuse_req_t request, fuse_ino_t ino, struct fuse_file_info *fi) {
+    debugPrint("ll_open %d", ino);
+    if (ino == STATS_INO) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            reply_err(request, EACCES);
+            return;
+        }
+        // Every open reads a consistent report
+        ByteArray *report = ALLOC(ByteArray);
+        *report = stats_report();
+        fi->fh = (uint64_t)(uintptr_t)report;
+        fi->direct_io = 1;
+        fuse_reply_open(request, fi);
+        return;
+    }
+    Inode *inode = find_inode(ino);
+    if (inode == NULL || inode->item == NULL) {
+        reply_err(request, ENOENT);
+        return;
+    }
+    if (inode->item->type == ItemTypeDir) {
+        reply_err(request, EISDIR);
+        return;
+    }
+    inode->opens++;
+    open_policy(inode->item, fi);
+    fuse_reply_open(request, fi);
+}
+
+static void ll_release(fuse_req_t request, fuse_ino_t ino, struct fuse_file_info *fi) {
+    debugPrint("ll_release %d", ino);
+    if (ino == STATS_INO) {
+        ByteArray *report = (ByteArray*)(uintptr_t)fi->fh;
+        free(report->bytes);
+        free(report);
+        reply_err(request, 0);
+        return;
+    }
+    Inode *inode = find_inode(ino);
+    if (inode != NULL) {
+        inode->opens -= MIN(inode->opens, 1);
+        release_inode_if_unused(inode);
+    }
+    reply_err(request, 0);
+}
+
+static void ll_read(fuse_req_t request, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    debugPrint("ll_read %d (size=%d, offset=%d)", ino, size, offset);
+    if (ino == STATS_INO) {
+        ByteArray *report = (ByteArray*)(uintptr_t)fi->fh;
+        ULong start = MIN((ULong)offset, report->length);
+        fuse_reply_buf(request, (const char*)report->bytes + start, MIN(size, report->length - start));
+        return;
+    }
+    IOJob *job = create_io_job(IOJobRead, request, ino);
+    if (job == NULL) {
+        return;
+    }
+    job->size = size;
+    job->offset = (ULong)offset;
+    enqueue_io(job);
+}
+
+static void ll_write(fuse_req_t request, fuse_ino_t ino, const char *data, size_t size, off_t offset, struct fuse_file_info *fi) {
+    (void)fi;
+    debugPrint("ll_write %d (size=%d, offset=%d)", ino, size, offset);
+    IOJob *job = create_io_job(IOJobWrite, request, ino);
+    if (job == NULL) {
+        return;
+    }
+
+    // The request buffer is only valid until this callback returns. Waiting for the budget holds
+    // back further requests until queued writes are applied.
+    memory_reserve(MemoryDirtyBuffers, size);
+    job->size = size;
+    job->offset = (ULong)offset;
+    job->data = malloc(MAX(size, 1));
+    memcpy(job->data, data, size);
+    enqueue_io(job);
+}
+
+static void ll_fsync(fuse_req_t request, fuse_ino_t ino, int isDataSync, struct fuse_file_info *fi) {
+    (void)fi;
+    debugPrint("ll_fsync %d, isdatasync=%d", ino, isDataSync);
+    if (ino == STATS_INO) {
+        reply_err(request, 0);
+        return;
+    }
+    IOJob *job = create_io_job(IOJobFsync, request, ino);
+    if (job != NULL) {
+        enqueue_io(job);
+    }
+}
+
+static void ll_fallocate(fuse_req_t request, fuse_ino_t ino, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    (void)fi;
+    debugPrint("ll_fallocate %d mode=%d (offset=%d, length=%d)", ino, mode, offset, length);
+    if (ino == STATS_INO) {
+        reply_err(request, EACCES);
+        return;
+    }
+    IOJob *job = create_io_job(IOJobFallocate, request, ino);
+    if (job == NULL) {
+        return;
+    }
+    job->mode = mode;
+    job->size = (ULong)length;
+    job->offset = (ULong)offset;
+    enqueue_io(job);
+}
+
+// Server side copy, whole blocks are cloned by sharing their block files
+static void ll_copy_file_range(fuse_req_t request, fuse_ino_t sourceIno, off_t sourceOffset, struct fuse_file_info *sourceInfo,
+                               fuse_ino_t ino, off_t offset, struct fuse_file_info *fi, size_t size, int flags) {
+    (void)sourceInfo;
+    (void)fi;
+    debugPrint("ll_copy_file_range %d -> %d (size=%d)", sourceIno, ino, size);
+    if (flags) {
+        reply_err(request, EINVAL);
+        return;
+    }
+    if (sourceIno == STATS_INO || ino == STATS_INO) {
+        reply_err(request, EOPNOTSUPP);
+        return;
+    }
+    Inode *source = find_inode(sourceIno);
+    if (source == NULL || source->item == NULL) {
+        reply_err(request, ENOENT);
+        return;
+    }
+    if (source->item->type == ItemTypeDir) {
+        reply_err(request, EISDIR);
+        return;
+    }
+    IOJob *job = create_io_job(IOJobCopy, request, ino);
+    if (job == NULL) {
+        return;
+    }
+    job->source = source;
+    job->sourceOffset = (ULong)sourceOffset;
+    job->size = size;
+    job->offset = (ULong)offset;
+    enqueue_io(job);
+}
+
+static void ll_opendir(fuse_req_t request, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (ino == STATS_INO) {
+        reply_err(request, ENOTDIR);
+        return;
+    }
+    Item *dir = item_for_inode(request, ino);
+    if (dir == NULL) {
+        return;
+    }
+    if (dir->type != ItemTypeDir) {
+        reply_err(request, ENOTDIR);
+        return;
+    }
+
+    // Every child gets its inode now, so the listing can carry attributes
+    ItemArray items = get_dir_items(secfs->indexDB, dir->path);
+    DirHandle *handle = ALLOC(DirHandle);
+    handle->ino = ino;
+    handle->length = items.length;
+    handle->inodes = malloc(sizeof(Inode*) * MAX(items.length, 1));
+    handle->names = malloc(sizeof(String) * MAX(items.length, 1));
+    for (UInt i = 0; i < items.length; i++) {
+        Inode *inode = inode_for_item(items.items[i]);
+        inode->listings++;
+        handle->inodes[i] = inode;
+        handle->names[i] = strdup(strrchr(items.items[i]->path, '/') + 1);
+    }
+    free(items.items);
+
+    fi->fh = (uint64_t)(uintptr_t)handle;
+    fuse_reply_open(request, fi);
+}
+
+// Entries from the offset on which fit into size. The offset of an entry is its position in the
+// listing, "." and ".." first. With plus, the entries carry the attributes and a lookup reference
+// of their inode, so the kernel doesn't ask for them one by one.
+static void reply_dir(fuse_req_t request, DirHandle *handle, size_t size, off_t offset, Bool plus) {
+    char *buffer = malloc(MAX(size, 1));
+    ULong length = 0;
+    for (ULong i = (ULong)offset; i < handle->length + 2; i++) {
+        const char *name;
+        struct fuse_entry_param entry;
+        memset(&entry, 0, sizeof entry);
+        Inode *inode = NULL;
+        if (i < 2) {
+            // The kernel takes no reference to "." and ".."
+            name = i == 0 ? "." : "..";
+            entry.attr.st_ino = i == 0 ? handle->ino : UNKNOWN_INO;
+            entry.attr.st_mode = S_IFDIR;
+        }
+        else {
+            inode = handle->inodes[i - 2];
+            name = handle->names[i - 2];
+            if (inode->item == NULL) {
+                // Deleted since opendir
+                continue;
+            }
+            fill_entry(inode, &entry);
+        }
+
+        ULong entrySize;
+        if (plus) {
+            entrySize = fuse_add_direntry_plus(request, buffer + length, size - length, name, &entry, (off_t)(i + 1));
+        }
+        else {
+            entrySize = fuse_add_direntry(request, buffer + length, size - length, name, &entry.attr, (off_t)(i + 1));
+        }
+        if (entrySize > size - length) {
+            break;
+        }
+        if (plus && inode != NULL) {
+            inode->lookups++;
+        }
+        length += entrySize;
+    }
+    fuse_reply_buf(request, buffer, length);
+    free(buffer);
+}
+
+static void ll_readdir(fuse_req_t request, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    debugPrint("ll_readdir %d", ino);
+    reply_dir(request, (DirHandle*)(uintptr_t)fi->fh, size, offset, false);
+}
+
+static void ll_readdirplus(fuse_req_t request, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi) {
+    debugPrint("ll_readdirplus %d", ino);
+    reply_dir(request, (DirHandle*)(uintptr_t)fi->fh, size, offset, true);
+}
+
+static void ll_releasedir(fuse_req_t request, fuse_ino_t ino, struct fuse_file_info *fi) {
+    (void)ino;
+    DirHandle *handle = (DirHandle*)(uintptr_t)fi->fh;
+    for (UInt i = 0; i < handle->length; i++) {
+        handle->inodes[i]->listings--;
+        release_inode_if_unused(handle->inodes[i]);
+        free(handle->names[i]);
+    }
+    free(handle->inodes);
+    free(handle->names);
+    free(handle);
+    reply_err(request, 0);
+}
+
+static void ll_fsyncdir(fuse_req_t request, fuse_ino_t ino, int isDataSync, struct fuse_file_info *fi) {
+    ll_fsync(request, ino, isDataSync, fi);
+}
+
+static void ll_statfs(fuse_req_t request, fuse_ino_t ino) {
+    (void)ino;
+    struct statvfs stats;
+    if (statvfs(secfs->dataPath, &stats) == ERROR) {
+        reply_err(request, errno);
+        return;
+    }
+    fuse_reply_statfs(request, &stats);
+}
+
+static void ll_access(fuse_req_t request, fuse_ino_t ino, int mask) {
+    if (ino == STATS_INO) {
+        reply_err(request, (mask & (W_OK | X_OK)) ? EACCES : 0);
+        return;
+    }
+    if (item_for_inode(request, ino) == NULL) {
+        return;
+    }
+    reply_err(request, access(secfs->dataPath, mask) == ERROR ? errno : 0);
+}
+
+// Timed and traced entry points of the requests answered on the session thread, the inode (or the
+// parent's for operations on names) is the path id of the trace. Reads, writes and fsyncs are timed until the I/O thread replies.
+// Directories are listed on opendir, which counts as readdir.
+#define TIMED_REQUEST(metric, ino, call) {\
+        ULong start = stats_start();\
+        trace_begin_request(ino);\
+        requestFailed = false;\
+        call;\
+        stats_record((metric), start, 0, requestFailed);\
+        trace_end_request();\
+    }
+
+static void timed_lookup(fuse_req_t request, fuse_ino_t parent, const char *name)
+    TIMED_REQUEST(MetricLookup, parent, ll_lookup(request, parent, name))
+static void timed_getattr(fuse_req_t request, fuse_ino_t ino, struct fuse_file_info *fi)
+    TIMED_REQUEST(MetricGetattr, ino, ll_getattr(request, ino, fi))
+static void timed_setattr(fuse_req_t request, fuse_ino_t ino, struct stat *attributes, int toSet, struct fuse_file_info *fi)
+    TIMED_REQUEST(MetricTruncate, ino, ll_setattr(request, ino, attributes, toSet, fi))
+static void timed_mkdir(fuse_req_t request, fuse_ino_t parent, const char *name, mode_t mode)
+    TIMED_REQUEST(MetricMkdir, parent, ll_mkdir(request, parent, name, mode))
+static void timed_create(fuse_req_t request, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+    TIMED_REQUEST(MetricCreate, parent, ll_create(request, parent, name, mode, fi))
+static void timed_unlink(fuse_req_t request, fuse_ino_t parent, const char *name)
+    TIMED_REQUEST(MetricUnlink, parent, ll_unlink(request, parent, name))
+static void timed_rmdir(fuse_req_t request, fuse_ino_t parent, const char *name)
+    TIMED_REQUEST(MetricRmdir, parent, ll_rmdir(request, parent, name))
+static void timed_rename(fuse_req_t request, fuse_ino_t parent, const char *name, fuse_ino_t newParent, const char *newName, unsigned int flags)
+    TIMED_REQUEST(MetricRename, parent, ll_rename(request, parent, name, newParent, newName, flags))
+static void timed_open(fuse_req_t request, fuse_ino_t ino, struct fuse_file_info *fi)
+    TIMED_REQUEST(MetricOpen, ino, ll_open(request, ino, fi))
+static void timed_release(fuse_req_t request, fuse_ino_t ino, struct fuse_file_info *fi)
+    TIMED_REQUEST(MetricRelease, ino, ll_release(request, ino, fi))
+static void timed_opendir(fuse_req_t request, fuse_ino_t ino, struct fuse_file_info *fi)
+    TIMED_REQUEST(MetricReaddir, ino, ll_opendir(request, ino, fi))
+static void timed_statfs(fuse_req_t request, fuse_ino_t ino)
+    TIMED_REQUEST(MetricStatfs, ino, ll_statfs(request, ino))
+static void timed_access(fuse_req_t request, fuse_ino_t ino, int mask)
+    TIMED_REQUEST(MetricAccess, ino, ll_access(request, ino, mask))
+
+static const struct fuse_lowlevel_ops secfs_ll_operations = {
+    .init            = ll_init,
+    .destroy         = ll_destroy,
+    .lookup          = timed_lookup,
+    .forget          = ll_forget,
+    .forget_multi    = ll_forget_multi,
+    .getattr         = timed_getattr,
+    .setattr         = timed_setattr,
+    .mkdir           = timed_mkdir,
+    .create          = timed_create,
+    .unlink          = timed_unlink,
+    .rmdir           = timed_rmdir,
+    .rename          = timed_rename,
+    .open            = timed_open,
+    .release         = timed_release,
+    .read            = ll_read,
+    .write           = ll_write,
+    .fsync           = ll_fsync,
+    .fallocate       = ll_fallocate,
+    .copy_file_range = ll_copy_file_range,
+    .opendir         = timed_opendir,
+    .readdir         = ll_readdir,
+    .readdirplus     = ll_readdirplus,
+    .releasedir      = ll_releasedir,
+    .fsyncdir        = ll_fsyncdir,
+    .statfs          = timed_statfs,
+    .access          = timed_access,
+};
+
+Int fs_ll_main(Secfs *secfsRef, String mountPath, FsOptions options) {
+    secfs = secfsRef;
+    fsOptions = options;
+    pthread_rwlock_init(&namespaceLock, NULL);
+
+    memset(&inodes, 0, sizeof inodes);
+    grow_inode_table();
+    Item *root = search_item_path(secfs->indexDB, "/");
+    if (root == NULL) {
+        fprintf(stderr, "[ERROR] Secure folder has no root directory\n");
+        return EXIT_FAILURE;
+    }
+    create_inode(root, FUSE_ROOT_ID);
+    inodes.nextIno = FUSE_ROOT_ID + 1;
+
+    String args[1] = { "secfs" };
+    struct fuse_args fuse_args = FUSE_ARGS_INIT(1, args);
+    struct fuse_session *session = fuse_session_new(&fuse_args, &secfs_ll_operations, sizeof secfs_ll_operations, NULL);
+    if (session == NULL) {
+        fuse_opt_free_args(&fuse_args);
+        return EXIT_FAILURE;
+    }
+
+    Int returnCode = EXIT_FAILURE;
+    if (fuse_set_signal_handlers(session) == SUCCESS) {
+        if (fuse_session_mount(session, mountPath) == SUCCESS) {
+            // Metadata requests are answered on this thread, file data on the I/O threads
+            start_io_threads();
+            returnCode = fuse_session_loop(session) == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+            stop_io_threads();
+            fuse_session_unmount(session);
+        }
+        fuse_remove_signal_handlers(session);
+    }
+    fuse_session_destroy(session);
+    fuse_opt_free_args(&fuse_args);
+    return returnCode;
+}
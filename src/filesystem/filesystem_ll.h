@@ -0,0 +1,17 @@
+//
+//  Created by Stasel
+//
+
+#ifndef filesystem_ll_h
+#define filesystem_ll_h
+
+#include "../utilities/utilities.h"
+#include "filesystem.h"
+#include "secfs.h"
+
+// Serves the file system through the FUSE low-level API until it is unmounted.
+// Requests address items by inode number instead of path, file data is read and written
+// on a pool of I/O threads which reply asynchronously.
+Int fs_ll_main(Secfs *secfs, String mountPath, FsOptions options);
+
+#endif /* filesystem_ll_h */
@@ -0,0 +1,441 @@
+//
+//  Created by Stasel
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "fsck.h"
+#include "../db/recordfile.h"
+
+#define UUID_STRING_LENGTH 37
+#define FSCK_PROGRESS_SHARDS 256
+
+typedef struct {
+    uuid_t id;
+    Item *item;
+} ItemById;
+
+// Block files found in the data folder, sorted by id
+typedef struct {
+    uuid_t *ids;
+    atomic_uint *references; // Blocks using the file
+    UInt length;
+    UInt max;
+} DiskBlocks;
+
+typedef struct {
+    Secfs *secfs;
+    FsckOptions options;
+    ItemById *items;
+    UInt itemsLength;
+    DiskBlocks disk;
+    atomic_uint shardsDone;
+    atomic_ullong blocks;
+    atomic_ullong verifiedBytes;
+    atomic_ullong orphanBlocks;    // Blocks of files which don't exist
+    atomic_ullong staleBlocks;     // Blocks past the end of their file, left behind by truncation
+    atomic_ullong missingBlocks;   // Blocks without a block file
+    atomic_ullong corruptBlocks;   // Block files which don't decrypt
+    atomic_ullong duplicateBlocks; // Several blocks for the same offset of a file
+    atomic_ullong shardErrors;
+    atomic_bool changed;
+    pthread_mutex_t outputLock;
+} FsckState;
+
+static void report(FsckState *state, const String format, ...) {
+    pthread_mutex_lock(&state->outputLock);
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+    printf("\n");
+    pthread_mutex_unlock(&state->outputLock);
+}
+
+static Int compare_uuids(const void *a, const void *b) {
+    return uuid_compare(*(const uuid_t*)a, *(const uuid_t*)b);
+}
+
+static Int compare_items_by_id(const void *a, const void *b) {
+    return uuid_compare(((const ItemById*)a)->id, ((const ItemById*)b)->id);
+}
+
+static Int compare_item_paths(const void *a, const void *b) {
+    return strcmp((*(Item* const*)a)->path, (*(Item* const*)b)->path);
+}
+
+static Int compare_blocks_by_position(const void *a, const void *b) {
+    const Block *first = *(Block* const*)a;
+    const Block *second = *(Block* const*)b;
+    Int result = uuid_compare(first->fileId, second->fileId);
+    if (result != 0) {
+        return result;
+    }
+    return first->index < second->index ? -1 : first->index > second->index;
+}
+
+static Item* find_item(FsckState *state, uuid_t id) {
+    ItemById key;
+    uuid_copy(key.id, id);
+    ItemById *found = bsearch(&key, state->items, state->itemsLength, sizeof(ItemById), compare_items_by_id);
+    return found ? found->item : NULL;
+}
+
+static Int find_disk_block(FsckState *state, uuid_t id) {
+    uuid_t *found = bsearch(id, state->disk.ids, state->disk.length, sizeof(uuid_t), compare_uuids);
+    return found ? (Int)(found - state->disk.ids) : ERROR;
+}
+
+// Collects the block files and removes temporary files of interrupted writes
+static Error scan_directory(FsckState *state, const String path, Bool blockFiles, ULong *staleTempFiles) {
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return errno == ENOENT ? NULL : strerror(errno);
+    }
+
+    ULong suffixLength = strlen(RECORD_FILE_TEMP_SUFFIX);
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        ULong nameLength = strlen(entry->d_name);
+        uuid_t id;
+        if (blockFiles && nameLength == UUID_STRING_LENGTH - 1 && uuid_parse(entry->d_name, id) == SUCCESS) {
+            DiskBlocks *disk = &state->disk;
+            if (disk->length >= disk->max) {
+                disk->max = MAX(disk->max * 2, 1024);
+                disk->ids = realloc(disk->ids, sizeof(uuid_t) * disk->max);
+            }
+            uuid_copy(disk->ids[disk->length++], id);
+        }
+        else if (nameLength > suffixLength && strcmp(entry->d_name + nameLength - suffixLength, RECORD_FILE_TEMP_SUFFIX) == 0) {
+            (*staleTempFiles)++;
+            if (state->options.repair) {
+                char tempPath[PATH_MAX_LENGTH + sizeof entry->d_name];
+                snprintf(tempPath, sizeof tempPath, "%s%s", path, entry->d_name);
+                unlink(tempPath);
+            }
+        }
+    }
+    closedir(dir);
+    return NULL;
+}
+
+static ULong check_index(FsckState *state) {
+    IndexDB *indexDB = state->secfs->indexDB;
+    ULong problems = 0;
+
+    Item **byPath = malloc(sizeof(Item*) * MAX(indexDB->length, 1));
+    memcpy(byPath, indexDB->items, sizeof(Item*) * indexDB->length);
+    qsort(byPath, indexDB->length, sizeof(Item*), compare_item_paths);
+
+    if (indexDB->length == 0 || strcmp(byPath[0]->path, "/") != 0) {
+        report(state, "The root directory is missing");
+        problems++;
+    }
+    for (UInt i = 0; i < indexDB->length; i++) {
+        Item *item = byPath[i];
+        if (i > 0 && strcmp(byPath[i - 1]->path, item->path) == 0) {
+            report(state, "Duplicate path %s", item->path);
+            problems++;
+        }
+        if (strcmp(item->path, "/") == 0) {
+            continue;
+        }
+
+        char parentPath[PATH_MAX_LENGTH];
+        strcpy(parentPath, item->path);
+        Item parentKey;
+        strcpy(parentKey.path, dirname(parentPath));
+        Item *parentKeyPointer = &parentKey;
+        Item **parent = bsearch(&parentKeyPointer, byPath, indexDB->length, sizeof(Item*), compare_item_paths);
+        if (parent == NULL || (*parent)->type != ItemTypeDir) {
+            report(state, "%s has no parent directory", item->path);
+            problems++;
+        }
+    }
+    free(byPath);
+    return problems;
+}
+
+// Files shared by cloned files must count every block using them, or deleting one of the files
+// deletes the data of the others
+static ULong check_references(FsckState *state) {
+    BlockDB *blockDB = state->secfs->blockDB;
+    ULong problems = 0;
+    for (UInt i = 0; i < state->disk.length; i++) {
+        UInt counted = MAX(atomic_load(&state->disk.references[i]), 1);
+        if (block_file_references(blockDB, state->disk.ids[i]) != counted) {
+            problems++;
+            if (state->options.repair) {
+                set_block_file_references(blockDB, state->disk.ids[i], counted);
+            }
+        }
+    }
+
+    // Counts of files which are gone
+    ByteArray records = pack_block_references(blockDB);
+    for (UInt i = 0; i < records.length / sizeof(BlockReference); i++) {
+        BlockReference reference;
+        memcpy(&reference, records.bytes + i * sizeof(BlockReference), sizeof reference);
+        if (find_disk_block(state, reference.id) == ERROR) {
+            problems++;
+            if (state->options.repair) {
+                set_block_file_references(blockDB, reference.id, 0);
+            }
+        }
+    }
+    free(records.bytes);
+    if (problems > 0 && state->options.repair) {
+        atomic_store(&state->changed, true);
+    }
+    return problems;
+}
+
+// Removes a block from the database, its file is reclaimed with the unreferenced files
+static void drop_block(FsckState *state, Block *block) {
+    remove_block(state->secfs->blockDB, block);
+    atomic_store(&state->changed, true);
+}
+
+static void check_block(FsckState *state, Block *block) {
+    Secfs *secfs = state->secfs;
+    atomic_fetch_add(&state->blocks, 1);
+    char uuidString[UUID_STRING_LENGTH];
+    uuid_unparse_lower(block->id, uuidString);
+
+    Item *file = find_item(state, block->fileId);
+    Int diskIndex = find_disk_block(state, block->id);
+    if (file == NULL || file->type != ItemTypeFile) {
+        atomic_fetch_add(&state->orphanBlocks, 1);
+        if (state->options.repair) {
+            drop_block(state, block);
+        }
+        else if (diskIndex != ERROR) {
+            atomic_fetch_add(&state->disk.references[diskIndex], 1);
+        }
+        return;
+    }
+    if ((ULong)block->index * BLOCK_SIZE >= file->size) {
+        atomic_fetch_add(&state->staleBlocks, 1);
+        if (state->options.repair) {
+            drop_block(state, block);
+        }
+        else if (diskIndex != ERROR) {
+            atomic_fetch_add(&state->disk.references[diskIndex], 1);
+        }
+        return;
+    }
+    if (diskIndex == ERROR) {
+        atomic_fetch_add(&state->missingBlocks, 1);
+        report(state, "Block %u of %s is missing (%s)%s", block->index, file->path, uuidString, state->options.repair ? ", reads as zeros" : "");
+        if (state->options.repair) {
+            drop_block(state, block);
+        }
+        return;
+    }
+
+    atomic_fetch_add(&state->disk.references[diskIndex], 1);
+    if (state->options.verify) {
+        ReadBlockResult readResult = read_block(secfs, block);
+        if (readResult.error == NULL && readResult.bytes.length > BLOCK_SIZE) {
+            release_block_data(secfs, readResult.bytes);
+            readResult.error = "Block is too large";
+        }
+        if (readResult.error) {
+            atomic_fetch_add(&state->corruptBlocks, 1);
+            report(state, "Block %u of %s is corrupted (%s): %s", block->index, file->path, uuidString, readResult.error);
+        }
+        else {
+            atomic_fetch_add(&state->verifiedBytes, readResult.bytes.length);
+            release_block_data(secfs, readResult.bytes);
+        }
+    }
+}
+
+static void check_shard(UInt shard, void *context) {
+    FsckState *state = context;
+    BlockDB *blockDB = state->secfs->blockDB;
+    BlocksForFileResult blocks = blocks_in_shard(blockDB, shard);
+    if (blocks.error) {
+        atomic_fetch_add(&state->shardErrors, 1);
+        report(state, "Couldn't load block shard %03x: %s", shard, blocks.error);
+        release_blocks(blockDB, blocks);
+        return;
+    }
+
+    // Only one block may exist per offset of a file, which one is current is unknown
+    qsort(blocks.blocks, blocks.length, sizeof(Block*), compare_blocks_by_position);
+    for (UInt i = 1; i < blocks.length; i++) {
+        if (compare_blocks_by_position(&blocks.blocks[i - 1], &blocks.blocks[i]) == 0) {
+            atomic_fetch_add(&state->duplicateBlocks, 1);
+            Item *file = find_item(state, blocks.blocks[i]->fileId);
+            report(state, "Block %u of %s exists more than once", blocks.blocks[i]->index, file ? file->path : "a deleted file");
+        }
+    }
+
+    for (UInt i = 0; i < blocks.length; i++) {
+        check_block(state, blocks.blocks[i]);
+    }
+    release_blocks(blockDB, blocks);
+
+    UInt done = atomic_fetch_add(&state->shardsDone, 1) + 1;
+    if (done % FSCK_PROGRESS_SHARDS == 0 && isatty(STDERR_FILENO)) {
+        pthread_mutex_lock(&state->outputLock);
+        fprintf(stderr, "Checked %u of %u shards\n", done, BLOCK_SHARD_COUNT);
+        pthread_mutex_unlock(&state->outputLock);
+    }
+}
+
+static void free_fsck_state(FsckState *state) {
+    free(state->items);
+    free(state->disk.ids);
+    free(state->disk.references);
+    pthread_mutex_destroy(&state->outputLock);
+    free(state);
+}
+
+Int fsck_secfs(Secfs *secfs, FsckOptions options) {
+    ULong start = monotonicNanos();
+    FsckState *state = calloc(1, sizeof(FsckState));
+    state->secfs = secfs;
+    state->options = options;
+    pthread_mutex_init(&state->outputLock, NULL);
+
+    // Items by id for the block checks
+    IndexDB *indexDB = secfs->indexDB;
+    state->items = malloc(sizeof(ItemById) * MAX(indexDB->length, 1));
+    state->itemsLength = indexDB->length;
+    for (UInt i = 0; i < indexDB->length; i++) {
+        uuid_copy(state->items[i].id, indexDB->items[i]->id);
+        state->items[i].item = indexDB->items[i];
+    }
+    qsort(state->items, state->itemsLength, sizeof(ItemById), compare_items_by_id);
+    ULong indexProblems = check_index(state);
+
+    ULong staleTempFiles = 0;
+    char shardsPath[PATH_MAX_LENGTH];
+    snprintf(shardsPath, sizeof shardsPath, "%s%s", secfs->dataPath, BLOCK_SHARDS_DIR_NAME);
+    Error error = scan_directory(state, shardsPath, false, &staleTempFiles);
+
+    // Both layouts while block files are migrated, a file moved in between shows up in either
+    UInt layouts[2] = { secfs->header.blockFanOut, secfs->header.previousBlockFanOut };
+    UInt layoutCount = layouts[0] == layouts[1] ? 1 : 2;
+    for (UInt layout = 0; layout < layoutCount && error == NULL; layout++) {
+        for (UInt directory = 0; directory < block_directory_count(layouts[layout]) && error == NULL; directory++) {
+            char directoryPath[PATH_MAX_LENGTH];
+            block_directory_path(secfs, layouts[layout], directory, directoryPath);
+            error = scan_directory(state, directoryPath, true, &staleTempFiles);
+        }
+    }
+    if (error) {
+        fprintf(stderr, "[ERROR] Couldn't list %s: %s\n", secfs->dataPath, error);
+        free_fsck_state(state);
+        return FSCK_FAILED;
+    }
+    qsort(state->disk.ids, state->disk.length, sizeof(uuid_t), compare_uuids);
+    
+    // A file is linked in both layouts while it's moved, it's still a single block file
+    UInt uniqueLength = 0;
+    for (UInt i = 0; i < state->disk.length; i++) {
+        if (uniqueLength == 0 || uuid_compare(state->disk.ids[uniqueLength - 1], state->disk.ids[i]) != 0) {
+            uuid_copy(state->disk.ids[uniqueLength++], state->disk.ids[i]);
+        }
+    }
+    state->disk.length = uniqueLength;
+    state->disk.references = calloc(MAX(state->disk.length, 1), sizeof(atomic_uint));
+
+    // Shards are independent, each is loaded, checked and released by one thread
+    parallelFor(BLOCK_SHARD_COUNT, options.threads, check_shard, state);
+    ULong wrongReferences = check_references(state);
+
+    // Write the repaired databases before deleting anything they referred to
+    Bool changed = atomic_load(&state->changed);
+    if (options.repair) {
+        error = archive_secfs(secfs);
+        if (error) {
+            fprintf(stderr, "[ERROR] Couldn't write the databases: %s\n", error);
+            free_fsck_state(state);
+            return FSCK_FAILED;
+        }
+    }
+
+    // Files of deleted files which are still queued aren't a problem, a repair deletes them right away
+    UInt queuedLength = secfs->reclaim.queuedLength - secfs->reclaim.queuedStart;
+    uuid_t *queued = secfs->reclaim.queued + secfs->reclaim.queuedStart;
+    qsort(queued, queuedLength, sizeof(uuid_t), compare_uuids);
+    ULong queuedFiles = 0;
+    ULong queuedBytes = 0;
+
+    ULong orphanFiles = 0;
+    ULong orphanBytes = 0;
+    for (UInt i = 0; i < state->disk.length; i++) {
+        if (atomic_load(&state->disk.references[i]) > 0) {
+            continue;
+        }
+        char blockPath[PATH_MAX_LENGTH];
+        struct stat stats;
+        Bool found = find_block_file(secfs, state->disk.ids[i], blockPath);
+        ULong size = found && stat(blockPath, &stats) == SUCCESS ? (ULong)stats.st_size : 0;
+        if (bsearch(state->disk.ids[i], queued, queuedLength, sizeof(uuid_t), compare_uuids) != NULL) {
+            queuedFiles++;
+            queuedBytes += size;
+            continue;
+        }
+        orphanBytes += size;
+        orphanFiles++;
+        
+        // Every link of the file, in either layout
+        while (options.repair && found) {
+            if (unlink(blockPath) == ERROR) {
+                fprintf(stderr, "[Warning] Couldn't delete %s: %s\n", blockPath, strerror(errno));
+                break;
+            }
+            found = find_block_file(secfs, state->disk.ids[i], blockPath);
+        }
+    }
+
+    if (options.repair && queuedLength > 0) {
+        reclaim_blocks(secfs, queuedLength);
+    }
+
+    ULong repairable = atomic_load(&state->orphanBlocks) + atomic_load(&state->staleBlocks) + atomic_load(&state->missingBlocks) + orphanFiles + staleTempFiles + wrongReferences;
+    ULong unrepairable = atomic_load(&state->corruptBlocks) + atomic_load(&state->duplicateBlocks) + atomic_load(&state->shardErrors) + indexProblems;
+    double seconds = (double)(monotonicNanos() - start) / 1e9;
+
+    printf("\n%u items, %llu blocks, %.1f MB verified in %.1f s (%.1f MB/s)\n", indexDB->length,
+           (unsigned long long)atomic_load(&state->blocks), (double)atomic_load(&state->verifiedBytes) / (1024.0 * 1024.0), seconds,
+           (double)atomic_load(&state->verifiedBytes) / (1024.0 * 1024.0) / MAX(seconds, 1e-9));
+    printf("Blocks of deleted files:     %llu\n", (unsigned long long)atomic_load(&state->orphanBlocks));
+    printf("Blocks past end of file:     %llu\n", (unsigned long long)atomic_load(&state->staleBlocks));
+    printf("Missing block files:         %llu\n", (unsigned long long)atomic_load(&state->missingBlocks));
+    printf("Corrupted blocks:            %llu\n", (unsigned long long)atomic_load(&state->corruptBlocks));
+    printf("Duplicate blocks:            %llu\n", (unsigned long long)atomic_load(&state->duplicateBlocks));
+    printf("Wrong reference counts:      %llu\n", (unsigned long long)wrongReferences);
+    printf("Unreferenced block files:    %llu (%.1f MB)\n", (unsigned long long)orphanFiles, (double)orphanBytes / (1024.0 * 1024.0));
+    printf("Interrupted writes:          %llu\n", (unsigned long long)staleTempFiles);
+    printf("Queued for deletion:         %llu (%.1f MB)\n", (unsigned long long)queuedFiles, (double)queuedBytes / (1024.0 * 1024.0));
+    printf("Index problems:              %llu\n", (unsigned long long)indexProblems);
+    if (options.repair && (changed || orphanFiles > 0 || staleTempFiles > 0)) {
+        printf("Reclaimed %.1f MB and rewrote the databases\n", (double)orphanBytes / (1024.0 * 1024.0));
+    }
+    else if (!options.repair && repairable > 0) {
+        printf("Run with --repair to fix what can be fixed\n");
+    }
+
+    free_fsck_state(state);
+
+    if (unrepairable > 0) {
+        return FSCK_UNREPAIRED;
+    }
+    if (repairable > 0) {
+        return options.repair ? FSCK_REPAIRED : FSCK_UNREPAIRED;
+    }
+    return FSCK_OK;
+}
@@ -0,0 +1,27 @@
+//
+//  Created by Stasel
+//
+
+#ifndef fsck_h
+#define fsck_h
+
+#include "../utilities/utilities.h"
+#include "secfs.h"
+
+// Exit codes, following fsck(8)
+#define FSCK_OK 0
+#define FSCK_REPAIRED 1
+#define FSCK_UNREPAIRED 4
+#define FSCK_FAILED 8
+
+typedef struct {
+    Bool repair; // Reclaim orphans and rewrite the databases, otherwise only report
+    Bool verify; // Read and decrypt every block
+    UInt threads;
+} FsckOptions;
+
+// Cross-checks the index, the block database and the block files of an unmounted secure folder.
+// Shards are checked in parallel, so verification is bound by disk bandwidth on enough cores.
+Int fsck_secfs(Secfs *secfs, FsckOptions options);
+
+#endif /* fsck_h */
@@ -6,8 +6,16 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include "secfs.h"
 #include "../security/encryption.h"
+#include "../db/recordfile.h"
+#include "../utilities/stats.h"
+#include "../utilities/trace.h"
+#include "../utilities/memory.h"
 
 #define UUID_STRING_LENGTH 37
 #define INIT_HANDLE_ERROR(err)    if ((err)) {\
@@ -17,48 +25,720 @@
         return result;\
     }
 
-Error archive_secfs(Secfs *secfs) {
-    char indexDBPath[PATH_MAX_LENGTH];
-    char blockDBPath[PATH_MAX_LENGTH];
-    snprintf(indexDBPath, sizeof blockDBPath, "%s%s", secfs->dataPath, INDEX_DB_NAME);
-    snprintf(blockDBPath, sizeof blockDBPath, "%s%s", secfs->dataPath, BLOCK_DB_NAME);
-    
-    debugPrint("Archive secdb to %s", secfs->dataPath);
-    Error error = archive_indexDB(indexDBPath, secfs->indexDB, secfs->key, secfs->iv);
+// The index switches to the new data key before the first shard does
+static ByteArray index_key(Secfs *secfs) {
+    return secfs->keys->rotating && !secfs->keys->indexRotated ? secfs->previousKey : secfs->key;
+}
+
+static pthread_rwlock_t* key_lock(Secfs *secfs, uuid_t fileId) {
+    return &secfs->keyLocks[shard_index(fileId) % KEY_LOCK_STRIPES];
+}
+
+void lock_archives(Secfs *secfs) {
+    pthread_mutex_lock(&secfs->archiveLock);
+}
+
+void unlock_archives(Secfs *secfs) {
+    pthread_mutex_unlock(&secfs->archiveLock);
+}
+
+// MARK: - Block files
+
+UInt block_directory_count(UInt fanOut) {
+    return 1U << (8 * fanOut);
+}
+
+void block_directory_path(Secfs *secfs, UInt fanOut, UInt directory, char *path) {
+    ULong length = (ULong)snprintf(path, PATH_MAX_LENGTH, "%s", secfs->dataPath);
+    for (UInt level = 0; level < fanOut && length < PATH_MAX_LENGTH; level++) {
+        UInt byte = (directory >> (8 * (fanOut - 1 - level))) & 0xff;
+        length += (ULong)snprintf(path + length, PATH_MAX_LENGTH - length, "%02x/", byte);
+    }
+}
+
+static UInt block_directory_of(const uuid_t id, UInt fanOut) {
+    UInt directory = 0;
+    for (UInt level = 0; level < fanOut; level++) {
+        directory = directory << 8 | id[level];
+    }
+    return directory;
+}
+
+static void block_file_path(Secfs *secfs, const uuid_t id, UInt fanOut, char *path) {
+    char uuidString[UUID_STRING_LENGTH];
+    uuid_unparse_lower(id, uuidString);
+    block_directory_path(secfs, fanOut, block_directory_of(id, fanOut), path);
+    ULong length = strlen(path);
+    snprintf(path + length, PATH_MAX_LENGTH - length, "%s", uuidString);
+}
+
+Bool find_block_file(Secfs *secfs, const uuid_t id, char *path) {
+    block_file_path(secfs, id, secfs->header.blockFanOut, path);
+    if (isFileExists(path) || !atomic_load(&secfs->blockMigration)) {
+        return isFileExists(path);
+    }
+    block_file_path(secfs, id, secfs->header.previousBlockFanOut, path);
+    if (isFileExists(path)) {
+        return true;
+    }
+    // Moved to the current layout in between
+    block_file_path(secfs, id, secfs->header.blockFanOut, path);
+    return isFileExists(path);
+}
+
+static void init_block_directories(Secfs *secfs) {
+    secfs->blockDirectories = calloc(block_directory_count(secfs->header.blockFanOut), sizeof(atomic_bool));
+    atomic_init(&secfs->blockMigration, secfs->header.previousBlockFanOut != secfs->header.blockFanOut);
+}
+
+// Directories of the current layout are created the first time a block goes into them
+static Error create_block_directory(Secfs *secfs, const uuid_t id) {
+    UInt fanOut = secfs->header.blockFanOut;
+    UInt directory = block_directory_of(id, fanOut);
+    if (fanOut == 0 || atomic_load_explicit(&secfs->blockDirectories[directory], memory_order_acquire)) {
+        return NULL;
+    }
+    char path[PATH_MAX_LENGTH];
+    block_directory_path(secfs, fanOut, directory, path);
+    for (ULong i = strlen(secfs->dataPath); path[i] != '\0'; i++) {
+        if (path[i] != '/') {
+            continue;
+        }
+        path[i] = '\0';
+        Int result = mkdir(path, 0755);
+        path[i] = '/';
+        if (result == ERROR && errno != EEXIST) {
+            return strerror(errno);
+        }
+    }
+    atomic_store_explicit(&secfs->blockDirectories[directory], true, memory_order_release);
+    return NULL;
+}
+
+// A file in the previous layout goes first, so a file moved in between is deleted in the current one
+static Error delete_block_file(Secfs *secfs, const uuid_t id) {
+    char blockPath[PATH_MAX_LENGTH];
+    Bool deleted = false;
+    if (atomic_load(&secfs->blockMigration)) {
+        block_file_path(secfs, id, secfs->header.previousBlockFanOut, blockPath);
+        deleted = unlink(blockPath) == SUCCESS;
+    }
+    block_file_path(secfs, id, secfs->header.blockFanOut, blockPath);
+    debugPrint("Deleting block %s from disk", blockPath);
+    if (unlink(blockPath) == SUCCESS || deleted) {
+        return NULL;
+    }
+    return strerror(errno);
+}
+
+static Error write_volume_header(Secfs *secfs, VolumeHeader header) {
+    char headerFilePath[PATH_MAX_LENGTH];
+    snprintf(headerFilePath, sizeof headerFilePath, "%s%s", secfs->dataPath, VOLUME_HEADER_FILE_NAME);
+    ByteArray headerBytes = { (Byte*)&header, sizeof(VolumeHeader) };
+    return writeFileAtomically(headerFilePath, headerBytes).error;
+}
+
+Error start_block_migration(Secfs *secfs, UInt fanOut) {
+    if (fanOut > BLOCK_FAN_OUT_MAX) {
+        return "Unsupported number of block directory levels";
+    }
+    VolumeHeader header = secfs->header;
+    header.version = VOLUME_HEADER_VERSION;
+    header.previousBlockFanOut = header.blockFanOut;
+    header.blockFanOut = fanOut;
+    Error error = write_volume_header(secfs, header);
     if (error) {
         return error;
     }
-    
-    error = archive_blockDB(blockDBPath, secfs->blockDB, secfs->key, secfs->iv);
+    secfs->header = header;
+    free(secfs->blockDirectories);
+    init_block_directories(secfs);
+    return NULL;
+}
+
+Error migrate_block_directory(Secfs *secfs, UInt directory, UInt max, UInt *moved) {
+    UInt previous = secfs->header.previousBlockFanOut;
+    char directoryPath[PATH_MAX_LENGTH];
+    block_directory_path(secfs, previous, directory, directoryPath);
+    *moved = 0;
+    DIR *dir = opendir(directoryPath);
+    if (dir == NULL) {
+        return errno == ENOENT ? NULL : strerror(errno);
+    }
+
+    Error error = NULL;
+    struct dirent *entry;
+    while (error == NULL && *moved < max && (entry = readdir(dir)) != NULL) {
+        uuid_t id;
+        if (strlen(entry->d_name) != UUID_STRING_LENGTH - 1 || uuid_parse(entry->d_name, id) != SUCCESS) {
+            continue;
+        }
+        char oldPath[PATH_MAX_LENGTH];
+        char newPath[PATH_MAX_LENGTH];
+        block_file_path(secfs, id, previous, oldPath);
+        block_file_path(secfs, id, secfs->header.blockFanOut, newPath);
+
+        // Unlike a rename, a link never replaces the file of a write to the current layout, the older copy just goes
+        error = create_block_directory(secfs, id);
+        if (error == NULL && link(oldPath, newPath) == ERROR && errno != EEXIST && errno != ENOENT) {
+            error = strerror(errno);
+        }
+        if (error == NULL && unlink(oldPath) == ERROR && errno != ENOENT) {
+            error = strerror(errno);
+        }
+        (*moved)++;
+    }
+    closedir(dir);
+
+    // Directories deeper than the current layout go once they're empty, the parent with its last child
+    if (error == NULL && *moved < max) {
+        for (UInt level = previous; level > secfs->header.blockFanOut; level--) {
+            char path[PATH_MAX_LENGTH];
+            block_directory_path(secfs, level, directory >> (8 * (previous - level)), path);
+            rmdir(path);
+        }
+    }
+    return error;
+}
+
+Error finish_block_migration(Secfs *secfs) {
+    VolumeHeader header = secfs->header;
+    header.previousBlockFanOut = header.blockFanOut;
+    Error error = write_volume_header(secfs, header);
     if (error) {
         return error;
     }
-    
+    atomic_store(&secfs->blockMigration, false);
+    secfs->header.previousBlockFanOut = header.blockFanOut;
     return NULL;
 }
 
+// MARK: - Reclaim queue
+
+static void append_block_id(uuid_t **ids, UInt *length, UInt *max, const uuid_t id) {
+    if (*length >= *max) {
+        *max = MAX(*max * 2, 64);
+        *ids = realloc(*ids, sizeof(uuid_t) * *max);
+    }
+    uuid_copy((*ids)[(*length)++], id);
+}
+
+static void init_reclaim_queue(ReclaimQueue *queue) {
+    memset(queue, 0, sizeof(ReclaimQueue));
+    pthread_mutex_init(&queue->lock, NULL);
+}
+
+static Error load_reclaim_queue(ReclaimQueue *queue, const String dataPath) {
+    char reclaimPath[PATH_MAX_LENGTH];
+    snprintf(reclaimPath, sizeof reclaimPath, "%s%s", dataPath, RECLAIM_QUEUE_NAME);
+    if (!isFileExists(reclaimPath)) {
+        return NULL;
+    }
+    ReadFileResult readResult = readFile(reclaimPath);
+    if (readResult.error) {
+        return readResult.error;
+    }
+    UInt count = (UInt)(readResult.contents.length / sizeof(uuid_t));
+    for (UInt i = 0; i < count; i++) {
+        append_block_id(&queue->queued, &queue->queuedLength, &queue->queuedMax, readResult.contents.bytes + i * sizeof(uuid_t));
+    }
+
+    // An append torn by a crash would shift every entry appended after it
+    Error error = NULL;
+    if (readResult.contents.length % sizeof(uuid_t) != 0) {
+        readResult.contents.length = count * sizeof(uuid_t);
+        error = writeFileAtomically(reclaimPath, readResult.contents).error;
+    }
+    free(readResult.contents.bytes);
+    return error;
+}
+
+// With the reclaim lock held. Entries are durable before any of their files is deleted.
+static Error append_reclaim_file(Secfs *secfs, uuid_t *ids, UInt count) {
+    char reclaimPath[PATH_MAX_LENGTH];
+    snprintf(reclaimPath, sizeof reclaimPath, "%s%s", secfs->dataPath, RECLAIM_QUEUE_NAME);
+    Int fd = open(reclaimPath, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd == ERROR) {
+        return strerror(errno);
+    }
+
+    Error error = NULL;
+    struct stat stats;
+    ULong length = (ULong)count * sizeof(uuid_t);
+    if (fstat(fd, &stats) == ERROR) {
+        error = strerror(errno);
+    }
+    else {
+        ssize_t written = write(fd, ids, length);
+        if (written == ERROR || (ULong)written != length || fsync(fd) == ERROR) {
+            error = written == ERROR || (ULong)written == length ? strerror(errno) : "Short write";
+            // The next append starts at a whole entry again
+            if (ftruncate(fd, stats.st_size) == ERROR) {
+                debugPrint("[Warning] couldn't truncate %s: %s", reclaimPath, strerror(errno));
+            }
+        }
+    }
+    close(fd);
+    return error;
+}
+
+// Blocks of a failed archive stay released and go with the next one
+static Error queue_released_blocks(Secfs *secfs, SecfsSnapshot snapshot, Bool archived) {
+    if (snapshot.releasedLength == 0) {
+        return NULL;
+    }
+    ReclaimQueue *queue = &secfs->reclaim;
+    pthread_mutex_lock(&queue->lock);
+    Error error = archived ? append_reclaim_file(secfs, snapshot.released, snapshot.releasedLength) : NULL;
+    Bool queued = archived && error == NULL;
+    for (UInt i = 0; i < snapshot.releasedLength; i++) {
+        if (queued) {
+            append_block_id(&queue->queued, &queue->queuedLength, &queue->queuedMax, snapshot.released[i]);
+        }
+        else {
+            append_block_id(&queue->released, &queue->releasedLength, &queue->releasedMax, snapshot.released[i]);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return error;
+}
+
+// With the reclaim lock held. Drops the file once everything is deleted, and the deleted entries
+// before the rest when they're the bulk of it.
+static void compact_reclaim_queue(Secfs *secfs) {
+    ReclaimQueue *queue = &secfs->reclaim;
+    char reclaimPath[PATH_MAX_LENGTH];
+    snprintf(reclaimPath, sizeof reclaimPath, "%s%s", secfs->dataPath, RECLAIM_QUEUE_NAME);
+    if (queue->queuedStart == queue->queuedLength) {
+        if (queue->queuedLength > 0 && unlink(reclaimPath) == ERROR && errno != ENOENT) {
+            debugPrint("[Warning] couldn't delete %s: %s", reclaimPath, strerror(errno));
+        }
+        queue->queuedStart = 0;
+        queue->queuedLength = 0;
+        return;
+    }
+    if (queue->queuedStart < RECLAIM_COMPACT_BLOCKS || queue->queuedStart * 2 < queue->queuedLength) {
+        return;
+    }
+    UInt remaining = queue->queuedLength - queue->queuedStart;
+    ByteArray contents = { (Byte*)(queue->queued + queue->queuedStart), (ULong)remaining * sizeof(uuid_t) };
+    if (writeFileAtomically(reclaimPath, contents).error == NULL) {
+        memmove(queue->queued, queue->queued + queue->queuedStart, sizeof(uuid_t) * remaining);
+        queue->queuedStart = 0;
+        queue->queuedLength = remaining;
+    }
+}
+
+UInt reclaim_blocks(Secfs *secfs, UInt max) {
+    ReclaimQueue *queue = &secfs->reclaim;
+    pthread_mutex_lock(&queue->lock);
+    UInt count = MIN(max, queue->queuedLength - queue->queuedStart);
+    uuid_t *ids = malloc(sizeof(uuid_t) * MAX(count, 1));
+    memcpy(ids, queue->queued + queue->queuedStart, sizeof(uuid_t) * count);
+    pthread_mutex_unlock(&queue->lock);
+
+    // Files deleted before a crash are still in the file, they're just gone already
+    for (UInt i = 0; i < count; i++) {
+        ULong start = stats_start();
+        Error error = delete_block_file(secfs, ids[i]);
+        Bool failed = error != NULL && errno != ENOENT;
+        stats_record(MetricBlockDelete, start, 0, failed);
+        if (failed) {
+            debugPrint("[Warning] couldn't delete a block file: %s", error);
+        }
+    }
+    free(ids);
+
+    // Only one thread deletes, nobody else moved the start meanwhile
+    pthread_mutex_lock(&queue->lock);
+    queue->queuedStart += count;
+    compact_reclaim_queue(secfs);
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+UInt reclaim_queue_length(Secfs *secfs) {
+    pthread_mutex_lock(&secfs->reclaim.lock);
+    UInt length = secfs->reclaim.queuedLength - secfs->reclaim.queuedStart;
+    pthread_mutex_unlock(&secfs->reclaim.lock);
+    return length;
+}
+
+// Writes change the size of a file without the database lock, so items are copied whole
+ByteArray snapshot_secfs_index(Secfs *secfs) {
+    pthread_mutex_lock(&secfs->sizeLock);
+    ByteArray records = snapshot_indexDB(secfs->indexDB);
+    pthread_mutex_unlock(&secfs->sizeLock);
+    return records;
+}
+
+static void set_item_size(Secfs *secfs, Item *file, ULong size) {
+    pthread_mutex_lock(&secfs->sizeLock);
+    file->size = size;
+    pthread_mutex_unlock(&secfs->sizeLock);
+}
+
+static void grow_item_size(Secfs *secfs, Item *file, ULong size) {
+    pthread_mutex_lock(&secfs->sizeLock);
+    file->size = MAX(file->size, size);
+    pthread_mutex_unlock(&secfs->sizeLock);
+}
+
+SecfsSnapshot snapshot_secfs(Secfs *secfs) {
+    SecfsSnapshot snapshot;
+    
+    // Blocks are removed before their files are released, punching holes doesn't hold the database
+    // lock: every released file is taken before the blocks, so the snapshot no longer refers to it
+    pthread_mutex_lock(&secfs->reclaim.lock);
+    snapshot.released = secfs->reclaim.released;
+    snapshot.releasedLength = secfs->reclaim.releasedLength;
+    secfs->reclaim.released = NULL;
+    secfs->reclaim.releasedLength = 0;
+    secfs->reclaim.releasedMax = 0;
+    pthread_mutex_unlock(&secfs->reclaim.lock);
+    snapshot.indexRecords = snapshot_secfs_index(secfs);
+    snapshot.blocks = snapshot_blockDB(secfs->blockDB);
+    return snapshot;
+}
+
+Error archive_secfs_snapshot(Secfs *secfs, SecfsSnapshot snapshot) {
+    char indexDBPath[PATH_MAX_LENGTH];
+    char legacyBlockDBPath[PATH_MAX_LENGTH];
+    char referencesPath[PATH_MAX_LENGTH];
+    snprintf(indexDBPath, sizeof indexDBPath, "%s%s", secfs->dataPath, INDEX_DB_NAME);
+    snprintf(legacyBlockDBPath, sizeof legacyBlockDBPath, "%s%s", secfs->dataPath, BLOCK_DB_NAME);
+    snprintf(referencesPath, sizeof referencesPath, "%s%s", secfs->dataPath, BLOCK_REFERENCES_NAME);
+    
+    debugPrint("Archive secdb to %s", secfs->dataPath);
+    ULong start = stats_start();
+    lock_archives(secfs);
+    
+    // Blocks go first, a crash in between leaves unreferenced blocks rather than files missing their blocks
+    Error error = archive_blockDB_snapshot(secfs->blockDB, snapshot.blocks);
+    
+    // All shards are written, the single file database is no longer needed
+    if (error == NULL && isFileExists(legacyBlockDBPath) && unlink(legacyBlockDBPath) == ERROR) {
+        error = strerror(errno);
+    }
+    
+    // Reference counts share the key of the index, so a key rotation switches them together
+    if (error == NULL) {
+        error = archive_block_references(secfs->blockDB, snapshot.blocks, referencesPath, index_key(secfs));
+    }
+    if (error == NULL) {
+        error = archive_records(indexDBPath, snapshot.indexRecords, (Cipher)secfs->header.cipher, index_key(secfs), secfs->iv);
+    }
+    unlock_archives(secfs);
+    stats_record(MetricArchive, start, snapshot.indexRecords.length, error != NULL);
+
+    // The archived databases no longer refer to the released blocks, their files can go
+    Error queueError = queue_released_blocks(secfs, snapshot, error == NULL);
+    return error ? error : queueError;
+}
+
+void free_secfs_snapshot(SecfsSnapshot snapshot) {
+    free(snapshot.indexRecords.bytes);
+    free_blockDB_snapshot(snapshot.blocks);
+    free(snapshot.released);
+}
+
+Error archive_secfs(Secfs *secfs) {
+    SecfsSnapshot snapshot = snapshot_secfs(secfs);
+    Error error = archive_secfs_snapshot(secfs, snapshot);
+    free_secfs_snapshot(snapshot);
+    return error;
+}
+
 Bool is_existing_secfs(String dataPath) {
     // make sure all files exist
     char indexDBPath[PATH_MAX_LENGTH];
     char blockDBPath[PATH_MAX_LENGTH];
+    char legacyBlockDBPath[PATH_MAX_LENGTH];
     char ivFilePath[PATH_MAX_LENGTH];
     char encryptedIVFilePath[PATH_MAX_LENGTH];
+    char keyFilePath[PATH_MAX_LENGTH];
     snprintf(indexDBPath, sizeof indexDBPath, "%s%s", dataPath, INDEX_DB_NAME);
-    snprintf(blockDBPath, sizeof blockDBPath, "%s%s", dataPath, BLOCK_DB_NAME);
+    snprintf(blockDBPath, sizeof blockDBPath, "%s%s", dataPath, BLOCK_SHARDS_DIR_NAME);
+    snprintf(legacyBlockDBPath, sizeof legacyBlockDBPath, "%s%s", dataPath, BLOCK_DB_NAME);
     snprintf(ivFilePath, sizeof ivFilePath, "%s%s", dataPath, IV_FILE_NAME);
     snprintf(encryptedIVFilePath, sizeof encryptedIVFilePath, "%s%s", dataPath, ENCRYPTED_IV_FILE_NAME);
-    return isFileExists(indexDBPath) && isFileExists(blockDBPath) && isFileExists(ivFilePath) &&isFileExists(encryptedIVFilePath);
+    snprintf(keyFilePath, sizeof keyFilePath, "%s%s", dataPath, KEY_FILE_NAME);
+    Bool blockDBExists = isFileExists(blockDBPath) || isFileExists(legacyBlockDBPath);
+    Bool keyExists = isFileExists(keyFilePath) || isFileExists(encryptedIVFilePath);
+    return isFileExists(indexDBPath) && blockDBExists && isFileExists(ivFilePath) && keyExists;
+}
+
+
+static void init_dirty_block_list(DirtyBlockList *list) {
+    list->ids = NULL;
+    list->length = 0;
+    list->max = 0;
+    pthread_mutex_init(&list->lock, NULL);
+}
+
+static void mark_block_dirty(Secfs *secfs, Block *block) {
+    DirtyBlockList *list = &secfs->dirtyBlocks;
+    pthread_mutex_lock(&list->lock);
+    if (list->length >= list->max) {
+        list->max = MAX(list->max * 2, 64);
+        list->ids = realloc(list->ids, sizeof(uuid_t) * list->max);
+    }
+    uuid_copy(list->ids[list->length++], block->id);
+    pthread_mutex_unlock(&list->lock);
+}
+
+typedef struct {
+    Secfs *secfs;
+    uuid_t *ids;
+    _Atomic(Error) error; // First error of the workers
+} SyncBlocksTask;
+
+// Keeps the first error reported by the workers of a parallelFor
+static void record_task_error(_Atomic(Error) *slot, Error error) {
+    Error expected = NULL;
+    atomic_compare_exchange_strong(slot, &expected, error);
+}
+
+static Int compare_uuids(const void *a, const void *b) {
+    return uuid_compare(*(const uuid_t*)a, *(const uuid_t*)b);
+}
+
+static void sync_block(UInt index, void *context) {
+    SyncBlocksTask *task = context;
+    char blockPath[PATH_MAX_LENGTH];
+    block_file_path(task->secfs, task->ids[index], task->secfs->header.blockFanOut, blockPath);
+    
+    // Blocks deleted in the meantime don't need syncing, blocks are only written to the current layout
+    Int fd = open(blockPath, O_RDONLY);
+    if (fd == ERROR) {
+        if (errno != ENOENT) {
+            record_task_error(&task->error, strerror(errno));
+        }
+        return;
+    }
+    if (fdatasync(fd) == ERROR) {
+        record_task_error(&task->error, strerror(errno));
+    }
+    close(fd);
+}
+
+Error sync_dirty_blocks(Secfs *secfs) {
+    // Take the current list, blocks written from now on go to the next sync
+    DirtyBlockList *list = &secfs->dirtyBlocks;
+    pthread_mutex_lock(&list->lock);
+    SyncBlocksTask task;
+    task.secfs = secfs;
+    task.ids = list->ids;
+    atomic_init(&task.error, NULL);
+    UInt length = list->length;
+    list->ids = NULL;
+    list->length = 0;
+    list->max = 0;
+    pthread_mutex_unlock(&list->lock);
+    
+    if (length == 0) {
+        free(task.ids);
+        return NULL;
+    }
+    
+    // Blocks are usually written many times between two syncs
+    qsort(task.ids, length, sizeof(uuid_t), compare_uuids);
+    UInt uniqueLength = 1;
+    for (UInt i = 1; i < length; i++) {
+        if (uuid_compare(task.ids[i], task.ids[uniqueLength - 1]) != 0) {
+            uuid_copy(task.ids[uniqueLength++], task.ids[i]);
+        }
+    }
+    
+    debugPrint("Syncing %d blocks", uniqueLength);
+    ULong start = stats_start();
+    parallelFor(uniqueLength, SYNC_THREADS, sync_block, &task);
+    Error error = atomic_load(&task.error);
+    stats_record(MetricBlockSync, start, 0, error != NULL);
+    free(task.ids);
+    return error;
+}
+
+typedef struct {
+    String error;
+    VolumeKeys *keys;
+    ByteArray salt;
+} LoadKeysResult;
+
+static void init_key_locks(Secfs *secfs) {
+    pthread_mutex_init(&secfs->archiveLock, NULL);
+    pthread_mutex_init(&secfs->sizeLock, NULL);
+    for (UInt i = 0; i < KEY_LOCK_STRIPES; i++) {
+        pthread_rwlock_init(&secfs->keyLocks[i], NULL);
+    }
+}
+
+static void use_volume_keys(Secfs *secfs, VolumeKeys *keys) {
+    secfs->keys = keys;
+    secfs->key.bytes = keys->key;
+    secfs->key.length = KEY_LENGTH;
+    secfs->previousKey.bytes = keys->previousKey;
+    secfs->previousKey.length = KEY_LENGTH;
 }
 
+static Error write_volume_keys(String dataPath, const VolumeKeys *keys, ByteArray passwordKey, ByteArray salt, Cipher cipher) {
+    char keyFilePath[PATH_MAX_LENGTH];
+    snprintf(keyFilePath, sizeof keyFilePath, "%s%s", dataPath, KEY_FILE_NAME);
+
+    KeyFileHeader header;
+    memset(&header, 0, sizeof header);
+    strcpy(header.magic, KEY_FILE_MAGIC);
+    header.version = KEY_FILE_VERSION;
+    memcpy(header.salt, salt.bytes, IV_LENGTH);
+
+    ByteArray keysBytes = { (Byte*)keys, sizeof(VolumeKeys) };
+    EncryptResult encryptResult = cipher_encrypt(cipher, keysBytes, passwordKey, salt);
+    if (encryptResult.error) {
+        return encryptResult.error;
+    }
+    ByteArray contents = initByteArray(sizeof header + encryptResult.cipher.length);
+    memcpy(contents.bytes, &header, sizeof header);
+    memcpy(contents.bytes + sizeof header, encryptResult.cipher.bytes, encryptResult.cipher.length);
+    free(encryptResult.cipher.bytes);
+
+    WriteFileResult writeResult = writeFileAtomically(keyFilePath, contents);
+    free(contents.bytes);
+    return writeResult.error;
+}
+
+static Error save_volume_keys(Secfs *secfs, const VolumeKeys *keys) {
+    return write_volume_keys(secfs->dataPath, keys, secfs->passwordKey, secfs->salt, (Cipher)secfs->header.cipher);
+}
+
+static LoadKeysResult load_volume_keys(String dataPath, ByteArray passwordKey, Cipher cipher) {
+    LoadKeysResult result = { NULL, NULL, { NULL, 0 } };
+    char keyFilePath[PATH_MAX_LENGTH];
+    snprintf(keyFilePath, sizeof keyFilePath, "%s%s", dataPath, KEY_FILE_NAME);
+    ReadFileResult readResult = readFile(keyFilePath);
+    if (readResult.error) {
+        result.error = readResult.error;
+        return result;
+    }
+
+    KeyFileHeader header;
+    if (readResult.contents.length < sizeof header) {
+        free(readResult.contents.bytes);
+        result.error = "Invalid key file";
+        return result;
+    }
+    memcpy(&header, readResult.contents.bytes, sizeof header);
+    if (strncmp(header.magic, KEY_FILE_MAGIC, sizeof header.magic) != 0 || header.version != KEY_FILE_VERSION) {
+        free(readResult.contents.bytes);
+        result.error = "Invalid key file";
+        return result;
+    }
+
+    ByteArray salt = { header.salt, IV_LENGTH };
+    ByteArray wrappedKeys = { readResult.contents.bytes + sizeof header, readResult.contents.length - sizeof header };
+    DecryptResult decryptResult = cipher_decrypt(cipher, wrappedKeys, passwordKey, salt);
+    free(readResult.contents.bytes);
+    if (decryptResult.error) {
+        result.error = "Incorrect password";
+        return result;
+    }
+    if (decryptResult.plainText.length != sizeof(VolumeKeys) ||
+        strncmp((String)decryptResult.plainText.bytes, KEY_FILE_MAGIC, sizeof header.magic) != 0) {
+        free(decryptResult.plainText.bytes);
+        result.error = "Incorrect password";
+        return result;
+    }
+
+    result.keys = ALLOC(VolumeKeys);
+    memcpy(result.keys, decryptResult.plainText.bytes, sizeof(VolumeKeys));
+    free(decryptResult.plainText.bytes);
+    result.salt = initByteArray(IV_LENGTH);
+    memcpy(result.salt.bytes, header.salt, IV_LENGTH);
+    return result;
+}
+
+// Volumes without a key file keep their password key as data key, so nothing is re-encrypted
+static LoadKeysResult load_or_create_volume_keys(String dataPath, ByteArray passwordKey, ByteArray iv, Cipher cipher) {
+    char keyFilePath[PATH_MAX_LENGTH];
+    snprintf(keyFilePath, sizeof keyFilePath, "%s%s", dataPath, KEY_FILE_NAME);
+    if (isFileExists(keyFilePath)) {
+        return load_volume_keys(dataPath, passwordKey, cipher);
+    }
+
+    LoadKeysResult result = { NULL, NULL, { NULL, 0 } };
+    if (!verify_key(passwordKey, iv, cipher, dataPath)) {
+        result.error = "Incorrect password";
+        return result;
+    }
+    result.keys = ALLOC(VolumeKeys);
+    memset(result.keys, 0, sizeof(VolumeKeys));
+    strcpy(result.keys->magic, KEY_FILE_MAGIC);
+    memcpy(result.keys->key, passwordKey.bytes, KEY_LENGTH);
+    result.keys->rotatedShards = BLOCK_SHARD_COUNT;
+    result.salt = initByteArray(IV_LENGTH);
+    memcpy(result.salt.bytes, iv.bytes, IV_LENGTH);
+    result.error = write_volume_keys(dataPath, result.keys, passwordKey, result.salt, cipher);
+    if (result.error) {
+        free(result.keys);
+        free(result.salt.bytes);
+        result.keys = NULL;
+        return result;
+    }
+
+    // The key file replaces the password check
+    char encryptedIVPath[PATH_MAX_LENGTH];
+    snprintf(encryptedIVPath, sizeof encryptedIVPath, "%s%s", dataPath, ENCRYPTED_IV_FILE_NAME);
+    unlink(encryptedIVPath);
+    return result;
+}
+
+// A database file re-encrypted by a rotation replaces the current one once the key file says so
+static void resolve_rotated_file(const String path, Bool rotated) {
+    char nextPath[PATH_MAX_LENGTH + 16];
+    snprintf(nextPath, sizeof nextPath, "%s%s", path, ROTATED_FILE_SUFFIX);
+    if (!isFileExists(nextPath)) {
+        return;
+    }
+    if (rotated) {
+        rename(nextPath, path);
+    }
+    else {
+        unlink(nextPath);
+    }
+}
+
+typedef struct {
+    String path;
+    String legacyPath;
+    Cipher cipher;
+    ByteArray key;
+    ByteArray iv;
+    LoadBlockDBResult result;
+} LoadBlockDBTask;
+
+static void* load_blockDB_task(void *arg) {
+    LoadBlockDBTask *task = arg;
+    if (!isFileExists(task->legacyPath)) {
+        task->result = load_blockDB(task->path, task->cipher, task->key, task->iv);
+        return NULL;
+    }
+    
+    // Older volume, split the single file database into shards
+    debugPrint("Migrating %s to sharded block database", task->legacyPath);
+    task->result.blockDB = init_blockDB(task->path, task->cipher, task->key, task->iv);
+    task->result.error = migrate_blockDB(task->result.blockDB, task->legacyPath);
+    return NULL;
+}
 
 LoadSecfsResult load_secfs(String dataPath, ByteArray key) {
     LoadSecfsResult result = { NULL, NULL };
     char indexDBPath[PATH_MAX_LENGTH];
     char blockDBPath[PATH_MAX_LENGTH];
-    char ivFilePath[PATH_MAX_LENGTH];
-    snprintf(indexDBPath, sizeof blockDBPath, "%s%s", dataPath, INDEX_DB_NAME);
-    snprintf(blockDBPath, sizeof blockDBPath, "%s%s", dataPath, BLOCK_DB_NAME);
-    snprintf(ivFilePath, sizeof ivFilePath, "%s%s", dataPath, IV_FILE_NAME);
+    char legacyBlockDBPath[PATH_MAX_LENGTH];
+    char referencesPath[PATH_MAX_LENGTH];
+    snprintf(indexDBPath, sizeof indexDBPath, "%s%s", dataPath, INDEX_DB_NAME);
+    snprintf(blockDBPath, sizeof blockDBPath, "%s%s", dataPath, BLOCK_SHARDS_DIR_NAME);
+    snprintf(legacyBlockDBPath, sizeof legacyBlockDBPath, "%s%s", dataPath, BLOCK_DB_NAME);
+    snprintf(referencesPath, sizeof referencesPath, "%s%s", dataPath, BLOCK_REFERENCES_NAME);
 
     LoadIVResult ivResult = load_iv(dataPath);
     if (ivResult.error) {
@@ -66,58 +746,157 @@ LoadSecfsResult load_secfs(String dataPath, ByteArray key) {
         return result;
     }
     
-    LoadIndexDBResult indexResult = load_indexDB(indexDBPath, key, ivResult.iv);
+    LoadVolumeHeaderResult headerResult = load_volume_header(dataPath);
+    if (headerResult.error) {
+        result.error = headerResult.error;
+        return result;
+    }
+    Cipher cipher = (Cipher)headerResult.header.cipher;
+    
+    LoadKeysResult keysResult = load_or_create_volume_keys(dataPath, key, ivResult.iv, cipher);
+    if (keysResult.error) {
+        result.error = keysResult.error;
+        return result;
+    }
+    Secfs *secfs = ALLOC(Secfs);
+    use_volume_keys(secfs, keysResult.keys);
+    VolumeKeys *keys = keysResult.keys;
+    
+    // Finish the switch of a file an interrupted rotation left behind, or drop it
+    resolve_rotated_file(indexDBPath, keys->rotating && keys->indexRotated);
+    resolve_rotated_file(referencesPath, keys->rotating && keys->indexRotated);
+    if (keys->rotating) {
+        for (UInt shard = keys->rotatedShards > 0 ? keys->rotatedShards - 1 : 0; shard <= keys->rotatedShards && shard < BLOCK_SHARD_COUNT; shard++) {
+            char shardPath[PATH_MAX_LENGTH + 4];
+            snprintf(shardPath, sizeof shardPath, "%s%03x", blockDBPath, shard);
+            resolve_rotated_file(shardPath, shard < keys->rotatedShards);
+        }
+    }
+    
+    // Load both databases concurrently, the block database on a helper thread
+    LoadBlockDBTask blockTask = { blockDBPath, legacyBlockDBPath, cipher, secfs->key, ivResult.iv, { NULL, NULL } };
+    pthread_t blockThread;
+    Bool threaded = pthread_create(&blockThread, NULL, load_blockDB_task, &blockTask) == 0;
+    if (!threaded) {
+        load_blockDB_task(&blockTask);
+    }
+    
+    ByteArray indexKey = keys->rotating && !keys->indexRotated ? secfs->previousKey : secfs->key;
+    LoadIndexDBResult indexResult = load_indexDB(indexDBPath, cipher, indexKey, ivResult.iv);
+    if (threaded) {
+        pthread_join(blockThread, NULL);
+    }
+    
+    LoadBlockDBResult blockResult = blockTask.result;
     if (indexResult.error) {
+        free_blockDB(blockResult.blockDB);
         result.error = indexResult.error;
         return result;
     }
-    
-    LoadBlockDBResult blockResult = load_blockDB(blockDBPath, key, ivResult.iv);
     if (blockResult.error) {
+        free_blockDB(blockResult.blockDB);
         result.error = blockResult.error;
         return result;
     }
-        
-    result.secfs = ALLOC(Secfs);
+    Error referencesError = load_block_references(blockResult.blockDB, referencesPath, indexKey);
+    if (referencesError) {
+        free_blockDB(blockResult.blockDB);
+        result.error = referencesError;
+        return result;
+    }
+    
+    init_reclaim_queue(&secfs->reclaim);
+    Error reclaimError = load_reclaim_queue(&secfs->reclaim, dataPath);
+    if (reclaimError) {
+        free_blockDB(blockResult.blockDB);
+        result.error = reclaimError;
+        return result;
+    }
+    
+    blockResult.blockDB->previousKey = secfs->previousKey;
+    atomic_store(&blockResult.blockDB->rotatedShards, keys->rotating ? keys->rotatedShards : BLOCK_SHARD_COUNT);
+
+    result.secfs = secfs;
     result.secfs->dataPath = malloc(strlen(dataPath) + 1);
     strcpy(result.secfs->dataPath, dataPath);
     result.secfs->indexDB = indexResult.indexDB;
     result.secfs->blockDB = blockResult.blockDB;
     result.secfs->iv = ivResult.iv;
-    result.secfs->key = key;
+    result.secfs->passwordKey = key;
+    result.secfs->salt = keysResult.salt;
+    result.secfs->header = headerResult.header;
+    init_block_directories(result.secfs);
+    init_dirty_block_list(&result.secfs->dirtyBlocks);
+    init_key_locks(result.secfs);
+    result.secfs->blockBuffers = init_buffer_pool(cipher_max_length(cipher, BLOCK_SIZE));
+    result.secfs->directIO = false;
+    
+    // A migrated block database only exists in memory until it's archived, archiving drops the single file.
+    // Should it fail, the single file stays the source of truth and is migrated again on the next load.
+    if (isFileExists(legacyBlockDBPath)) {
+        Error migrationError = archive_secfs(result.secfs);
+        if (migrationError) {
+            debugPrint("[Warning] couldn't archive migrated block database: %s", migrationError);
+        }
+    }
     return result;
 }
 
-LoadSecfsResult init_secfs(String dataPath, ByteArray key, ByteArray iv) {
+LoadSecfsResult init_secfs(String dataPath, ByteArray key, ByteArray iv, Cipher cipher) {
 
     char indexDBPath[PATH_MAX_LENGTH];
     char blockDBPath[PATH_MAX_LENGTH];
     char ivFilePath[PATH_MAX_LENGTH];
-    char encryptedIVFilePath[PATH_MAX_LENGTH];
+    char headerFilePath[PATH_MAX_LENGTH];
 
     snprintf(indexDBPath, sizeof indexDBPath, "%s%s", dataPath, INDEX_DB_NAME);
-    snprintf(blockDBPath, sizeof blockDBPath, "%s%s", dataPath, BLOCK_DB_NAME);
+    snprintf(blockDBPath, sizeof blockDBPath, "%s%s", dataPath, BLOCK_SHARDS_DIR_NAME);
     snprintf(ivFilePath, sizeof ivFilePath, "%s%s", dataPath, IV_FILE_NAME);
-    snprintf(encryptedIVFilePath, sizeof encryptedIVFilePath, "%s%s", dataPath, ENCRYPTED_IV_FILE_NAME);
+    snprintf(headerFilePath, sizeof headerFilePath, "%s%s", dataPath, VOLUME_HEADER_FILE_NAME);
+
+    // A random data key, wrapped by the password key in the key file
+    VolumeKeys *keys = ALLOC(VolumeKeys);
+    memset(keys, 0, sizeof(VolumeKeys));
+    strcpy(keys->magic, KEY_FILE_MAGIC);
+    ByteArray dataKey = get_random_bytes(KEY_LENGTH);
+    memcpy(keys->key, dataKey.bytes, KEY_LENGTH);
+    free(dataKey.bytes);
+    keys->rotatedShards = BLOCK_SHARD_COUNT;
 
     LoadSecfsResult result;
     result.secfs = ALLOC(Secfs);
+    use_volume_keys(result.secfs, keys);
     result.secfs -> iv = iv;
-    result.secfs -> key = key;
+    result.secfs -> passwordKey = key;
+    result.secfs -> salt = initByteArray(IV_LENGTH);
+    memcpy(result.secfs->salt.bytes, iv.bytes, IV_LENGTH);
     result.secfs -> indexDB = init_indexDB();
-    result.secfs -> blockDB = init_blockDB();
+    result.secfs -> blockDB = init_blockDB(blockDBPath, cipher, result.secfs->key, iv);
     result.secfs -> dataPath = malloc(strlen(dataPath) + 1);
+    init_dirty_block_list(&result.secfs->dirtyBlocks);
+    init_reclaim_queue(&result.secfs->reclaim);
+    init_key_locks(result.secfs);
+    result.secfs->blockBuffers = init_buffer_pool(cipher_max_length(cipher, BLOCK_SIZE));
+    result.secfs->directIO = false;
     result.error = NULL;
     strcpy(result.secfs->dataPath, dataPath);
     
+    memset(&result.secfs->header, 0, sizeof(VolumeHeader));
+    strcpy(result.secfs->header.magic, VOLUME_HEADER_MAGIC);
+    result.secfs->header.version = VOLUME_HEADER_VERSION;
+    result.secfs->header.cipher = cipher;
+    result.secfs->header.blockFanOut = DEFAULT_BLOCK_FAN_OUT;
+    result.secfs->header.previousBlockFanOut = DEFAULT_BLOCK_FAN_OUT;
+    init_block_directories(result.secfs);
+    ByteArray headerBytes = { (Byte*)&result.secfs->header, sizeof(VolumeHeader) };
+    WriteFileResult writeHeaderResult = writeFile(headerFilePath, headerBytes);
+    INIT_HANDLE_ERROR(writeHeaderResult.error);
+    
     WriteFileResult writeIVResult = writeFile(ivFilePath, iv);
     INIT_HANDLE_ERROR(writeIVResult.error);
 
-    // encrypt and save encrypted IV for later verification
-    AESEncryptResult encryptionResult = aes_encrypt(iv, key, iv);
-    INIT_HANDLE_ERROR(encryptionResult.error);
-    WriteFileResult encryptedIVWriteResult = writeFile(encryptedIVFilePath, encryptionResult.cipher);
-    INIT_HANDLE_ERROR(encryptedIVWriteResult.error);
+    Error keysError = save_volume_keys(result.secfs, keys);
+    INIT_HANDLE_ERROR(keysError);
     
     // Create initial root folder for the file system
     Item *root = create_item(ItemTypeDir, "/");
@@ -135,81 +914,153 @@ ReadBlockResult read_block(Secfs *secfs, Block *block) {
     result.error = NULL;
     result.bytes.length = 0;
     
-    char uuidString[UUID_STRING_LENGTH];
     char blockPath[PATH_MAX_LENGTH];
-    uuid_unparse_lower(block->id, uuidString);
-    snprintf(blockPath, sizeof blockPath, "%s%s", secfs->dataPath, uuidString);
+    ULong start = stats_start();
+    Byte *cipherText = buffer_pool_acquire(secfs->blockBuffers);
+    ULong capacity = buffer_pool_buffer_size(secfs->blockBuffers);
+    ReadFileResult readResult;
 
-    debugPrint("Reading data from block %s", blockPath);
-    ReadFileResult readResult = readFile(blockPath);
+    // While the layout is migrated, a file is in the current layout, the previous one, or was just moved
+    UInt attempts = atomic_load(&secfs->blockMigration) ? 3 : 1;
+    for (UInt attempt = 0; attempt < attempts; attempt++) {
+        block_file_path(secfs, block->id, attempt == 1 ? secfs->header.previousBlockFanOut : secfs->header.blockFanOut, blockPath);
+        debugPrint("Reading data from block %s", blockPath);
+        readResult = secfs->directIO
+            ? readFileDirect(blockPath, cipherText, capacity)
+            : readFileInto(blockPath, cipherText, capacity);
+        if (readResult.error == NULL) {
+            break;
+        }
+    }
+    stats_record(MetricBlockRead, start, readResult.error ? 0 : readResult.contents.length, readResult.error != NULL);
     if (readResult.error) {
+        buffer_pool_release(secfs->blockBuffers, cipherText);
         result.error = readResult.error;
         return result;
     }
     
     // Decrypt block before returning to FUSE
     ByteArray blockIV = { block->iv, IV_LENGTH };
-    AESDecryptResult decryptResult = aes_decrypt(readResult.contents, secfs->key, blockIV);
+    start = stats_start();
+    ByteArray key = shard_key(secfs->blockDB, shard_index(block->fileId));
+    Byte *plainText = buffer_pool_acquire(secfs->blockBuffers);
+    DecryptResult decryptResult = cipher_decrypt_into((Cipher)secfs->header.cipher, readResult.contents, key, blockIV, plainText);
+    stats_record(MetricDecrypt, start, readResult.contents.length, decryptResult.error != NULL);
+    buffer_pool_release(secfs->blockBuffers, cipherText);
     if (decryptResult.error) {
+        buffer_pool_release(secfs->blockBuffers, plainText);
         result.error = decryptResult.error;
         return result;
     }
     
-    free(readResult.contents.bytes);
+    // Blocks at the end of a file are stored up to the end only, the rest reads as zeros
     result.bytes = decryptResult.plainText;
+    if (result.bytes.length < BLOCK_SIZE) {
+        memset(result.bytes.bytes + result.bytes.length, 0, BLOCK_SIZE - result.bytes.length);
+    }
     return result;
 }
 
-Error write_block(Secfs *secfs, Block *block, ByteArray data) {
-    char uuidString[UUID_STRING_LENGTH];
+Error use_direct_block_io(Secfs *secfs, Bool enabled) {
+    secfs->directIO = false;
+    if (!enabled) {
+        return NULL;
+    }
+
+    // Pooled buffers are page aligned and sized, the file system has to take O_DIRECT at all
+    char headerFilePath[PATH_MAX_LENGTH];
+    snprintf(headerFilePath, sizeof headerFilePath, "%s%s", secfs->dataPath, VOLUME_HEADER_FILE_NAME);
+    if (buffer_pool_buffer_size(secfs->blockBuffers) % DIRECT_IO_ALIGNMENT != 0 || !isDirectIOSupported(headerFilePath)) {
+        return "The file system of the secure folder doesn't support direct I/O";
+    }
+    secfs->directIO = true;
+    return NULL;
+}
+
+ByteArray acquire_block_data(Secfs *secfs) {
+    ByteArray data = { buffer_pool_acquire(secfs->blockBuffers), BLOCK_SIZE };
+    memset(data.bytes, 0, BLOCK_SIZE);
+    return data;
+}
+
+void release_block_data(Secfs *secfs, ByteArray data) {
+    buffer_pool_release(secfs->blockBuffers, data.bytes);
+}
+
+static Error encrypt_block_to_disk(Secfs *secfs, Block *block, ByteArray data, ByteArray key) {
     char blockPath[PATH_MAX_LENGTH];
-    uuid_unparse_lower(block->id, uuidString);
-    snprintf(blockPath, sizeof blockPath, "%s%s", secfs->dataPath, uuidString);
+    block_file_path(secfs, block->id, secfs->header.blockFanOut, blockPath);
+    Error directoryError = create_block_directory(secfs, block->id);
+    if (directoryError) {
+        return directoryError;
+    }
     
     // Encrypt block before writing to disk
     ByteArray blockIV = { block->iv, IV_LENGTH };
-    AESEncryptResult encryptResult = aes_encrypt(data, secfs->key, blockIV);
+    ULong start = stats_start();
+    Byte *cipherText = buffer_pool_acquire(secfs->blockBuffers);
+    EncryptResult encryptResult = cipher_encrypt_into((Cipher)secfs->header.cipher, data, key, blockIV, cipherText);
+    stats_record(MetricEncrypt, start, data.length, encryptResult.error != NULL);
     if (encryptResult.error) {
+        buffer_pool_release(secfs->blockBuffers, cipherText);
         return encryptResult.error;
     }
     
     // Write encrypted data to file
     debugPrint("Writing %d bytes of data to block %s", data.length, blockPath);
-    WriteFileResult writeResult = writeFile(blockPath, encryptResult.cipher);
-    if(writeResult.error) {
-        return writeResult.error;
+    start = stats_start();
+    WriteFileResult writeResult = secfs->directIO
+        ? writeFileDirect(blockPath, encryptResult.cipher)
+        : writeFile(blockPath, encryptResult.cipher);
+    stats_record(MetricBlockWrite, start, encryptResult.cipher.length, writeResult.error != NULL);
+    buffer_pool_release(secfs->blockBuffers, cipherText);
+    return writeResult.error;
+}
+
+Error write_block(Secfs *secfs, Block *block, ByteArray data) {
+    Error error = encrypt_block_to_disk(secfs, block, data, shard_key(secfs->blockDB, shard_index(block->fileId)));
+    if (error) {
+        return error;
     }
     
-    free(encryptResult.cipher.bytes);
+    mark_block_dirty(secfs, block);
     return NULL;
 }
 
 Error delete_block_from_disk(Secfs *secfs, Block *block) {
-    char uuidString[37];
-    char blockPath[PATH_MAX_LENGTH];
-    uuid_unparse_lower(block->id, uuidString);
-    snprintf(blockPath, sizeof blockPath, "%s%s", secfs->dataPath, uuidString);
+    return delete_block_file(secfs, block->id);
+}
 
-    debugPrint("Deleting block %s from disk", blockPath);
-    if(unlink(blockPath) != 0) {
-        return strerror(errno);
+// The block file is deleted once the databases without the block are saved, unless a clone still uses it
+static void release_block_to_reclaim(Secfs *secfs, Block *block) {
+    if (release_block_file(secfs->blockDB, block->id)) {
+        pthread_mutex_lock(&secfs->reclaim.lock);
+        append_block_id(&secfs->reclaim.released, &secfs->reclaim.releasedLength, &secfs->reclaim.releasedMax, block->id);
+        pthread_mutex_unlock(&secfs->reclaim.lock);
     }
-    
-    return NULL;
 }
 
 void purge_item(Secfs *secfs, Item *item) {
     if (item->type == ItemTypeFile) {
+        pthread_rwlock_t *keyLock = key_lock(secfs, item->id);
+        pthread_rwlock_rdlock(keyLock);
         BlocksForFileResult result = all_blocks_for_file(secfs->blockDB, item->id);
         for (UInt i = 0 ; i < result.length; i++) {
             Block *block = result.blocks[i];
-            delete_block_from_disk(secfs, block);
-            remove_block(secfs->blockDB, block->id);
+            // A block punched out in the meantime has been released already
+            if (remove_block(secfs->blockDB, block) == NULL) {
+                release_block_to_reclaim(secfs, block);
+            }
         }
+        release_blocks(secfs->blockDB, result);
+        pthread_rwlock_unlock(keyLock);
     }
     else if (item->type == ItemTypeDir) {
         ItemArray descendants = get_dir_descendants(secfs->indexDB, item->path);
         for (UInt i = 0; i < descendants.length; i++) {
+            if (descendants.items[i] == item) {
+                continue;
+            }
             if (descendants.items[i]->type == ItemTypeFile) {
                 purge_item(secfs, descendants.items[i]);
             }
@@ -222,7 +1073,364 @@ void purge_item(Secfs *secfs, Item *item) {
     remove_item(secfs->indexDB, item->id);
 }
 
-Bool verify_key(ByteArray key, ByteArray iv, String dataPath) {
+static Block* find_block_with_index(BlocksForFileResult blocks, UInt index) {
+    for (UInt i = 0; i < blocks.length; i++) {
+        if (blocks.blocks[i]->index == index) {
+            return blocks.blocks[i];
+        }
+    }
+    return NULL;
+}
+
+Error read_item_data(Secfs *secfs, Item *file, Byte *out, ULong size, ULong offset) {
+    if (size == 0) {
+        return NULL;
+    }
+    
+    // A key rotation doesn't move the file's blocks while they're used
+    pthread_rwlock_t *keyLock = key_lock(secfs, file->id);
+    pthread_rwlock_rdlock(keyLock);
+    BlocksForFileResult blocksResult = all_blocks_for_file(secfs->blockDB, file->id);
+    if (blocksResult.error) {
+        release_blocks(secfs->blockDB, blocksResult);
+        pthread_rwlock_unlock(keyLock);
+        return blocksResult.error;
+    }
+    debugPrint("Total blocks to read: %d", blocksResult.length);
+    
+    Error error = NULL;
+    UInt lastBlockIndex = (UInt)((offset + size - 1) / BLOCK_SIZE);
+    for (UInt index = (UInt)(offset / BLOCK_SIZE); index <= lastBlockIndex && error == NULL; index++) {
+        debugPrint("    reading block %d",index);
+        trace_set_block(index);
+        
+        // Blocks which were never written are holes filled with zeros
+        memory_reserve(MemoryIOBuffers, BLOCK_IO_MEMORY);
+        Block *block = find_block_with_index(blocksResult, index);
+        ByteArray blockData;
+        if (block == NULL) {
+            blockData = acquire_block_data(secfs);
+        }
+        else {
+            ReadBlockResult readResult = read_block(secfs, block);
+            if (readResult.error) {
+                memory_release(MemoryIOBuffers, BLOCK_IO_MEMORY);
+                error = readResult.error;
+                break;
+            }
+            blockData = readResult.bytes;
+        }
+        
+        // Copy the requested range of the block to the output
+        ULong start = MAX(offset, (ULong)index * BLOCK_SIZE);
+        ULong end = MIN(offset + size, (ULong)index * BLOCK_SIZE + BLOCK_SIZE);
+        debugPrint("    Block ranges %d to %d; Data ranges %d to %d", start, end, start - offset, end - offset);
+        memcpy(&out[start - offset], &blockData.bytes[start % BLOCK_SIZE], end - start);
+        release_block_data(secfs, blockData);
+        memory_release(MemoryIOBuffers, BLOCK_IO_MEMORY);
+    }
+    
+    release_blocks(secfs->blockDB, blocksResult);
+    pthread_rwlock_unlock(keyLock);
+    return error;
+}
+
+// Holes are filled with new blocks, unless only the existing blocks are overwritten
+static Error write_blocks(Secfs *secfs, Item *file, const Byte *data, ULong size, ULong offset, Bool fillHoles) {
+    if (size == 0) {
+        return NULL;
+    }
+    
+    // A key rotation doesn't move the file's blocks while they're used
+    pthread_rwlock_t *keyLock = key_lock(secfs, file->id);
+    pthread_rwlock_rdlock(keyLock);
+    BlocksForFileResult blocksResult = all_blocks_for_file(secfs->blockDB, file->id);
+    if (blocksResult.error) {
+        release_blocks(secfs->blockDB, blocksResult);
+        pthread_rwlock_unlock(keyLock);
+        return blocksResult.error;
+    }
+    debugPrint("    Found %d blocks for the file", blocksResult.length);
+    
+    // Blocks are stored up to the end of the file after this write
+    ULong endOfFile = fillHoles ? MAX(file->size, offset + size) : file->size;
+    Error error = NULL;
+    UInt lastBlockIndex = (UInt)((offset + size - 1) / BLOCK_SIZE);
+    for (UInt index = (UInt)(offset / BLOCK_SIZE); index <= lastBlockIndex && error == NULL; index++) {
+        trace_set_block(index);
+        debugPrint("    Writing block %d",index);
+        
+        // Read block bytes. If block doesn't exist, we will create a new one filled with zeros as the data
+        Block *block = find_block_with_index(blocksResult, index);
+        Block *sharedBlock = NULL;
+        Bool newBlock = block == NULL;
+        ByteArray blockData;
+        if (block == NULL && !fillHoles) {
+            continue;
+        }
+        memory_reserve(MemoryIOBuffers, BLOCK_IO_MEMORY);
+        if (block == NULL) {
+            debugPrint("   Creating new block index %d", index);
+            block = generate_block(file->id, index);
+            error = add_block(secfs->blockDB, block);
+            if (error) {
+                memory_release(MemoryIOBuffers, BLOCK_IO_MEMORY);
+                free(block);
+                break;
+            }
+            blockData = acquire_block_data(secfs);
+        }
+        else {
+            ReadBlockResult readResult = read_block(secfs, block);
+            if (readResult.error) {
+                memory_release(MemoryIOBuffers, BLOCK_IO_MEMORY);
+                error = readResult.error;
+                break;
+            }
+            blockData = readResult.bytes;
+            
+            // The block file of a clone is copied on write, the other files keep the original
+            if (block_file_references(secfs->blockDB, block->id) > 1) {
+                sharedBlock = block;
+                block = generate_block(file->id, index);
+            }
+        }
+        
+        // Partially modify block according to the data
+        ULong start = MAX(offset, (ULong)index * BLOCK_SIZE);
+        ULong end = MIN(offset + size, (ULong)index * BLOCK_SIZE + BLOCK_SIZE);
+        debugPrint("   Block ranges %d to %d; Data ranges %d to %d", start, end, start - offset, end - offset);
+        memcpy(&blockData.bytes[start % BLOCK_SIZE], &data[start - offset], end - start);
+        blockData.length = endOfFile > (ULong)index * BLOCK_SIZE ? MIN(BLOCK_SIZE, endOfFile - (ULong)index * BLOCK_SIZE) : 0;
+        
+        // Write block back to disk
+        error = write_block(secfs, block, blockData);
+        release_block_data(secfs, blockData);
+        memory_release(MemoryIOBuffers, BLOCK_IO_MEMORY);
+        if (error && newBlock) {
+            // A block without its file would fail every read instead of reading as zeros
+            delete_block_from_disk(secfs, block);
+            remove_block(secfs->blockDB, block);
+        }
+        if (sharedBlock != NULL) {
+            if (error == NULL) {
+                error = replace_block(secfs->blockDB, sharedBlock, block);
+            }
+            if (error) {
+                delete_block_from_disk(secfs, block);
+                free(block);
+            }
+            else {
+                release_block_to_reclaim(secfs, sharedBlock);
+            }
+        }
+    }
+    
+    if (error == NULL && fillHoles) {
+        grow_item_size(secfs, file, offset + size);
+    }
+    release_blocks(secfs->blockDB, blocksResult);
+    pthread_rwlock_unlock(keyLock);
+    return error;
+}
+
+Error write_item_data(Secfs *secfs, Item *file, const Byte *data, ULong size, ULong offset) {
+    return write_blocks(secfs, file, data, size, offset, true);
+}
+
+Error punch_item_data(Secfs *secfs, Item *file, ULong offset, ULong size) {
+    if (size == 0) {
+        return NULL;
+    }
+    ULong end = offset + size;
+    ULong firstWhole = (offset + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    ULong endWhole = end / BLOCK_SIZE;
+    
+    // Blocks within the range or past the end of the file are dropped
+    pthread_rwlock_t *keyLock = key_lock(secfs, file->id);
+    pthread_rwlock_rdlock(keyLock);
+    BlocksForFileResult blocksResult = all_blocks_for_file(secfs->blockDB, file->id);
+    if (blocksResult.error) {
+        release_blocks(secfs->blockDB, blocksResult);
+        pthread_rwlock_unlock(keyLock);
+        return blocksResult.error;
+    }
+    Error error = NULL;
+    for (UInt i = 0; i < blocksResult.length && error == NULL; i++) {
+        Block *block = blocksResult.blocks[i];
+        Bool pastEnd = (ULong)block->index * BLOCK_SIZE >= file->size;
+        if ((block->index < firstWhole || block->index >= endWhole) && !pastEnd) {
+            continue;
+        }
+        error = remove_block(secfs->blockDB, block);
+        if (error == NULL) {
+            release_block_to_reclaim(secfs, block);
+        }
+    }
+    release_blocks(secfs->blockDB, blocksResult);
+    pthread_rwlock_unlock(keyLock);
+    if (error) {
+        return error;
+    }
+    
+    // Parts of blocks at the ends are overwritten with zeros, if the blocks exist
+    ULong headEnd = MIN(end, firstWhole * BLOCK_SIZE);
+    ULong tailStart = MAX(headEnd, endWhole * BLOCK_SIZE);
+    Byte *zeros = calloc(BLOCK_SIZE, 1);
+    error = write_blocks(secfs, file, zeros, headEnd - offset, offset, false);
+    if (error == NULL) {
+        error = write_blocks(secfs, file, zeros, end - tailStart, tailStart, false);
+    }
+    free(zeros);
+    return error;
+}
+
+Error allocate_item_data(Secfs *secfs, Item *file, ULong offset, ULong size) {
+    ULong end = offset + size;
+    if (end <= file->size) {
+        return NULL;
+    }
+    
+    // Blocks left past the end by a truncation of an earlier version would show up again
+    Error error = punch_item_data(secfs, file, file->size, end - file->size);
+    if (error == NULL) {
+        set_item_size(secfs, file, end);
+    }
+    return error;
+}
+
+Error truncate_item_data(Secfs *secfs, Item *file, ULong size) {
+    ULong previousSize = file->size;
+    set_item_size(secfs, file, size);
+    if (size >= previousSize) {
+        return NULL;
+    }
+    
+    // The bytes past the end would show up again when the file grows
+    return punch_item_data(secfs, file, size, previousSize - size);
+}
+
+// Makes a block of the destination refer to the block file of the source, or a hole if the source has none
+static Error share_block(Secfs *secfs, Item *source, UInt sourceIndex, Item *destination, UInt destinationIndex, Bool *shared) {
+    // Blocks are only shared while every shard uses the same data key
+    pthread_rwlock_t *sourceLock = key_lock(secfs, source->id);
+    pthread_rwlock_t *destinationLock = key_lock(secfs, destination->id);
+    pthread_rwlock_t *firstLock = sourceLock < destinationLock ? sourceLock : destinationLock;
+    pthread_rwlock_t *secondLock = sourceLock < destinationLock ? destinationLock : sourceLock;
+    pthread_rwlock_rdlock(firstLock);
+    if (secondLock != firstLock) {
+        pthread_rwlock_rdlock(secondLock);
+    }
+    *shared = !secfs->keys->rotating;
+    if (!*shared) {
+        if (secondLock != firstLock) {
+            pthread_rwlock_unlock(secondLock);
+        }
+        pthread_rwlock_unlock(firstLock);
+        return NULL;
+    }
+    
+    BlocksForFileResult sourceBlocks = all_blocks_for_file(secfs->blockDB, source->id);
+    BlocksForFileResult destinationBlocks = all_blocks_for_file(secfs->blockDB, destination->id);
+    Error error = sourceBlocks.error ? sourceBlocks.error : destinationBlocks.error;
+    if (error == NULL) {
+        Block *sourceBlock = find_block_with_index(sourceBlocks, sourceIndex);
+        Block *replacedBlock = find_block_with_index(destinationBlocks, destinationIndex);
+        if (sourceBlock != NULL) {
+            Block *block = ALLOC(Block);
+            memcpy(block, sourceBlock, sizeof(Block));
+            uuid_copy(block->fileId, destination->id);
+            block->index = destinationIndex;
+            retain_block_file(secfs->blockDB, block->id);
+            error = replacedBlock ? replace_block(secfs->blockDB, replacedBlock, block) : add_block(secfs->blockDB, block);
+            if (error) {
+                release_block_file(secfs->blockDB, block->id);
+                free(block);
+            }
+        }
+        else if (replacedBlock != NULL) {
+            error = remove_block(secfs->blockDB, replacedBlock);
+        }
+        if (error == NULL && replacedBlock != NULL) {
+            release_block_to_reclaim(secfs, replacedBlock);
+        }
+    }
+    
+    release_blocks(secfs->blockDB, destinationBlocks);
+    release_blocks(secfs->blockDB, sourceBlocks);
+    if (secondLock != firstLock) {
+        pthread_rwlock_unlock(secondLock);
+    }
+    pthread_rwlock_unlock(firstLock);
+    return error;
+}
+
+Error copy_item_data(Secfs *secfs, Item *source, ULong sourceOffset, Item *destination, ULong destinationOffset, ULong size) {
+    Bool aligned = sourceOffset % BLOCK_SIZE == destinationOffset % BLOCK_SIZE && source != destination;
+    Byte *buffer = NULL;
+    Error error = NULL;
+    ULong done = 0;
+    while (done < size && error == NULL) {
+        ULong position = sourceOffset + done;
+        ULong length = MIN(BLOCK_SIZE - position % BLOCK_SIZE, size - done);
+        ULong destinationPosition = destinationOffset + done;
+        
+        // A block is shared when the copy covers all of it, or its part within both files
+        Bool wholeBlock = length == BLOCK_SIZE ||
+            (position % BLOCK_SIZE == 0 && position + length >= source->size && destinationPosition + length >= destination->size);
+        Bool shared = false;
+        if (aligned && wholeBlock) {
+            error = share_block(secfs, source, (UInt)(position / BLOCK_SIZE), destination, (UInt)(destinationPosition / BLOCK_SIZE), &shared);
+        }
+        if (error == NULL && !shared) {
+            if (buffer == NULL) {
+                buffer = malloc(BLOCK_SIZE);
+                memory_charge(MemoryIOBuffers, BLOCK_SIZE);
+            }
+            error = read_item_data(secfs, source, buffer, length, position);
+            if (error == NULL) {
+                error = write_item_data(secfs, destination, buffer, length, destinationPosition);
+            }
+        }
+        done += length;
+        if (error == NULL) {
+            grow_item_size(secfs, destination, destinationPosition + length);
+        }
+    }
+    if (buffer != NULL) {
+        free(buffer);
+        memory_uncharge(MemoryIOBuffers, BLOCK_SIZE);
+    }
+    return error;
+}
+
+void rename_item(Secfs *secfs, Item *item, const String destinationPath) {
+    // Descendants of directories keep their path relative to the directory
+    ItemArray descendants = get_dir_descendants(secfs->indexDB, item->path);
+    ULong sourceLength = strlen(item->path);
+    for (UInt i = 0; i < descendants.length; i++) {
+        Item *descendant = descendants.items[i];
+        if (descendant == item) {
+            continue;
+        }
+        char newPath[PATH_MAX_LENGTH];
+        snprintf(newPath, sizeof newPath, "%s%s", destinationPath, descendant->path + sourceLength);
+        strcpy(descendant->path, newPath);
+    }
+    free(descendants.items);
+    strcpy(item->path, destinationPath);
+}
+
+Bool verify_key(ByteArray key, ByteArray iv, Cipher cipher, String dataPath) {
+    char keyFilePath[PATH_MAX_LENGTH];
+    snprintf(keyFilePath, sizeof keyFilePath, "%s%s", dataPath, KEY_FILE_NAME);
+    if (isFileExists(keyFilePath)) {
+        LoadKeysResult keysResult = load_volume_keys(dataPath, key, cipher);
+        free(keysResult.keys);
+        free(keysResult.salt.bytes);
+        return keysResult.error == NULL;
+    }
+    
     char encryptedIVPath[PATH_MAX_LENGTH];
     snprintf(encryptedIVPath, sizeof encryptedIVPath, "%s%s", dataPath, ENCRYPTED_IV_FILE_NAME);
     ReadFileResult readResult = readFile(encryptedIVPath);
@@ -230,11 +1438,11 @@ Bool verify_key(ByteArray key, ByteArray iv, String dataPath) {
         return false;
     }
     
-    AESDecryptResult decryptResult = aes_decrypt(readResult.contents, key, iv);
+    DecryptResult decryptResult = cipher_decrypt(cipher, readResult.contents, key, iv);
     if (decryptResult.error) {
         return false;
     }
-    UInt compareSize = MIN(iv.length, decryptResult.plainText.length);
+    ULong compareSize = MIN(iv.length, decryptResult.plainText.length);
     Int compareResult = memcmp(decryptResult.plainText.bytes, iv.bytes, compareSize);
     free(decryptResult.plainText.bytes);
     free(readResult.contents.bytes);
@@ -247,9 +1455,338 @@ LoadIVResult load_iv(String dataPath) {
     char ivFilePath[PATH_MAX_LENGTH];
     snprintf(ivFilePath, sizeof ivFilePath, "%s%s", dataPath, IV_FILE_NAME);
     ReadFileResult readResult = readFile(ivFilePath);
-    if (result.error) {
+    if (readResult.error) {
         result.error = readResult.error;
     }
     result.iv = readResult.contents;
     return result;
 }
+
+LoadVolumeHeaderResult load_volume_header(String dataPath) {
+    LoadVolumeHeaderResult result;
+    result.error = NULL;
+    memset(&result.header, 0, sizeof(VolumeHeader));
+    
+    char headerFilePath[PATH_MAX_LENGTH];
+    snprintf(headerFilePath, sizeof headerFilePath, "%s%s", dataPath, VOLUME_HEADER_FILE_NAME);
+    if (!isFileExists(headerFilePath)) {
+        // Legacy volume
+        strcpy(result.header.magic, VOLUME_HEADER_MAGIC);
+        result.header.version = 0;
+        result.header.cipher = CipherAES128CBC;
+        return result;
+    }
+    
+    ReadFileResult readResult = readFile(headerFilePath);
+    if (readResult.error) {
+        result.error = readResult.error;
+        return result;
+    }
+    
+    // Newer header versions only append fields, read whatever is known
+    memcpy(&result.header, readResult.contents.bytes, MIN(readResult.contents.length, sizeof(VolumeHeader)));
+    free(readResult.contents.bytes);
+    
+    if (strncmp(result.header.magic, VOLUME_HEADER_MAGIC, sizeof result.header.magic) != 0) {
+        result.error = "Invalid volume header";
+    }
+    else if (result.header.cipher >= CIPHER_COUNT) {
+        result.error = "Unsupported cipher in volume header";
+    }
+    else if (result.header.blockFanOut > BLOCK_FAN_OUT_MAX || result.header.previousBlockFanOut > BLOCK_FAN_OUT_MAX) {
+        result.error = "Unsupported block layout in volume header";
+    }
+    return result;
+}
+
+LoadIVResult load_password_salt(String dataPath) {
+    char keyFilePath[PATH_MAX_LENGTH];
+    snprintf(keyFilePath, sizeof keyFilePath, "%s%s", dataPath, KEY_FILE_NAME);
+    if (!isFileExists(keyFilePath)) {
+        // Volumes without a key file derive the password key with the volume iv
+        return load_iv(dataPath);
+    }
+    
+    LoadIVResult result = { NULL, initByteArray(IV_LENGTH) };
+    ReadFileResult readResult = readFile(keyFilePath);
+    if (readResult.error) {
+        result.error = readResult.error;
+        return result;
+    }
+    KeyFileHeader header;
+    if (readResult.contents.length < sizeof header) {
+        result.error = "Invalid key file";
+    }
+    else {
+        memcpy(&header, readResult.contents.bytes, sizeof header);
+        memcpy(result.iv.bytes, header.salt, IV_LENGTH);
+    }
+    free(readResult.contents.bytes);
+    return result;
+}
+
+Error change_password(String dataPath, ByteArray passwordKey, ByteArray newPasswordKey, ByteArray newSalt) {
+    LoadVolumeHeaderResult headerResult = load_volume_header(dataPath);
+    if (headerResult.error) {
+        return headerResult.error;
+    }
+    LoadIVResult ivResult = load_iv(dataPath);
+    if (ivResult.error) {
+        return ivResult.error;
+    }
+    Cipher cipher = (Cipher)headerResult.header.cipher;
+    
+    // Only the key file is rewritten, the data key it wraps stays the same
+    LoadKeysResult keysResult = load_or_create_volume_keys(dataPath, passwordKey, ivResult.iv, cipher);
+    free(ivResult.iv.bytes);
+    if (keysResult.error) {
+        return keysResult.error;
+    }
+    Error error = write_volume_keys(dataPath, keysResult.keys, newPasswordKey, newSalt, cipher);
+    free(keysResult.keys);
+    free(keysResult.salt.bytes);
+    return error;
+}
+
+Error start_key_rotation(Secfs *secfs) {
+    // Nothing may use the data key while it is replaced
+    for (UInt i = 0; i < KEY_LOCK_STRIPES; i++) {
+        pthread_rwlock_wrlock(&secfs->keyLocks[i]);
+    }
+    lock_archives(secfs);
+    
+    VolumeKeys keys = *secfs->keys;
+    memcpy(keys.previousKey, keys.key, KEY_LENGTH);
+    ByteArray newKey = get_random_bytes(KEY_LENGTH);
+    memcpy(keys.key, newKey.bytes, KEY_LENGTH);
+    free(newKey.bytes);
+    keys.rotating = true;
+    keys.rotatedShards = 0;
+    keys.indexRotated = false;
+    Error error = save_volume_keys(secfs, &keys);
+    if (error == NULL) {
+        // Shards are loaded with the key under the block database lock
+        pthread_mutex_lock(&secfs->blockDB->lock);
+        memcpy(secfs->keys, &keys, sizeof keys);
+        atomic_store(&secfs->blockDB->rotatedShards, 0);
+        pthread_mutex_unlock(&secfs->blockDB->lock);
+    }
+    
+    unlock_archives(secfs);
+    for (UInt i = KEY_LOCK_STRIPES; i > 0; i--) {
+        pthread_rwlock_unlock(&secfs->keyLocks[i - 1]);
+    }
+    return error;
+}
+
+Error rotate_index_key(Secfs *secfs, ByteArray indexRecords) {
+    char indexDBPath[PATH_MAX_LENGTH];
+    char nextPath[PATH_MAX_LENGTH + sizeof ROTATED_FILE_SUFFIX];
+    char referencesPath[PATH_MAX_LENGTH];
+    char nextReferencesPath[PATH_MAX_LENGTH + sizeof ROTATED_FILE_SUFFIX];
+    snprintf(indexDBPath, sizeof indexDBPath, "%s%s", secfs->dataPath, INDEX_DB_NAME);
+    snprintf(nextPath, sizeof nextPath, "%s%s", indexDBPath, ROTATED_FILE_SUFFIX);
+    snprintf(referencesPath, sizeof referencesPath, "%s%s", secfs->dataPath, BLOCK_REFERENCES_NAME);
+    snprintf(nextReferencesPath, sizeof nextReferencesPath, "%s%s", referencesPath, ROTATED_FILE_SUFFIX);
+    
+    // Without shared blocks the old counts file is dropped, it isn't readable with the new key
+    Error error = archive_records(nextPath, indexRecords, (Cipher)secfs->header.cipher, secfs->key, secfs->iv);
+    ByteArray references = pack_block_references(secfs->blockDB);
+    if (error == NULL && references.length > 0) {
+        error = archive_records(nextReferencesPath, references, (Cipher)secfs->header.cipher, secfs->key, secfs->iv);
+    }
+    else if (error == NULL && unlink(referencesPath) == ERROR && errno != ENOENT) {
+        error = strerror(errno);
+    }
+    free(references.bytes);
+    if (error) {
+        unlink(nextPath);
+        return error;
+    }
+    VolumeKeys keys = *secfs->keys;
+    keys.indexRotated = true;
+    error = save_volume_keys(secfs, &keys);
+    if (error) {
+        unlink(nextPath);
+        unlink(nextReferencesPath);
+        return error;
+    }
+    
+    // The key file says the new index is current, loading finishes the renames after a crash
+    secfs->keys->indexRotated = true;
+    if (rename(nextPath, indexDBPath) == ERROR) {
+        return strerror(errno);
+    }
+    if (isFileExists(nextReferencesPath) && rename(nextReferencesPath, referencesPath) == ERROR) {
+        return strerror(errno);
+    }
+    return NULL;
+}
+
+typedef struct {
+    Secfs *secfs;
+    Block **blocks;
+    Block *replacements;
+    atomic_ullong bytes;
+    _Atomic(Error) error; // First error of the workers
+} RotateShardTask;
+
+// Re-encrypts a block into a new file, the current file stays valid until the shard is switched
+static void rotate_block(UInt index, void *context) {
+    RotateShardTask *task = context;
+    Block *block = task->blocks[index];
+    Block *replacement = &task->replacements[index];
+    memcpy(replacement, block, sizeof(Block));
+    
+    ReadBlockResult readResult = read_block(task->secfs, block);
+    if (readResult.error) {
+        char blockPath[PATH_MAX_LENGTH];
+        // Missing blocks are left to fsck
+        if (find_block_file(task->secfs, block->id, blockPath)) {
+            record_task_error(&task->error, readResult.error);
+        }
+        return;
+    }
+    
+    uuid_generate(replacement->id);
+    ByteArray randomBytes = get_random_bytes(IV_LENGTH);
+    memcpy(replacement->iv, randomBytes.bytes, IV_LENGTH);
+    free(randomBytes.bytes);
+    Error error = encrypt_block_to_disk(task->secfs, replacement, readResult.bytes, task->secfs->key);
+    atomic_fetch_add(&task->bytes, readResult.bytes.length);
+    release_block_data(task->secfs, readResult.bytes);
+    if (error) {
+        record_task_error(&task->error, error);
+    }
+}
+
+// Switches the shard to its re-encrypted blocks, with the archives locked
+static Error commit_rotated_shard(Secfs *secfs, UInt shard, Block **blocks, const Block *replacements, const Block *originals, UInt length) {
+    BlockDB *db = secfs->blockDB;
+    char path[PATH_MAX_LENGTH];
+    char nextPath[PATH_MAX_LENGTH + sizeof ROTATED_FILE_SUFFIX];
+    shard_path(db, shard, path, sizeof path);
+    snprintf(nextPath, sizeof nextPath, "%s%s", path, ROTATED_FILE_SUFFIX);
+    
+    BlockShardSnapshot snapshot = replace_shard_blocks(db, shard, blocks, replacements, length);
+    Error error = NULL;
+    if (snapshot.records.length == 0) {
+        // Nothing to re-encrypt, a missing shard is empty under either key
+        if (unlink(path) == ERROR && errno != ENOENT) {
+            error = strerror(errno);
+        }
+    }
+    else {
+        error = archive_records(nextPath, snapshot.records, db->cipher, secfs->key, db->iv);
+    }
+    free(snapshot.records.bytes);
+    
+    if (error == NULL) {
+        VolumeKeys keys = *secfs->keys;
+        keys.rotatedShards = shard + 1;
+        error = save_volume_keys(secfs, &keys);
+    }
+    if (error) {
+        unlink(nextPath);
+        BlockShardSnapshot revertSnapshot = replace_shard_blocks(db, shard, blocks, originals, length);
+        free(revertSnapshot.records.bytes);
+        return error;
+    }
+    
+    secfs->keys->rotatedShards = shard + 1;
+    atomic_store(&db->rotatedShards, shard + 1);
+    if (snapshot.records.length > 0 && rename(nextPath, path) == ERROR) {
+        return strerror(errno);
+    }
+    set_shard_archived(db, shard, snapshot.version);
+    return NULL;
+}
+
+Error rotate_shard_key(Secfs *secfs, UInt shard, UInt threads, ULong *bytes) {
+    BlockDB *db = secfs->blockDB;
+    pthread_rwlock_t *keyLock = &secfs->keyLocks[shard % KEY_LOCK_STRIPES];
+    pthread_rwlock_wrlock(keyLock);
+    BlocksForFileResult blocks = blocks_in_shard(db, shard);
+    if (blocks.error) {
+        pthread_rwlock_unlock(keyLock);
+        return blocks.error;
+    }
+    
+    Block *originals = malloc(sizeof(Block) * MAX(blocks.length, 1));
+    for (UInt i = 0; i < blocks.length; i++) {
+        memcpy(&originals[i], blocks.blocks[i], sizeof(Block));
+    }
+    RotateShardTask task;
+    task.secfs = secfs;
+    task.blocks = blocks.blocks;
+    task.replacements = malloc(sizeof(Block) * MAX(blocks.length, 1));
+    atomic_init(&task.bytes, 0);
+    atomic_init(&task.error, NULL);
+    parallelFor(blocks.length, threads, rotate_block, &task);
+    
+    // New block files reach the disk before the shard refers to them
+    UInt rotatedLength = 0;
+    uuid_t *rotatedIds = malloc(sizeof(uuid_t) * MAX(blocks.length, 1));
+    for (UInt i = 0; i < blocks.length; i++) {
+        if (uuid_compare(task.replacements[i].id, originals[i].id) != 0) {
+            uuid_copy(rotatedIds[rotatedLength++], task.replacements[i].id);
+        }
+    }
+    Error error = atomic_load(&task.error);
+    if (error == NULL) {
+        SyncBlocksTask syncTask;
+        syncTask.secfs = secfs;
+        syncTask.ids = rotatedIds;
+        atomic_init(&syncTask.error, NULL);
+        parallelFor(rotatedLength, SYNC_THREADS, sync_block, &syncTask);
+        error = atomic_load(&syncTask.error);
+    }
+    free(rotatedIds);
+    
+    Bool committed = false;
+    if (error == NULL) {
+        lock_archives(secfs);
+        error = commit_rotated_shard(secfs, shard, blocks.blocks, task.replacements, originals, blocks.length);
+        committed = secfs->keys->rotatedShards > shard;
+        unlock_archives(secfs);
+    }
+    
+    // Drop whichever copy of the blocks is no longer referenced. If only the rename of the
+    // shard failed, loading finishes it and both copies are kept until then.
+    if (error == NULL || !committed) {
+        for (UInt i = 0; i < blocks.length; i++) {
+            if (uuid_compare(task.replacements[i].id, originals[i].id) == 0) {
+                continue;
+            }
+            // Every file gets its own copy of a shared block, the others keep using the original
+            if (!committed) {
+                delete_block_from_disk(secfs, &task.replacements[i]);
+            }
+            else if (release_block_file(db, originals[i].id)) {
+                delete_block_from_disk(secfs, &originals[i]);
+            }
+        }
+    }
+    
+    *bytes = atomic_load(&task.bytes);
+    free(task.replacements);
+    free(originals);
+    release_blocks(db, blocks);
+    pthread_rwlock_unlock(keyLock);
+    return error;
+}
+
+Error finish_key_rotation(Secfs *secfs) {
+    lock_archives(secfs);
+    VolumeKeys keys = *secfs->keys;
+    keys.rotating = false;
+    keys.rotatedShards = BLOCK_SHARD_COUNT;
+    keys.indexRotated = false;
+    memset(keys.previousKey, 0, KEY_LENGTH);
+    Error error = save_volume_keys(secfs, &keys);
+    if (error == NULL) {
+        memcpy(secfs->keys, &keys, sizeof keys);
+    }
+    unlock_archives(secfs);
+    return error;
+}
@@ -5,21 +5,112 @@
 #ifndef secfs_h
 #define secfs_h
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include "../utilities/utilities.h"
+#include "../utilities/bufferpool.h"
 #include "../db/indexdb.h"
 #include "../db/blockdb.h"
 
 #define INDEX_DB_NAME ".secfs"
-#define BLOCK_DB_NAME ".secfs_blocks"
+#define BLOCK_DB_NAME ".secfs_blocks" // Single file block database of older volumes, migrated to shards on load
+#define BLOCK_SHARDS_DIR_NAME ".secfs_blocks.d/"
 #define IV_FILE_NAME  ".secfs.iv"
 #define ENCRYPTED_IV_FILE_NAME  ".secfs.iv.enc"
+#define VOLUME_HEADER_FILE_NAME ".secfs.header"
+#define KEY_FILE_NAME ".secfs.key"
+#define BLOCK_REFERENCES_NAME ".secfs_refs" // Reference counts of block files shared by cloned files
+#define RECLAIM_QUEUE_NAME ".secfs_reclaim" // Ids of block files waiting to be deleted, unencrypted like the file names
+#define ROTATED_FILE_SUFFIX ".next" // Database file re-encrypted with the new key, until the key file says it's in use
+
+#define SYNC_THREADS 16
+#define KEY_LOCK_STRIPES 64 // Locks guarding the data key of the shards against a concurrent rotation
+#define BLOCK_IO_MEMORY (2 * BLOCK_SIZE) // Plain and encrypted copy of a block while it's read or written
+#define RECLAIM_COMPACT_BLOCKS 65536 // Deleted entries the reclaim file keeps before it's rewritten
+
+#define VOLUME_HEADER_MAGIC "SECFS"
+#define VOLUME_HEADER_VERSION 2
+
+#define BLOCK_FAN_OUT_MAX 2 // Levels of directories above the block files, each named after a byte of the block id
+#define DEFAULT_BLOCK_FAN_OUT 2 // ab/cd/<uuid>, 65536 directories
+
+// Unencrypted volume settings. Volumes created before the header existed have no header file
+// and are treated as version 0 volumes using AES-128-CBC. Before version 2 block files were
+// stored directly in the data directory.
+typedef struct {
+    char magic[8];
+    UInt version;
+    UInt cipher;
+    UInt blockFanOut;         // Layout block files are written in
+    UInt previousBlockFanOut; // Layout block files are moved from, the same unless a migration is in progress
+} VolumeHeader;
+
+#define KEY_FILE_MAGIC "SECKEY"
+#define KEY_FILE_VERSION 1
+
+// Unencrypted start of the key file, followed by the VolumeKeys encrypted with the key derived
+// from the password and this salt. Volumes created before the key file existed have none and
+// get one with their password key as data key when they are first loaded.
+typedef struct {
+    char magic[8];
+    UInt version;
+    Byte salt[IV_LENGTH];
+} KeyFileHeader;
+
+// A random data key encrypts the blocks and the databases, so changing the password only rewrites
+// the key file. While the data key is rotated, shards below rotatedShards and, once indexRotated is
+// set, the index use key and everything else previousKey.
+typedef struct {
+    char magic[8]; // Tells a wrong password apart with ciphers which don't authenticate
+    Byte key[KEY_LENGTH];
+    Byte previousKey[KEY_LENGTH];
+    UInt rotating;
+    UInt rotatedShards;
+    UInt indexRotated;
+} VolumeKeys;
+
+// Blocks written since they were last synced to disk
+typedef struct {
+    uuid_t *ids;
+    UInt length;
+    UInt max;
+    pthread_mutex_t lock;
+} DirtyBlockList;
+
+// Block files of deleted and truncated files. Released blocks are deleted only once archived databases
+// no longer refer to them: every archive appends the blocks released before its snapshot to the
+// reclaim file, which is worked through in the background and resumed after a crash or unmount.
+typedef struct {
+    uuid_t *released; // Since the last snapshot
+    UInt releasedLength;
+    UInt releasedMax;
+    uuid_t *queued; // Entries of the reclaim file, the ones before queuedStart are deleted
+    UInt queuedStart;
+    UInt queuedLength;
+    UInt queuedMax;
+    pthread_mutex_t lock;
+} ReclaimQueue;
 
 typedef struct {
     IndexDB *indexDB;
     BlockDB *blockDB;
     String dataPath;
-    ByteArray key;
+    ByteArray key; // Data key, see VolumeKeys
+    ByteArray previousKey;
     ByteArray iv; // used for database encryption only. All other files will have their own iv
+    VolumeHeader header;
+    DirtyBlockList dirtyBlocks;
+    VolumeKeys *keys;
+    ByteArray passwordKey;
+    ByteArray salt;
+    pthread_mutex_t archiveLock; // Database files and the key file are written by one thread at a time
+    pthread_mutex_t sizeLock; // File sizes change without the database lock, index snapshots hold it
+    pthread_rwlock_t keyLocks[KEY_LOCK_STRIPES]; // Taken for writing while the blocks of a shard are re-encrypted
+    BufferPool *blockBuffers; // Plain and encrypted blocks, of cipher_max_length(BLOCK_SIZE) bytes
+    Bool directIO; // Block files bypass the page cache of the host, see use_direct_block_io
+    atomic_bool blockMigration; // Block files may still be in the previous layout of the header
+    atomic_bool *blockDirectories; // Directories of the current layout known to exist
+    ReclaimQueue reclaim;
 }Secfs;
 
 typedef struct {
@@ -27,6 +118,14 @@ typedef struct {
     Secfs *secfs;
 } LoadSecfsResult;
 
+// Consistent copy of the databases, taken under the database lock and archived without it
+typedef struct {
+    ByteArray indexRecords;
+    BlockDBSnapshot blocks;
+    uuid_t *released; // Block files the snapshot no longer refers to
+    UInt releasedLength;
+} SecfsSnapshot;
+
 typedef struct {
     String error;
     ByteArray bytes;
@@ -37,16 +136,74 @@ typedef struct {
     ByteArray iv;
 } LoadIVResult;
 
-LoadSecfsResult init_secfs(String dataPath, ByteArray key, ByteArray iv);
+typedef struct {
+    String error;
+    VolumeHeader header;
+} LoadVolumeHeaderResult;
+
+LoadSecfsResult init_secfs(String dataPath, ByteArray key, ByteArray iv, Cipher cipher);
 LoadSecfsResult load_secfs(String dataPath, ByteArray key);
 Bool is_existing_secfs(String dataPath);
 Error archive_secfs(Secfs *secfs);
+ByteArray snapshot_secfs_index(Secfs *secfs);
+SecfsSnapshot snapshot_secfs(Secfs *secfs);
+Error archive_secfs_snapshot(Secfs *secfs, SecfsSnapshot snapshot);
+void free_secfs_snapshot(SecfsSnapshot snapshot);
+
+// Block files are spread over directories named after the first bytes of their id, so no directory
+// holds more than a few hundred files even on large volumes.
+UInt block_directory_count(UInt fanOut);
+void block_directory_path(Secfs *secfs, UInt fanOut, UInt directory, char *path); // PATH_MAX_LENGTH, ends with a slash
+Bool find_block_file(Secfs *secfs, const uuid_t id, char *path); // Where the file is, false if it's nowhere
 
+// Block files are moved to a layout with another number of levels while the volume is in use.
+// Until every directory of the previous layout is done, files are looked up in both layouts,
+// and a migration stopped by an unmount or a crash resumes on the next mount.
+Error start_block_migration(Secfs *secfs, UInt fanOut); // Before any block is read or written
+Error migrate_block_directory(Secfs *secfs, UInt directory, UInt max, UInt *moved); // Moves at most max files
+Error finish_block_migration(Secfs *secfs);
+
+// Block files are read and written with direct I/O, so the kernel doesn't cache the encrypted
+// blocks besides the plain pages of the mount. Set before any block is read or written.
+Error use_direct_block_io(Secfs *secfs, Bool enabled);
+// Block files hold the bytes of the block up to the end of the file only. The length of a read block
+// is the stored length, the rest of its buffer up to BLOCK_SIZE is filled with zeros.
 ReadBlockResult read_block(Secfs *secfs, Block *block);
-Error write_block(Secfs *secfs, Block *block, ByteArray data);
+// Blocks of read_block and acquire_block_data are pooled and handed back with release_block_data
+ByteArray acquire_block_data(Secfs *secfs); // BLOCK_SIZE zeros
+void release_block_data(Secfs *secfs, ByteArray data);
+Error write_block(Secfs *secfs, Block *block, ByteArray data); // Stores data.length bytes
 Error delete_block_from_disk(Secfs *secfs, Block *block);
+Error sync_dirty_blocks(Secfs *secfs);
+// Removes the item and its descendants right away, their block files go to the reclaim queue
 void purge_item(Secfs *secfs, Item *item);
-Bool verify_key(ByteArray key, ByteArray iv, String dataPath);
+// Deletes at most max block files of the reclaim queue, returns how many, 0 once it's empty
+UInt reclaim_blocks(Secfs *secfs, UInt max);
+UInt reclaim_queue_length(Secfs *secfs); // Archived and waiting to be deleted
+Error read_item_data(Secfs *secfs, Item *file, Byte *out, ULong size, ULong offset);
+Error write_item_data(Secfs *secfs, Item *file, const Byte *data, ULong size, ULong offset);
+// Drops the blocks within the range, the parts of blocks at its ends are overwritten with zeros
+Error punch_item_data(Secfs *secfs, Item *file, ULong offset, ULong size);
+// Extends the file without writing anything, holes read as zeros
+Error allocate_item_data(Secfs *secfs, Item *file, ULong offset, ULong size);
+// Sets the size, blocks past a smaller end are dropped and the last block is cut at the end
+Error truncate_item_data(Secfs *secfs, Item *file, ULong size);
+// Whole blocks are shared with the destination instead of copied, either file copies them on write
+Error copy_item_data(Secfs *secfs, Item *source, ULong sourceOffset, Item *destination, ULong destinationOffset, ULong size);
+void rename_item(Secfs *secfs, Item *item, const String destinationPath);
+Bool verify_key(ByteArray key, ByteArray iv, Cipher cipher, String dataPath);
 LoadIVResult load_iv(String dataPath);
+LoadIVResult load_password_salt(String dataPath);
+LoadVolumeHeaderResult load_volume_header(String dataPath);
+Error change_password(String dataPath, ByteArray passwordKey, ByteArray newPasswordKey, ByteArray newSalt);
+
+// Data key rotation. Blocks are re-encrypted shard by shard, each shard is switched to the new key
+// by a single write of the key file, so a rotation resumes where it stopped after a crash.
+void lock_archives(Secfs *secfs);
+void unlock_archives(Secfs *secfs);
+Error start_key_rotation(Secfs *secfs);
+Error rotate_index_key(Secfs *secfs, ByteArray indexRecords); // With the archives locked
+Error rotate_shard_key(Secfs *secfs, UInt shard, UInt threads, ULong *bytes);
+Error finish_key_rotation(Secfs *secfs);
 
 #endif /* secfs_h */
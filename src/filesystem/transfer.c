@@ -0,0 +1,515 @@
+//
+//  Created by Stasel
+//
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "transfer.h"
+
+#define TRANSFER_PROGRESS_BLOCKS 2048
+
+typedef struct {
+    Item *item;
+    String path; // Source file of an import, destination file of an export
+} TransferFile;
+
+typedef struct {
+    UInt fileIndex;
+    UInt index;
+    Block block;    // Export only
+    ByteArray data; // Plain text handed from the first stage to the second
+} TransferJob;
+
+typedef struct Transfer Transfer;
+typedef Error (*TransferStage)(Transfer *transfer, TransferJob *job);
+
+// Jobs go through the first stage on one group of threads and are queued for the second stage
+// on another. The queue is bounded, so at most a few blocks per thread are held in memory.
+struct Transfer {
+    Secfs *secfs;
+    TransferFile *files;
+    UInt filesLength;
+    UInt filesMax;
+    UInt directories;
+    TransferJob *jobs;
+    UInt jobsLength;
+    UInt jobsMax;
+    atomic_uint nextJob;
+    TransferStage firstStage;
+    TransferStage secondStage;
+
+    TransferJob **queue;
+    UInt queueCapacity;
+    UInt queueHead;
+    UInt queueLength;
+    UInt producers; // First stage threads still running
+    pthread_mutex_t queueLock;
+    pthread_cond_t queueNotEmpty;
+    pthread_cond_t queueNotFull;
+
+    atomic_ullong bytes;
+    atomic_uint doneJobs;
+    atomic_uint failures;
+    pthread_mutex_t outputLock;
+};
+
+static void init_transfer(Transfer *transfer, Secfs *secfs) {
+    memset(transfer, 0, sizeof(Transfer));
+    transfer->secfs = secfs;
+    pthread_mutex_init(&transfer->queueLock, NULL);
+    pthread_cond_init(&transfer->queueNotEmpty, NULL);
+    pthread_cond_init(&transfer->queueNotFull, NULL);
+    pthread_mutex_init(&transfer->outputLock, NULL);
+}
+
+static void free_transfer(Transfer *transfer) {
+    for (UInt i = 0; i < transfer->filesLength; i++) {
+        free(transfer->files[i].path);
+    }
+    free(transfer->files);
+    free(transfer->jobs);
+    free(transfer->queue);
+    pthread_mutex_destroy(&transfer->queueLock);
+    pthread_cond_destroy(&transfer->queueNotEmpty);
+    pthread_cond_destroy(&transfer->queueNotFull);
+    pthread_mutex_destroy(&transfer->outputLock);
+}
+
+static void report(Transfer *transfer, const String format, ...) {
+    pthread_mutex_lock(&transfer->outputLock);
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+    pthread_mutex_unlock(&transfer->outputLock);
+}
+
+static UInt add_file(Transfer *transfer, Item *item, const String path) {
+    if (transfer->filesLength >= transfer->filesMax) {
+        transfer->filesMax = MAX(transfer->filesMax * 2, 256);
+        transfer->files = realloc(transfer->files, sizeof(TransferFile) * transfer->filesMax);
+    }
+    TransferFile *file = &transfer->files[transfer->filesLength];
+    file->item = item;
+    file->path = malloc(strlen(path) + 1);
+    strcpy(file->path, path);
+    return transfer->filesLength++;
+}
+
+static TransferJob* add_job(Transfer *transfer, UInt fileIndex, UInt index) {
+    if (transfer->jobsLength >= transfer->jobsMax) {
+        transfer->jobsMax = MAX(transfer->jobsMax * 2, 1024);
+        transfer->jobs = realloc(transfer->jobs, sizeof(TransferJob) * transfer->jobsMax);
+    }
+    TransferJob *job = &transfer->jobs[transfer->jobsLength++];
+    memset(job, 0, sizeof(TransferJob));
+    job->fileIndex = fileIndex;
+    job->index = index;
+    return job;
+}
+
+// Bytes of a file stored in one of its blocks
+static UInt block_length(Item *file, UInt index) {
+    return (UInt)MIN((ULong)BLOCK_SIZE, file->size - (ULong)index * BLOCK_SIZE);
+}
+
+static void push_job(Transfer *transfer, TransferJob *job) {
+    pthread_mutex_lock(&transfer->queueLock);
+    while (transfer->queueLength == transfer->queueCapacity) {
+        pthread_cond_wait(&transfer->queueNotFull, &transfer->queueLock);
+    }
+    transfer->queue[(transfer->queueHead + transfer->queueLength) % transfer->queueCapacity] = job;
+    transfer->queueLength++;
+    pthread_cond_signal(&transfer->queueNotEmpty);
+    pthread_mutex_unlock(&transfer->queueLock);
+}
+
+// Waits for the next job, NULL once the first stage is done and the queue is drained
+static TransferJob* pop_job(Transfer *transfer) {
+    pthread_mutex_lock(&transfer->queueLock);
+    while (transfer->queueLength == 0 && transfer->producers > 0) {
+        pthread_cond_wait(&transfer->queueNotEmpty, &transfer->queueLock);
+    }
+    TransferJob *job = NULL;
+    if (transfer->queueLength > 0) {
+        job = transfer->queue[transfer->queueHead];
+        transfer->queueHead = (transfer->queueHead + 1) % transfer->queueCapacity;
+        transfer->queueLength--;
+        pthread_cond_signal(&transfer->queueNotFull);
+    }
+    pthread_mutex_unlock(&transfer->queueLock);
+    return job;
+}
+
+static void finish_job(Transfer *transfer, TransferJob *job, Error error) {
+    if (error) {
+        atomic_fetch_add(&transfer->failures, 1);
+        report(transfer, "[ERROR] %s, block %u: %s", transfer->files[job->fileIndex].item->path, job->index, error);
+    }
+    release_block_data(transfer->secfs, job->data);
+    job->data.bytes = NULL;
+
+    UInt done = atomic_fetch_add(&transfer->doneJobs, 1) + 1;
+    if (done % TRANSFER_PROGRESS_BLOCKS == 0 && isatty(STDERR_FILENO)) {
+        report(transfer, "%u of %u blocks, %.1f MB", done, transfer->jobsLength, (double)atomic_load(&transfer->bytes) / (1024.0 * 1024.0));
+    }
+}
+
+static void* run_first_stage(void *arg) {
+    Transfer *transfer = arg;
+    while (true) {
+        UInt next = atomic_fetch_add(&transfer->nextJob, 1);
+        if (next >= transfer->jobsLength) {
+            break;
+        }
+        TransferJob *job = &transfer->jobs[next];
+        Error error = transfer->firstStage(transfer, job);
+        if (error || job->data.bytes == NULL) {
+            finish_job(transfer, job, error);
+            continue;
+        }
+        push_job(transfer, job);
+    }
+
+    pthread_mutex_lock(&transfer->queueLock);
+    transfer->producers--;
+    if (transfer->producers == 0) {
+        pthread_cond_broadcast(&transfer->queueNotEmpty);
+    }
+    pthread_mutex_unlock(&transfer->queueLock);
+    return NULL;
+}
+
+static void* run_second_stage(void *arg) {
+    Transfer *transfer = arg;
+    TransferJob *job;
+    while ((job = pop_job(transfer)) != NULL) {
+        finish_job(transfer, job, transfer->secondStage(transfer, job));
+    }
+    return NULL;
+}
+
+static void run_pipeline(Transfer *transfer, UInt firstThreads, UInt secondThreads) {
+    transfer->queueCapacity = MAX(MAX(firstThreads, secondThreads) * TRANSFER_QUEUE_BLOCKS, 1);
+    transfer->queue = malloc(sizeof(TransferJob*) * transfer->queueCapacity);
+    transfer->producers = firstThreads;
+
+    UInt threadsCount = firstThreads + secondThreads;
+    pthread_t *threads = malloc(sizeof(pthread_t) * threadsCount);
+    for (UInt i = 0; i < threadsCount; i++) {
+        void* (*stage)(void*) = i < firstThreads ? run_first_stage : run_second_stage;
+        if (pthread_create(&threads[i], NULL, stage, transfer) != 0) {
+            fatalError("Couldn't start transfer threads: %s", strerror(errno));
+        }
+    }
+    for (UInt i = 0; i < threadsCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+static Int compare_item_paths(const void *a, const void *b) {
+    return strcmp((*(Item* const*)a)->path, (*(Item* const*)b)->path);
+}
+
+// Existing items by path, looked up without scanning the whole index for every imported file
+static Item** sorted_items(IndexDB *indexDB) {
+    Item **items = malloc(sizeof(Item*) * MAX(indexDB->length, 1));
+    memcpy(items, indexDB->items, sizeof(Item*) * indexDB->length);
+    qsort(items, indexDB->length, sizeof(Item*), compare_item_paths);
+    return items;
+}
+
+static Item* find_sorted_item(Item **items, UInt length, const String path) {
+    Item key;
+    strcpy(key.path, path);
+    Item *keyPointer = &key;
+    Item **found = bsearch(&keyPointer, items, length, sizeof(Item*), compare_item_paths);
+    return found ? *found : NULL;
+}
+
+// MARK: - Import
+
+typedef struct {
+    Item **existing;
+    UInt existingLength;
+} ImportWalk;
+
+static Error read_source_block(Transfer *transfer, TransferJob *job) {
+    TransferFile *file = &transfer->files[job->fileIndex];
+    UInt length = block_length(file->item, job->index);
+    Int fd = open(file->path, O_RDONLY);
+    if (fd == ERROR) {
+        return strerror(errno);
+    }
+
+    // The last block is stored up to the end of the file
+    job->data = acquire_block_data(transfer->secfs);
+    job->data.length = length;
+    UInt done = 0;
+    while (done < length) {
+        ssize_t count = pread(fd, job->data.bytes + done, length - done, (off_t)((ULong)job->index * BLOCK_SIZE + done));
+        if (count == ERROR && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            Error error = count == 0 ? "File was truncated while importing it" : strerror(errno);
+            close(fd);
+            release_block_data(transfer->secfs, job->data);
+            job->data.bytes = NULL;
+            return error;
+        }
+        done += (UInt)count;
+    }
+    close(fd);
+    atomic_fetch_add(&transfer->bytes, length);
+
+    // Ranges of zeros are stored as holes, like blocks which were never written
+    Bool zeros = true;
+    for (UInt i = 0; i < length && zeros; i++) {
+        zeros = job->data.bytes[i] == 0;
+    }
+    if (zeros) {
+        release_block_data(transfer->secfs, job->data);
+        job->data.bytes = NULL;
+    }
+    return NULL;
+}
+
+static Error encrypt_block(Transfer *transfer, TransferJob *job) {
+    Secfs *secfs = transfer->secfs;
+    Block *block = generate_block(transfer->files[job->fileIndex].item->id, job->index);
+    Error error = write_block(secfs, block, job->data);
+    if (error) {
+        free(block);
+        return error;
+    }
+    return add_block(secfs->blockDB, block);
+}
+
+static void import_directory(Transfer *transfer, ImportWalk *walk, const String sourceDir, const String volumeDir) {
+    DIR *dir = opendir(sourceDir);
+    if (dir == NULL) {
+        atomic_fetch_add(&transfer->failures, 1);
+        report(transfer, "[ERROR] Couldn't list %s: %s", sourceDir, strerror(errno));
+        return;
+    }
+
+    IndexDB *indexDB = transfer->secfs->indexDB;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+        char sourcePath[PATH_MAX];
+        char volumePath[PATH_MAX];
+        snprintf(sourcePath, sizeof sourcePath, "%s/%s", sourceDir, entry->d_name);
+        snprintf(volumePath, sizeof volumePath, "%s/%s", strcmp(volumeDir, "/") == 0 ? "" : volumeDir, entry->d_name);
+        if (strlen(volumePath) >= sizeof(((Item*)NULL)->path)) {
+            report(transfer, "[Warning] %s: path is too long, skipped", sourcePath);
+            continue;
+        }
+
+        struct stat stats;
+        if (lstat(sourcePath, &stats) == ERROR) {
+            atomic_fetch_add(&transfer->failures, 1);
+            report(transfer, "[ERROR] %s: %s", sourcePath, strerror(errno));
+            continue;
+        }
+        Item *existing = find_sorted_item(walk->existing, walk->existingLength, volumePath);
+        if (S_ISDIR(stats.st_mode)) {
+            if (existing != NULL && existing->type != ItemTypeDir) {
+                report(transfer, "[Warning] %s already exists as a file, skipped", volumePath);
+                continue;
+            }
+            if (existing == NULL) {
+                add_item(indexDB, create_item(ItemTypeDir, volumePath));
+                transfer->directories++;
+            }
+            import_directory(transfer, walk, sourcePath, volumePath);
+        }
+        else if (S_ISREG(stats.st_mode)) {
+            if (existing != NULL) {
+                report(transfer, "[Warning] %s already exists, skipped", volumePath);
+                continue;
+            }
+            Item *file = create_item(ItemTypeFile, volumePath);
+            file->size = (ULong)stats.st_size;
+            add_item(indexDB, file);
+            UInt fileIndex = add_file(transfer, file, sourcePath);
+            UInt blocks = (UInt)((file->size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+            for (UInt index = 0; index < blocks; index++) {
+                add_job(transfer, fileIndex, index);
+            }
+        }
+        else {
+            report(transfer, "[Warning] %s is not a regular file or directory, skipped", sourcePath);
+        }
+    }
+    closedir(dir);
+}
+
+Error import_tree(Secfs *secfs, const String sourcePath, TransferOptions options) {
+    ULong start = monotonicNanos();
+    Transfer transfer;
+    init_transfer(&transfer, secfs);
+    transfer.firstStage = read_source_block;
+    transfer.secondStage = encrypt_block;
+
+    // Items are added up front, the databases are only written once every block is on disk
+    ImportWalk walk = { sorted_items(secfs->indexDB), secfs->indexDB->length };
+    import_directory(&transfer, &walk, sourcePath, "/");
+    free(walk.existing);
+
+    run_pipeline(&transfer, TRANSFER_IO_THREADS, MAX(options.threads, 1));
+
+    Error error = NULL;
+    if (atomic_load(&transfer.failures) > 0) {
+        error = "Some files couldn't be imported, the secure folder was left unchanged. Blocks written so far are reclaimed by secfs fsck --repair";
+    }
+    if (error == NULL) {
+        error = sync_dirty_blocks(secfs);
+    }
+    if (error == NULL) {
+        error = archive_secfs(secfs);
+    }
+    if (error == NULL) {
+        double seconds = (double)(monotonicNanos() - start) / 1e9;
+        double megabytes = (double)atomic_load(&transfer.bytes) / (1024.0 * 1024.0);
+        printf("Imported %u files and %u directories, %.1f MB in %.1f s (%.1f MB/s)\n", transfer.filesLength, transfer.directories,
+               megabytes, seconds, megabytes / MAX(seconds, 1e-9));
+    }
+    free_transfer(&transfer);
+    return error;
+}
+
+// MARK: - Export
+
+static Error decrypt_block(Transfer *transfer, TransferJob *job) {
+    ReadBlockResult readResult = read_block(transfer->secfs, &job->block);
+    if (readResult.error) {
+        return readResult.error;
+    }
+    job->data = readResult.bytes;
+    return NULL;
+}
+
+static Error write_destination_block(Transfer *transfer, TransferJob *job) {
+    TransferFile *file = &transfer->files[job->fileIndex];
+    UInt length = block_length(file->item, job->index);
+    Int fd = open(file->path, O_WRONLY);
+    if (fd == ERROR) {
+        return strerror(errno);
+    }
+
+    UInt done = 0;
+    while (done < length) {
+        ssize_t count = pwrite(fd, job->data.bytes + done, length - done, (off_t)((ULong)job->index * BLOCK_SIZE + done));
+        if (count == ERROR && errno == EINTR) {
+            continue;
+        }
+        if (count == ERROR) {
+            Error error = strerror(errno);
+            close(fd);
+            return error;
+        }
+        done += (UInt)count;
+    }
+    close(fd);
+    atomic_fetch_add(&transfer->bytes, length);
+    return NULL;
+}
+
+// Creates the file at its full size, blocks which don't exist are left as holes
+static Error create_destination_file(Transfer *transfer, Item *item, const String path) {
+    Int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == ERROR) {
+        return strerror(errno);
+    }
+    Int result = ftruncate(fd, (off_t)item->size);
+    close(fd);
+    if (result == ERROR) {
+        return strerror(errno);
+    }
+
+    BlocksForFileResult blocks = all_blocks_for_file(transfer->secfs->blockDB, item->id);
+    if (blocks.error) {
+        release_blocks(transfer->secfs->blockDB, blocks);
+        return blocks.error;
+    }
+    UInt fileIndex = add_file(transfer, item, path);
+    for (UInt i = 0; i < blocks.length; i++) {
+        // Blocks past the end were left behind by truncation
+        if ((ULong)blocks.blocks[i]->index * BLOCK_SIZE >= item->size) {
+            continue;
+        }
+        TransferJob *job = add_job(transfer, fileIndex, blocks.blocks[i]->index);
+        job->block = *blocks.blocks[i];
+    }
+    release_blocks(transfer->secfs->blockDB, blocks);
+    return NULL;
+}
+
+Error export_tree(Secfs *secfs, const String destinationPath, TransferOptions options) {
+    ULong start = monotonicNanos();
+    Transfer transfer;
+    init_transfer(&transfer, secfs);
+    transfer.firstStage = decrypt_block;
+    transfer.secondStage = write_destination_block;
+
+    if (mkdir(destinationPath, 0755) == ERROR && errno != EEXIST) {
+        free_transfer(&transfer);
+        return strerror(errno);
+    }
+
+    // Parents sort before their children
+    Item **items = sorted_items(secfs->indexDB);
+    for (UInt i = 0; i < secfs->indexDB->length; i++) {
+        Item *item = items[i];
+        if (strcmp(item->path, "/") == 0) {
+            continue;
+        }
+        char path[PATH_MAX];
+        snprintf(path, sizeof path, "%s%s", destinationPath, item->path);
+        Error error = NULL;
+        if (item->type == ItemTypeDir) {
+            if (mkdir(path, 0755) == ERROR && errno != EEXIST) {
+                error = strerror(errno);
+            }
+            transfer.directories++;
+        }
+        else {
+            error = create_destination_file(&transfer, item, path);
+        }
+        if (error) {
+            atomic_fetch_add(&transfer.failures, 1);
+            report(&transfer, "[ERROR] %s: %s", path, error);
+        }
+    }
+    free(items);
+
+    run_pipeline(&transfer, MAX(options.threads, 1), TRANSFER_IO_THREADS);
+
+    Error error = NULL;
+    if (atomic_load(&transfer.failures) > 0) {
+        error = "Some files couldn't be exported";
+    }
+    else {
+        double seconds = (double)(monotonicNanos() - start) / 1e9;
+        double megabytes = (double)atomic_load(&transfer.bytes) / (1024.0 * 1024.0);
+        printf("Exported %u files and %u directories, %.1f MB in %.1f s (%.1f MB/s)\n", transfer.filesLength, transfer.directories,
+               megabytes, seconds, megabytes / MAX(seconds, 1e-9));
+    }
+    free_transfer(&transfer);
+    return error;
+}
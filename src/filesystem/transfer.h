@@ -0,0 +1,26 @@
+//
+//  Created by Stasel
+//
+
+#ifndef transfer_h
+#define transfer_h
+
+#include "../utilities/utilities.h"
+#include "secfs.h"
+
+#define TRANSFER_IO_THREADS 8    // Threads reading the source files of an import or writing the files of an export
+#define TRANSFER_QUEUE_BLOCKS 4  // Blocks waiting between the stages, per encryption thread
+
+typedef struct {
+    UInt threads; // Encryption or decryption threads
+} TransferOptions;
+
+// Copies a directory tree into an unmounted secure folder without going through FUSE. Source
+// files are read, encrypted and written as whole blocks by pipelined stages, and the databases
+// are archived once at the end. Nothing is added to the secure folder if any file fails.
+Error import_tree(Secfs *secfs, const String sourcePath, TransferOptions options);
+
+// Decrypts every file of an unmounted secure folder into a directory
+Error export_tree(Secfs *secfs, const String destinationPath, TransferOptions options);
+
+#endif /* transfer_h */
@@ -7,81 +7,401 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <getopt.h>
 #include "utilities/utilities.h"
 #include "filesystem/filesystem.h"
 #include "security/passwordinput.h"
+#include "security/cipherbench.h"
+#include "filesystem/fsck.h"
+#include "filesystem/transfer.h"
 
 void show_help(void) {
-    printf("Usage: secfs <secure folder> <mount point>\n\n");
+    printf("Usage: secfs [options] <secure folder> <mount point>\n");
+    printf("       secfs fsck [--repair] [--no-verify] [--threads <count>] <secure folder>\n");
+    printf("       secfs import [--threads <count>] [--cipher <name>] <source folder> <secure folder>\n");
+    printf("       secfs export [--threads <count>] <secure folder> <destination folder>\n");
+    printf("       secfs passwd <secure folder>\n");
+    printf("       secfs --bench-ciphers\n\n");
+    printf("Options:\n");
+    printf("  --cipher <name>     Cipher suite for a new secure folder (default: %s)\n", cipher_name(DEFAULT_CIPHER));
+    printf("                      One of:");
+    for (Int i = 0; i < CIPHER_COUNT; i++) {
+        printf(" %s", cipher_name((Cipher)i));
+    }
+    printf("\n");
+    printf("  --bench-ciphers     Measure cipher throughput on this host and recommend the fastest\n");
+    printf("  --cache-timeout <seconds>\n");
+    printf("                      How long the kernel may cache names and attributes (default: %.1f, 0 disables)\n", DEFAULT_CACHE_TIMEOUT_SEC);
+    printf("  --negative-timeout <seconds>\n");
+    printf("                      How long the kernel may cache missing names (default: %.1f, 0 disables)\n", DEFAULT_CACHE_TIMEOUT_SEC);
+    printf("  --no-keep-cache     Drop cached file pages whenever a file is opened\n");
+    printf("  --direct-io-size <MB>\n");
+    printf("                      Bypass the page cache for files of at least this size (default: off)\n");
+    printf("  --low-level         Use the inode based FUSE low-level interface with asynchronous file I/O\n");
+    printf("  --trace <file>      Trace requests and their phases, written to <file> on SIGUSR1 and unmount\n");
+    printf("  --rotate-key        Re-encrypt the secure folder with a new data key while it is mounted\n");
+    printf("  --rotate-rate <MB/s>\n");
+    printf("                      Limit of the key rotation (default: %.0f, 0 for no limit)\n", DEFAULT_KEY_ROTATION_RATE);
+    printf("  --fan-out <levels>  Move the block files to 0, 1 or 2 levels of directories while mounted (default for new folders: %d)\n", DEFAULT_BLOCK_FAN_OUT);
+    printf("  --reclaim-rate <files/s>\n");
+    printf("                      Block files of deleted files removed in the background per second (default: %.0f, 0 for no limit)\n", DEFAULT_RECLAIM_RATE);
+    printf("  --memory-limit <MB>\n");
+    printf("                      Memory for metadata and I/O buffers, above it caches shrink and I/O waits (default: off)\n");
+    printf("  --huge-pages        Back the pooled block buffers with transparent huge pages\n");
+    printf("  --direct-backing-io Read and write block files with O_DIRECT, so only the mount caches file data\n\n");
+    printf("passwd changes the password of an unmounted secure folder without re-encrypting it\n\n");
+    printf("fsck checks an unmounted secure folder:\n");
+    printf("  --repair            Reclaim leftover blocks and files and rewrite the databases\n");
+    printf("  --no-verify         Don't read and decrypt every block\n");
+    printf("  --threads <count>   Shards checked in parallel (default: twice the number of cores)\n\n");
+    printf("import and export copy files into or out of an unmounted secure folder:\n");
+    printf("  --threads <count>   Encryption or decryption threads (default: the number of cores)\n\n");
 }
 
-int main(int argc, String argv[]) {
-    
-    if (argc < 3) {
+double parse_number_option(const String name, const String value) {
+    char *end;
+    double number = strtod(value, &end);
+    if (end == value || *end != '\0' || number < 0) {
+        fatalError("Invalid value '%s' for --%s", value, name);
+    }
+    return number;
+}
+
+// Appends a trailing '/' to the data path if missing
+String normalize_data_path(String dataPath) {
+    if (dataPath[strlen(dataPath) - 1] == '/') {
+        return dataPath;
+    }
+    String normalized = malloc(strlen(dataPath) + 2);
+    strcpy(normalized, dataPath);
+    strcat(normalized, "/");
+    return normalized;
+}
+
+// Asks for the password of an existing secure folder until it's correct
+ByteArray ask_password(String dataPath) {
+    LoadIVResult ivResult = load_iv(dataPath);
+    if (ivResult.error) {
+        fatalError("Could not load secure folder: %s",ivResult.error);
+    }
+    ByteArray iv = ivResult.iv;
+    LoadIVResult saltResult = load_password_salt(dataPath);
+    if (saltResult.error) {
+        fatalError("Could not load secure folder: %s", saltResult.error);
+    }
+    LoadVolumeHeaderResult headerResult = load_volume_header(dataPath);
+    if (headerResult.error) {
+        fatalError("Could not load secure folder: %s", headerResult.error);
+    }
+    ByteArray key;
+    while (true) {
+        key = enter_password(saltResult.iv);
+        if(verify_key(key, iv, (Cipher)headerResult.header.cipher, dataPath)) {
+            break;
+        }
+        printf("\nIncorrect password. Please try again\n");
+    }
+    free(saltResult.iv.bytes);
+    return key;
+}
+
+// Asks for the password until it's correct and loads an existing secure folder
+Secfs* unlock_secfs(String dataPath, ULong *loadNanos) {
+    ByteArray key = ask_password(dataPath);
+
+    ULong loadStart = monotonicNanos();
+    LoadSecfsResult loadResult = load_secfs(dataPath, key);
+    *loadNanos = monotonicNanos() - loadStart;
+    if (loadResult.error) {
+        fatalError("Could not load secure folder: %s",loadResult.error);
+    }
+    return loadResult.secfs;
+}
+
+// Initializes a new secure folder with a new password
+Secfs* create_secfs(String dataPath, Cipher cipher) {
+    ByteArray iv = get_random_bytes(IV_LENGTH);
+    ByteArray key = setup_password(iv);
+
+    LoadSecfsResult initResult = init_secfs(dataPath, key, iv, cipher);
+    if (initResult.error) {
+        fatalError("Could not initialize secure folder: %s", initResult.error);
+    }
+    printf("\n\nSecfs folder has been successfully initialized at %s (cipher: %s)\n", dataPath, cipher_name(cipher));
+    printf("!!! If you lose your password, you will lose access to your data. Please keep your password safe\n\n");
+    return initResult.secfs;
+}
+
+// Changing the password rewraps the data key, nothing else is re-encrypted
+int passwd_main(int argc, String argv[]) {
+    if (argc < 2 || strcmp(argv[1], "--help") == 0) {
+        show_help();
+        return argc < 2;
+    }
+    String dataPath = normalize_data_path(argv[1]);
+    if (!is_existing_secfs(dataPath)) {
+        fatalError("Couldn't find secfs in '%s'", dataPath);
+    }
+
+    printf("Current password\n");
+    ByteArray key = ask_password(dataPath);
+    printf("\nNew password\n");
+    ByteArray salt = get_random_bytes(IV_LENGTH);
+    ByteArray newKey = setup_password(salt);
+    Error error = change_password(dataPath, key, newKey, salt);
+    if (error) {
+        fatalError("Could not change the password: %s", error);
+    }
+    printf("\n\nPassword changed\n");
+    return 0;
+}
+
+int fsck_main(int argc, String argv[]) {
+    FsckOptions fsckOptions = { false, true, cpuCount() * 2 };
+    static struct option options[] = {
+        { "repair", no_argument, NULL, 'r' },
+        { "no-verify", no_argument, NULL, 'v' },
+        { "threads", required_argument, NULL, 't' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Int option;
+    while ((option = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (option) {
+            case 'r':
+                fsckOptions.repair = true;
+                break;
+            case 'v':
+                fsckOptions.verify = false;
+                break;
+            case 't':
+                fsckOptions.threads = MAX((UInt)parse_number_option("threads", optarg), 1);
+                break;
+            case 'h':
+                show_help();
+                return 0;
+            default:
+                show_help();
+                return FSCK_FAILED;
+        }
+    }
+    if (argc - optind < 1) {
+        show_help();
+        return FSCK_FAILED;
+    }
+
+    String dataPath = normalize_data_path(argv[optind]);
+    if (!is_existing_secfs(dataPath)) {
+        fatalError("Couldn't find secfs in '%s'", dataPath);
+    }
+    ULong loadNanos;
+    Secfs *secfs = unlock_secfs(dataPath, &loadNanos);
+    printf("\n\nChecking %s with %u threads%s\n", dataPath, fsckOptions.threads, fsckOptions.repair ? ", repairing" : "");
+    fflush(stdout);
+    return fsck_secfs(secfs, fsckOptions);
+}
+
+// import <source folder> <secure folder> and export <secure folder> <destination folder>
+int transfer_main(int argc, String argv[], Bool import) {
+    TransferOptions transferOptions = { cpuCount() };
+    Cipher cipher = DEFAULT_CIPHER;
+    static struct option options[] = {
+        { "threads", required_argument, NULL, 't' },
+        { "cipher", required_argument, NULL, 'c' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    Int option;
+    while ((option = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (option) {
+            case 't':
+                transferOptions.threads = MAX((UInt)parse_number_option("threads", optarg), 1);
+                break;
+            case 'c': {
+                Int parsedCipher = cipher_from_name(optarg);
+                if (parsedCipher == -1) {
+                    fatalError("Unknown cipher '%s'", optarg);
+                }
+                cipher = (Cipher)parsedCipher;
+                break;
+            }
+            case 'h':
+                show_help();
+                return 0;
+            default:
+                show_help();
+                return 1;
+        }
+    }
+    if (argc - optind < 2) {
         show_help();
         return 1;
     }
+
+    String dataPath = normalize_data_path(argv[import ? optind + 1 : optind]);
+    String otherPath = argv[import ? optind : optind + 1];
+    Secfs *secfs = NULL;
+    ULong loadNanos;
+    if (is_existing_secfs(dataPath)) {
+        secfs = unlock_secfs(dataPath, &loadNanos);
+    }
+    else if (import) {
+        printf("Couldn't find secfs in '%s'\nWould you like to initialize secfs in that directory? [y/n] ", dataPath);
+        if (!boolPrompt()) {
+            exit(EXIT_SUCCESS);
+        }
+        secfs = create_secfs(dataPath, cipher);
+    }
+    else {
+        fatalError("Couldn't find secfs in '%s'", dataPath);
+    }
+
+    printf("\n\n%s %s with %u threads\n", import ? "Importing" : "Exporting", otherPath, transferOptions.threads);
+    fflush(stdout);
+    Error error = import ? import_tree(secfs, otherPath, transferOptions) : export_tree(secfs, otherPath, transferOptions);
+    if (error) {
+        fatalError("%s", error);
+    }
+    return 0;
+}
+
+int main(int argc, String argv[]) {
+    if (argc > 1 && strcmp(argv[1], "passwd") == 0) {
+        return passwd_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && strcmp(argv[1], "fsck") == 0) {
+        return fsck_main(argc - 1, argv + 1);
+    }
+    if (argc > 1 && (strcmp(argv[1], "import") == 0 || strcmp(argv[1], "export") == 0)) {
+        return transfer_main(argc - 1, argv + 1, strcmp(argv[1], "import") == 0);
+    }
     
-    String dataPath = argv[1];
-    String mountPath = argv[2];
+    Cipher cipher = DEFAULT_CIPHER;
+    FsOptions fsOptions = default_fs_options();
+    static struct option options[] = {
+        { "cipher", required_argument, NULL, 'c' },
+        { "bench-ciphers", no_argument, NULL, 'b' },
+        { "cache-timeout", required_argument, NULL, 't' },
+        { "negative-timeout", required_argument, NULL, 'n' },
+        { "no-keep-cache", no_argument, NULL, 'k' },
+        { "direct-io-size", required_argument, NULL, 'd' },
+        { "low-level", no_argument, NULL, 'l' },
+        { "trace", required_argument, NULL, 'r' },
+        { "rotate-key", no_argument, NULL, 'R' },
+        { "rotate-rate", required_argument, NULL, 'a' },
+        { "reclaim-rate", required_argument, NULL, 'e' },
+        { "fan-out", required_argument, NULL, 'f' },
+        { "memory-limit", required_argument, NULL, 'm' },
+        { "huge-pages", no_argument, NULL, 'H' },
+        { "direct-backing-io", no_argument, NULL, 'D' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
     
-    // Append trailing '/' to dataPath if missing
-    if (dataPath[strlen(dataPath) - 1] != '/') {
-        dataPath = malloc(strlen(dataPath) + 1);
-        strcpy(dataPath, argv[1]);
-        strcat(dataPath, "/");
+    Int option;
+    while ((option = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+        switch (option) {
+            case 'c': {
+                Int parsedCipher = cipher_from_name(optarg);
+                if (parsedCipher == -1) {
+                    fatalError("Unknown cipher '%s'", optarg);
+                }
+                cipher = (Cipher)parsedCipher;
+                break;
+            }
+            case 'b':
+                bench_ciphers(BLOCK_SIZE);
+                return 0;
+            case 't':
+                fsOptions.entryTimeout = parse_number_option("cache-timeout", optarg);
+                fsOptions.attrTimeout = fsOptions.entryTimeout;
+                break;
+            case 'n':
+                fsOptions.negativeTimeout = parse_number_option("negative-timeout", optarg);
+                break;
+            case 'k':
+                fsOptions.keepCache = false;
+                break;
+            case 'd':
+                fsOptions.directIOMinSize = (ULong)(parse_number_option("direct-io-size", optarg) * 1024 * 1024);
+                break;
+            case 'l':
+                fsOptions.lowLevel = true;
+                break;
+            case 'r':
+                fsOptions.tracePath = optarg;
+                break;
+            case 'R':
+                fsOptions.rotateKey = true;
+                break;
+            case 'a':
+                fsOptions.keyRotationRate = parse_number_option("rotate-rate", optarg);
+                break;
+            case 'e':
+                fsOptions.reclaimRate = parse_number_option("reclaim-rate", optarg);
+                break;
+            case 'f': {
+                double levels = parse_number_option("fan-out", optarg);
+                if (levels > BLOCK_FAN_OUT_MAX || levels != (Int)levels) {
+                    fatalError("Invalid value '%s' for --fan-out", optarg);
+                }
+                fsOptions.blockFanOut = (Int)levels;
+                break;
+            }
+            case 'm':
+                fsOptions.memoryLimit = (ULong)(parse_number_option("memory-limit", optarg) * 1024 * 1024);
+                break;
+            case 'H':
+                fsOptions.hugePages = true;
+                break;
+            case 'D':
+                fsOptions.directBackingIO = true;
+                break;
+            case 'h':
+                show_help();
+                return 0;
+            default:
+                show_help();
+                return 1;
+        }
     }
+    
+    if (argc - optind < 2) {
+        show_help();
+        return 1;
+    }
+    
+    String dataPath = normalize_data_path(argv[optind]);
+    String mountPath = argv[optind + 1];
 
     debugPrint("Data path: %s, mount path: %s", dataPath, mountPath);
     
     // check for existing secfs.
     Secfs *secfs;
+    ULong loadNanos = 0;
     if (!is_existing_secfs(dataPath)) {
         // New secure folder
         printf("Couldn't find secfs in '%s'\nWould you like to initialize secfs in that directory? [y/n] ", dataPath);
         if (!boolPrompt()) {
             exit(EXIT_SUCCESS);
         }
-        
-        ByteArray iv = get_random_bytes(IV_LENGTH);
-        ByteArray key = setup_password(iv);
-
-        LoadSecfsResult initResult = init_secfs(dataPath, key, iv);
-        if (initResult.error) {
-            fatalError("Could not initialize secure folder: %s", initResult.error);
-        }
-        secfs = initResult.secfs;
-        printf("\n\nSecfs folder has been successfully initialized at %s\n",dataPath);
-        printf("!!! If you lose your password, you will lose access to your data. Please keep your password safe\n\n");
+        secfs = create_secfs(dataPath, cipher);
     }
     else {
         // Existing secure folder
-        LoadIVResult ivResult = load_iv(dataPath);
-        if (ivResult.error) {
-            fatalError("Could not load secure folder: %s",ivResult.error);
-        }
-        ByteArray iv = ivResult.iv;
-        ByteArray key;
-        while (true) {
-            key = enter_password(iv);
-            if(verify_key(key, iv, dataPath)) {
-                break;
-            }
-            printf("\nIncorrect password. Please try again\n");
-        }
-        
-        LoadSecfsResult loadResult = load_secfs(dataPath, key);
-        if (loadResult.error) {
-            fatalError("Could not load secure folder: %s",loadResult.error);
-        }
-        secfs = loadResult.secfs;
+        secfs = unlock_secfs(dataPath, &loadNanos);
     }
 
     printf("\n\n======================= Secfs is now running =======================\n");
     printf("Mount path (Working directory):\t\t%s\n",mountPath);
     printf("Secure data path (Encrypted storage):\t%s\n",dataPath);
+    printf("Startup time:\t\t\t\t%.1f ms (%u items)\n", (double)loadNanos / 1e6, secfs->indexDB->length);
+    printf("Peak memory:\t\t\t\t%.1f MB\n", (double)peakMemoryBytes() / (1024.0 * 1024.0));
     printf("====================================================================\n");
-    fs_start(secfs, mountPath);
+    fflush(stdout);
+    fs_start(secfs, mountPath, fsOptions);
     
     return 0;
 }
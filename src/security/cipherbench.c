@@ -0,0 +1,83 @@
+//
+//  Created by Stasel
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "cipherbench.h"
+#include "encryption.h"
+
+#define BENCH_DURATION_NANOS 500000000UL // 0.5 sec per cipher and direction
+
+static double megabytesPerSecond(ULong bytes, ULong nanos) {
+    return ((double)bytes / (1024.0 * 1024.0)) / ((double)nanos / 1e9);
+}
+
+static CipherBenchResult bench_cipher(Cipher cipher, ByteArray sample, ByteArray key, ByteArray iv) {
+    CipherBenchResult result = { cipher, 0, 0 };
+    
+    // Warm up and keep one cipher text for the decryption pass
+    EncryptResult encrypted = cipher_encrypt(cipher, sample, key, iv);
+    if (encrypted.error) {
+        printf("%-20s failed: %s\n", cipher_name(cipher), encrypted.error);
+        return result;
+    }
+    
+    ULong bytes = 0;
+    ULong start = monotonicNanos();
+    ULong elapsed = 0;
+    while (elapsed < BENCH_DURATION_NANOS) {
+        EncryptResult encryptResult = cipher_encrypt(cipher, sample, key, iv);
+        free(encryptResult.cipher.bytes);
+        bytes += sample.length;
+        elapsed = monotonicNanos() - start;
+    }
+    result.encryptMBps = megabytesPerSecond(bytes, elapsed);
+    
+    bytes = 0;
+    start = monotonicNanos();
+    elapsed = 0;
+    while (elapsed < BENCH_DURATION_NANOS) {
+        DecryptResult decryptResult = cipher_decrypt(cipher, encrypted.cipher, key, iv);
+        free(decryptResult.plainText.bytes);
+        bytes += sample.length;
+        elapsed = monotonicNanos() - start;
+    }
+    result.decryptMBps = megabytesPerSecond(bytes, elapsed);
+    
+    free(encrypted.cipher.bytes);
+    return result;
+}
+
+Cipher bench_ciphers(UInt sampleSize) {
+    ByteArray sample = get_random_bytes(sampleSize);
+    ByteArray key = get_random_bytes(KEY_LENGTH);
+    ByteArray iv = get_random_bytes(IV_LENGTH);
+    
+    printf("Cipher throughput (single thread, %u byte blocks)\n\n", sampleSize);
+    printf("%-20s %14s %14s\n", "Cipher", "Encrypt MB/s", "Decrypt MB/s");
+    
+    Cipher fastest = DEFAULT_CIPHER;
+    double fastestScore = 0;
+    for (Int i = 0; i < CIPHER_COUNT; i++) {
+        CipherBenchResult result = bench_cipher((Cipher)i, sample, key, iv);
+        printf("%-20s %14.1f %14.1f\n", cipher_name(result.cipher), result.encryptMBps, result.decryptMBps);
+        
+        // Every block write is a read-modify-write, weight both directions equally (harmonic mean)
+        if (result.encryptMBps <= 0 || result.decryptMBps <= 0) {
+            continue;
+        }
+        double score = 2.0 / (1.0 / result.encryptMBps + 1.0 / result.decryptMBps);
+        if (score > fastestScore) {
+            fastestScore = score;
+            fastest = result.cipher;
+        }
+    }
+    
+    printf("\nRecommended cipher: %s (use --cipher %s when creating a new secure folder)\n", cipher_name(fastest), cipher_name(fastest));
+    
+    free(sample.bytes);
+    free(key.bytes);
+    free(iv.bytes);
+    return fastest;
+}
@@ -0,0 +1,21 @@
+//
+//  Created by Stasel
+//
+
+#ifndef cipherbench_h
+#define cipherbench_h
+
+#include "../utilities/utilities.h"
+#include "encryption.h"
+
+typedef struct {
+    Cipher cipher;
+    double encryptMBps;
+    double decryptMBps;
+} CipherBenchResult;
+
+// Measure single thread encrypt/decrypt throughput of every cipher suite on this host
+// using samples of `sampleSize` bytes. Prints a report and returns the fastest suite.
+Cipher bench_ciphers(UInt sampleSize);
+
+#endif /* cipherbench_h */
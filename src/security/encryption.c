@@ -9,9 +9,108 @@
 #include "encryption.h"
 #include "../utilities/utilities.h"
 
-AESEncryptResult aes_encrypt(ByteArray bytes, ByteArray key, ByteArray iv) {
+#define EVP_MAX_CHUNK 1073741824 // EVP takes int lengths, larger inputs are fed in chunks
+
+#define CIPHER_FAIL(message) {\
+        EVP_CIPHER_CTX_free(ctx);\
+        result.error = (message);\
+        return result;\
+    }
+
+static const EVP_CIPHER* evp_cipher(Cipher cipher) {
+    switch (cipher) {
+        case CipherAES128CBC: return EVP_aes_128_cbc();
+        case CipherAES256CBC: return EVP_aes_256_cbc();
+        case CipherAES256CTR: return EVP_aes_256_ctr();
+        case CipherAES256GCM: return EVP_aes_256_gcm();
+        case CipherChaCha20Poly1305: return EVP_chacha20_poly1305();
+        default: return NULL;
+    }
+}
+
+// Length of the random nonce stored in front of the cipher text. CBC suites use the caller's iv instead
+static UInt nonce_length(Cipher cipher) {
+    switch (cipher) {
+        case CipherAES128CBC:
+        case CipherAES256CBC: return 0;
+        case CipherAES256CTR: return 16;
+        case CipherAES256GCM:
+        case CipherChaCha20Poly1305: return 12;
+        default: return 0;
+    }
+}
+
+static UInt tag_length(Cipher cipher) {
+    switch (cipher) {
+        case CipherAES256GCM:
+        case CipherChaCha20Poly1305: return TAG_LENGTH;
+        case CipherAES128CBC:
+        case CipherAES256CBC:
+        case CipherAES256CTR: return 0;
+        default: return 0;
+    }
+}
+
+ULong cipher_max_length(Cipher cipher, ULong plainTextLength) {
+    switch (cipher) {
+        case CipherAES128CBC:
+        case CipherAES256CBC: return plainTextLength + 16; // Up to one block of padding
+        case CipherAES256CTR:
+        case CipherAES256GCM:
+        case CipherChaCha20Poly1305: return nonce_length(cipher) + plainTextLength + tag_length(cipher);
+        default: return plainTextLength;
+    }
+}
+
+String cipher_name(Cipher cipher) {
+    switch (cipher) {
+        case CipherAES128CBC: return "aes-128-cbc";
+        case CipherAES256CBC: return "aes-256-cbc";
+        case CipherAES256CTR: return "aes-256-ctr";
+        case CipherAES256GCM: return "aes-256-gcm";
+        case CipherChaCha20Poly1305: return "chacha20-poly1305";
+        default: return "unknown";
+    }
+}
+
+// Encrypts or decrypts inputs of any length, the output length is added to outLength
+static Bool cipher_update(EVP_CIPHER_CTX *ctx, Bool encrypt, Byte *out, ULong *outLength, const Byte *in, ULong inLength) {
+    while (inLength > 0) {
+        Int chunk = (Int)MIN(inLength, EVP_MAX_CHUNK);
+        Int chunkOutLength = 0;
+        Int success = encrypt ? EVP_EncryptUpdate(ctx, out + *outLength, &chunkOutLength, in, chunk)
+                              : EVP_DecryptUpdate(ctx, out + *outLength, &chunkOutLength, in, chunk);
+        if (!success) {
+            return false;
+        }
+        *outLength += (ULong)chunkOutLength;
+        in += chunk;
+        inLength -= (ULong)chunk;
+    }
+    return true;
+}
+
+Int cipher_from_name(const String name) {
+    for (Int cipher = 0; cipher < CIPHER_COUNT; cipher++) {
+        if (strcmp(name, cipher_name((Cipher)cipher)) == 0) {
+            return cipher;
+        }
+    }
+    return -1;
+}
+
+EncryptResult cipher_encrypt(Cipher cipher, ByteArray bytes, ByteArray key, ByteArray iv) {
+    Byte *buffer = malloc(cipher_max_length(cipher, bytes.length));
+    EncryptResult result = cipher_encrypt_into(cipher, bytes, key, iv, buffer);
+    if (result.error) {
+        free(buffer);
+    }
+    return result;
+}
+
+EncryptResult cipher_encrypt_into(Cipher cipher, ByteArray bytes, ByteArray key, ByteArray iv, Byte *buffer) {
     
-    AESEncryptResult result;
+    EncryptResult result;
     
     if (key.length != KEY_LENGTH) {
         result.error = "Invalid key length";
@@ -34,44 +133,59 @@ AESEncryptResult aes_encrypt(ByteArray bytes, ByteArray key, ByteArray iv) {
         return result;
     }
     
-    Int initResult = EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key.bytes, iv.bytes);
-    if (!initResult) {
-        result.error = "Error initializing encryption";
-        return result;
+    // Output layout: [nonce][cipher text][tag]
+    UInt nonceLength = nonce_length(cipher);
+    Byte *nonce = iv.bytes;
+    if (nonceLength > 0) {
+        RAND_bytes(buffer, (Int)nonceLength);
+        nonce = buffer;
     }
+    Byte *cipherText = buffer + nonceLength;
     
-    Int cipherTextLength;
-    Byte *cipherText = malloc((ULong)MAX(bytes.length*2, 32));
+    Int initResult = EVP_EncryptInit_ex(ctx, evp_cipher(cipher), NULL, key.bytes, nonce);
+    if (!initResult) {
+        CIPHER_FAIL("Error initializing encryption");
+    }
     
-    Int encryptionResult = EVP_EncryptUpdate(ctx, cipherText, &cipherTextLength, bytes.bytes, (Int)bytes.length);
-    if (!encryptionResult) {
-        result.error = "Encryption error";
-        return result;
+    ULong cipherTextLength = 0;
+    if (!cipher_update(ctx, true, cipherText, &cipherTextLength, bytes.bytes, bytes.length)) {
+        CIPHER_FAIL("Encryption error");
     }
     
     Int cipherTextFinalizeLength;
     Int finalizeResult = EVP_EncryptFinal_ex(ctx, cipherText + cipherTextLength, &cipherTextFinalizeLength);
     if (!finalizeResult) {
-        result.error = "Finalize error";
-        return result;
+        CIPHER_FAIL("Finalize error");
     }
     
-    EVP_CIPHER_CTX_free(ctx);
+    ULong finalCipherLength = cipherTextLength + (ULong)cipherTextFinalizeLength;
+    UInt tagLength = tag_length(cipher);
+    if (tagLength > 0 && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, (Int)tagLength, cipherText + finalCipherLength)) {
+        CIPHER_FAIL("Error reading authentication tag");
+    }
     
-    UInt finalCipherLength = (UInt)cipherTextLength + (UInt)cipherTextFinalizeLength;
-    cipherText = realloc(cipherText, (UInt)finalCipherLength);
+    EVP_CIPHER_CTX_free(ctx);
     
-    result.cipher.bytes = cipherText;
-    result.cipher.length = finalCipherLength;
+    result.cipher.bytes = buffer;
+    result.cipher.length = nonceLength + finalCipherLength + tagLength;
     result.error = NULL;
     
-    debugPrint("Encrypted %d bytes of plaintext to %d bytes of cipher", bytes.length, result.cipher.length);
+    debugPrint("Encrypted %d bytes of plaintext to %d bytes of cipher (%s)", bytes.length, result.cipher.length, cipher_name(cipher));
     
     return result;
 }
 
-AESDecryptResult aes_decrypt(ByteArray cipher, ByteArray key, ByteArray iv) {
-    AESDecryptResult result;
+DecryptResult cipher_decrypt(Cipher cipher, ByteArray bytes, ByteArray key, ByteArray iv) {
+    Byte *buffer = malloc(MAX(bytes.length, 1));
+    DecryptResult result = cipher_decrypt_into(cipher, bytes, key, iv, buffer);
+    if (result.error) {
+        free(buffer);
+    }
+    return result;
+}
+
+DecryptResult cipher_decrypt_into(Cipher cipher, ByteArray bytes, ByteArray key, ByteArray iv, Byte *buffer) {
+    DecryptResult result;
     
     if (key.length != KEY_LENGTH) {
         result.error = "Invalid key length";
@@ -83,7 +197,9 @@ AESDecryptResult aes_decrypt(ByteArray cipher, ByteArray key, ByteArray iv) {
         return result;
     }
     
-    if (cipher.length == 0) {
+    UInt nonceLength = nonce_length(cipher);
+    UInt tagLength = tag_length(cipher);
+    if (bytes.length <= nonceLength + tagLength) {
         result.error = "Nothing to decrypt";
         return result;
     }
@@ -94,42 +210,244 @@ AESDecryptResult aes_decrypt(ByteArray cipher, ByteArray key, ByteArray iv) {
         return result;
     }
     
-    Int initResult = EVP_DecryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key.bytes, iv.bytes);
+    Byte *nonce = nonceLength > 0 ? bytes.bytes : iv.bytes;
+    Byte *cipherText = bytes.bytes + nonceLength;
+    ULong cipherTextLength = bytes.length - nonceLength - tagLength;
+    
+    Int initResult = EVP_DecryptInit_ex(ctx, evp_cipher(cipher), NULL, key.bytes, nonce);
     if (!initResult) {
-        result.error = "Error initializing decryption";
-        return result;
+        CIPHER_FAIL("Error initializing decryption");
     }
     
-    Int plainTextLength;
-    Byte *plainText = malloc((UInt)cipher.length);
+    ULong plainTextLength = 0;
+    if (!cipher_update(ctx, false, buffer, &plainTextLength, cipherText, cipherTextLength)) {
+        CIPHER_FAIL("Decryption error");
+    }
     
-    Int decryptionResult = EVP_DecryptUpdate(ctx, plainText, &plainTextLength, cipher.bytes, (Int)cipher.length);
-    if (!decryptionResult) {
-        result.error = "Decryption error";
-        return result;
+    if (tagLength > 0 && !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, (Int)tagLength, cipherText + cipherTextLength)) {
+        CIPHER_FAIL("Error setting authentication tag");
     }
     
     Int plainTextFinalizeLength;
-    Int finalizeResult = EVP_DecryptFinal(ctx, plainText + plainTextLength, &plainTextFinalizeLength);
+    Int finalizeResult = EVP_DecryptFinal_ex(ctx, buffer + plainTextLength, &plainTextFinalizeLength);
     if (!finalizeResult) {
+        CIPHER_FAIL(tagLength > 0 ? "Authentication failed" : "Finalize error");
+    }
+    
+    EVP_CIPHER_CTX_free(ctx);
+
+    result.plainText.bytes = buffer;
+    result.plainText.length = plainTextLength + (ULong)plainTextFinalizeLength;
+    result.error = NULL;
+    
+    debugPrint("Decrypted %d bytes of cipher to %d bytes of plaintext (%s)", bytes.length, result.plainText.length, cipher_name(cipher));
+    
+    return result;
+}
+
+struct CipherStream {
+    Cipher cipher;
+    Bool encrypt;
+    EVP_CIPHER_CTX *ctx;
+    Byte key[KEY_LENGTH];
+    Byte nonce[IV_LENGTH];
+    UInt nonceLength;
+    UInt nonceFilled;
+    Byte tail[TAG_LENGTH]; // Last bytes seen so far, may turn out to be the authentication tag
+    UInt tailLength;
+    Byte *output;
+    ULong outputCapacity;
+};
+
+CipherStream* cipher_decrypt_stream(Cipher cipher, ByteArray key, ByteArray iv) {
+    if (key.length != KEY_LENGTH || iv.length != IV_LENGTH) {
+        return NULL;
+    }
+    
+    CipherStream *stream = ALLOC(CipherStream);
+    memset(stream, 0, sizeof(CipherStream));
+    stream->cipher = cipher;
+    stream->ctx = EVP_CIPHER_CTX_new();
+    stream->nonceLength = nonce_length(cipher);
+    memcpy(stream->key, key.bytes, KEY_LENGTH);
+    memcpy(stream->nonce, iv.bytes, IV_LENGTH);
+    
+    // CBC suites are ready right away, the others wait for the nonce in front of the cipher text
+    if (stream->nonceLength == 0) {
+        EVP_DecryptInit_ex(stream->ctx, evp_cipher(cipher), NULL, stream->key, stream->nonce);
+    }
+    return stream;
+}
+
+CipherStream* cipher_encrypt_stream(Cipher cipher, ByteArray key, ByteArray iv) {
+    if (key.length != KEY_LENGTH || iv.length != IV_LENGTH) {
+        return NULL;
+    }
+    
+    CipherStream *stream = ALLOC(CipherStream);
+    memset(stream, 0, sizeof(CipherStream));
+    stream->cipher = cipher;
+    stream->encrypt = true;
+    stream->ctx = EVP_CIPHER_CTX_new();
+    stream->nonceLength = nonce_length(cipher);
+    memcpy(stream->key, key.bytes, KEY_LENGTH);
+    memcpy(stream->nonce, iv.bytes, IV_LENGTH);
+    
+    // Same layout as cipher_encrypt, the random nonce goes out in front of the first output
+    if (stream->nonceLength > 0) {
+        RAND_bytes(stream->nonce, (Int)stream->nonceLength);
+    }
+    EVP_EncryptInit_ex(stream->ctx, evp_cipher(cipher), NULL, stream->key, stream->nonce);
+    return stream;
+}
+
+static void reserve_output(CipherStream *stream, ULong size) {
+    if (stream->outputCapacity < size) {
+        stream->outputCapacity = size;
+        stream->output = realloc(stream->output, size);
+    }
+}
+
+// Emits the nonce the first time it's called
+static UInt write_nonce(CipherStream *stream) {
+    if (stream->nonceFilled == stream->nonceLength) {
+        return 0;
+    }
+    memcpy(stream->output, stream->nonce, stream->nonceLength);
+    stream->nonceFilled = stream->nonceLength;
+    return stream->nonceLength;
+}
+
+static CipherStreamResult encrypt_stream_update(CipherStream *stream, ByteArray input) {
+    CipherStreamResult result = { { NULL, 0 }, NULL };
+    reserve_output(stream, stream->nonceLength + input.length + EVP_MAX_BLOCK_LENGTH);
+    
+    UInt nonceLength = write_nonce(stream);
+    ULong outLength = 0;
+    if (!cipher_update(stream->ctx, true, stream->output + nonceLength, &outLength, input.bytes, input.length)) {
+        result.error = "Encryption error";
+        return result;
+    }
+    result.output.bytes = stream->output;
+    result.output.length = nonceLength + outLength;
+    return result;
+}
+
+static CipherStreamResult encrypt_stream_final(CipherStream *stream) {
+    CipherStreamResult result = { { NULL, 0 }, NULL };
+    reserve_output(stream, stream->nonceLength + EVP_MAX_BLOCK_LENGTH + TAG_LENGTH);
+    
+    UInt nonceLength = write_nonce(stream);
+    Int finalLength = 0;
+    if (!EVP_EncryptFinal_ex(stream->ctx, stream->output + nonceLength, &finalLength)) {
         result.error = "Finalize error";
         return result;
     }
     
-    EVP_CIPHER_CTX_free(ctx);
+    UInt length = nonceLength + (UInt)finalLength;
+    UInt tagLength = tag_length(stream->cipher);
+    if (tagLength > 0 && !EVP_CIPHER_CTX_ctrl(stream->ctx, EVP_CTRL_AEAD_GET_TAG, (Int)tagLength, stream->output + length)) {
+        result.error = "Error reading authentication tag";
+        return result;
+    }
+    result.output.bytes = stream->output;
+    result.output.length = length + tagLength;
+    return result;
+}
 
-    UInt finalPlainTextLength = (UInt)plainTextLength + (UInt)plainTextFinalizeLength;
-    plainText = realloc(plainText, (UInt)finalPlainTextLength);
+CipherStreamResult cipher_stream_update(CipherStream *stream, ByteArray input) {
+    if (stream->encrypt) {
+        return encrypt_stream_update(stream, input);
+    }
+    
+    CipherStreamResult result = { { stream->output, 0 }, NULL };
+    
+    // Collect the nonce first
+    if (stream->nonceFilled < stream->nonceLength) {
+        UInt nonceBytes = (UInt)MIN(stream->nonceLength - stream->nonceFilled, input.length);
+        memcpy(&stream->nonce[stream->nonceFilled], input.bytes, nonceBytes);
+        stream->nonceFilled += nonceBytes;
+        input.bytes += nonceBytes;
+        input.length -= nonceBytes;
+        if (stream->nonceFilled < stream->nonceLength) {
+            return result;
+        }
+        if (!EVP_DecryptInit_ex(stream->ctx, evp_cipher(stream->cipher), NULL, stream->key, stream->nonce)) {
+            result.error = "Error initializing decryption";
+            return result;
+        }
+    }
+    
+    // Hold back the last tag_length bytes, they are only known to be the tag once the input ends
+    UInt tagLength = tag_length(stream->cipher);
+    ULong available = stream->tailLength + input.length;
+    if (available <= tagLength) {
+        memcpy(&stream->tail[stream->tailLength], input.bytes, input.length);
+        stream->tailLength += (UInt)input.length;
+        return result;
+    }
+    
+    ULong feedLength = available - tagLength;
+    UInt fromTail = (UInt)MIN(stream->tailLength, feedLength);
+    ULong fromInput = feedLength - fromTail;
+    reserve_output(stream, feedLength + EVP_MAX_BLOCK_LENGTH);
+    
+    ULong outLength = 0;
+    if (!cipher_update(stream->ctx, false, stream->output, &outLength, stream->tail, fromTail) ||
+        !cipher_update(stream->ctx, false, stream->output, &outLength, input.bytes, fromInput)) {
+        result.error = "Decryption error";
+        return result;
+    }
+    
+    // Keep whatever was not fed as the new tail
+    UInt tailLeft = stream->tailLength - fromTail;
+    memmove(stream->tail, &stream->tail[fromTail], tailLeft);
+    memcpy(&stream->tail[tailLeft], input.bytes + fromInput, input.length - fromInput);
+    stream->tailLength = tailLeft + (UInt)(input.length - fromInput);
+    
+    result.output.bytes = stream->output;
+    result.output.length = outLength;
+    return result;
+}
 
-    result.plainText.bytes = plainText;
-    result.plainText.length = finalPlainTextLength;
-    result.error = NULL;
+CipherStreamResult cipher_stream_final(CipherStream *stream) {
+    if (stream->encrypt) {
+        return encrypt_stream_final(stream);
+    }
     
-    debugPrint("Decrypted %d bytes of cipher to %d bytes of plaintext",cipher.length,result.plainText.length);
+    CipherStreamResult result = { { NULL, 0 }, NULL };
+    
+    UInt tagLength = tag_length(stream->cipher);
+    if (stream->nonceFilled < stream->nonceLength || stream->tailLength < tagLength) {
+        result.error = "Truncated cipher text";
+        return result;
+    }
+    if (tagLength > 0 && !EVP_CIPHER_CTX_ctrl(stream->ctx, EVP_CTRL_AEAD_SET_TAG, (Int)tagLength, stream->tail)) {
+        result.error = "Error setting authentication tag";
+        return result;
+    }
     
+    reserve_output(stream, EVP_MAX_BLOCK_LENGTH);
+    Int finalLength = 0;
+    if (!EVP_DecryptFinal_ex(stream->ctx, stream->output, &finalLength)) {
+        result.error = tagLength > 0 ? "Authentication failed" : "Finalize error";
+        return result;
+    }
+    result.output.bytes = stream->output;
+    result.output.length = (ULong)finalLength;
     return result;
 }
 
+void cipher_stream_free(CipherStream *stream) {
+    if (stream == NULL) {
+        return;
+    }
+    EVP_CIPHER_CTX_free(stream->ctx);
+    OPENSSL_cleanse(stream->key, KEY_LENGTH);
+    free(stream->output);
+    free(stream);
+}
+
 SHA256Result sha_256(ByteArray data) {
     SHA256Result result;
     
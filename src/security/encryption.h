@@ -9,25 +9,63 @@
 
 #define KEY_LENGTH 32
 #define IV_LENGTH 16
+#define NONCE_MAX_LENGTH 16
+#define TAG_LENGTH 16
+
+// Supported cipher suites. The numeric values are stored in the volume header, do not reorder.
+typedef enum {
+    CipherAES128CBC = 0,
+    CipherAES256CBC = 1,
+    CipherAES256CTR = 2,
+    CipherAES256GCM = 3,
+    CipherChaCha20Poly1305 = 4
+} Cipher;
+
+#define CIPHER_COUNT 5
+#define DEFAULT_CIPHER CipherAES256GCM
 
 typedef struct {
     ByteArray cipher;
     String error;
-} AESEncryptResult;
+} EncryptResult;
 
 typedef struct {
     ByteArray plainText;
     String error;
-} AESDecryptResult;
+} DecryptResult;
 
 typedef struct {
     ByteArray digest;
     String error;
 } SHA256Result;
 
+// Incremental encryption and decryption in chunks of any size, using the same format as cipher_encrypt
+typedef struct CipherStream CipherStream;
+
+typedef struct {
+    ByteArray output; // Owned by the stream, valid until the next call
+    String error;
+} CipherStreamResult;
+
+// CBC suites use the given iv as is and produce padded cipher text.
+// Stream and AEAD suites never reuse the given iv: every call draws a fresh random nonce which is stored
+// in front of the cipher text (followed by the authentication tag for AEAD suites), since blocks and
+// databases are rewritten in place.
+EncryptResult cipher_encrypt(Cipher cipher, ByteArray bytes, ByteArray key, ByteArray iv);
+DecryptResult cipher_decrypt(Cipher cipher, ByteArray bytes, ByteArray key, ByteArray iv);
+// Same, into a caller's buffer of cipher_max_length bytes, or the cipher text length for decryption
+EncryptResult cipher_encrypt_into(Cipher cipher, ByteArray bytes, ByteArray key, ByteArray iv, Byte *out);
+DecryptResult cipher_decrypt_into(Cipher cipher, ByteArray bytes, ByteArray key, ByteArray iv, Byte *out);
+ULong cipher_max_length(Cipher cipher, ULong plainTextLength);
+String cipher_name(Cipher cipher);
+Int cipher_from_name(const String name);
+
+CipherStream* cipher_encrypt_stream(Cipher cipher, ByteArray key, ByteArray iv);
+CipherStream* cipher_decrypt_stream(Cipher cipher, ByteArray key, ByteArray iv);
+CipherStreamResult cipher_stream_update(CipherStream *stream, ByteArray input);
+CipherStreamResult cipher_stream_final(CipherStream *stream);
+void cipher_stream_free(CipherStream *stream);
 
-AESEncryptResult aes_encrypt(ByteArray bytes, ByteArray key, ByteArray iv);
-AESDecryptResult aes_decrypt(ByteArray bytes, ByteArray key, ByteArray iv);
 SHA256Result sha_256(ByteArray data);
 ByteArray get_random_bytes(UInt size);
 ByteArray generate_key(ByteArray userPassword, ByteArray salt);
@@ -0,0 +1,198 @@
+//
+//  Created by Stasel
+//
+
+#include "bufferpool.h"
+#include "memory.h"
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+
+typedef struct {
+    Byte *mapping;
+    ULong mappingSize;
+    Byte *start; // First buffer
+    UInt count;
+} Slab;
+
+struct BufferPool {
+    ULong bufferSize; // Rounded up to whole pages
+    Bool hugePages;
+    UInt buffers;
+    Byte **free; // Room for every buffer
+    UInt freeLength;
+    UInt freeMax;
+    Slab *slabs;
+    UInt slabsLength;
+    UInt slabsMax;
+    pthread_mutex_t lock;
+};
+
+static atomic_ullong acquires = 0;
+static atomic_ullong allocations = 0;
+static atomic_ullong releases = 0;
+static atomic_ullong mappedBytes = 0;
+
+static ULong round_up(ULong value, ULong multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+BufferPool* init_buffer_pool(ULong bufferSize) {
+    BufferPool *pool = ALLOC(BufferPool);
+    pool->bufferSize = round_up(MAX(bufferSize, 1), (ULong)sysconf(_SC_PAGESIZE));
+    pool->hugePages = false;
+    pool->buffers = 0;
+    pool->free = NULL;
+    pool->freeLength = 0;
+    pool->freeMax = 0;
+    pool->slabs = NULL;
+    pool->slabsLength = 0;
+    pool->slabsMax = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+Bool buffer_pool_use_huge_pages(BufferPool *pool, Bool hugePages) {
+#ifndef MADV_HUGEPAGE
+    // Slabs rounded up to huge pages would only waste memory
+    if (hugePages) {
+        return false;
+    }
+#endif
+    pthread_mutex_lock(&pool->lock);
+    pool->hugePages = hugePages;
+    pthread_mutex_unlock(&pool->lock);
+    return true;
+}
+
+ULong buffer_pool_buffer_size(BufferPool *pool) {
+    return pool->bufferSize;
+}
+
+// Must be called with pool->lock held
+static Bool grow_pool(BufferPool *pool) {
+    // Slabs fit in what's left of the memory budget, otherwise trimming unmaps them as soon as they're idle
+    ULong slabBuffers = MAX(1, MIN(BUFFER_POOL_SLAB_BUFFERS, memory_headroom() / pool->bufferSize));
+    ULong slabSize = pool->bufferSize * slabBuffers;
+    ULong alignment = pool->hugePages ? HUGE_PAGE_SIZE : 0;
+    if (pool->hugePages) {
+        slabSize = round_up(slabSize, HUGE_PAGE_SIZE);
+    }
+
+    // Huge pages only back aligned ranges, the slack in front of the slab stays unused
+    Byte *mapping = mmap(NULL, slabSize + alignment, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return false;
+    }
+    Byte *slab = mapping;
+    if (pool->hugePages) {
+        slab = (Byte*)round_up((ULong)(uintptr_t)mapping, HUGE_PAGE_SIZE);
+#ifdef MADV_HUGEPAGE
+        madvise(slab, slabSize, MADV_HUGEPAGE);
+#endif
+    }
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mappedBytes, slabSize + alignment, memory_order_relaxed);
+
+    UInt count = (UInt)(slabSize / pool->bufferSize);
+    if (pool->slabsLength >= pool->slabsMax) {
+        pool->slabsMax = MAX(pool->slabsMax * 2, 8);
+        pool->slabs = realloc(pool->slabs, sizeof(Slab) * pool->slabsMax);
+    }
+    Slab *newSlab = &pool->slabs[pool->slabsLength++];
+    newSlab->mapping = mapping;
+    newSlab->mappingSize = slabSize + alignment;
+    newSlab->start = slab;
+    newSlab->count = count;
+    memory_charge(MemoryPooledBuffers, (ULong)count * pool->bufferSize);
+    pool->buffers += count;
+    if (pool->buffers > pool->freeMax) {
+        pool->freeMax = MAX(pool->freeMax * 2, pool->buffers);
+        pool->free = realloc(pool->free, sizeof(Byte*) * pool->freeMax);
+    }
+    for (UInt i = 0; i < count; i++) {
+        pool->free[pool->freeLength++] = slab + (ULong)i * pool->bufferSize;
+    }
+    return true;
+}
+
+Byte* buffer_pool_acquire(BufferPool *pool) {
+    atomic_fetch_add_explicit(&acquires, 1, memory_order_relaxed);
+    pthread_mutex_lock(&pool->lock);
+    if (pool->freeLength == 0 && !grow_pool(pool)) {
+        pthread_mutex_unlock(&pool->lock);
+        fatalError("Couldn't map %llu bytes of buffers", (unsigned long long)pool->bufferSize * BUFFER_POOL_SLAB_BUFFERS);
+    }
+    Byte *buffer = pool->free[--pool->freeLength];
+    memory_uncharge(MemoryPooledBuffers, pool->bufferSize);
+    pthread_mutex_unlock(&pool->lock);
+    return buffer;
+}
+
+void buffer_pool_release(BufferPool *pool, Byte *buffer) {
+    if (buffer == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->free[pool->freeLength++] = buffer;
+    memory_charge(MemoryPooledBuffers, pool->bufferSize);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static Slab* slab_of_buffer(BufferPool *pool, Byte *buffer) {
+    for (UInt i = 0; i < pool->slabsLength; i++) {
+        Slab *slab = &pool->slabs[i];
+        if (buffer >= slab->start && buffer < slab->start + (ULong)slab->count * pool->bufferSize) {
+            return slab;
+        }
+    }
+    return NULL;
+}
+
+ULong buffer_pool_trim(BufferPool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    UInt *idle = calloc(MAX(pool->slabsLength, 1), sizeof(UInt));
+    for (UInt i = 0; i < pool->freeLength; i++) {
+        idle[slab_of_buffer(pool, pool->free[i]) - pool->slabs]++;
+    }
+    
+    // Buffers of slabs which are about to be unmapped leave the free list first
+    UInt kept = 0;
+    for (UInt i = 0; i < pool->freeLength; i++) {
+        Slab *slab = slab_of_buffer(pool, pool->free[i]);
+        if (idle[slab - pool->slabs] < slab->count) {
+            pool->free[kept++] = pool->free[i];
+        }
+    }
+    pool->freeLength = kept;
+    
+    ULong trimmed = 0;
+    UInt slabs = 0;
+    for (UInt i = 0; i < pool->slabsLength; i++) {
+        Slab slab = pool->slabs[i];
+        if (idle[i] < slab.count) {
+            pool->slabs[slabs++] = slab;
+            continue;
+        }
+        munmap(slab.mapping, slab.mappingSize);
+        pool->buffers -= slab.count;
+        trimmed += (ULong)slab.count * pool->bufferSize;
+        atomic_fetch_add_explicit(&releases, 1, memory_order_relaxed);
+        atomic_fetch_sub_explicit(&mappedBytes, slab.mappingSize, memory_order_relaxed);
+    }
+    pool->slabsLength = slabs;
+    memory_uncharge(MemoryPooledBuffers, trimmed);
+    pthread_mutex_unlock(&pool->lock);
+    free(idle);
+    return trimmed;
+}
+
+BufferPoolCounters buffer_pool_counters(void) {
+    BufferPoolCounters counters;
+    counters.acquires = atomic_load_explicit(&acquires, memory_order_relaxed);
+    counters.allocations = atomic_load_explicit(&allocations, memory_order_relaxed);
+    counters.releases = atomic_load_explicit(&releases, memory_order_relaxed);
+    counters.bytes = atomic_load_explicit(&mappedBytes, memory_order_relaxed);
+    return counters;
+}
@@ -0,0 +1,35 @@
+//
+//  Created by Stasel
+//
+
+#ifndef bufferpool_h
+#define bufferpool_h
+
+#include "utilities.h"
+
+#define BUFFER_POOL_SLAB_BUFFERS 8 // Buffers mapped at once when the pool runs dry, fewer if the memory budget is tight
+#define HUGE_PAGE_SIZE 2097152
+
+// Page aligned buffers of a single size, recycled across requests and threads instead of being
+// allocated and page faulted for every block. Buffers are mapped in slabs, which are aligned to
+// huge pages and advised as such when enabled. Idle buffers are charged to the memory budget as
+// pooled buffers, and slabs whose buffers are all idle are unmapped when the pool is trimmed.
+typedef struct BufferPool BufferPool;
+
+typedef struct {
+    ULong acquires;
+    ULong allocations; // Slabs mapped
+    ULong releases;    // Slabs unmapped by trimming
+    ULong bytes;       // Mapped by every pool
+} BufferPoolCounters;
+
+BufferPool* init_buffer_pool(ULong bufferSize);
+Bool buffer_pool_use_huge_pages(BufferPool *pool, Bool hugePages); // Applies to slabs mapped afterwards, false if unsupported
+ULong buffer_pool_buffer_size(BufferPool *pool);
+Byte* buffer_pool_acquire(BufferPool *pool); // Contents are undefined
+void buffer_pool_release(BufferPool *pool, Byte *buffer);
+ULong buffer_pool_trim(BufferPool *pool); // Unmaps the idle slabs, returns the bytes given back
+
+BufferPoolCounters buffer_pool_counters(void); // Totals of every pool
+
+#endif /* bufferpool_h */
@@ -0,0 +1,123 @@
+//
+//  Created by Stasel
+//
+
+#include "epoch.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Epoch a thread entered its outermost read section in, 0 outside. Records of finished threads
+// are reused by new ones.
+typedef struct EpochRecord {
+    atomic_ullong epoch;
+    atomic_bool owned;
+    UInt depth;
+    struct EpochRecord *next;
+} EpochRecord;
+
+typedef struct {
+    void *pointer;
+    ULong epoch; // Readers from this epoch on can't see the pointer
+} RetiredPointer;
+
+static atomic_ullong globalEpoch = 1;
+static _Atomic(EpochRecord*) records = NULL;
+static pthread_key_t recordKey;
+static pthread_once_t recordKeyOnce = PTHREAD_ONCE_INIT;
+static __thread EpochRecord *threadRecord = NULL;
+
+static RetiredPointer *retired = NULL;
+static UInt retiredLength = 0;
+static UInt retiredMax = 0;
+static pthread_mutex_t retiredLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void release_record(void *record) {
+    atomic_store(&((EpochRecord*)record)->owned, false);
+}
+
+static void create_record_key(void) {
+    pthread_key_create(&recordKey, release_record);
+}
+
+static EpochRecord* acquire_record(void) {
+    pthread_once(&recordKeyOnce, create_record_key);
+    EpochRecord *record = atomic_load(&records);
+    while (record != NULL) {
+        _Bool owned = false;
+        if (atomic_compare_exchange_strong(&record->owned, &owned, true)) {
+            break;
+        }
+        record = record->next;
+    }
+    if (record == NULL) {
+        // Records are never freed, readers scanning them don't need any lock
+        record = calloc(1, sizeof(EpochRecord));
+        atomic_store(&record->owned, true);
+        record->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &record->next, record)) {
+        }
+    }
+    record->depth = 0;
+    pthread_setspecific(recordKey, record);
+    return record;
+}
+
+void epoch_enter(void) {
+    if (threadRecord == NULL) {
+        threadRecord = acquire_record();
+    }
+    if (threadRecord->depth++ == 0) {
+        // Sequentially consistent, so loads in the read section can't move before the announcement
+        atomic_store(&threadRecord->epoch, atomic_load(&globalEpoch));
+    }
+}
+
+void epoch_exit(void) {
+    if (--threadRecord->depth == 0) {
+        atomic_store_explicit(&threadRecord->epoch, 0, memory_order_release);
+    }
+}
+
+void epoch_retire(void *pointer) {
+    if (pointer == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&retiredLock);
+    if (retiredLength >= retiredMax) {
+        retiredMax = MAX(retiredMax * 2, EPOCH_RECLAIM_BATCH);
+        retired = realloc(retired, sizeof(RetiredPointer) * retiredMax);
+    }
+    retired[retiredLength].pointer = pointer;
+    retired[retiredLength].epoch = atomic_fetch_add(&globalEpoch, 1) + 1;
+    retiredLength++;
+    Bool reclaim = retiredLength % EPOCH_RECLAIM_BATCH == 0;
+    pthread_mutex_unlock(&retiredLock);
+    if (reclaim) {
+        epoch_reclaim();
+    }
+}
+
+void epoch_reclaim(void) {
+    // Oldest epoch a reader is still in
+    ULong oldest = atomic_load(&globalEpoch);
+    for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+        ULong epoch = atomic_load(&record->epoch);
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
+    }
+
+    pthread_mutex_lock(&retiredLock);
+    UInt kept = 0;
+    for (UInt i = 0; i < retiredLength; i++) {
+        if (retired[i].epoch <= oldest) {
+            free(retired[i].pointer);
+        }
+        else {
+            retired[kept++] = retired[i];
+        }
+    }
+    retiredLength = kept;
+    pthread_mutex_unlock(&retiredLock);
+}
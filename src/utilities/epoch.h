@@ -0,0 +1,20 @@
+//
+//  Created by Stasel
+//
+
+#ifndef epoch_h
+#define epoch_h
+
+#include "utilities.h"
+
+#define EPOCH_RECLAIM_BATCH 64 // Retired pointers collected before trying to free them
+
+// Epoch based reclamation for structures read without locks. Readers wrap their accesses in
+// epoch_enter and epoch_exit, which nest and never block. Writers unpublish a pointer and hand it
+// to epoch_retire, it is freed once every reader which might still see it has left.
+void epoch_enter(void);
+void epoch_exit(void);
+void epoch_retire(void *pointer);
+void epoch_reclaim(void);
+
+#endif /* epoch_h */
@@ -0,0 +1,132 @@
+//
+//  Created by Stasel
+//
+
+#include "memory.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct {
+    MemoryShedder shed;
+    void *context;
+} Shedder;
+
+static atomic_ullong budget = 0;
+static atomic_ullong used[MemoryConsumerCount];
+static atomic_ullong waits[MemoryConsumerCount];
+static UInt reservations[MemoryConsumerCount]; // Buffers in use, guarded by lock
+static Shedder shedders[MemoryConsumerCount];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t released = PTHREAD_COND_INITIALIZER;
+
+static const String consumerNames[MemoryConsumerCount] = {
+    "block_metadata",
+    "index_metadata",
+    "io_buffers",
+    "dirty_buffers",
+    "pooled_buffers",
+};
+
+static ULong total_used(void) {
+    ULong total = 0;
+    for (UInt consumer = 0; consumer < MemoryConsumerCount; consumer++) {
+        total += atomic_load_explicit(&used[consumer], memory_order_relaxed);
+    }
+    return total;
+}
+
+static Bool exceeds_budget(ULong bytes) {
+    ULong limit = atomic_load_explicit(&budget, memory_order_relaxed);
+    return limit > 0 && total_used() + bytes > limit;
+}
+
+static void shed_consumers(void) {
+    for (UInt consumer = 0; consumer < MemoryConsumerCount && memory_over_budget(); consumer++) {
+        pthread_mutex_lock(&lock);
+        Shedder shedder = shedders[consumer];
+        pthread_mutex_unlock(&lock);
+        if (shedder.shed != NULL) {
+            shedder.shed(shedder.context);
+        }
+    }
+}
+
+void memory_set_budget(ULong bytes) {
+    atomic_store(&budget, bytes);
+    pthread_mutex_lock(&lock);
+    pthread_cond_broadcast(&released);
+    pthread_mutex_unlock(&lock);
+}
+
+ULong memory_budget(void) {
+    return atomic_load(&budget);
+}
+
+void memory_set_shedder(MemoryConsumer consumer, MemoryShedder shed, void *context) {
+    pthread_mutex_lock(&lock);
+    shedders[consumer].shed = shed;
+    shedders[consumer].context = context;
+    pthread_mutex_unlock(&lock);
+}
+
+Bool memory_over_budget(void) {
+    return exceeds_budget(0);
+}
+
+ULong memory_headroom(void) {
+    ULong limit = atomic_load_explicit(&budget, memory_order_relaxed);
+    if (limit == 0) {
+        return UINT64_MAX;
+    }
+    ULong total = total_used();
+    return total >= limit ? 0 : limit - total;
+}
+
+void memory_charge(MemoryConsumer consumer, ULong bytes) {
+    atomic_fetch_add_explicit(&used[consumer], bytes, memory_order_relaxed);
+}
+
+void memory_uncharge(MemoryConsumer consumer, ULong bytes) {
+    atomic_fetch_sub_explicit(&used[consumer], bytes, memory_order_relaxed);
+}
+
+void memory_reserve(MemoryConsumer consumer, ULong bytes) {
+    // Caches give memory back before anyone waits for it
+    if (exceeds_budget(bytes)) {
+        shed_consumers();
+    }
+
+    pthread_mutex_lock(&lock);
+    Bool waited = false;
+    while (reservations[consumer] > 0 && exceeds_budget(bytes)) {
+        waited = true;
+        pthread_cond_wait(&released, &lock);
+    }
+    reservations[consumer]++;
+    atomic_fetch_add_explicit(&used[consumer], bytes, memory_order_relaxed);
+    pthread_mutex_unlock(&lock);
+
+    if (waited) {
+        atomic_fetch_add_explicit(&waits[consumer], 1, memory_order_relaxed);
+    }
+}
+
+void memory_release(MemoryConsumer consumer, ULong bytes) {
+    pthread_mutex_lock(&lock);
+    reservations[consumer]--;
+    atomic_fetch_sub_explicit(&used[consumer], bytes, memory_order_relaxed);
+    pthread_cond_broadcast(&released);
+    pthread_mutex_unlock(&lock);
+}
+
+ULong memory_used(MemoryConsumer consumer) {
+    return atomic_load_explicit(&used[consumer], memory_order_relaxed);
+}
+
+ULong memory_waits(MemoryConsumer consumer) {
+    return atomic_load_explicit(&waits[consumer], memory_order_relaxed);
+}
+
+String memory_consumer_name(MemoryConsumer consumer) {
+    return consumerNames[consumer];
+}
@@ -0,0 +1,42 @@
+//
+//  Created by Stasel
+//
+
+#ifndef memory_h
+#define memory_h
+
+#include "utilities.h"
+
+// Consumers of the memory budget
+typedef enum {
+    MemoryBlockMetadata = 0, // Blocks of the loaded shards, shed by evicting clean shards
+    MemoryIndexMetadata,     // Items of the index
+    MemoryIOBuffers,         // Plain and encrypted blocks of the reads and writes in progress
+    MemoryDirtyBuffers,      // Data of queued writes which aren't applied yet
+    MemoryPooledBuffers,     // Idle buffers of the buffer pools, shed by unmapping idle slabs
+    MemoryConsumerCount
+} MemoryConsumer;
+
+// Frees memory of a consumer when the budget is exceeded, called without any lock of the governor
+typedef void (*MemoryShedder)(void *context);
+
+// Single memory budget shared by every consumer, 0 for no limit. Metadata is charged without
+// waiting, it can only be shed. Buffers are reserved before they're allocated and wait until
+// other buffers of the same consumer are released, so one reservation always goes through and
+// the budget is exceeded by at most one buffer of each consumer.
+void memory_set_budget(ULong bytes);
+ULong memory_budget(void);
+void memory_set_shedder(MemoryConsumer consumer, MemoryShedder shed, void *context);
+Bool memory_over_budget(void);
+ULong memory_headroom(void); // Bytes left within the budget, UINT64_MAX without a limit
+
+void memory_charge(MemoryConsumer consumer, ULong bytes);
+void memory_uncharge(MemoryConsumer consumer, ULong bytes);
+void memory_reserve(MemoryConsumer consumer, ULong bytes);
+void memory_release(MemoryConsumer consumer, ULong bytes);
+
+ULong memory_used(MemoryConsumer consumer);
+ULong memory_waits(MemoryConsumer consumer); // Reservations which had to wait for a release
+String memory_consumer_name(MemoryConsumer consumer);
+
+#endif /* memory_h */
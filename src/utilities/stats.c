@@ -0,0 +1,214 @@
+//
+//  Created by Stasel
+//
+
+#include "stats.h"
+#include "trace.h"
+#include "memory.h"
+#include "bufferpool.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdatomic.h>
+
+typedef struct {
+    atomic_ullong errors;
+    atomic_ullong bytes;
+    atomic_ullong totalNanos;
+    atomic_ullong buckets[STATS_BUCKETS + 1]; // The last bucket holds everything slower
+} MetricCounters;
+
+typedef struct {
+    String name;
+    Bool stage;
+} MetricInfo;
+
+static MetricCounters counters[MetricCount];
+
+static const MetricInfo metricInfo[MetricCount] = {
+    [MetricGetattr]     = { "getattr", false },
+    [MetricLookup]      = { "lookup", false },
+    [MetricReaddir]     = { "readdir", false },
+    [MetricOpen]        = { "open", false },
+    [MetricRelease]     = { "release", false },
+    [MetricRead]        = { "read", false },
+    [MetricWrite]       = { "write", false },
+    [MetricTruncate]    = { "truncate", false },
+    [MetricCreate]      = { "create", false },
+    [MetricMkdir]       = { "mkdir", false },
+    [MetricUnlink]      = { "unlink", false },
+    [MetricRmdir]       = { "rmdir", false },
+    [MetricRename]      = { "rename", false },
+    [MetricFsync]       = { "fsync", false },
+    [MetricStatfs]      = { "statfs", false },
+    [MetricAccess]      = { "access", false },
+    [MetricCopy]        = { "copy", false },
+    [MetricFallocate]   = { "fallocate", false },
+    [MetricPathLookup]  = { "path_lookup", true },
+    [MetricBlockLookup] = { "block_lookup", true },
+    [MetricLockWait]    = { "lock_wait", true },
+    [MetricBlockRead]   = { "block_read", true },
+    [MetricDecrypt]     = { "decrypt", true },
+    [MetricEncrypt]     = { "encrypt", true },
+    [MetricBlockWrite]  = { "block_write", true },
+    [MetricBlockSync]   = { "block_sync", true },
+    [MetricArchive]     = { "db_archive", true },
+    [MetricBlockDelete] = { "block_delete", true },
+};
+
+String stats_metric_name(Metric metric) {
+    return metric < MetricCount ? metricInfo[metric].name : "unknown";
+}
+
+Bool stats_is_stage(Metric metric) {
+    return metric < MetricCount && metricInfo[metric].stage;
+}
+
+ULong stats_start(void) {
+    return monotonicNanos();
+}
+
+static UInt bucket_index(ULong nanos) {
+    UInt bits = nanos == 0 ? 0 : 64 - (UInt)__builtin_clzll(nanos);
+    if (bits <= STATS_FIRST_BUCKET_LOG) {
+        return 0;
+    }
+    return MIN(bits - STATS_FIRST_BUCKET_LOG, STATS_BUCKETS);
+}
+
+void stats_record(Metric metric, ULong startNanos, ULong bytes, Bool failed) {
+    ULong end = monotonicNanos();
+    ULong nanos = end - startNanos;
+    MetricCounters *metricCounters = &counters[metric];
+    atomic_fetch_add_explicit(&metricCounters->buckets[bucket_index(nanos)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metricCounters->totalNanos, nanos, memory_order_relaxed);
+    if (bytes > 0) {
+        atomic_fetch_add_explicit(&metricCounters->bytes, bytes, memory_order_relaxed);
+    }
+    if (failed) {
+        atomic_fetch_add_explicit(&metricCounters->errors, 1, memory_order_relaxed);
+    }
+    trace_span(metric, startNanos, end, failed);
+}
+
+typedef struct {
+    char *text;
+    ULong length;
+    ULong max;
+} Report;
+
+static void append(Report *report, const String format, ...) {
+    while (true) {
+        va_list args;
+        va_start(args, format);
+        Int length = vsnprintf(report->text + report->length, report->max - report->length, format, args);
+        va_end(args);
+        if (length >= 0 && (ULong)length < report->max - report->length) {
+            report->length += (ULong)length;
+            return;
+        }
+        report->max *= 2;
+        report->text = realloc(report->text, report->max);
+    }
+}
+
+static void append_family(Report *report, Bool stage, MetricCounters *snapshot) {
+    String family = stage ? "secfs_stage" : "secfs_operation";
+    String label = stage ? "stage" : "op";
+
+    append(report, "# HELP %s_latency_seconds Latency of secfs %ss.\n", family, stage ? "stage" : "operation");
+    append(report, "# TYPE %s_latency_seconds histogram\n", family);
+    for (UInt metric = 0; metric < MetricCount; metric++) {
+        if (metricInfo[metric].stage != stage) {
+            continue;
+        }
+        // Buckets are read one by one, the count is their sum so the histogram stays consistent
+        ULong cumulative = 0;
+        for (UInt bucket = 0; bucket < STATS_BUCKETS; bucket++) {
+            cumulative += snapshot[metric].buckets[bucket];
+            double bound = (double)(1UL << (bucket + STATS_FIRST_BUCKET_LOG)) / 1e9;
+            append(report, "%s_latency_seconds_bucket{%s=\"%s\",le=\"%.9g\"} %llu\n", family, label, metricInfo[metric].name, bound, (unsigned long long)cumulative);
+        }
+        cumulative += snapshot[metric].buckets[STATS_BUCKETS];
+        append(report, "%s_latency_seconds_bucket{%s=\"%s\",le=\"+Inf\"} %llu\n", family, label, metricInfo[metric].name, (unsigned long long)cumulative);
+        append(report, "%s_latency_seconds_sum{%s=\"%s\"} %.9f\n", family, label, metricInfo[metric].name, (double)snapshot[metric].totalNanos / 1e9);
+        append(report, "%s_latency_seconds_count{%s=\"%s\"} %llu\n", family, label, metricInfo[metric].name, (unsigned long long)cumulative);
+    }
+
+    append(report, "# HELP %s_errors_total Failed secfs %ss.\n", family, stage ? "stage" : "operation");
+    append(report, "# TYPE %s_errors_total counter\n", family);
+    for (UInt metric = 0; metric < MetricCount; metric++) {
+        if (metricInfo[metric].stage == stage) {
+            append(report, "%s_errors_total{%s=\"%s\"} %llu\n", family, label, metricInfo[metric].name, (unsigned long long)snapshot[metric].errors);
+        }
+    }
+
+    append(report, "# HELP %s_bytes_total Bytes processed by secfs %ss.\n", family, stage ? "stage" : "operation");
+    append(report, "# TYPE %s_bytes_total counter\n", family);
+    for (UInt metric = 0; metric < MetricCount; metric++) {
+        if (metricInfo[metric].stage == stage) {
+            append(report, "%s_bytes_total{%s=\"%s\"} %llu\n", family, label, metricInfo[metric].name, (unsigned long long)snapshot[metric].bytes);
+        }
+    }
+}
+
+static void append_memory(Report *report) {
+    append(report, "# HELP secfs_memory_budget_bytes Memory budget of secfs, 0 without a limit.\n");
+    append(report, "# TYPE secfs_memory_budget_bytes gauge\n");
+    append(report, "secfs_memory_budget_bytes %llu\n", (unsigned long long)memory_budget());
+
+    append(report, "# HELP secfs_memory_used_bytes Memory charged to the budget by each consumer.\n");
+    append(report, "# TYPE secfs_memory_used_bytes gauge\n");
+    for (UInt consumer = 0; consumer < MemoryConsumerCount; consumer++) {
+        append(report, "secfs_memory_used_bytes{consumer=\"%s\"} %llu\n", memory_consumer_name((MemoryConsumer)consumer),
+               (unsigned long long)memory_used((MemoryConsumer)consumer));
+    }
+
+    append(report, "# HELP secfs_memory_waits_total Buffer reservations which waited for the budget.\n");
+    append(report, "# TYPE secfs_memory_waits_total counter\n");
+    for (UInt consumer = 0; consumer < MemoryConsumerCount; consumer++) {
+        append(report, "secfs_memory_waits_total{consumer=\"%s\"} %llu\n", memory_consumer_name((MemoryConsumer)consumer),
+               (unsigned long long)memory_waits((MemoryConsumer)consumer));
+    }
+}
+
+static void append_buffers(Report *report) {
+    BufferPoolCounters pool = buffer_pool_counters();
+    append(report, "# HELP secfs_buffer_pool_acquires_total Block buffers taken from the pool.\n");
+    append(report, "# TYPE secfs_buffer_pool_acquires_total counter\n");
+    append(report, "secfs_buffer_pool_acquires_total %llu\n", (unsigned long long)pool.acquires);
+    append(report, "# HELP secfs_buffer_pool_allocations_total Slabs of block buffers mapped because the pool ran dry.\n");
+    append(report, "# TYPE secfs_buffer_pool_allocations_total counter\n");
+    append(report, "secfs_buffer_pool_allocations_total %llu\n", (unsigned long long)pool.allocations);
+    append(report, "# HELP secfs_buffer_pool_releases_total Slabs of idle block buffers unmapped to stay within the memory budget.\n");
+    append(report, "# TYPE secfs_buffer_pool_releases_total counter\n");
+    append(report, "secfs_buffer_pool_releases_total %llu\n", (unsigned long long)pool.releases);
+    append(report, "# HELP secfs_buffer_pool_bytes Memory mapped for block buffers.\n");
+    append(report, "# TYPE secfs_buffer_pool_bytes gauge\n");
+    append(report, "secfs_buffer_pool_bytes %llu\n", (unsigned long long)pool.bytes);
+    append(report, "# HELP secfs_page_faults_total Minor and major page faults of secfs.\n");
+    append(report, "# TYPE secfs_page_faults_total counter\n");
+    append(report, "secfs_page_faults_total %llu\n", (unsigned long long)pageFaults());
+}
+
+ByteArray stats_report(void) {
+    MetricCounters *snapshot = malloc(sizeof counters);
+    for (UInt metric = 0; metric < MetricCount; metric++) {
+        snapshot[metric].errors = atomic_load_explicit(&counters[metric].errors, memory_order_relaxed);
+        snapshot[metric].bytes = atomic_load_explicit(&counters[metric].bytes, memory_order_relaxed);
+        snapshot[metric].totalNanos = atomic_load_explicit(&counters[metric].totalNanos, memory_order_relaxed);
+        for (UInt bucket = 0; bucket <= STATS_BUCKETS; bucket++) {
+            snapshot[metric].buckets[bucket] = atomic_load_explicit(&counters[metric].buckets[bucket], memory_order_relaxed);
+        }
+    }
+
+    Report report = { malloc(65536), 0, 65536 };
+    append_family(&report, false, snapshot);
+    append_family(&report, true, snapshot);
+    append_memory(&report);
+    append_buffers(&report);
+    free(snapshot);
+
+    ByteArray result = { (Byte*)report.text, report.length };
+    return result;
+}
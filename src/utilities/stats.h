@@ -0,0 +1,56 @@
+//
+//  Created by Stasel
+//
+
+#ifndef stats_h
+#define stats_h
+
+#include "utilities.h"
+
+#define STATS_BUCKETS 26         // Latency buckets of powers of two, from 1 microsecond to 34 seconds
+#define STATS_FIRST_BUCKET_LOG 10 // The first bucket holds latencies below 2^10 nanoseconds
+
+// File system operations followed by the internal stages they are made of
+typedef enum {
+    MetricGetattr = 0,
+    MetricLookup,
+    MetricReaddir,
+    MetricOpen,
+    MetricRelease,
+    MetricRead,
+    MetricWrite,
+    MetricTruncate,
+    MetricCreate,
+    MetricMkdir,
+    MetricUnlink,
+    MetricRmdir,
+    MetricRename,
+    MetricFsync,
+    MetricStatfs,
+    MetricAccess,
+    MetricCopy,
+    MetricFallocate,
+    MetricPathLookup,
+    MetricBlockLookup,
+    MetricLockWait,
+    MetricBlockRead,
+    MetricDecrypt,
+    MetricEncrypt,
+    MetricBlockWrite,
+    MetricBlockSync,
+    MetricArchive,
+    MetricBlockDelete,
+    MetricCount
+} Metric;
+
+// Recording is lock free and safe from any thread
+ULong stats_start(void);
+void stats_record(Metric metric, ULong startNanos, ULong bytes, Bool failed);
+
+String stats_metric_name(Metric metric);
+Bool stats_is_stage(Metric metric);
+
+// Prometheus text exposition of every metric, the caller frees the bytes
+ByteArray stats_report(void);
+
+#endif /* stats_h */
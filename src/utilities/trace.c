@@ -0,0 +1,215 @@
+//
+//  Created by Stasel
+//
+
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+// Spans of a single thread. Only the owner writes, a dump reads concurrently and drops whatever
+// may have been overwritten meanwhile. Rings of finished threads are reused by new ones.
+typedef struct TraceRing {
+    TraceSpan spans[TRACE_RING_SPANS];
+    atomic_ullong head; // Spans written so far
+    atomic_bool owned;
+    UInt thread;
+    struct TraceRing *next;
+} TraceRing;
+
+static Bool tracing = false;
+static String tracePath = NULL;
+static TraceRing *rings = NULL;
+static UInt ringsCount = 0;
+static pthread_mutex_t ringsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ringKey;
+static atomic_ullong nextRequestId = 1;
+static Int dumpPipe[2];
+static pthread_t dumpThreadId;
+
+static __thread TraceRing *threadRing = NULL;
+static __thread ULong currentRequest = 0;
+static __thread ULong currentPath = 0;
+static __thread UInt currentBlock = TRACE_NO_BLOCK;
+
+static void release_ring(void *ring) {
+    atomic_store(&((TraceRing*)ring)->owned, false);
+}
+
+static TraceRing* acquire_ring(void) {
+    pthread_mutex_lock(&ringsLock);
+    TraceRing *ring = rings;
+    while (ring != NULL && atomic_load(&ring->owned)) {
+        ring = ring->next;
+    }
+    if (ring == NULL) {
+        ring = calloc(1, sizeof(TraceRing));
+        ring->thread = ringsCount++;
+        ring->next = rings;
+        rings = ring;
+    }
+    atomic_store(&ring->owned, true);
+    pthread_mutex_unlock(&ringsLock);
+    pthread_setspecific(ringKey, ring);
+    return ring;
+}
+
+static void handle_dump_signal(Int signal) {
+    (void)signal;
+    Int savedErrno = errno;
+    Byte request = 1;
+    if (write(dumpPipe[1], &request, 1) == ERROR) {
+        // The pipe is full, a dump is pending anyway
+    }
+    errno = savedErrno;
+}
+
+static void* process_dump_requests(void *arg) {
+    (void)arg;
+    Byte request;
+    while (true) {
+        ssize_t length = read(dumpPipe[0], &request, 1);
+        if (length == ERROR && errno == EINTR) {
+            continue;
+        }
+        if (length <= 0) {
+            return NULL;
+        }
+        Error error = trace_dump();
+        if (error) {
+            fprintf(stderr, "[ERROR] Couldn't write trace to %s: %s\n", tracePath, error);
+        }
+        else {
+            fprintf(stderr, "Trace written to %s\n", tracePath);
+        }
+    }
+}
+
+void trace_start(const String dumpPath) {
+    tracePath = malloc(strlen(dumpPath) + 1);
+    strcpy(tracePath, dumpPath);
+    pthread_key_create(&ringKey, release_ring);
+    if (pipe(dumpPipe) == ERROR) {
+        fatalError("Couldn't start tracing: %s", strerror(errno));
+    }
+    pthread_create(&dumpThreadId, NULL, process_dump_requests, NULL);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof action);
+    action.sa_handler = handle_dump_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+    tracing = true;
+}
+
+Bool trace_enabled(void) {
+    return tracing;
+}
+
+void trace_begin_request(ULong pathId) {
+    if (!tracing) {
+        return;
+    }
+    currentRequest = atomic_fetch_add_explicit(&nextRequestId, 1, memory_order_relaxed);
+    currentPath = pathId;
+    currentBlock = TRACE_NO_BLOCK;
+}
+
+void trace_end_request(void) {
+    currentRequest = 0;
+    currentPath = 0;
+    currentBlock = TRACE_NO_BLOCK;
+}
+
+void trace_set_block(UInt blockIndex) {
+    currentBlock = blockIndex;
+}
+
+// FNV-1a
+ULong trace_path_id(const String path) {
+    ULong hash = 14695981039346656037UL;
+    for (const char *c = path; *c != '\0'; c++) {
+        hash = (hash ^ (Byte)*c) * 1099511628211UL;
+    }
+    return hash;
+}
+
+void trace_span(Metric metric, ULong start, ULong end, Bool failed) {
+    if (!tracing) {
+        return;
+    }
+    if (threadRing == NULL) {
+        threadRing = acquire_ring();
+    }
+
+    ULong head = atomic_load_explicit(&threadRing->head, memory_order_relaxed);
+    TraceSpan *span = &threadRing->spans[head % TRACE_RING_SPANS];
+    span->requestId = currentRequest;
+    span->pathId = currentPath;
+    span->start = start;
+    span->end = end;
+    span->blockIndex = stats_is_stage(metric) ? currentBlock : TRACE_NO_BLOCK;
+    span->thread = threadRing->thread;
+    span->metric = (Byte)metric;
+    span->failed = failed;
+    memset(span->reserved, 0, sizeof span->reserved);
+    atomic_store_explicit(&threadRing->head, head + 1, memory_order_release);
+}
+
+Error trace_dump(void) {
+    if (!tracing) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&ringsLock);
+    TraceSpan *spans = malloc(sizeof(TraceSpan) * TRACE_RING_SPANS * MAX(ringsCount, 1));
+    ULong length = 0;
+    for (TraceRing *ring = rings; ring != NULL; ring = ring->next) {
+        ULong head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        ULong first = head > TRACE_RING_SPANS ? head - TRACE_RING_SPANS : 0;
+        ULong copied = length;
+        for (ULong i = first; i < head; i++) {
+            spans[length++] = ring->spans[i % TRACE_RING_SPANS];
+        }
+
+        // Spans written during the copy may have replaced the oldest ones, including one in progress
+        ULong newHead = atomic_load_explicit(&ring->head, memory_order_acquire);
+        ULong valid = newHead + 1 > TRACE_RING_SPANS ? newHead + 1 - TRACE_RING_SPANS : 0;
+        if (valid > first) {
+            ULong dropped = MIN(valid - first, length - copied);
+            memmove(&spans[copied], &spans[copied + dropped], sizeof(TraceSpan) * (length - copied - dropped));
+            length -= dropped;
+        }
+    }
+    pthread_mutex_unlock(&ringsLock);
+
+    char temporaryPath[PATH_MAX_LENGTH];
+    snprintf(temporaryPath, sizeof temporaryPath, "%s.tmp", tracePath);
+    FILE *file = fopen(temporaryPath, "wb");
+    if (file == NULL) {
+        free(spans);
+        return strerror(errno);
+    }
+
+    TraceHeader header;
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, TRACE_MAGIC, sizeof header.magic);
+    header.version = TRACE_VERSION;
+    header.spanSize = sizeof(TraceSpan);
+    header.spanCount = length;
+    Bool written = fwrite(&header, sizeof header, 1, file) == 1 && (length == 0 || fwrite(spans, sizeof(TraceSpan), length, file) == length);
+    free(spans);
+    if (fclose(file) != 0 || !written) {
+        unlink(temporaryPath);
+        return "Couldn't write trace file";
+    }
+    if (rename(temporaryPath, tracePath) == ERROR) {
+        return strerror(errno);
+    }
+    return NULL;
+}
@@ -0,0 +1,54 @@
+//
+//  Created by Stasel
+//
+
+#ifndef trace_h
+#define trace_h
+
+#include "utilities.h"
+#include "stats.h"
+
+#define TRACE_MAGIC "SECTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RING_SPANS 16384 // Most recent spans kept per thread
+#define TRACE_NO_BLOCK 0xffffffff
+
+// One timed phase of a request. The request itself is a span of its operation, its phases are
+// the spans of internal stages sharing its request id. Stages outside of a request have id 0.
+typedef struct {
+    ULong requestId;
+    ULong pathId;    // Hash of the path, or the inode number in low-level mode
+    ULong start;     // Monotonic nanoseconds
+    ULong end;
+    UInt blockIndex; // TRACE_NO_BLOCK unless the phase works on a single block
+    UInt thread;
+    Byte metric;     // Metric of the operation or stage
+    Byte failed;
+    Byte reserved[6];
+} TraceSpan;
+
+// Trace files are the header followed by spanCount spans, in host byte order
+typedef struct {
+    char magic[8];
+    UInt version;
+    UInt spanSize;
+    ULong spanCount;
+} TraceHeader;
+
+// Starts recording and dumps to dumpPath on SIGUSR1. Must be called before other threads start.
+void trace_start(const String dumpPath);
+Bool trace_enabled(void);
+
+// Request context of the calling thread
+void trace_begin_request(ULong pathId);
+void trace_end_request(void);
+void trace_set_block(UInt blockIndex);
+ULong trace_path_id(const String path);
+
+// Called by stats_record for every recorded metric
+void trace_span(Metric metric, ULong start, ULong end, Bool failed);
+
+// Writes the spans of every thread, oldest first per thread
+Error trace_dump(void);
+
+#endif /* trace_h */
@@ -2,12 +2,17 @@
 //  Created by Stasel
 //
 
+#define _GNU_SOURCE // O_DIRECT
 #include <stdio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <pthread.h>
 #include "utilities.h"
 
 void debugPrint(String message, ...) {
@@ -52,7 +57,7 @@ Bool boolPrompt() {
     return answer == 'y' || answer == 'Y';
 }
 
-ByteArray initByteArray(UInt size) {
+ByteArray initByteArray(ULong size) {
     ByteArray result;
     result.length = size;
     result.bytes = malloc(size);
@@ -60,6 +65,75 @@ ByteArray initByteArray(UInt size) {
     return result;
 }
 
+ULong monotonicNanos(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (ULong)now.tv_sec * 1000000000UL + (ULong)now.tv_nsec;
+}
+
+ULong peakMemoryBytes(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == ERROR) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return (ULong)usage.ru_maxrss; // bytes on macOS
+#else
+    return (ULong)usage.ru_maxrss * 1024; // kilobytes on Linux
+#endif
+}
+
+ULong pageFaults(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == ERROR) {
+        return 0;
+    }
+    return (ULong)usage.ru_minflt + (ULong)usage.ru_majflt;
+}
+
+UInt cpuCount(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (UInt)count : 1;
+}
+
+typedef struct {
+    UInt count;
+    UInt next;
+    ParallelTask task;
+    void *context;
+} ParallelForState;
+
+static void* parallel_for_worker(void *arg) {
+    ParallelForState *state = arg;
+    while (true) {
+        UInt index = __atomic_fetch_add(&state->next, 1, __ATOMIC_RELAXED);
+        if (index >= state->count) {
+            return NULL;
+        }
+        state->task(index, state->context);
+    }
+}
+
+// Run task(0..count-1) on up to `threads` threads, including the calling one. Returns when all are done.
+void parallelFor(UInt count, UInt threads, ParallelTask task, void *context) {
+    ParallelForState state = { count, 0, task, context };
+    UInt helpersCount = MIN(threads, count);
+    helpersCount = helpersCount > 0 ? helpersCount - 1 : 0;
+    
+    pthread_t *helpers = malloc(sizeof(pthread_t) * MAX(helpersCount, 1));
+    UInt started = 0;
+    for (; started < helpersCount; started++) {
+        if (pthread_create(&helpers[started], NULL, parallel_for_worker, &state) != 0) {
+            break;
+        }
+    }
+    parallel_for_worker(&state);
+    for (UInt i = 0; i < started; i++) {
+        pthread_join(helpers[i], NULL);
+    }
+    free(helpers);
+}
+
 FileSizeResult fileSize(const String path) {
     FileSizeResult result;
     
@@ -93,11 +167,13 @@ ReadFileResult readFile(const String path) {
     }
     
     ByteArray fileContents;
-    fileContents.length = (UInt)fileSize;
+    fileContents.length = fileSize;
     fileContents.bytes = malloc(fileSize);
 
     if(fileSize > 0 && fread(fileContents.bytes, fileSize, 1, handler) != 1) {
-        result.error = strerror(errno);
+        result.error = ferror(handler) ? strerror(errno) : "Unexpected end of file";
+        free(fileContents.bytes);
+        fclose(handler);
         return result;
     }
     
@@ -107,6 +183,142 @@ ReadFileResult readFile(const String path) {
     return result;
 }
 
+ReadFileResult readFileInto(const String path, Byte *buffer, ULong capacity) {
+    ReadFileResult result;
+    result.error = NULL;
+    result.contents.bytes = buffer;
+    result.contents.length = 0;
+
+    Int fd = open(path, O_RDONLY);
+    if (fd == ERROR) {
+        result.error = strerror(errno);
+        return result;
+    }
+
+    // One byte more than the buffer holds tells a file which doesn't fit
+    Byte extra;
+    while (true) {
+        Byte *target = result.contents.length < capacity ? buffer + result.contents.length : &extra;
+        ULong length = result.contents.length < capacity ? capacity - result.contents.length : 1;
+        ssize_t count = read(fd, target, length);
+        if (count == ERROR && errno == EINTR) {
+            continue;
+        }
+        if (count == ERROR) {
+            result.error = strerror(errno);
+            break;
+        }
+        if (count == 0) {
+            break;
+        }
+        if (target == &extra) {
+            result.error = "File is larger than the buffer";
+            break;
+        }
+        result.contents.length += (ULong)count;
+    }
+    close(fd);
+    return result;
+}
+
+static Int openDirect(const String path, Int flags) {
+#ifdef O_DIRECT
+    return open(path, flags | O_DIRECT, 0666);
+#else
+    Int fd = open(path, flags, 0666);
+    if (fd != ERROR && fcntl(fd, F_NOCACHE, 1) == ERROR) {
+        close(fd);
+        return ERROR;
+    }
+    return fd;
+#endif
+}
+
+Bool isDirectIOSupported(const String path) {
+    Int fd = openDirect(path, O_RDONLY);
+    if (fd == ERROR) {
+        return false;
+    }
+    close(fd);
+    return true;
+}
+
+ReadFileResult readFileDirect(const String path, Byte *buffer, ULong capacity) {
+    ReadFileResult result;
+    result.error = NULL;
+    result.contents.bytes = buffer;
+    result.contents.length = 0;
+
+    Int fd = openDirect(path, O_RDONLY);
+    if (fd == ERROR) {
+        result.error = strerror(errno);
+        return result;
+    }
+
+    // Reads past the buffer would have to be aligned as well, so the size tells a file which doesn't fit
+    struct stat stats;
+    if (fstat(fd, &stats) == ERROR) {
+        result.error = strerror(errno);
+        close(fd);
+        return result;
+    }
+    if ((ULong)stats.st_size > capacity) {
+        result.error = "File is larger than the buffer";
+        close(fd);
+        return result;
+    }
+
+    // Only the last read comes up short, at the end of the file
+    while (result.contents.length < capacity) {
+        ssize_t count = read(fd, buffer + result.contents.length, capacity - result.contents.length);
+        if (count == ERROR && errno == EINTR) {
+            continue;
+        }
+        if (count == ERROR) {
+            result.error = strerror(errno);
+            break;
+        }
+        if (count == 0) {
+            break;
+        }
+        result.contents.length += (ULong)count;
+    }
+    close(fd);
+    return result;
+}
+
+WriteFileResult writeFileDirect(const String path, ByteArray data) {
+    WriteFileResult result;
+    result.error = NULL;
+
+    // Whole aligned sectors go to the disk, the padding is cut off again by the truncate
+    ULong alignedLength = (data.length + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT;
+    memset(data.bytes + data.length, 0, alignedLength - data.length);
+
+    Int fd = openDirect(path, O_WRONLY | O_CREAT | O_TRUNC);
+    if (fd == ERROR) {
+        result.error = strerror(errno);
+        return result;
+    }
+    ULong written = 0;
+    while (written < alignedLength) {
+        ssize_t count = write(fd, data.bytes + written, alignedLength - written);
+        if (count == ERROR && errno == EINTR) {
+            continue;
+        }
+        if (count == ERROR) {
+            result.error = strerror(errno);
+            break;
+        }
+        written += (ULong)count;
+    }
+    if (result.error == NULL && alignedLength != data.length && ftruncate(fd, (off_t)data.length) == ERROR) {
+        result.error = strerror(errno);
+    }
+    close(fd);
+    return result;
+}
+
 WriteFileResult writeFile(const String path, ByteArray data) {
     
     WriteFileResult result;
@@ -117,12 +329,70 @@ WriteFileResult writeFile(const String path, ByteArray data) {
         return result;
     }
     
-    fwrite(data.bytes, data.length, 1, handler);
-    fclose(handler);
     result.error = NULL;
+    if (data.length > 0 && fwrite(data.bytes, data.length, 1, handler) != 1) {
+        result.error = strerror(errno);
+    }
+    // Buffered data is only written out when closing, a full disk shows up here
+    if (fclose(handler) != 0 && result.error == NULL) {
+        result.error = strerror(errno);
+    }
     return result;
 }
 
+WriteFileResult writeFileAtomically(const String path, ByteArray data) {
+    WriteFileResult result;
+    result.error = NULL;
+
+    char tempPath[PATH_MAX_LENGTH];
+    snprintf(tempPath, sizeof tempPath, "%s.tmp", path);
+    FILE *handler = fopen(tempPath, "wb");
+    if (handler == NULL) {
+        result.error = strerror(errno);
+        return result;
+    }
+
+    if ((data.length > 0 && fwrite(data.bytes, data.length, 1, handler) != 1) || fflush(handler) != 0 || fsync(fileno(handler)) == ERROR) {
+        result.error = strerror(errno);
+    }
+    fclose(handler);
+    if (result.error == NULL && rename(tempPath, path) == ERROR) {
+        result.error = strerror(errno);
+    }
+    if (result.error) {
+        unlink(tempPath);
+        return result;
+    }
+    result.error = syncParentDirectory(path);
+    return result;
+}
+
+Error syncParentDirectory(const String path) {
+    char directory[PATH_MAX_LENGTH];
+    snprintf(directory, sizeof directory, "%s", path);
+    char *separator = strrchr(directory, '/');
+    if (separator == NULL) {
+        snprintf(directory, sizeof directory, ".");
+    }
+    else if (separator == directory) {
+        directory[1] = '\0';
+    }
+    else {
+        *separator = '\0';
+    }
+    
+    Int fd = open(directory, O_RDONLY | O_DIRECTORY);
+    if (fd == ERROR) {
+        return strerror(errno);
+    }
+    Error error = NULL;
+    if (fsync(fd) == ERROR) {
+        error = strerror(errno);
+    }
+    close(fd);
+    return error;
+}
+
 Bool isFileExists(const String path) {
     return access(path, F_OK) != -1;
 }
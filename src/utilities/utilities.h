@@ -12,6 +12,7 @@
 #define SUCCESS 0
 #define ERROR -1
 #define PATH_MAX_LENGTH 512
+#define DIRECT_IO_ALIGNMENT 4096 // Of the buffers, offsets and lengths of direct I/O
 
 // Macros
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -31,7 +32,7 @@ typedef String Error;
 
 typedef struct {
     Byte* bytes;
-    UInt length;
+    ULong length;
 } ByteArray;
 
 typedef struct {
@@ -48,6 +49,8 @@ typedef struct {
     String error;
 } WriteFileResult;
 
+typedef void (*ParallelTask)(UInt index, void *context);
+
 
 // Helper methods
 void debugPrint(const String message, ...);
@@ -55,12 +58,27 @@ void fatalError(const String message, ...);
 Bool isPrefix(const String prefix, const String string);
 Int firstIndexOf(const String string, char c);
 Bool boolPrompt(void);
-ByteArray initByteArray(UInt size);
+ByteArray initByteArray(ULong size);
+ULong monotonicNanos(void);
+ULong peakMemoryBytes(void);
+ULong pageFaults(void); // Minor and major page faults of the process so far
+UInt cpuCount(void);
+void parallelFor(UInt count, UInt threads, ParallelTask task, void *context);
 
 // Filesystem helpers
 FileSizeResult fileSize(const String path);
 ReadFileResult readFile(const String path);
+ReadFileResult readFileInto(const String path, Byte *buffer, ULong capacity); // Fails if the file doesn't fit
 WriteFileResult writeFile(const String path, ByteArray data);
+WriteFileResult writeFileAtomically(const String path, ByteArray data); // Synced and renamed over the target
+Error syncParentDirectory(const String path); // Makes a rename or creation of path durable
+
+// Reads and writes which bypass the page cache, with O_DIRECT or F_NOCACHE on macOS. Buffers are
+// aligned to DIRECT_IO_ALIGNMENT, the capacity is a multiple of it and writes have room to pad the
+// data up to the next multiple. File systems without direct I/O fail them.
+Bool isDirectIOSupported(const String path);
+ReadFileResult readFileDirect(const String path, Byte *buffer, ULong capacity); // Fails if the file doesn't fit
+WriteFileResult writeFileDirect(const String path, ByteArray data);
 Bool isFileExists(const String path);
 
 #endif /* utilities_h */